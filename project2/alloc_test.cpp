@@ -0,0 +1,146 @@
+/*
+ * File: alloc_test.cpp
+ *
+ * Checks that handling requests on a keep-alive connection allocates
+ * nothing once the buffer pool and the file cache have warmed up.
+ *
+ * operator new is replaced with one that counts the allocations made by this
+ * thread (the file cache's background threads allocate as they please). The
+ * test feeds an HttpConnection a mix of requests, sending each response into
+ * the void, then checks that another round of them allocated nothing.
+ *
+ * Run it from this directory, so it can serve WWW.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string_view>
+#include <thread>
+
+#include "file_cache.hpp"
+#include "http.hpp"
+#include "path_table.hpp"
+
+static thread_local bool counting = false;
+static thread_local unsigned long allocations = 0;
+
+void *operator new(size_t size) {
+	if (counting) {
+		allocations++;
+	}
+	void *memory = malloc(size == 0 ? 1 : size);
+	if (memory == nullptr) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void *operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void *memory) noexcept {
+	free(memory);
+}
+
+void operator delete[](void *memory) noexcept {
+	free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept {
+	free(memory);
+}
+
+void operator delete[](void *memory, size_t) noexcept {
+	free(memory);
+}
+
+// Requests covering the different kinds of response that keep the connection
+// open: a file (whole, a range of it, compressed, not modified, and just its
+// head), a listing and a redirect.
+static const std::string_view REQUESTS[] = {
+	"GET /index.html HTTP/1.1\r\nHost: test\r\n\r\n",
+	"GET /index.html HTTP/1.1\r\nHost: test\r\nAccept-Encoding: gzip\r\n\r\n",
+	"GET /tux.png HTTP/1.1\r\nHost: test\r\nRange: bytes=0-99,200-299\r\n\r\n",
+	"GET /pic.html HTTP/1.1\r\nHost: test\r\n"
+		"If-Modified-Since: Fri, 31 Dec 2100 23:59:59 GMT\r\n\r\n",
+	"GET /test/ HTTP/1.1\r\nHost: test\r\n\r\n",
+	"GET /test HTTP/1.1\r\nHost: test\r\n\r\n",
+	"HEAD /styled.html HTTP/1.1\r\nHost: test\r\n\r\n",
+};
+
+// The files among those that get compressed copies. Until a file's copies are
+// made, each request for it queues them again, which allocates.
+static const char *const COMPRESSIBLE_FILES[] = {
+	"WWW/index.html", "WWW/pic.html", "WWW/styled.html"
+};
+
+// Rounds of all the requests to warm up with, and then to count.
+static const int WARM_UP_ROUNDS = 10;
+static const int COUNTED_ROUNDS = 100;
+
+/**
+ * Sends one round of requests over the connection, pipelined, and takes
+ * every response.
+ *
+ * @return False if the connection was to be closed.
+ */
+static bool sendRound(HttpConnection &http) {
+	for (std::string_view request : REQUESTS) {
+		if (http.received(request.data(), request.size()) != request.size()) {
+			fprintf(stderr, "alloc_test: input full\n");
+			exit(1);
+		}
+	}
+
+	while (http.nextResponse()) {
+		ResponsePart part;
+		while ((part = http.pendingPart()).length > 0) {
+			http.sent(part.length);
+		}
+		if (!http.finishResponse()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main() {
+	FileCache files("WWW");
+	if (!files.paths().start()) {
+		perror("alloc_test: can't watch WWW");
+		return 1;
+	}
+
+	// Give the compressor time to make the compressed copies, so every
+	// request is answered the same way every round.
+	auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	for (const char *file : COMPRESSIBLE_FILES) {
+		std::shared_ptr<const FileInfo> info;
+		while ((info = files.lookup(file)) && !info->encodings
+				&& std::chrono::steady_clock::now() < give_up) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	BufferPool pool;
+	HttpConnection http(files, pool);
+	for (int i = 0; i < WARM_UP_ROUNDS; i++) {
+		if (!sendRound(http)) {
+			fprintf(stderr, "alloc_test: connection closed\n");
+			return 1;
+		}
+	}
+
+	counting = true;
+	for (int i = 0; i < COUNTED_ROUNDS; i++) {
+		sendRound(http);
+	}
+	counting = false;
+
+	size_t requests = COUNTED_ROUNDS * (sizeof(REQUESTS) / sizeof(REQUESTS[0]));
+	printf("alloc_test: %lu allocations for %zu requests\n", allocations,
+			requests);
+	return allocations == 0 ? 0 : 1;
+}
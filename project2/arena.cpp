@@ -0,0 +1,118 @@
+/*
+ * File: arena.cpp
+ *
+ * Implementation of the buffer pool and arenas.
+ *
+ */
+#include <charconv>
+#include <cstring>
+
+#include "arena.hpp"
+
+using std::string_view;
+
+// How many buffers to add to a pool when it runs out.
+static const size_t SLAB_BUFFERS = 16;
+
+char *BufferPool::get() {
+	if (free_list == nullptr) {
+		slabs.emplace_back(new char[SLAB_BUFFERS * POOL_BUFFER_SIZE]);
+		for (size_t i = 0; i < SLAB_BUFFERS; i++) {
+			put(slabs.back().get() + i * POOL_BUFFER_SIZE);
+		}
+	}
+	FreeBuffer *buffer = free_list;
+	free_list = buffer->next;
+	return reinterpret_cast<char*>(buffer);
+}
+
+void BufferPool::put(char *buffer) {
+	FreeBuffer *free_buffer = reinterpret_cast<FreeBuffer*>(buffer);
+	free_buffer->next = free_list;
+	free_list = free_buffer;
+}
+
+Arena::~Arena() {
+	reset();
+}
+
+/**
+ * Makes room for more bytes in the current piece of text (which may be empty).
+ *
+ * @return Where the bytes go.
+ */
+char *Arena::reserve(size_t size) {
+	if (piece == nullptr) {
+		piece = top;
+	}
+	if (top != nullptr && size <= (size_t)(limit - top)) {
+		return top;
+	}
+
+	// The piece has to move to a new buffer, taken from the pool unless it's
+	// too big for one of those.
+	size_t length = top - piece;
+	size_t needed = sizeof(Block) + length + size;
+	bool pooled = needed <= POOL_BUFFER_SIZE;
+	size_t capacity = pooled ? POOL_BUFFER_SIZE : needed;
+	char *buffer = pooled ? pool.get() : new char[capacity];
+
+	Block *block = reinterpret_cast<Block*>(buffer);
+	block->next = blocks;
+	block->pooled = pooled;
+	blocks = block;
+
+	char *start = buffer + sizeof(Block);
+	if (length > 0) {
+		memcpy(start, piece, length);
+	}
+	piece = start;
+	top = start + length;
+	limit = buffer + capacity;
+	return top;
+}
+
+char *Arena::allocate(size_t size) {
+	finish();
+	char *bytes = reserve(size);
+	top += size;
+	piece = nullptr;
+	return bytes;
+}
+
+void Arena::append(string_view text) {
+	char *end = reserve(text.size());
+	if (!text.empty()) {
+		memcpy(end, text.data(), text.size());
+	}
+	top += text.size();
+}
+
+void Arena::appendNumber(unsigned long long number) {
+	char digits[20];
+	char *end = std::to_chars(digits, digits + sizeof(digits), number).ptr;
+	append(string_view(digits, end - digits));
+}
+
+string_view Arena::finish() {
+	if (piece == nullptr) {
+		return {};
+	}
+	string_view text(piece, top - piece);
+	piece = nullptr;
+	return text;
+}
+
+void Arena::reset() {
+	while (blocks != nullptr) {
+		Block *next = blocks->next;
+		if (blocks->pooled) {
+			pool.put(reinterpret_cast<char*>(blocks));
+		}
+		else {
+			delete[] reinterpret_cast<char*>(blocks);
+		}
+		blocks = next;
+	}
+	piece = top = limit = nullptr;
+}
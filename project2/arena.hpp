@@ -0,0 +1,116 @@
+/*
+ * File: arena.hpp
+ *
+ * Header / API file for the memory ToreroServe handles requests in.
+ *
+ * Each event loop has a BufferPool: fixed-size buffers, carved out of larger
+ * slabs, that its connections take and give back. A connection holds a
+ * buffer for the bytes it has received only while there are some it hasn't
+ * handled, and one (or more) for its response only while sending it. So idle
+ * connections hold no memory, and once the pool has grown to fit the busiest
+ * moment, handling a request allocates nothing.
+ *
+ * A response's bytes are built in an Arena, which hands out memory from pool
+ * buffers by bumping a pointer, and gives it all back at once when the
+ * response has been sent.
+ *
+ * Neither is thread-safe: a pool (and its connections' arenas) belongs to one
+ * event loop's thread.
+ */
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Size of a pool's buffers.
+static const size_t POOL_BUFFER_SIZE = 32 * 1024;
+
+class BufferPool {
+public:
+	BufferPool() = default;
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	/**
+	 * @return A buffer of POOL_BUFFER_SIZE bytes.
+	 */
+	char *get();
+
+	/**
+	 * Gives a buffer back to the pool.
+	 *
+	 * @param buffer A buffer from get.
+	 */
+	void put(char *buffer);
+
+private:
+	// Free buffers are kept in a list linked through their first bytes.
+	struct FreeBuffer {
+		FreeBuffer *next;
+	};
+
+	FreeBuffer *free_list = nullptr;
+	std::vector<std::unique_ptr<char[]>> slabs;
+};
+
+class Arena {
+public:
+	explicit Arena(BufferPool &pool) : pool(pool) {}
+	~Arena();
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	/**
+	 * @param size How many bytes.
+	 * @return That many bytes (with no particular alignment), which last
+	 * 		until the arena is reset. Finishes any piece of text that was
+	 * 		being appended to.
+	 */
+	char *allocate(size_t size);
+
+	/**
+	 * Adds text to the end of the current piece of text, starting a new piece
+	 * if there isn't one. A piece is kept in one place: if its buffer fills
+	 * up, it's moved to a new one.
+	 */
+	void append(std::string_view text);
+
+	/**
+	 * Adds a number, in decimal, to the end of the current piece of text.
+	 */
+	void appendNumber(unsigned long long number);
+
+	/**
+	 * Ends the current piece of text.
+	 *
+	 * @return The piece, which lasts until the arena is reset.
+	 */
+	std::string_view finish();
+
+	/**
+	 * Gives all of the arena's memory back.
+	 */
+	void reset();
+
+private:
+	// Each buffer starts with one of these, linking the arena's buffers.
+	struct Block {
+		Block *next;
+		bool pooled;	// from the pool, rather than the heap (if too big)
+	};
+
+	char *reserve(size_t size);
+
+	BufferPool &pool;
+	Block *blocks = nullptr;	// the latest first
+	char *piece = nullptr;		// start of the current piece of text
+	char *top = nullptr;		// start of the free space
+	char *limit = nullptr;		// end of the free space
+};
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * File: compress.cpp
+ *
+ * Implementation of the content codings.
+ *
+ */
+#include <zlib.h>
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.hpp"
+
+using std::string;
+using std::string_view;
+
+string_view encodingName(Encoding encoding) {
+	switch (encoding) {
+		case ENCODING_BROTLI: return "br";
+		case ENCODING_ZSTD: return "zstd";
+		default: return "gzip";
+	}
+}
+
+bool encodingSupported(Encoding encoding) {
+	switch (encoding) {
+#ifdef HAVE_BROTLI
+		case ENCODING_BROTLI: return true;
+#endif
+#ifdef HAVE_ZSTD
+		case ENCODING_ZSTD: return true;
+#endif
+		case ENCODING_GZIP: return true;
+		default: return false;
+	}
+}
+
+static bool gzipData(string_view data, string &compressed) {
+	z_stream stream = {};
+	// 15 bits of window, plus 16 for a gzip header and trailer rather than
+	// zlib's.
+	if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+				Z_DEFAULT_STRATEGY) != Z_OK) {
+		return false;
+	}
+
+	compressed.resize(deflateBound(&stream, data.size()));
+	stream.next_in = (Bytef*)data.data();
+	stream.avail_in = data.size();
+	stream.next_out = (Bytef*)compressed.data();
+	stream.avail_out = compressed.size();
+	int result = deflate(&stream, Z_FINISH);
+	compressed.resize(stream.total_out);
+	deflateEnd(&stream);
+	return result == Z_STREAM_END;
+}
+
+bool compressData(Encoding encoding, string_view data, string &compressed) {
+	switch (encoding) {
+#ifdef HAVE_BROTLI
+		case ENCODING_BROTLI: {
+			size_t size = BrotliEncoderMaxCompressedSize(data.size());
+			compressed.resize(size);
+			bool ok = BrotliEncoderCompress(BROTLI_MAX_QUALITY,
+					BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(),
+					(const uint8_t*)data.data(), &size,
+					(uint8_t*)compressed.data());
+			compressed.resize(size);
+			return ok;
+		}
+#endif
+
+#ifdef HAVE_ZSTD
+		case ENCODING_ZSTD: {
+			compressed.resize(ZSTD_compressBound(data.size()));
+			size_t size = ZSTD_compress(compressed.data(), compressed.size(),
+					data.data(), data.size(), ZSTD_maxCLevel());
+			if (ZSTD_isError(size)) {
+				return false;
+			}
+			compressed.resize(size);
+			return true;
+		}
+#endif
+
+		case ENCODING_GZIP:
+			return gzipData(data, compressed);
+
+		default:
+			return false;
+	}
+}
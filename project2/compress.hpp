@@ -0,0 +1,46 @@
+/*
+ * File: compress.hpp
+ *
+ * Header / API file for the content codings ToreroServe can send files in.
+ *
+ * gzip (from zlib) is always there. Brotli and zstd compress text better, and
+ * are built in when their libraries are installed (the Makefile checks, and
+ * defines HAVE_BROTLI and HAVE_ZSTD). Files are compressed once, ahead of
+ * time, so each coding uses its slowest, smallest setting.
+ */
+#ifndef COMPRESS_HPP
+#define COMPRESS_HPP
+
+#include <string>
+#include <string_view>
+
+/**
+ * The codings, from most to least preferred when a client accepts several
+ * equally.
+ */
+enum Encoding { ENCODING_BROTLI, ENCODING_ZSTD, ENCODING_GZIP, NUM_ENCODINGS };
+
+/**
+ * @param encoding A coding.
+ * @return Its name in Accept-Encoding and Content-Encoding headers.
+ */
+std::string_view encodingName(Encoding encoding);
+
+/**
+ * @param encoding A coding.
+ * @return Whether this build can compress with it.
+ */
+bool encodingSupported(Encoding encoding);
+
+/**
+ * Compresses some data.
+ *
+ * @param encoding The coding to use, which must be supported.
+ * @param data The data.
+ * @param compressed Set to the compressed data.
+ * @return False if compression failed.
+ */
+bool compressData(Encoding encoding, std::string_view data,
+		std::string &compressed);
+
+#endif
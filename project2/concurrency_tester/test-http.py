@@ -0,0 +1,303 @@
+#!/usr/bin/python3
+
+# Usage: test-http.py [HOSTNAME] [PORT_NUM]
+#
+# Checks a running server's responses against the files in ../WWW (so start
+# the server on that directory): that files arrive byte for byte, that
+# directories are redirected, indexed and listed, that errors get the right
+# status, that keep-alive and pipelining work (including far more pipelined
+# requests than fit in the server's buffers), that conditional requests and
+# ranges are answered correctly, and that compressed copies decode to the
+# file, with the file itself sent whenever the client can't take one.
+#
+# Prints ok or FAIL for each check, and exits with the number of failures.
+
+import gzip
+import os
+import socket
+import sys
+import time
+
+if len(sys.argv) != 3:
+    print("Usage: test-http.py [HOSTNAME] [PORT_NUM]")
+    sys.exit(1)
+
+host, port = sys.argv[1], int(sys.argv[2])
+root = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'WWW')
+failures = 0
+
+
+def contents(path):
+    with open(os.path.join(root, path), 'rb') as f:
+        return f.read()
+
+
+def connect():
+    s = socket.create_connection((host, port))
+    s.settimeout(10)
+    return s
+
+
+def read_response(s, buf=b'', head_only=False):
+    """
+    Reads one response from a connection.
+
+    Returns its status line, its headers (with lower-cased names), its body,
+    and whatever was read past its end.
+    """
+    while b'\r\n\r\n' not in buf:
+        data = s.recv(65536)
+        if not data:
+            raise Exception('connection closed in the head')
+        buf += data
+    head, rest = buf.split(b'\r\n\r\n', 1)
+    lines = head.decode().split('\r\n')
+    headers = {}
+    for line in lines[1:]:
+        name, value = line.split(':', 1)
+        headers[name.lower()] = value.strip()
+
+    length = 0 if head_only else int(headers.get('content-length', 0))
+    while len(rest) < length:
+        data = s.recv(65536)
+        if not data:
+            raise Exception('connection closed in the body')
+        rest += data
+    return lines[0], headers, rest[:length], rest[length:]
+
+
+def request(path, extra='', method='GET'):
+    """
+    Sends one request on a new connection.
+
+    Returns the response as read_response does.
+    """
+    s = connect()
+    s.sendall(('%s %s HTTP/1.1\r\nHost: %s\r\n%sConnection: close\r\n\r\n'
+               % (method, path, host, extra)).encode())
+    response = read_response(s, head_only=(method == 'HEAD'))
+    s.close()
+    return response
+
+
+def status(line):
+    return line.split()[1]
+
+
+def check(name, passed):
+    global failures
+    print(('ok   ' if passed else 'FAIL ') + name)
+    if not passed:
+        failures += 1
+
+
+def check_files():
+    for path in ['index.html', 'tux.png', 'monorail.jpg',
+                 'test/dir/endtoend.pdf', 'comp375.css']:
+        line, headers, body, _ = request('/' + path)
+        check('byte-exact ' + path,
+              line.endswith('200 OK') and body == contents(path))
+
+    line, headers, body, _ = request('/tux.png', method='HEAD')
+    check('HEAD', line.endswith('200 OK') and body == b''
+          and headers['content-length'] == str(len(contents('tux.png'))))
+
+
+def check_directories():
+    body = request('/test/dir/')[2]
+    check('directory index', body == contents('test/dir/index.html'))
+
+    line, headers, body, _ = request('/test/dir')
+    check('directory redirect', status(line) == '301'
+          and headers['location'] == '/test/dir/')
+
+    body = request('/test/')[2]
+    check('directory listing', b'href="dir/"' in body)
+
+
+def check_errors():
+    check('404', status(request('/nope')[0]) == '404')
+    check('traversal', status(request('/../etc/passwd')[0]) in ('400', '404'))
+    check('encoded traversal',
+          status(request('/%2e%2e/etc/passwd')[0]) in ('400', '404'))
+    check('501', status(request('/', method='POST')[0]) == '501')
+
+    s = connect()
+    s.sendall(b'GARBAGE\r\n\r\n')
+    response = read_response(s)
+    check('400 and close', status(response[0]) == '400' and s.recv(10) == b'')
+
+
+def check_connections():
+    # Keep-alive and pipelining, with every response checked.
+    paths = ['index.html', 'test/dir/endtoend.pdf', 'tux.png'] * 5
+    s = connect()
+    s.sendall(b''.join(b'GET /%s HTTP/1.1\r\nHost: x\r\n\r\n' % p.encode()
+                       for p in paths))
+    rest = b''
+    passed = True
+    for path in paths:
+        line, headers, body, rest = read_response(s, rest)
+        passed = passed and body == contents(path) \
+            and headers['connection'] == 'keep-alive'
+    check('pipelined keep-alive', passed)
+
+    # Far more pipelined requests than fit in the input buffer, sent before
+    # reading anything back.
+    count = 2000
+    s = connect()
+    s.sendall(b'GET /index.html HTTP/1.1\r\nHost: x\r\n\r\n' * count)
+    s.shutdown(socket.SHUT_WR)
+    rest = b''
+    answered = 0
+    try:
+        for i in range(count):
+            line, headers, body, rest = read_response(s, rest)
+            if status(line) != '200':
+                break
+            answered += 1
+    except Exception:
+        pass
+    check('%d pipelined requests' % count, answered == count)
+
+    # A client that half-closes after sending still gets its answer.
+    s = connect()
+    s.sendall(b'GET /index.html HTTP/1.0\r\n\r\n')
+    s.shutdown(socket.SHUT_WR)
+    line = read_response(s)[0]
+    check('half-close', line.endswith('200 OK') and s.recv(10) == b'')
+
+    # A request sent a byte at a time.
+    s = connect()
+    for c in b'GET /pic.html HTTP/1.1\r\nHost: x\r\n\r\n':
+        s.send(bytes([c]))
+        time.sleep(0.001)
+    check('slow request', read_response(s)[0].endswith('200 OK'))
+
+    # Clients that go away mid-download shouldn't hurt the server.
+    for i in range(20):
+        s = connect()
+        s.sendall(b'GET /test/dir/endtoend.pdf HTTP/1.1\r\n\r\n')
+        s.recv(100)
+        s.close()
+    check('alive after aborted downloads',
+          request('/index.html')[0].endswith('200 OK'))
+
+
+def check_conditional():
+    path = '/test/dir/endtoend.pdf'
+    headers = request(path)[1]
+    etag, modified = headers['etag'], headers['last-modified']
+    check('validators', etag.startswith('"') and modified.endswith('GMT')
+          and headers['accept-ranges'] == 'bytes')
+
+    response = request(path, 'If-None-Match: %s\r\n' % etag, 'HEAD')
+    check('304 on ETag', status(response[0]) == '304'
+          and response[1]['etag'] == etag
+          and 'content-length' not in response[1])
+    check('304 on weak ETag in a list', status(request(
+        path, 'If-None-Match: "x", W/%s\r\n' % etag, 'HEAD')[0]) == '304')
+    check('200 on other ETag',
+          status(request(path, 'If-None-Match: "x"\r\n')[0]) == '200')
+    check('304 on If-Modified-Since', status(request(
+        path, 'If-Modified-Since: %s\r\n' % modified, 'HEAD')[0]) == '304')
+    check('200 on old If-Modified-Since', status(request(
+        path, 'If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n')[0]) == '200')
+    check('If-None-Match beats If-Modified-Since', status(request(
+        path, 'If-None-Match: "x"\r\nIf-Modified-Since: %s\r\n'
+        % modified)[0]) == '200')
+
+
+def check_ranges():
+    path = '/test/dir/endtoend.pdf'
+    pdf = contents(path[1:])
+    size = len(pdf)
+
+    line, headers, body, _ = request(path, 'Range: bytes=100-199\r\n')
+    check('206 single range', status(line) == '206'
+          and body == pdf[100:200]
+          and headers['content-range'] == 'bytes 100-199/%d' % size)
+    check('suffix range',
+          request(path, 'Range: bytes=-50\r\n')[2] == pdf[-50:])
+    check('open range',
+          request(path, 'Range: bytes=37000-\r\n')[2] == pdf[37000:])
+    check('clamped range',
+          request(path, 'Range: bytes=37000-999999\r\n')[2] == pdf[37000:])
+
+    response = request(path, 'Range: bytes=999999-\r\n')
+    check('416', status(response[0]) == '416'
+          and response[1]['content-range'] == 'bytes */%d' % size)
+    check('bad range ignored',
+          status(request(path, 'Range: bytes=5-1\r\n')[0]) == '200')
+    check('If-Range mismatch', request(
+        path, 'Range: bytes=0-9\r\nIf-Range: "nope"\r\n')[2] == pdf)
+    etag = request(path, method='HEAD')[1]['etag']
+    check('If-Range match', request(
+        path, 'Range: bytes=0-9\r\nIf-Range: %s\r\n' % etag)[2] == pdf[:10])
+
+    line, headers, body, _ = request(
+        path, 'Range: bytes=0-9, 20000-20099, -5\r\n')
+    content_type = headers['content-type']
+    boundary = content_type.split('boundary=')[1].encode()
+    parts = body.split(b'--' + boundary)
+    passed = status(line) == '206' and len(parts) == 5 \
+        and content_type.startswith('multipart/byteranges') \
+        and parts[-1] == b'--\r\n'
+    wanted = [(0, 9), (20000, 20099), (size - 5, size - 1)]
+    for part, (first, last) in zip(parts[1:-1], wanted):
+        head, data = part.split(b'\r\n\r\n', 1)
+        passed = passed and data[:-2] == pdf[first:last + 1] \
+            and b'Content-Range: bytes %d-%d/%d' % (first, last, size) in head
+    check('multipart ranges', passed)
+
+    many = ','.join('%d-%d' % (i, i) for i in range(20))
+    check('too many ranges ignored',
+          status(request(path, 'Range: bytes=%s\r\n' % many)[0]) == '200')
+
+    s = connect()
+    s.sendall(b'GET /test/dir/endtoend.pdf HTTP/1.1\r\nRange: bytes=1-2,4-5'
+              b'\r\n\r\nGET /index.html HTTP/1.1\r\n\r\n')
+    rest = read_response(s)[3]
+    check('ranges on a kept-alive connection',
+          read_response(s, rest)[2] == contents('index.html'))
+
+
+def check_encodings():
+    # Compressed copies are made in the background after the first request,
+    # so give the server a moment.
+    html = contents('index.html')
+    deadline = time.time() + 5
+    while True:
+        headers, body = request('/index.html', 'Accept-Encoding: gzip\r\n')[1:3]
+        if headers.get('content-encoding') == 'gzip' or time.time() > deadline:
+            break
+        time.sleep(0.1)
+    check('gzip decodes to the file',
+          headers.get('content-encoding') == 'gzip'
+          and gzip.decompress(body) == html
+          and 'Accept-Encoding' in headers.get('vary', ''))
+
+    # Whenever the client can't (or won't) take a compressed copy, the file
+    # itself is sent.
+    for name, accept in [('no Accept-Encoding', ''),
+                         ('unknown coding', 'Accept-Encoding: zstd-x\r\n'),
+                         ('gzip refused', 'Accept-Encoding: gzip;q=0\r\n')]:
+        headers, body = request('/index.html', accept)[1:3]
+        check('identity fallback, ' + name,
+              'content-encoding' not in headers and body == html)
+
+    headers, body = request('/index.html',
+                            'Accept-Encoding: gzip\r\nRange: bytes=0-9\r\n')[1:3]
+    check('ranges are of the file itself',
+          'content-encoding' not in headers and body == html[:10])
+
+
+check_files()
+check_directories()
+check_errors()
+check_connections()
+check_conditional()
+check_ranges()
+check_encodings()
+print('FAILURES', failures)
+sys.exit(min(failures, 255))
@@ -0,0 +1,49 @@
+/*
+ * File: engine.hpp
+ *
+ * Header / API file for ToreroServe's engines: the event loops that accept
+ * connections and move bytes between clients and the files they ask for.
+ *
+ * There are two. The epoll engine waits for sockets to be ready, then makes
+ * a nonblocking system call (accept, recv, send or sendfile) for each step.
+ * The io_uring engine instead keeps a few long-lived requests queued with the
+ * kernel -- one multishot accept for the listening socket, one multishot recv
+ * per connection that picks its own buffer from a shared pool -- and answers
+ * each request with a linked chain of send and splice (file to socket)
+ * operations, all on registered descriptors. It submits and reaps a whole
+ * batch of these with one system call, so under load it makes far fewer
+ * system calls and context switches per request.
+ *
+ * Each engine runs one event loop per thread, with all the threads sharing
+ * the listening socket.
+ */
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+
+#include "file_cache.hpp"
+
+/**
+ * Serves clients forever using epoll.
+ *
+ * @param server_sock The listening socket.
+ * @param files The cache of the served files.
+ * @param num_threads How many event loops to run.
+ */
+void runEpollEngine(int server_sock, FileCache &files, unsigned num_threads);
+
+/**
+ * @return Whether the kernel has everything the io_uring engine needs.
+ */
+bool uringEngineAvailable();
+
+/**
+ * Serves clients forever using io_uring. Only call this if
+ * uringEngineAvailable says it can work.
+ *
+ * @param server_sock The listening socket.
+ * @param files The cache of the served files.
+ * @param num_threads How many event loops (each with its own ring) to run.
+ */
+void runUringEngine(int server_sock, FileCache &files, unsigned num_threads);
+
+#endif
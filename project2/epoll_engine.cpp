@@ -0,0 +1,242 @@
+/*
+ * File: epoll_engine.cpp
+ *
+ * Implementation of the epoll engine.
+ *
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "engine.hpp"
+#include "http.hpp"
+
+// Most events to handle per epoll_wait.
+static const int MAX_EVENTS = 256;
+
+/**
+ * A client connection.
+ */
+struct EpollConnection {
+	EpollConnection(int sock, FileCache &files, BufferPool &pool)
+		: sock(sock), http(files, pool) {}
+
+	int sock;
+	HttpConnection http;
+
+	// Whether the client has finished sending (though it may still be
+	// waiting for responses).
+	bool done_sending = false;
+};
+
+/**
+ * Reads everything the client has sent so far, straight into the
+ * connection's input buffer, or as much of it as fits.
+ *
+ * @param full Set to whether reading stopped because the buffer is full (so
+ * 		there's more to read once the requests in it have been answered).
+ * @return False if the connection should be closed.
+ */
+static bool readRequests(EpollConnection *conn, bool &full) {
+	full = false;
+	while (true) {
+		size_t space;
+		char *buffer = conn->http.inputSpace(space);
+		if (space == 0) {
+			full = true;
+			return true;
+		}
+		ssize_t received = recv(conn->sock, buffer, space, 0);
+		if (received > 0) {
+			conn->http.inputReceived(received);
+		}
+		else if (received == 0) {
+			conn->done_sending = true;
+			return true;
+		}
+		else {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+	}
+}
+
+/**
+ * Sends as much of the responses to the client's requests as the socket will
+ * take.
+ *
+ * @param blocked Set to whether sending stopped because the socket is full.
+ * @return False if the connection should be closed.
+ */
+static bool writeResponses(EpollConnection *conn, bool &blocked) {
+	HttpConnection &http = conn->http;
+	blocked = false;
+	while (http.nextResponse()) {
+		ResponsePart part;
+		while ((part = http.pendingPart()).length > 0) {
+			ssize_t sent;
+			if (part.from_file) {
+				off_t offset = part.offset;
+				sent = sendfile(conn->sock, http.file(), &offset, part.length);
+			}
+			else {
+				// Hold this back if a file part follows, so that small
+				// responses go out in one segment.
+				int flags = MSG_NOSIGNAL;
+				if (http.pendingPart(1).from_file) {
+					flags |= MSG_MORE;
+				}
+				sent = send(conn->sock, http.partData(part), part.length, flags);
+			}
+
+			if (sent < 0) {
+				blocked = true;
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			}
+			if (sent == 0) {
+				// The file got shorter since we opened it.
+				return false;
+			}
+			http.sent(sent);
+		}
+
+		if (!http.finishResponse()) {
+			return false;
+		}
+	}
+
+	// Once the client has stopped sending, the requests it did send have
+	// all been answered.
+	return !conn->done_sending;
+}
+
+/**
+ * Reads and answers requests until the client has nothing more to send or
+ * the socket can't take any more responses. A client can send more requests
+ * at once than fit in the input buffer, in which case the ones that do are
+ * answered (making room for the rest) before reading any more.
+ *
+ * @return False if the connection should be closed.
+ */
+static bool serveConnection(EpollConnection *conn) {
+	bool full = true;
+	bool blocked = false;
+	while (full && !blocked) {
+		if (!readRequests(conn, full) || !writeResponses(conn, blocked)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void closeConnection(EpollConnection *conn) {
+	close(conn->sock);
+	delete conn;
+}
+
+/**
+ * Accepts every connection that's waiting and starts watching it.
+ */
+static void acceptAll(int server_sock, int epoll_fd, FileCache &files,
+		BufferPool &pool) {
+	while (true) {
+		int sock = accept4(server_sock, nullptr, nullptr,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+					&& errno != ECONNABORTED) {
+				perror("accept4");
+			}
+			return;
+		}
+
+		int one = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		EpollConnection *conn = new EpollConnection(sock, files, pool);
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = conn;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0) {
+			perror("epoll_ctl");
+			closeConnection(conn);
+		}
+	}
+}
+
+/**
+ * One thread's event loop.
+ */
+static void epollLoop(int server_sock, FileCache &files) {
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	// EPOLLEXCLUSIVE wakes only one of the threads for a new connection,
+	// rather than all of them.
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLEXCLUSIVE;
+	event.data.ptr = nullptr;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &event) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+
+	// The buffers for this thread's connections.
+	BufferPool pool;
+
+	struct epoll_event events[MAX_EVENTS];
+	while (true) {
+		int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (num_events < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			exit(1);
+		}
+
+		for (int i = 0; i < num_events; i++) {
+			if (events[i].data.ptr == nullptr) {
+				acceptAll(server_sock, epoll_fd, files, pool);
+				continue;
+			}
+
+			// The connection is edge-triggered, so read and write until the
+			// socket can't take any more.
+			EpollConnection *conn =
+				static_cast<EpollConnection*>(events[i].data.ptr);
+			bool keep_open = !(events[i].events & EPOLLERR)
+				&& serveConnection(conn);
+			if (!keep_open) {
+				closeConnection(conn);
+			}
+		}
+	}
+}
+
+void runEpollEngine(int server_sock, FileCache &files, unsigned num_threads) {
+	int flags = fcntl(server_sock, F_GETFL);
+	if (flags < 0 || fcntl(server_sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("fcntl");
+		exit(1);
+	}
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < num_threads; i++) {
+		threads.emplace_back(epollLoop, server_sock, std::ref(files));
+	}
+	epollLoop(server_sock, files);
+}
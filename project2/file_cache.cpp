@@ -0,0 +1,266 @@
+/*
+ * File: file_cache.cpp
+ *
+ * Implementation of the file metadata cache.
+ *
+ */
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "file_cache.hpp"
+
+namespace fs = std::filesystem;
+
+using std::string;
+using std::string_view;
+
+bool FileInfo::matches(const struct stat &info) const {
+	return info.st_size == size && info.st_ino == inode
+		&& info.st_mtim.tv_sec == mtime.tv_sec
+		&& info.st_mtim.tv_nsec == mtime.tv_nsec;
+}
+
+FileEncodings::~FileEncodings() {
+	for (EncodedFile &file : files) {
+		if (file.fd >= 0) {
+			close(file.fd);
+		}
+	}
+}
+
+FileCache::FileCache(const fs::path &root) : root_dir(root) {}
+
+FileCache::~FileCache() {
+	{
+		std::lock_guard<std::mutex> lock(compress_mutex);
+		stopping = true;
+	}
+	compress_ready.notify_one();
+	if (compressor.joinable()) {
+		compressor.join();
+	}
+}
+
+std::shared_ptr<const FileInfo> FileCache::lookup(const string &path) {
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		auto it = entries.find(path);
+		if (it != entries.end() && std::chrono::steady_clock::now()
+				- it->second.checked < CACHE_VALIDITY) {
+			return it->second.info;
+		}
+	}
+
+	struct stat info;
+	if (stat(path.c_str(), &info) < 0 || !S_ISREG(info.st_mode)) {
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		entries.erase(path);
+		return nullptr;
+	}
+	return update(path, info);
+}
+
+std::shared_ptr<const FileInfo> FileCache::update(const string &path,
+		const struct stat &info) {
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	CacheSlot &slot = entries[path];
+	slot.checked = std::chrono::steady_clock::now();
+
+	// If the file hasn't changed, keep what we worked out about it
+	// (particularly its compressed copies).
+	if (slot.info && slot.info->matches(info)) {
+		return slot.info;
+	}
+
+	auto entry = std::make_shared<FileInfo>();
+	entry->size = info.st_size;
+	entry->inode = info.st_ino;
+	entry->mtime = info.st_mtim;
+	entry->type = &fileMimeType(path);
+
+	// Any change to the file's contents changes its size or mtime (or, if
+	// it's replaced by another file, its inode), so together they make a
+	// good enough tag.
+	char etag[64];
+	snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"",
+			(unsigned long long)info.st_ino, (unsigned long long)info.st_size,
+			(unsigned long long)info.st_mtim.tv_sec * 1000000000ull
+			+ info.st_mtim.tv_nsec);
+	entry->etag = etag;
+	entry->last_modified = httpDate(info.st_mtim.tv_sec);
+
+	slot.info = entry;
+	return entry;
+}
+
+void FileCache::requestEncodings(const string &path, const FileInfo &info) {
+	std::lock_guard<std::mutex> lock(compress_mutex);
+	if (stopping || !compress_queued.insert(path + info.etag).second) {
+		return;
+	}
+	compress_queue.emplace_back(path, info.etag);
+	if (!compressor.joinable()) {
+		compressor = std::thread(&FileCache::compressLoop, this);
+	}
+	compress_ready.notify_one();
+}
+
+void FileCache::compressLoop() {
+	std::unique_lock<std::mutex> lock(compress_mutex);
+	while (true) {
+		compress_ready.wait(lock, [this] {
+			return stopping || !compress_queue.empty();
+		});
+		if (stopping) {
+			return;
+		}
+
+		auto [path, etag] = std::move(compress_queue.front());
+		compress_queue.pop_front();
+
+		lock.unlock();
+		compressFile(path, etag);
+		lock.lock();
+
+		compress_queued.erase(path + etag);
+	}
+}
+
+/**
+ * Reads all of a file.
+ *
+ * @param fd The file.
+ * @param size How big it is.
+ * @param data Set to its contents.
+ * @return False if it couldn't all be read.
+ */
+static bool readFile(int fd, off_t size, string &data) {
+	data.resize(size);
+	size_t have = 0;
+	while (have < data.size()) {
+		ssize_t n = pread(fd, data.data() + have, data.size() - have, have);
+		if (n <= 0) {
+			return false;
+		}
+		have += n;
+	}
+	return true;
+}
+
+/**
+ * Stores bytes in a new memory-backed file.
+ *
+ * @param name A name for the file (only seen in /proc).
+ * @param data The bytes.
+ * @return The file, or -1 on failure.
+ */
+static int memoryFile(const char *name, const string &data) {
+	int fd = memfd_create(name, MFD_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	size_t written = 0;
+	while (written < data.size()) {
+		ssize_t n = write(fd, data.data() + written, data.size() - written);
+		if (n < 0) {
+			close(fd);
+			return -1;
+		}
+		written += n;
+	}
+	return fd;
+}
+
+void FileCache::compressFile(const string &path, const string &etag) {
+	auto encodings = std::make_shared<FileEncodings>();
+
+	// Only compress the version of the file the request was for: if it has
+	// changed since, whoever asks for the new one will queue that.
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	struct stat info;
+	std::shared_ptr<const FileInfo> entry;
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		auto it = entries.find(path);
+		if (it != entries.end()) {
+			entry = it->second.info;
+		}
+	}
+	string data;
+	if (fstat(fd, &info) < 0 || !entry || entry->etag != etag
+			|| !entry->matches(info)
+			|| (info.st_size <= MAX_COMPRESS_SIZE
+				&& !readFile(fd, info.st_size, data))) {
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	// Too big files get no copies (rather than being queued again and again).
+	if (info.st_size <= MAX_COMPRESS_SIZE) {
+		string compressed;
+		for (int i = 0; i < NUM_ENCODINGS; i++) {
+			Encoding encoding = (Encoding)i;
+			if (!encodingSupported(encoding)
+					|| !compressData(encoding, data, compressed)
+					|| compressed.size() >= data.size()) {
+				continue;
+			}
+
+			EncodedFile &file = encodings->files[i];
+			file.fd = memoryFile(string(encodingName(encoding)).c_str(),
+					compressed);
+			if (file.fd < 0) {
+				continue;
+			}
+			file.size = compressed.size();
+			// e.g. "3e8-17f3a2b1c" becomes "3e8-17f3a2b1c-br", so caches
+			// don't mix up the copies.
+			file.etag = etag.substr(0, etag.size() - 1) + "-"
+				+ string(encodingName(encoding)) + "\"";
+		}
+	}
+
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	auto it = entries.find(path);
+	if (it != entries.end() && it->second.info
+			&& it->second.info->etag == etag) {
+		auto updated = std::make_shared<FileInfo>(*it->second.info);
+		updated->encodings = encodings;
+		it->second.info = updated;
+	}
+}
+
+static const char *HTTP_DATE_FORMAT = "%a, %d %b %Y %H:%M:%S GMT";
+
+string httpDate(time_t time) {
+	struct tm tm;
+	char date[64];
+	gmtime_r(&time, &tm);
+	strftime(date, sizeof(date), HTTP_DATE_FORMAT, &tm);
+	return date;
+}
+
+time_t parseHttpDate(string_view date) {
+	// strptime needs a C string; a valid date is much shorter than this.
+	char copy[64];
+	if (date.size() >= sizeof(copy)) {
+		return -1;
+	}
+	date.copy(copy, date.size());
+	copy[date.size()] = '\0';
+	struct tm tm = {};
+	const char *end = strptime(copy, HTTP_DATE_FORMAT, &tm);
+	if (end == nullptr || *end != '\0') {
+		return -1;
+	}
+	return timegm(&tm);
+}
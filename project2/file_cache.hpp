@@ -0,0 +1,189 @@
+/*
+ * File: file_cache.hpp
+ *
+ * Header / API file for the cache of what ToreroServe knows about the files
+ * it serves.
+ *
+ * For each file that has been asked for, the cache holds what goes in the
+ * headers of a response about it: its size, MIME type, and the validators
+ * (ETag and Last-Modified) that clients send back to ask whether it has
+ * changed. That lets a conditional request be answered with "304 Not
+ * Modified" without opening the file, or even looking at it again if it was
+ * looked at in the last CACHE_VALIDITY.
+ *
+ * Text files are also kept compressed with each of the codings in
+ * compress.hpp. The first request for a file only queues the compression,
+ * which is done on a background thread (so no request ever waits for it);
+ * until it's done, the file is sent as it is. Compressed copies are kept in
+ * memory-backed files, so they can be sent with sendfile and splice just like
+ * the originals.
+ *
+ * The cache is shared by all of an engine's threads. Entries are never
+ * changed, only replaced, so a thread can keep using one it has looked up
+ * while another thread replaces it.
+ */
+#ifndef FILE_CACHE_HPP
+#define FILE_CACHE_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "compress.hpp"
+#include "mime.hpp"
+#include "path_table.hpp"
+
+// How long to trust an entry before checking the file again.
+static const std::chrono::milliseconds CACHE_VALIDITY(1000);
+
+// Largest file we'll compress.
+static const off_t MAX_COMPRESS_SIZE = 64 * 1024 * 1024;
+
+/**
+ * A compressed copy of a file.
+ */
+struct EncodedFile {
+	int fd = -1;		// -1 if there's no copy in this coding
+	off_t size = 0;
+	std::string etag;	// the original's, marked with the coding
+};
+
+/**
+ * The compressed copies of a file (only those smaller than the original are
+ * kept).
+ */
+struct FileEncodings {
+	FileEncodings() = default;
+	~FileEncodings();
+
+	FileEncodings(const FileEncodings&) = delete;
+	FileEncodings& operator=(const FileEncodings&) = delete;
+
+	EncodedFile files[NUM_ENCODINGS];
+};
+
+/**
+ * What we know about a regular file.
+ */
+struct FileInfo {
+	off_t size;
+	ino_t inode;
+	struct timespec mtime;
+	const MimeType *type;
+
+	// The compressed copies, or nullptr if they haven't been made yet.
+	std::shared_ptr<const FileEncodings> encodings;
+
+	std::string etag;			// quoted, e.g. "\"3e8-17f3a2b1c\""
+	std::string last_modified;	// an HTTP-date
+
+	/**
+	 * @return Whether this describes the file that stat gave info about.
+	 */
+	bool matches(const struct stat &info) const;
+};
+
+class FileCache {
+public:
+	/**
+	 * @param root The directory files are served from.
+	 */
+	explicit FileCache(const std::filesystem::path &root);
+	~FileCache();
+
+	FileCache(const FileCache&) = delete;
+	FileCache& operator=(const FileCache&) = delete;
+
+	/**
+	 * @return The directory files are served from.
+	 */
+	const std::filesystem::path &root() const { return root_dir; }
+
+	/**
+	 * @return The table of the paths under the served directory (which isn't
+	 * 		used until it's started).
+	 */
+	PathTable &paths() { return path_table; }
+
+	/**
+	 * Looks up a file, checking it again if its entry isn't recent.
+	 *
+	 * @param path The file's path.
+	 * @return What we know about the file, or nullptr if it isn't a regular
+	 * 		file.
+	 */
+	std::shared_ptr<const FileInfo> lookup(const std::string &path);
+
+	/**
+	 * Replaces a file's entry, e.g. when it turns out to have changed after
+	 * being opened.
+	 *
+	 * @param path The file's path.
+	 * @param info What stat (or fstat) says about the file now.
+	 * @return The new entry.
+	 */
+	std::shared_ptr<const FileInfo> update(const std::string &path,
+			const struct stat &info);
+
+	/**
+	 * Queues a compressible file to have its compressed copies made, unless
+	 * it already is queued. Never blocks on the compression itself.
+	 *
+	 * @param path The file's path.
+	 * @param info The cache's entry for the file.
+	 */
+	void requestEncodings(const std::string &path, const FileInfo &info);
+
+private:
+	void compressLoop();
+	void compressFile(const std::string &path, const std::string &etag);
+
+	// An entry, and when the file was last checked (kept out of the entry so
+	// that checking an unchanged file doesn't mean replacing its entry).
+	struct CacheSlot {
+		std::shared_ptr<const FileInfo> info;
+		std::chrono::steady_clock::time_point checked;
+	};
+
+	std::filesystem::path root_dir;
+	std::shared_mutex mutex;
+	std::unordered_map<std::string, CacheSlot> entries;
+
+	// Files waiting to be compressed, as (path, ETag), and the thread that
+	// compresses them, started when the first one is queued.
+	std::mutex compress_mutex;
+	std::condition_variable compress_ready;
+	std::deque<std::pair<std::string, std::string>> compress_queue;
+	std::unordered_set<std::string> compress_queued;	// path + ETag
+	std::thread compressor;
+	bool stopping = false;
+
+	// Last, so its watcher (which uses the rest) stops first.
+	PathTable path_table{*this};
+};
+
+/**
+ * @param time A time.
+ * @return The time as an HTTP-date, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+ */
+std::string httpDate(time_t time);
+
+/**
+ * @param date An HTTP-date (in the preferred, IMF-fixdate format).
+ * @return The time it stands for, or -1 if it isn't a valid date.
+ */
+time_t parseHttpDate(std::string_view date);
+
+#endif
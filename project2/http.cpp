@@ -0,0 +1,999 @@
+/*
+ * File: http.cpp
+ *
+ * Implementation of request parsing and response preparation.
+ *
+ */
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <random>
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "http.hpp"
+
+namespace fs = std::filesystem;
+
+using std::string;
+using std::string_view;
+
+// Most ranges we'll send of a file in one response. Asking for more is most
+// likely an attempt to make us do lots of work, so we send the whole file.
+static const size_t MAX_RANGES = 16;
+
+/**
+ * A range of bytes in a file, from first to last inclusive.
+ */
+struct ByteRange {
+	off_t first;
+	off_t last;
+};
+
+// What error pages, listings and redirects are sent as.
+static const MimeType &html_type = mimeType("html");
+
+// Most received bytes we'll hold on to for a connection, e.g. requests
+// pipelined behind the one being answered.
+static const size_t MAX_INPUT_SIZE = 4 * MAX_REQUEST_SIZE;
+static_assert(MAX_INPUT_SIZE <= POOL_BUFFER_SIZE, "input must fit a buffer");
+
+static bool equalsIgnoreCase(string_view a, string_view b) {
+	return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+/**
+ * @return Whether a comma-separated header value (like Connection's)
+ * 		includes the given token.
+ */
+static bool hasToken(string_view list, string_view token) {
+	while (!list.empty()) {
+		size_t comma = list.find(',');
+		string_view item = list.substr(0, comma);
+		while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) {
+			item.remove_prefix(1);
+		}
+		while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) {
+			item.remove_suffix(1);
+		}
+		if (equalsIgnoreCase(item, token)) {
+			return true;
+		}
+		if (comma == string_view::npos) {
+			break;
+		}
+		list.remove_prefix(comma + 1);
+	}
+	return false;
+}
+
+string_view HttpRequest::header(string_view name) const {
+	for (size_t i = 0; i < num_headers; i++) {
+		if (equalsIgnoreCase(header_names[i], name)) {
+			return header_values[i];
+		}
+	}
+	return {};
+}
+
+bool HttpRequest::keepAlive() const {
+	string_view connection = header("Connection");
+	if (hasToken(connection, "close")) {
+		return false;
+	}
+	return version == "HTTP/1.1" || hasToken(connection, "keep-alive");
+}
+
+/**
+ * Parses a request line, e.g. "GET /index.html HTTP/1.1".
+ */
+static bool parseRequestLine(string_view line, HttpRequest &request) {
+	size_t first_space = line.find(' ');
+	size_t second_space = line.find(' ', first_space + 1);
+	if (first_space == 0 || first_space == string_view::npos
+			|| second_space == string_view::npos) {
+		return false;
+	}
+
+	request.method = line.substr(0, first_space);
+	request.target = line.substr(first_space + 1,
+			second_space - first_space - 1);
+	request.version = line.substr(second_space + 1);
+
+	for (char c : request.method) {
+		if (c < 'A' || c > 'Z') {
+			return false;
+		}
+	}
+	return !request.target.empty() && request.target.front() == '/'
+		&& (request.version == "HTTP/1.1" || request.version == "HTTP/1.0");
+}
+
+/**
+ * Parses a header line, e.g. "Host: www.sandiego.edu".
+ */
+static bool parseHeaderLine(string_view line, HttpRequest &request) {
+	size_t colon = line.find(':');
+	if (colon == 0 || colon == string_view::npos
+			|| request.num_headers == MAX_HEADERS) {
+		return false;
+	}
+
+	string_view name = line.substr(0, colon);
+	if (name.find_first_of(" \t") != string_view::npos) {
+		return false;
+	}
+
+	string_view value = line.substr(colon + 1);
+	while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+		value.remove_prefix(1);
+	}
+	while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+		value.remove_suffix(1);
+	}
+
+	request.header_names[request.num_headers] = name;
+	request.header_values[request.num_headers] = value;
+	request.num_headers++;
+	return true;
+}
+
+ParseStatus parseRequest(string_view data, HttpRequest &request) {
+	request.num_headers = 0;
+	bool have_request_line = false;
+
+	size_t pos = 0;
+	while (true) {
+		size_t newline = data.find('\n', pos);
+		if (newline == string_view::npos) {
+			return data.size() > MAX_REQUEST_SIZE ? ParseStatus::BAD
+				: ParseStatus::INCOMPLETE;
+		}
+		if (newline >= MAX_REQUEST_SIZE) {
+			return ParseStatus::BAD;
+		}
+
+		// Lines should end with CRLF, but we'll take a bare LF too.
+		string_view line = data.substr(pos, newline - pos);
+		if (!line.empty() && line.back() == '\r') {
+			line.remove_suffix(1);
+		}
+		pos = newline + 1;
+
+		if (!have_request_line) {
+			// Empty lines before the request line are to be ignored.
+			if (line.empty()) {
+				continue;
+			}
+			if (!parseRequestLine(line, request)) {
+				return ParseStatus::BAD;
+			}
+			have_request_line = true;
+		}
+		else if (line.empty()) {
+			request.length = pos;
+			return ParseStatus::OK;
+		}
+		else if (!parseHeaderLine(line, request)) {
+			return ParseStatus::BAD;
+		}
+	}
+}
+
+static int hexValue(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * Turns a request target into the path it names: the part before any query,
+ * with %XX escapes decoded.
+ *
+ * @param target The request target.
+ * @param arena Where to put the path.
+ * @param path Set to the path, which starts with a '/'.
+ * @return False if the target is malformed, or has a ".." segment that would
+ * 		reach outside the served directory.
+ */
+static bool decodeTarget(string_view target, Arena &arena, string_view &path) {
+	target = target.substr(0, target.find_first_of("?#"));
+	char *decoded = arena.allocate(target.size());
+	size_t length = 0;
+	for (size_t i = 0; i < target.size(); i++) {
+		char c = target[i];
+		if (c == '%') {
+			int high = i + 2 < target.size() ? hexValue(target[i + 1]) : -1;
+			int low = high >= 0 ? hexValue(target[i + 2]) : -1;
+			if (low < 0) {
+				return false;
+			}
+			c = high * 16 + low;
+			i += 2;
+		}
+		if (c == '\0') {
+			return false;
+		}
+		decoded[length++] = c;
+	}
+	path = string_view(decoded, length);
+
+	size_t start = 0;
+	while (start < path.size()) {
+		size_t end = path.find('/', start);
+		if (end == string_view::npos) {
+			end = path.size();
+		}
+		if (path.substr(start, end - start) == "..") {
+			return false;
+		}
+		start = end + 1;
+	}
+	return true;
+}
+
+static const char *reasonPhrase(int status) {
+	switch (status) {
+		case 200: return "OK";
+		case 206: return "Partial Content";
+		case 301: return "Moved Permanently";
+		case 304: return "Not Modified";
+		case 400: return "Bad Request";
+		case 404: return "Not Found";
+		case 416: return "Range Not Satisfiable";
+		case 501: return "Not Implemented";
+		default: return "Internal Server Error";
+	}
+}
+
+/**
+ * Starts the response's head (in a new piece of text in its arena) with the
+ * status line and the headers every response has. Any others can then be
+ * appended, before endHead.
+ *
+ * @param content_type The body's Content-Type header line (e.g. a MimeType's
+ * 		header), or an empty string for none (as with a 304 response, which
+ * 		has no body or Content-Length either).
+ */
+static void writeHead(HttpResponse &response, int status,
+		string_view content_type, size_t content_length) {
+	Arena &head = response.arena;
+	head.append("HTTP/1.1 ");
+	head.appendNumber(status);
+	head.append(" ");
+	head.append(reasonPhrase(status));
+	head.append("\r\nServer: ToreroServe\r\n");
+	head.append(content_type);
+	if (status != 304) {
+		head.append("Content-Length: ");
+		head.appendNumber(content_length);
+		head.append("\r\n");
+	}
+}
+
+/**
+ * Ends the response's head. The body (or its first part) can then be
+ * appended, before addText.
+ */
+static void endHead(HttpResponse &response) {
+	response.arena.append(response.close ? "Connection: close\r\n\r\n"
+		: "Connection: keep-alive\r\n\r\n");
+}
+
+/**
+ * Adds a part to a response, unless it's empty. A memory part that directly
+ * follows another in the arena is merged with it.
+ */
+static void addPart(HttpResponse &response, bool from_file, off_t offset,
+		size_t length, const char *data = nullptr) {
+	if (length == 0) {
+		return;
+	}
+	if (!from_file && !response.parts.empty()) {
+		ResponsePart &last = response.parts.back();
+		if (!last.from_file && last.data + last.length == data) {
+			last.length += length;
+			return;
+		}
+	}
+	response.parts.push_back({from_file, offset, length, data});
+}
+
+/**
+ * Finishes the piece of text being written in the response's arena, and adds
+ * it to the response.
+ */
+static void addText(HttpResponse &response) {
+	string_view text = response.arena.finish();
+	addPart(response, false, 0, text.size(), text.data());
+}
+
+/**
+ * Fills in a response whose body is held in memory.
+ *
+ * @param head_only Whether to leave the body out (for a HEAD request).
+ */
+static void memoryResponse(int status, string_view content_type,
+		string_view body, bool head_only, HttpResponse &response) {
+	writeHead(response, status, content_type, body.size());
+	endHead(response);
+	if (!head_only) {
+		response.arena.append(body);
+	}
+	addText(response);
+}
+
+static void errorResponse(int status, bool head_only,
+		HttpResponse &response) {
+	response.close = true;
+	Arena &body = response.arena;
+	for (string_view tag : {"<html><head><title>", "</title></head><body><h1>"}) {
+		body.append(tag);
+		body.appendNumber(status);
+		body.append(" ");
+		body.append(reasonPhrase(status));
+	}
+	body.append("</h1></body></html>\n");
+	memoryResponse(status, html_type.header, body.finish(), head_only,
+			response);
+}
+
+void prepareError(int status, HttpResponse &response) {
+	errorResponse(status, false, response);
+}
+
+/**
+ * Fills in a response that redirects a client from a directory's path without
+ * a slash to the one with, where relative links in its page work.
+ */
+static void redirectResponse(const HttpRequest &request,
+		HttpResponse &response) {
+	string_view target = request.target;
+	writeHead(response, 301, html_type.header, 0);
+	response.arena.append("Location: ");
+	response.arena.append(target.substr(0, target.find_first_of("?#")));
+	response.arena.append("/\r\n");
+	endHead(response);
+	addText(response);
+}
+
+/**
+ * What we send for a file: either the file itself or one of its compressed
+ * copies.
+ */
+struct Representation {
+	const FileInfo *info;
+	const EncodedFile *encoded = nullptr;	// nullptr for the file itself
+	Encoding encoding = NUM_ENCODINGS;
+
+	off_t size() const { return encoded ? encoded->size : info->size; }
+	const string &etag() const { return encoded ? encoded->etag : info->etag; }
+};
+
+/**
+ * Adds the Vary, ETag and Last-Modified header lines for a file to a head.
+ */
+static void addValidatorHeaders(const Representation &rep, Arena &head) {
+	// Which of a text file's representations is sent depends on
+	// Accept-Encoding, even before its compressed copies are made.
+	if (rep.info->type->compressible) {
+		head.append("Vary: Accept-Encoding\r\n");
+	}
+	head.append("ETag: ");
+	head.append(rep.etag());
+	head.append("\r\nLast-Modified: ");
+	head.append(rep.info->last_modified);
+	head.append("\r\n");
+}
+
+/**
+ * Adds the header lines describing a file's content to a head: its
+ * validators, plus Content-Encoding for a compressed copy.
+ */
+static void addContentHeaders(const Representation &rep, Arena &head) {
+	if (rep.encoded) {
+		head.append("Content-Encoding: ");
+		head.append(encodingName(rep.encoding));
+		head.append("\r\n");
+	}
+	addValidatorHeaders(rep, head);
+}
+
+/**
+ * @param list The value of an If-None-Match header: entity tags separated by
+ * 		commas.
+ * @param etag A file's entity tag.
+ * @return Whether any tag in the list matches, ignoring weakness (as a GET's
+ * 		If-None-Match should).
+ */
+static bool etagListMatches(string_view list, string_view etag) {
+	while (!list.empty()) {
+		size_t comma = list.find(',');
+		string_view tag = list.substr(0, comma);
+		while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) {
+			tag.remove_prefix(1);
+		}
+		while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) {
+			tag.remove_suffix(1);
+		}
+		if (tag.substr(0, 2) == "W/") {
+			tag.remove_prefix(2);
+		}
+		if (tag == etag) {
+			return true;
+		}
+		if (comma == string_view::npos) {
+			break;
+		}
+		list.remove_prefix(comma + 1);
+	}
+	return false;
+}
+
+/**
+ * @return Whether a conditional request can be answered with 304 Not
+ * 		Modified. If-None-Match takes precedence over If-Modified-Since.
+ */
+static bool notModified(const HttpRequest &request,
+		const Representation &rep) {
+	string_view if_none_match = request.header("If-None-Match");
+	if (!if_none_match.empty()) {
+		return if_none_match == "*"
+			|| etagListMatches(if_none_match, rep.etag());
+	}
+
+	string_view if_modified_since = request.header("If-Modified-Since");
+	if (!if_modified_since.empty()) {
+		time_t since = parseHttpDate(if_modified_since);
+		return since >= 0 && rep.info->mtime.tv_sec <= since;
+	}
+	return false;
+}
+
+static string_view trimSpace(string_view text) {
+	while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+		text.remove_prefix(1);
+	}
+	while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) {
+		text.remove_suffix(1);
+	}
+	return text;
+}
+
+/**
+ * Parses a qvalue ("0", "0.5", "1.000", ...).
+ *
+ * @return The value in thousandths, or -1 if it isn't a valid qvalue.
+ */
+static int parseQuality(string_view text) {
+	if (text.empty() || (text[0] != '0' && text[0] != '1') || text.size() > 5
+			|| (text.size() > 1 && text[1] != '.')) {
+		return -1;
+	}
+	int value = (text[0] - '0') * 1000;
+	int scale = 100;
+	for (size_t i = 2; i < text.size(); i++, scale /= 10) {
+		if (!isdigit((unsigned char)text[i])) {
+			return -1;
+		}
+		value += (text[i] - '0') * scale;
+	}
+	return value <= 1000 ? value : -1;
+}
+
+/**
+ * @param accept The value of an Accept-Encoding header.
+ * @param coding A content coding's name.
+ * @return How much the client wants that coding, in thousandths: the q of
+ * 		the coding if it's listed, else that of "*" if that is, else -1.
+ */
+static int codingQuality(string_view accept, string_view coding) {
+	int wildcard = -1;
+	while (!accept.empty()) {
+		size_t comma = accept.find(',');
+		string_view item = accept.substr(0, comma);
+		size_t semicolon = item.find(';');
+		string_view name = trimSpace(item.substr(0, semicolon));
+
+		int quality = 1000;
+		if (semicolon != string_view::npos) {
+			string_view param = trimSpace(item.substr(semicolon + 1));
+			if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q')
+					&& param[1] == '=') {
+				quality = std::max(parseQuality(param.substr(2)), 0);
+			}
+		}
+
+		if (equalsIgnoreCase(name, coding)) {
+			return quality;
+		}
+		if (name == "*") {
+			wildcard = quality;
+		}
+		if (comma == string_view::npos) {
+			break;
+		}
+		accept.remove_prefix(comma + 1);
+	}
+	return wildcard;
+}
+
+/**
+ * Picks what to send for a file: the compressed copy the client likes best,
+ * preferring the better codings when it likes several equally, or the file
+ * itself if it accepts none of them (or says it prefers it).
+ */
+static Representation chooseRepresentation(const HttpRequest &request,
+		const FileInfo &info) {
+	Representation rep{&info};
+	string_view accept = request.header("Accept-Encoding");
+	if (!info.encodings || accept.empty()) {
+		return rep;
+	}
+
+	int best = std::max(codingQuality(accept, "identity"), 0);
+	for (int i = 0; i < NUM_ENCODINGS; i++) {
+		const EncodedFile &file = info.encodings->files[i];
+		int quality = codingQuality(accept, encodingName((Encoding)i));
+		if (file.fd >= 0 && quality > best) {
+			rep.encoded = &file;
+			rep.encoding = (Encoding)i;
+			best = quality;
+		}
+	}
+	return rep;
+}
+
+/**
+ * Parses a decimal number with no sign.
+ *
+ * @return False if it isn't one, or is too big to be a file offset.
+ */
+static bool parseOffset(string_view digits, off_t &value) {
+	if (digits.empty() || digits.size() > 18) {
+		return false;
+	}
+	value = 0;
+	for (char c : digits) {
+		if (c < '0' || c > '9') {
+			return false;
+		}
+		value = value * 10 + (c - '0');
+	}
+	return true;
+}
+
+/**
+ * Parses a Range header, e.g. "bytes=0-499, 1000-, -200".
+ *
+ * @param spec The header's value.
+ * @param size The size of the file.
+ * @param ranges Filled in with the ranges that are in the file, clamped to
+ * 		it.
+ * @return How many ranges were filled in (0 if none are satisfiable), or -1
+ * 		if the header isn't valid or has more than MAX_RANGES ranges, and
+ * 		should be ignored.
+ */
+static int parseRanges(string_view spec, off_t size,
+		ByteRange ranges[MAX_RANGES]) {
+	if (spec.size() < 6 || !equalsIgnoreCase(spec.substr(0, 6), "bytes=")) {
+		return -1;
+	}
+	spec.remove_prefix(6);
+
+	int count = 0;
+	size_t num_specs = 0;
+	while (!spec.empty()) {
+		size_t comma = spec.find(',');
+		string_view item = spec.substr(0, comma);
+		spec.remove_prefix(comma == string_view::npos ? spec.size() : comma + 1);
+		while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) {
+			item.remove_prefix(1);
+		}
+		while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) {
+			item.remove_suffix(1);
+		}
+		if (item.empty()) {
+			continue;
+		}
+		if (++num_specs > MAX_RANGES) {
+			return -1;
+		}
+
+		size_t dash = item.find('-');
+		if (dash == string_view::npos) {
+			return -1;
+		}
+		off_t first, last;
+		if (dash == 0) {
+			// the last n bytes
+			off_t suffix;
+			if (!parseOffset(item.substr(1), suffix)) {
+				return -1;
+			}
+			if (suffix == 0 || size == 0) {
+				continue;
+			}
+			first = suffix < size ? size - suffix : 0;
+			last = size - 1;
+		}
+		else {
+			if (!parseOffset(item.substr(0, dash), first)) {
+				return -1;
+			}
+			if (dash + 1 == item.size()) {
+				last = size - 1;
+			}
+			else if (!parseOffset(item.substr(dash + 1), last) || last < first) {
+				return -1;
+			}
+			if (first >= size) {
+				continue;
+			}
+			last = std::min(last, size - 1);
+		}
+		ranges[count++] = {first, last};
+	}
+	return num_specs == 0 ? -1 : count;
+}
+
+/**
+ * Adds a Content-Range header line, for a range of a file, to a head.
+ */
+static void addContentRange(const ByteRange &range, off_t size, Arena &head) {
+	head.append("Content-Range: bytes ");
+	head.appendNumber(range.first);
+	head.append("-");
+	head.appendNumber(range.last);
+	head.append("/");
+	head.appendNumber(size);
+	head.append("\r\n");
+}
+
+/**
+ * Fills in a 206 response with several ranges of a file, as a
+ * multipart/byteranges body: each range comes after a delimiter line and
+ * headers saying which range it is.
+ */
+static void multipartResponse(const Representation &rep,
+		const ByteRange *ranges, int num_ranges, HttpResponse &response) {
+	static const string boundary = "ToreroServe-"
+		+ std::to_string(std::random_device()());
+
+	// The head needs the body's length, so write the delimiters first.
+	Arena &arena = response.arena;
+	string_view delimiters[MAX_RANGES + 1];
+	size_t length = 0;
+	for (int i = 0; i <= num_ranges; i++) {
+		arena.append("\r\n--");
+		arena.append(boundary);
+		if (i < num_ranges) {
+			arena.append("\r\nContent-Type: ");
+			arena.append(rep.info->type->type);
+			arena.append("\r\n");
+			addContentRange(ranges[i], rep.size(), arena);
+			arena.append("\r\n");
+			length += ranges[i].last - ranges[i].first + 1;
+		}
+		else {
+			arena.append("--\r\n");
+		}
+		delimiters[i] = arena.finish();
+		length += delimiters[i].size();
+	}
+
+	writeHead(response, 206, "", length);
+	arena.append("Content-Type: multipart/byteranges; boundary=");
+	arena.append(boundary);
+	arena.append("\r\n");
+	addValidatorHeaders(rep, arena);
+	endHead(response);
+	addText(response);
+	for (int i = 0; i <= num_ranges; i++) {
+		addPart(response, false, 0, delimiters[i].size(), delimiters[i].data());
+		if (i < num_ranges) {
+			addPart(response, true, ranges[i].first,
+					ranges[i].last - ranges[i].first + 1);
+		}
+	}
+}
+
+void prepareResponse(const HttpRequest &request, FileCache &files,
+		HttpResponse &response) {
+	response.clear();
+
+	// We don't read request bodies, so if there is one we can't find where
+	// the next request starts.
+	string_view content_length = request.header("Content-Length");
+	response.close = !request.keepAlive()
+		|| !request.header("Transfer-Encoding").empty()
+		|| (!content_length.empty() && content_length != "0");
+
+	bool head_only = request.method == "HEAD";
+	if (request.method != "GET" && !head_only) {
+		errorResponse(501, false, response);
+		return;
+	}
+
+	string_view path;
+	if (!decodeTarget(request.target, response.arena, path)) {
+		errorResponse(400, head_only, response);
+		return;
+	}
+
+	// The table's entries stay put for the rest of the request, so a file's
+	// path can be used from there without copying it.
+	const string *file = nullptr;
+	string unlisted_file;
+	PathTable &paths = files.paths();
+	if (paths.active()) {
+		const PathEntry *entry = paths.resolve(path);
+		if (entry == nullptr) {
+			errorResponse(404, head_only, response);
+			return;
+		}
+		if (entry->kind == PathEntry::REDIRECT) {
+			redirectResponse(request, response);
+			return;
+		}
+		if (entry->kind == PathEntry::LISTING) {
+			memoryResponse(200, html_type.header, entry->listing, head_only,
+					response);
+			return;
+		}
+		file = &entry->file;
+	}
+	else {
+		fs::path found = files.root() / fs::path(path).relative_path();
+		std::error_code ec;
+		if (fs::is_directory(found, ec)) {
+			if (path.back() != '/') {
+				redirectResponse(request, response);
+				return;
+			}
+
+			fs::path index = found / "index.html";
+			if (!fs::exists(index, ec)) {
+				memoryResponse(200, html_type.header,
+						listingPage(found, string(path)), head_only, response);
+				return;
+			}
+			found = index;
+		}
+		unlisted_file = found.native();
+		file = &unlisted_file;
+	}
+
+	std::shared_ptr<const FileInfo> info = files.lookup(*file);
+	if (info == nullptr) {
+		errorResponse(404, head_only, response);
+		return;
+	}
+
+	// Text files are compressed in the background, the first time they're
+	// asked for.
+	if (info->type->compressible && !info->encodings) {
+		files.requestEncodings(*file, *info);
+	}
+
+	// Ranges are always of the file itself: a client asking for part of a
+	// file almost never wants part of a compressed copy (which it can't
+	// decompress on its own).
+	string_view range = request.header("Range");
+	Representation rep = range.empty() || head_only
+		? chooseRepresentation(request, *info) : Representation{info.get()};
+
+	// If the client's copy is still good, it doesn't need the file.
+	if (notModified(request, rep)) {
+		writeHead(response, 304, "", 0);
+		addValidatorHeaders(rep, response.arena);
+		endHead(response);
+		addText(response);
+		return;
+	}
+
+	if (rep.encoded) {
+		// The copy is shared with the cache, and it's only ever replaced (not
+		// changed), so it just needs to outlive the response.
+		response.file = rep.encoded->fd;
+		response.encodings = info->encodings;
+		writeHead(response, 200, info->type->header, rep.size());
+		response.arena.append("Accept-Ranges: bytes\r\n");
+		addContentHeaders(rep, response.arena);
+		endHead(response);
+		addText(response);
+		if (!head_only) {
+			addPart(response, true, 0, rep.size());
+		}
+		return;
+	}
+
+	int fd = open(file->c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat file_stat;
+	if (fd < 0 || fstat(fd, &file_stat) < 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		errorResponse(404, head_only, response);
+		return;
+	}
+	if (!info->matches(file_stat)) {
+		// It changed since we last looked, and the headers have to describe
+		// what we actually send.
+		info = files.update(*file, file_stat);
+		rep.info = info.get();
+	}
+	response.file = fd;
+
+	ByteRange ranges[MAX_RANGES];
+	int num_ranges = -1;
+	string_view if_range = request.header("If-Range");
+	if (!head_only && !range.empty()
+			&& (if_range.empty() || if_range == info->etag
+				|| if_range == info->last_modified)) {
+		num_ranges = parseRanges(range, info->size, ranges);
+	}
+
+	if (num_ranges < 0) {
+		writeHead(response, 200, info->type->header, info->size);
+		response.arena.append("Accept-Ranges: bytes\r\n");
+		addContentHeaders(rep, response.arena);
+		endHead(response);
+		addText(response);
+		if (!head_only) {
+			addPart(response, true, 0, info->size);
+		}
+	}
+	else if (num_ranges == 0) {
+		writeHead(response, 416, html_type.header, 0);
+		response.arena.append("Content-Range: bytes */");
+		response.arena.appendNumber(info->size);
+		response.arena.append("\r\n");
+		endHead(response);
+		addText(response);
+	}
+	else if (num_ranges == 1) {
+		size_t length = ranges[0].last - ranges[0].first + 1;
+		writeHead(response, 206, info->type->header, length);
+		addContentRange(ranges[0], info->size, response.arena);
+		addContentHeaders(rep, response.arena);
+		endHead(response);
+		addText(response);
+		addPart(response, true, ranges[0].first, length);
+	}
+	else {
+		multipartResponse(rep, ranges, num_ranges, response);
+	}
+}
+
+HttpResponse::~HttpResponse() {
+	clear();
+}
+
+void HttpResponse::clear() {
+	// A compressed copy's file belongs to the cache.
+	if (file >= 0 && !encodings) {
+		::close(file);
+	}
+	file = -1;
+	encodings.reset();
+	arena.reset();
+	parts.clear();
+	close = false;
+}
+
+HttpConnection::HttpConnection(FileCache &files, BufferPool &pool)
+	: files(files), pool(pool), response(pool) {}
+
+HttpConnection::~HttpConnection() {
+	releaseInput();
+}
+
+void HttpConnection::releaseInput() {
+	if (input != nullptr) {
+		pool.put(input);
+		input = nullptr;
+	}
+	input_start = input_end = 0;
+}
+
+size_t HttpConnection::received(const char *data, size_t length) {
+	size_t space;
+	char *end = inputSpace(space);
+	length = std::min(length, space);
+	if (length > 0) {
+		memcpy(end, data, length);
+		inputReceived(length);
+	}
+	return length;
+}
+
+char *HttpConnection::inputSpace(size_t &length) {
+	if (input == nullptr) {
+		input = pool.get();
+	}
+	else if (input_start > 0) {
+		// Make room at the end by moving what's left of the input (e.g. the
+		// start of the next request) to the start.
+		memmove(input, input + input_start, input_end - input_start);
+		input_end -= input_start;
+		input_start = 0;
+	}
+	length = MAX_INPUT_SIZE - input_end;
+	return input + input_end;
+}
+
+bool HttpConnection::nextResponse() {
+	if (responding) {
+		return true;
+	}
+
+	HttpRequest request;
+	string_view data(input + input_start, input_end - input_start);
+	switch (parseRequest(data, request)) {
+		case ParseStatus::INCOMPLETE:
+			if (data.empty()) {
+				// Idle connections don't hold on to buffers.
+				releaseInput();
+			}
+			return false;
+
+		case ParseStatus::BAD:
+			response.clear();
+			prepareError(400, response);
+			releaseInput();
+			break;
+
+		case ParseStatus::OK:
+			prepareResponse(request, files, response);
+			input_start += request.length;
+			break;
+	}
+
+	responding = true;
+	part_index = 0;
+	part_sent = 0;
+	return true;
+}
+
+ResponsePart HttpConnection::pendingPart(size_t ahead) const {
+	size_t index = part_index + ahead;
+	if (!responding || index >= response.parts.size()) {
+		return {false, 0, 0};
+	}
+	ResponsePart part = response.parts[index];
+	if (ahead == 0) {
+		if (part.from_file) {
+			part.offset += part_sent;
+		}
+		else {
+			part.data += part_sent;
+		}
+		part.length -= part_sent;
+	}
+	return part;
+}
+
+void HttpConnection::sent(size_t length) {
+	while (length > 0 && part_index < response.parts.size()) {
+		size_t left = response.parts[part_index].length - part_sent;
+		size_t taken = std::min(left, length);
+		part_sent += taken;
+		length -= taken;
+		if (part_sent == response.parts[part_index].length) {
+			part_index++;
+			part_sent = 0;
+		}
+	}
+}
+
+bool HttpConnection::finishResponse() {
+	bool keep_open = !response.close;
+	response.clear();
+	responding = false;
+	return keep_open;
+}
@@ -0,0 +1,242 @@
+/*
+ * File: http.hpp
+ *
+ * Header / API file for the HTTP side of ToreroServe: parsing requests and
+ * working out the responses to them.
+ *
+ * None of this does any network I/O. A connection's engine (see engine.hpp)
+ * hands the bytes it receives to an HttpConnection, and gets back a response
+ * as a list of parts to send, each either bytes in memory or a range of an
+ * open file. That lets each engine move the bytes in whatever way suits it
+ * best (send and sendfile, io_uring's send and splice, ...).
+ *
+ * The received bytes and the responses' memory parts are kept in buffers from
+ * the engine's BufferPool (see arena.hpp), so handling requests doesn't
+ * allocate memory.
+ */
+#ifndef HTTP_HPP
+#define HTTP_HPP
+
+#include <filesystem>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "arena.hpp"
+#include "file_cache.hpp"
+
+// Largest request head (request line and headers) we'll accept.
+static const size_t MAX_REQUEST_SIZE = 8192;
+
+// Most header fields we keep from a request; any more make it a bad request.
+static const size_t MAX_HEADERS = 32;
+
+enum class ParseStatus { INCOMPLETE, OK, BAD };
+
+/**
+ * A parsed request head. All the fields point into the received bytes, so
+ * they're only valid until those change.
+ */
+struct HttpRequest {
+	std::string_view method;
+	std::string_view target;
+	std::string_view version;
+
+	size_t num_headers = 0;
+	std::string_view header_names[MAX_HEADERS];
+	std::string_view header_values[MAX_HEADERS];
+
+	// How many bytes the request head took up.
+	size_t length = 0;
+
+	/**
+	 * @param name The name of a header field (in any case).
+	 * @return The field's value, or an empty string if it wasn't sent.
+	 */
+	std::string_view header(std::string_view name) const;
+
+	/**
+	 * @return Whether the client wants the connection kept open after the
+	 * 		response.
+	 */
+	bool keepAlive() const;
+};
+
+/**
+ * One piece of a response. Memory parts are bytes in the response's arena
+ * (the first being the status line and headers); file parts are a range of
+ * its file.
+ */
+struct ResponsePart {
+	bool from_file;
+	off_t offset;					// file parts: where the range starts
+	size_t length;
+	const char *data = nullptr;		// memory parts: the bytes
+};
+
+/**
+ * A response, ready to send.
+ */
+class HttpResponse {
+public:
+	/**
+	 * @param pool Where the response's arena gets its memory.
+	 */
+	explicit HttpResponse(BufferPool &pool) : arena(pool) {}
+	~HttpResponse();
+
+	HttpResponse(const HttpResponse&) = delete;
+	HttpResponse& operator=(const HttpResponse&) = delete;
+
+	/**
+	 * Closes the response's file (if any) and empties it (giving its memory
+	 * back), ready for reuse.
+	 */
+	void clear();
+
+	Arena arena;
+	int file = -1;
+	std::vector<ResponsePart> parts;
+
+	// If file is one of a file's compressed copies, the cache's set of them
+	// (which owns it).
+	std::shared_ptr<const FileEncodings> encodings;
+
+	// Whether to close the connection once the response has been sent.
+	bool close = false;
+};
+
+/**
+ * Parses the request head at the start of some received bytes.
+ *
+ * @param data The bytes received so far.
+ * @param request Filled in with the request when OK is returned.
+ * @return OK, INCOMPLETE if the head hasn't all arrived yet, or BAD if the
+ * 		bytes aren't a valid request (or are too long to be one).
+ */
+ParseStatus parseRequest(std::string_view data, HttpRequest &request);
+
+/**
+ * Works out the response to a request for a file under the served directory.
+ * Handles conditional requests (If-None-Match, If-Modified-Since), requests
+ * for ranges of a file (Range, If-Range), and sends a compressed copy of a
+ * text file if the client accepts one (Accept-Encoding).
+ *
+ * @param request The request.
+ * @param files The cache of the served files.
+ * @param response Filled in with the response.
+ */
+void prepareResponse(const HttpRequest &request, FileCache &files,
+		HttpResponse &response);
+
+/**
+ * Fills in an error response, which also closes the connection.
+ *
+ * @param status The status code, e.g. 400.
+ * @param response Filled in with the response.
+ */
+void prepareError(int status, HttpResponse &response);
+
+/**
+ * The HTTP state of one client connection: the bytes it has sent that haven't
+ * been handled yet, and the response currently being sent to it.
+ */
+class HttpConnection {
+public:
+	/**
+	 * @param files The cache of the served files.
+	 * @param pool Where the connection gets buffers from.
+	 */
+	HttpConnection(FileCache &files, BufferPool &pool);
+	~HttpConnection();
+
+	HttpConnection(const HttpConnection&) = delete;
+	HttpConnection& operator=(const HttpConnection&) = delete;
+
+	/**
+	 * Adds bytes received from the client, or as many of them as fit.
+	 *
+	 * @return How many were added. If it's fewer than length, the rest have
+	 * 		to wait until the requests already received have been answered.
+	 */
+	size_t received(const char *data, size_t length);
+
+	/**
+	 * Gets room to receive bytes from the client straight into, rather than
+	 * handing them to received.
+	 *
+	 * @param length Set to how many bytes fit, which is 0 if the client has
+	 * 		sent more than we're willing to buffer at once. There's always a
+	 * 		complete (or bad) request in a full buffer, so answering the
+	 * 		requests received makes room.
+	 * @return Where the bytes go.
+	 */
+	char *inputSpace(size_t &length);
+
+	/**
+	 * Adds bytes received into the room from inputSpace.
+	 *
+	 * @param length How many.
+	 */
+	void inputReceived(size_t length) { input_end += length; }
+
+	/**
+	 * Starts on the next response, unless one is still being sent.
+	 *
+	 * @return Whether there's a response to send.
+	 */
+	bool nextResponse();
+
+	/**
+	 * @param ahead How many parts past the current one to look.
+	 * @return What's left to send of a part of the response, with
+	 * 		a length of 0 if there's no such part.
+	 */
+	ResponsePart pendingPart(size_t ahead = 0) const;
+
+	/**
+	 * @param part A memory part from pendingPart.
+	 * @return The part's bytes.
+	 */
+	const char *partData(const ResponsePart &part) const { return part.data; }
+
+	/**
+	 * @return The response's file, which file parts are read from.
+	 */
+	int file() const { return response.file; }
+
+	/**
+	 * Notes that bytes of the response have been sent.
+	 *
+	 * @param length How many (which may span more than one part).
+	 */
+	void sent(size_t length);
+
+	/**
+	 * Finishes with a response once all of it has been sent.
+	 *
+	 * @return Whether to keep the connection open.
+	 */
+	bool finishResponse();
+
+private:
+	void releaseInput();
+
+	FileCache &files;
+	BufferPool &pool;
+
+	// The received bytes not handled yet are input[input_start, input_end).
+	// input is a pool buffer, held only while there are some.
+	char *input = nullptr;
+	size_t input_start = 0;
+	size_t input_end = 0;
+
+	HttpResponse response;
+	bool responding = false;
+	size_t part_index = 0;
+	size_t part_sent = 0;	// bytes of parts[part_index] already sent
+};
+
+#endif
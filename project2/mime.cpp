@@ -0,0 +1,150 @@
+/*
+ * File: mime.cpp
+ *
+ * Implementation of the MIME type table.
+ *
+ * The table's slots are indexed by a hash of the extension, seeded with the
+ * first seed (found by the compiler) that gives every known extension a slot
+ * of its own. A lookup then only has to check the one slot its extension
+ * hashes to.
+ */
+#include <array>
+#include <cstdint>
+
+#include "mime.hpp"
+
+using std::string_view;
+
+#define MIME(extension, type, compressible) \
+	{extension, type, "Content-Type: " type "\r\n", compressible}
+
+static constexpr MimeType TYPES[] = {
+	MIME("html", "text/html", true),
+	MIME("htm", "text/html", true),
+	MIME("css", "text/css", true),
+	MIME("txt", "text/plain", true),
+	MIME("js", "application/javascript", true),
+	MIME("json", "application/json", true),
+	MIME("svg", "image/svg+xml", true),
+	MIME("jpg", "image/jpeg", false),
+	MIME("jpeg", "image/jpeg", false),
+	MIME("png", "image/png", false),
+	MIME("gif", "image/gif", false),
+	MIME("ico", "image/x-icon", false),
+	MIME("pdf", "application/pdf", false),
+};
+
+static constexpr MimeType DEFAULT_TYPE =
+	MIME("", "application/octet-stream", false);
+
+#undef MIME
+
+static constexpr size_t NUM_TYPES = sizeof(TYPES) / sizeof(TYPES[0]);
+
+// A power of two, a few times the number of types so a seed is quick to find.
+static constexpr size_t NUM_SLOTS = 64;
+static_assert(NUM_TYPES < NUM_SLOTS, "too many types for the table");
+
+static constexpr char lowerCase(char c) {
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/**
+ * FNV-1a of an extension (in lower case), starting from a seed.
+ */
+static constexpr size_t slotOf(string_view extension, uint32_t seed) {
+	uint32_t hash = 2166136261u ^ seed;
+	for (char c : extension) {
+		hash = (hash ^ (unsigned char)lowerCase(c)) * 16777619u;
+	}
+	return (hash ^ (hash >> 16)) & (NUM_SLOTS - 1);
+}
+
+/**
+ * @return The length of the longest extension we know (anything longer can't
+ * 		be one of them).
+ */
+static constexpr size_t maxExtension() {
+	size_t longest = 0;
+	for (const MimeType &type : TYPES) {
+		longest = type.extension.size() > longest ? type.extension.size()
+			: longest;
+	}
+	return longest;
+}
+
+static constexpr size_t MAX_EXTENSION = maxExtension();
+
+static constexpr uint32_t findSeed() {
+	for (uint32_t seed = 0; ; seed++) {
+		bool taken[NUM_SLOTS] = {};
+		bool perfect = true;
+		for (const MimeType &type : TYPES) {
+			size_t slot = slotOf(type.extension, seed);
+			perfect = perfect && !taken[slot];
+			taken[slot] = true;
+		}
+		if (perfect) {
+			return seed;
+		}
+	}
+}
+
+static constexpr uint32_t SEED = findSeed();
+
+/**
+ * @return For each slot, the index in TYPES of the type whose extension hashes
+ * 		to it, or -1 if none.
+ */
+static constexpr std::array<int8_t, NUM_SLOTS> buildSlots() {
+	std::array<int8_t, NUM_SLOTS> slots = {};
+	for (size_t i = 0; i < NUM_SLOTS; i++) {
+		slots[i] = -1;
+	}
+	for (size_t i = 0; i < NUM_TYPES; i++) {
+		slots[slotOf(TYPES[i].extension, SEED)] = i;
+	}
+	return slots;
+}
+
+static constexpr std::array<int8_t, NUM_SLOTS> SLOTS = buildSlots();
+
+static constexpr bool sameExtension(string_view a, string_view b) {
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < a.size(); i++) {
+		if (lowerCase(a[i]) != b[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static constexpr const MimeType &lookup(string_view extension) {
+	if (extension.size() > MAX_EXTENSION) {
+		return DEFAULT_TYPE;
+	}
+	int8_t index = SLOTS[slotOf(extension, SEED)];
+	return index >= 0 && sameExtension(extension, TYPES[index].extension)
+		? TYPES[index] : DEFAULT_TYPE;
+}
+
+static_assert(lookup("html").type == "text/html", "html");
+static_assert(lookup("JPG").type == "image/jpeg", "case");
+static_assert(lookup("tar").type == "application/octet-stream", "unknown");
+
+const MimeType &mimeType(string_view extension) {
+	return lookup(extension);
+}
+
+const MimeType &fileMimeType(string_view path) {
+	// As with std::filesystem::path::extension, a name starting with a dot
+	// (like ".profile") has no extension.
+	string_view name = path.substr(path.rfind('/') + 1);
+	size_t dot = name.rfind('.');
+	if (dot == string_view::npos || dot == 0) {
+		return DEFAULT_TYPE;
+	}
+	return lookup(name.substr(dot + 1));
+}
@@ -0,0 +1,39 @@
+/*
+ * File: mime.hpp
+ *
+ * Header / API file for the MIME types ToreroServe sends files as.
+ *
+ * The types are in a table built at compile time, with a perfect hash of the
+ * file extensions (see mime.cpp), so finding a file's type takes one hash and
+ * one comparison. Each type comes with its Content-Type header line already
+ * written, so responses can copy it straight in.
+ */
+#ifndef MIME_HPP
+#define MIME_HPP
+
+#include <string_view>
+
+/**
+ * A type files can be sent as.
+ */
+struct MimeType {
+	std::string_view extension;	// without the dot, in lower case
+	std::string_view type;
+	std::string_view header;	// "Content-Type: ...\r\n"
+	bool compressible;			// whether it's text worth compressing
+};
+
+/**
+ * @param extension A file extension, without the dot (in any case).
+ * @return The type for files with that extension: application/octet-stream
+ * 		for extensions we don't know.
+ */
+const MimeType &mimeType(std::string_view extension);
+
+/**
+ * @param path A file's path.
+ * @return The type to send the file as, going by its extension.
+ */
+const MimeType &fileMimeType(std::string_view path);
+
+#endif
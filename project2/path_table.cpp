@@ -0,0 +1,394 @@
+/*
+ * File: path_table.cpp
+ *
+ * Implementation of the path resolution table.
+ *
+ */
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_cache.hpp"
+#include "path_table.hpp"
+
+namespace fs = std::filesystem;
+
+using std::string;
+using std::string_view;
+
+// The changes to a directory that change what its paths lead to. (Changes to
+// a file's contents don't: the file cache notices those.)
+static const uint32_t WATCH_EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM
+	| IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+// Changes tend to come in bursts (e.g. copying in a directory), so the tree
+// is only scanned again once it has been quiet for this long.
+static const int SETTLE_MS = 50;
+
+// How often the watcher tries again to free old tables that were still in
+// use, once things are quiet.
+static const int RECLAIM_MS = 1000;
+
+namespace {
+
+/**
+ * A reading thread's hazard pointer: the table it's reading from, which
+ * mustn't be freed until it moves on. Slots are never freed, only handed on
+ * to another thread once their thread ends, so there are only ever as many
+ * as the most threads that have read at once.
+ */
+struct ReaderSlot {
+	std::atomic<const void*> table{nullptr};
+	std::atomic<bool> taken{true};
+	ReaderSlot *next = nullptr;
+};
+
+std::atomic<ReaderSlot*> reader_slots{nullptr};
+
+/**
+ * Holds the calling thread's slot for as long as the thread lives.
+ */
+struct ThreadSlot {
+	ReaderSlot *slot = nullptr;
+
+	ThreadSlot() {
+		for (ReaderSlot *spare = reader_slots.load(std::memory_order_acquire);
+				spare != nullptr; spare = spare->next) {
+			if (!spare->taken.exchange(true, std::memory_order_acquire)) {
+				slot = spare;
+				return;
+			}
+		}
+
+		slot = new ReaderSlot;
+		slot->next = reader_slots.load(std::memory_order_relaxed);
+		while (!reader_slots.compare_exchange_weak(slot->next, slot,
+					std::memory_order_release, std::memory_order_relaxed)) {}
+	}
+
+	~ThreadSlot() {
+		slot->table.store(nullptr, std::memory_order_release);
+		slot->taken.store(false, std::memory_order_release);
+	}
+};
+
+}
+
+PathTable::PathTable(FileCache &files) : files(files) {}
+
+PathTable::~PathTable() {
+	if (watcher.joinable()) {
+		uint64_t one = 1;
+		if (write(stop_fd, &one, sizeof(one)) < 0) {
+			perror("write");
+		}
+		watcher.join();
+	}
+	if (watch_fd >= 0) {
+		close(watch_fd);
+	}
+	if (stop_fd >= 0) {
+		close(stop_fd);
+	}
+
+	// Nothing reads from the table once it's being destroyed.
+	delete table.load();
+	for (const Table *old : retired) {
+		delete old;
+	}
+}
+
+bool PathTable::start() {
+	watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (watch_fd >= 0 && stop_fd >= 0) {
+		std::unique_ptr<const Table> first = scan();
+		if (watched_all) {
+			publish(std::move(first));
+			started = true;
+			watcher = std::thread(&PathTable::watchLoop, this);
+			return true;
+		}
+	}
+
+	// Without watches we'd never see changes, so a table could only get more
+	// and more out of date.
+	int error = errno;
+	if (watch_fd >= 0) {
+		close(watch_fd);
+		watch_fd = -1;
+	}
+	if (stop_fd >= 0) {
+		close(stop_fd);
+		stop_fd = -1;
+	}
+	errno = error;
+	return false;
+}
+
+const PathEntry *PathTable::resolve(string_view path) const {
+	thread_local ThreadSlot reader;
+
+	// Say which table we're using, then check it's still the current one: if
+	// so, it was current when the watcher (which swaps before it looks at the
+	// slots) would have seen our slot, so it won't be freed. If not, the
+	// watcher may already have looked, so try again with the new one.
+	const Table *current = table.load();
+	while (true) {
+		reader.slot->table.store(current);
+		const Table *again = table.load();
+		if (again == current) {
+			break;
+		}
+		current = again;
+	}
+
+	auto it = current->entries.find(path);
+	return it == current->entries.end() ? nullptr : &it->second;
+}
+
+void PathTable::Table::add(string path, PathEntry entry) {
+	// A deque never moves its elements, so the keys stay valid.
+	paths.push_back(std::move(path));
+	entries.emplace(paths.back(), std::move(entry));
+}
+
+std::unique_ptr<const PathTable::Table> PathTable::scan() {
+	auto new_table = std::make_unique<Table>();
+	std::vector<std::pair<dev_t, ino_t>> ancestors;
+	std::vector<int> previous;
+	previous.swap(watches);
+	watched_all = true;
+	scanDirectory(files.root(), "/", *new_table, ancestors);
+
+	// The kernel drops the watch of a directory that's deleted, but not of
+	// one that's moved out of the tree, so those are removed here.
+	std::sort(previous.begin(), previous.end());
+	std::sort(watches.begin(), watches.end());
+	watches.erase(std::unique(watches.begin(), watches.end()), watches.end());
+	std::vector<int> stale;
+	std::set_difference(previous.begin(), previous.end(), watches.begin(),
+			watches.end(), std::back_inserter(stale));
+	for (int wd : stale) {
+		inotify_rm_watch(watch_fd, wd);
+	}
+	return new_table;
+}
+
+void PathTable::scanDirectory(const fs::path &directory, const string &path,
+		Table &new_table, std::vector<std::pair<dev_t, ino_t>> &ancestors) {
+	// A symbolic link back up the tree would have us scan it forever.
+	struct stat dir_stat;
+	if (stat(directory.c_str(), &dir_stat) < 0) {
+		return;
+	}
+	std::pair<dev_t, ino_t> id(dir_stat.st_dev, dir_stat.st_ino);
+	if (std::find(ancestors.begin(), ancestors.end(), id) != ancestors.end()) {
+		return;
+	}
+	ancestors.push_back(id);
+
+	// Adding a watch that's already there just gives back its descriptor, so
+	// every scan adds them all (see scan for removing them).
+	int wd = inotify_add_watch(watch_fd, directory.c_str(), WATCH_EVENTS);
+	if (wd < 0) {
+		watched_all = false;
+	}
+	else {
+		watches.push_back(wd);
+	}
+
+	if (path != "/") {
+		// Relative links in the directory's page only work if its URI ends in
+		// a slash, so send clients there.
+		new_table.add(path.substr(0, path.size() - 1),
+				{PathEntry::REDIRECT, "", ""});
+	}
+
+	bool has_index = false;
+	std::error_code ec;
+	for (const fs::directory_entry &entry
+			: fs::directory_iterator(directory, ec)) {
+		string name = entry.path().filename().string();
+		if (entry.is_directory(ec)) {
+			scanDirectory(entry.path(), path + name + "/", new_table, ancestors);
+		}
+		else if (entry.is_regular_file(ec)) {
+			new_table.add(path + name,
+					{PathEntry::FILE, entry.path().string(), ""});
+			has_index = has_index || name == "index.html";
+
+			// Get the file's details (and compressed copies) ready now, rather
+			// than on the first request for it.
+			const string &file = entry.path().native();
+			std::shared_ptr<const FileInfo> info = files.lookup(file);
+			if (info && info->type->compressible && !info->encodings) {
+				files.requestEncodings(file, *info);
+			}
+		}
+	}
+
+	if (has_index) {
+		new_table.add(path,
+				{PathEntry::FILE, (directory / "index.html").string(), ""});
+	}
+	else {
+		new_table.add(path,
+				{PathEntry::LISTING, "", listingPage(directory, path)});
+	}
+	ancestors.pop_back();
+}
+
+void PathTable::publish(std::unique_ptr<const Table> new_table) {
+	const Table *old = table.exchange(new_table.release());
+	if (old != nullptr) {
+		retired.push_back(old);
+	}
+	reclaim();
+}
+
+/**
+ * Frees the replaced tables that no reader's slot points to.
+ */
+void PathTable::reclaim() {
+	std::vector<const void*> in_use;
+	for (ReaderSlot *slot = reader_slots.load(std::memory_order_acquire);
+			slot != nullptr; slot = slot->next) {
+		in_use.push_back(slot->table.load());
+	}
+
+	auto still_used = [&in_use](const Table *old) {
+		if (std::find(in_use.begin(), in_use.end(), old) != in_use.end()) {
+			return true;
+		}
+		delete old;
+		return false;
+	};
+	retired.erase(std::remove_if(retired.begin(), retired.end(), still_used),
+			retired.end());
+}
+
+void PathTable::watchLoop() {
+	alignas(struct inotify_event) char events[4096];
+	struct pollfd fds[2] = {{watch_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+
+	int timeout = -1;
+	bool changed = false;
+	while (true) {
+		int ready = poll(fds, 2, timeout);
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			return;
+		}
+		if (fds[1].revents != 0) {
+			return;
+		}
+
+		if (ready > 0) {
+			// Which directories changed doesn't matter (the whole tree is
+			// scanned again). A watch being dropped (e.g. by scan) isn't a
+			// change in itself.
+			ssize_t length;
+			while ((length = read(watch_fd, events, sizeof(events))) > 0) {
+				for (char *p = events; p < events + length;) {
+					auto *event = reinterpret_cast<struct inotify_event*>(p);
+					changed = changed || event->mask != IN_IGNORED;
+					p += sizeof(struct inotify_event) + event->len;
+				}
+			}
+			if (changed) {
+				timeout = SETTLE_MS;
+			}
+			continue;
+		}
+
+		if (changed) {
+			changed = false;
+			bool had_all = watched_all;
+			publish(scan());
+			if (had_all && !watched_all) {
+				fprintf(stderr, "Can't watch all of the served directory, so "
+						"changes to it may be missed\n");
+			}
+		}
+		else {
+			reclaim();
+		}
+
+		// Threads that haven't read since the swap still hold old tables.
+		timeout = retired.empty() ? -1 : RECLAIM_MS;
+	}
+}
+
+static string htmlEscape(string_view text) {
+	string escaped;
+	for (char c : text) {
+		switch (c) {
+			case '&': escaped += "&amp;"; break;
+			case '<': escaped += "&lt;"; break;
+			case '>': escaped += "&gt;"; break;
+			case '"': escaped += "&quot;"; break;
+			default: escaped += c;
+		}
+	}
+	return escaped;
+}
+
+/**
+ * Percent-encodes everything but the characters that are safe as they are in
+ * a URI path.
+ */
+static string uriEscape(string_view text) {
+	static const char hex[] = "0123456789ABCDEF";
+	string escaped;
+	for (unsigned char c : text) {
+		if (isalnum(c) || strchr("-._~/", c) != nullptr) {
+			escaped += c;
+		}
+		else {
+			escaped += '%';
+			escaped += hex[c >> 4];
+			escaped += hex[c & 15];
+		}
+	}
+	return escaped;
+}
+
+string listingPage(const fs::path &directory, const string &path) {
+	std::error_code ec;
+	std::vector<string> names;
+	for (const fs::directory_entry &entry
+			: fs::directory_iterator(directory, ec)) {
+		string name = entry.path().filename().string();
+		if (entry.is_directory(ec)) {
+			name += '/';
+		}
+		names.push_back(name);
+	}
+	std::sort(names.begin(), names.end());
+
+	string title = "Index of " + htmlEscape(path);
+	string body = "<html><head><title>" + title + "</title></head>\n<body>\n<h1>"
+		+ title + "</h1>\n<ul>\n";
+	if (path != "/") {
+		body += "<li><a href=\"../\">Parent Directory</a></li>\n";
+	}
+	for (const string &name : names) {
+		body += "<li><a href=\"" + htmlEscape(uriEscape(name)) + "\">"
+			+ htmlEscape(name) + "</a></li>\n";
+	}
+	body += "</ul>\n</body></html>\n";
+	return body;
+}
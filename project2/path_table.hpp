@@ -0,0 +1,126 @@
+/*
+ * File: path_table.hpp
+ *
+ * Header / API file for the table ToreroServe resolves request paths with.
+ *
+ * At startup the whole served directory is scanned into a hash table from
+ * each path a client can ask for to what it gets: a file (a directory's
+ * index.html, for the directory's path), a listing of a directory (rendered
+ * then, not per request), or a redirect to a directory's path with a slash.
+ * So answering a request takes one hash lookup rather than several stat
+ * calls. The table holds only what's under the served directory, so anything
+ * not in it is a 404, however its path is spelled.
+ *
+ * A table is never changed. A background thread watches every directory with
+ * inotify, and when any of them changes, scans the tree into a new table and
+ * swaps that in. Readers load the current table from an atomic pointer and
+ * note it in their thread's hazard pointer, so they never take a lock or
+ * wait for a scan. An old table is freed once no thread's hazard pointer
+ * points to it.
+ */
+#ifndef PATH_TABLE_HPP
+#define PATH_TABLE_HPP
+
+#include <atomic>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+class FileCache;
+
+/**
+ * What a path in the table leads to.
+ */
+struct PathEntry {
+	enum Kind { FILE, LISTING, REDIRECT };
+
+	Kind kind;
+	std::string file;		// FILE: the file to send
+	std::string listing;	// LISTING: the HTML page
+};
+
+class PathTable {
+public:
+	/**
+	 * @param files The cache of the served files. Files found by a scan are
+	 * 		looked up in it, so their details (and compressed copies) are
+	 * 		ready before the first request for them.
+	 */
+	explicit PathTable(FileCache &files);
+	~PathTable();
+
+	PathTable(const PathTable&) = delete;
+	PathTable& operator=(const PathTable&) = delete;
+
+	/**
+	 * Scans the served directory and starts watching it for changes.
+	 *
+	 * @return False if it can't be watched (e.g. inotify isn't available),
+	 * 		in which case the table stays inactive.
+	 */
+	bool start();
+
+	/**
+	 * @return Whether the table is in use. If it isn't, paths have to be
+	 * 		resolved with the filesystem.
+	 */
+	bool active() const { return started; }
+
+	/**
+	 * @param path A decoded request path, starting with '/'.
+	 * @return What the path leads to, or nullptr if nothing. It stays valid
+	 * 		until the calling thread next calls resolve (on any table).
+	 */
+	const PathEntry *resolve(std::string_view path) const;
+
+private:
+	/**
+	 * A snapshot of the tree. It's looked up by the paths as views, so that
+	 * a request's path needn't be copied into a string to look it up.
+	 */
+	struct Table {
+		std::deque<std::string> paths;	// what the keys view
+		std::unordered_map<std::string_view, PathEntry> entries;
+
+		void add(std::string path, PathEntry entry);
+	};
+
+	std::unique_ptr<const Table> scan();
+	void scanDirectory(const std::filesystem::path &directory,
+			const std::string &path, Table &table,
+			std::vector<std::pair<dev_t, ino_t>> &ancestors);
+	void publish(std::unique_ptr<const Table> new_table);
+	void reclaim();
+	void watchLoop();
+
+	FileCache &files;
+	bool started = false;
+	bool watched_all = true;	// whether the last scan could watch everything
+	int watch_fd = -1;	// inotify
+	int stop_fd = -1;	// eventfd that tells the watcher to stop
+	std::vector<int> watches;	// watch descriptors of the last scan's directories
+	std::thread watcher;
+
+	// The current table, and the ones it replaced that may still be in use
+	// (only touched by whoever publishes tables).
+	std::atomic<const Table*> table{nullptr};
+	std::vector<const Table*> retired;
+};
+
+/**
+ * @param directory A directory.
+ * @param path The path it was requested by, ending in '/'.
+ * @return An HTML page listing the directory's contents.
+ */
+std::string listingPage(const std::filesystem::path &directory,
+		const std::string &path);
+
+#endif
@@ -2,10 +2,14 @@
  * ToreroServe: A Lean Web Server
  * COMP 375 - Project 02
  *
- * This program should take two arguments:
+ * This program takes two arguments:
  * 	1. The port number on which to bind and listen for connections
  * 	2. The directory out of which to serve files.
  *
+ * It may also be given "-e uring" to serve clients with the io_uring engine
+ * instead of the epoll one (see engine.hpp). If the kernel can't run the
+ * io_uring engine, it says so and uses epoll after all.
+ *
  * 	TODO: update author info with names and USD email addresses
  *
  * Author 1:
@@ -17,137 +21,95 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <csignal>
 
 // operating system specific libraries
+#include <getopt.h>
 #include <netinet/in.h>
-#include <sys/select.h>
 #include <sys/socket.h>
-#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/uio.h>
 #include <unistd.h>
 
 // C++ standard libraries
-#include <vector>
+#include <algorithm>
 #include <thread>
 #include <string>
 #include <iostream>
-#include <system_error>
 #include <filesystem>
 
+#include "engine.hpp"
+
 // shorten the std::filesystem namespace down to just fs
 namespace fs = std::filesystem;
 
-using std::cout;
+using std::cerr;
 using std::string;
-using std::vector;
-using std::thread;
 
 // This will limit how many clients can be waiting for a connection.
-static const int BACKLOG = 10;
+static const int BACKLOG = SOMAXCONN;
 
 // forward declarations
 int createSocketAndListen(const int port_num);
-void acceptConnections(const int server_sock);
-void handleClient(const int client_sock);
-void sendData(int socked_fd, const char *data, size_t data_length);
-int receiveData(int socked_fd, char *dest, size_t buff_size);
+
+static void usage(const char *program) {
+	cerr << "Usage: " << program << " [-e epoll|uring] port directory\n";
+	exit(1);
+}
 
 int main(int argc, char** argv) {
+	string engine = "epoll";
+	int opt;
+	while ((opt = getopt(argc, argv, "e:")) != -1) {
+		if (opt == 'e') {
+			engine = optarg;
+		}
+		else {
+			usage(argv[0]);
+		}
+	}
 
 	/* Make sure the user called our program correctly. */
-	if (argc != 3) {
-		// TODO: print a proper error message informing user of proper usage
-		cout << "INCORRECT USAGE!\n";
-		exit(1);
+	if (argc - optind != 2 || (engine != "epoll" && engine != "uring")) {
+		usage(argv[0]);
 	}
 
     /* Read the port number from the first command line argument. */
-    int port = std::stoi(argv[1]);
+    int port = std::stoi(argv[optind]);
+
+	std::error_code ec;
+	fs::path root = fs::canonical(argv[optind + 1], ec);
+	if (ec || !fs::is_directory(root, ec)) {
+		cerr << argv[optind + 1] << " is not a directory\n";
+		exit(1);
+	}
+
+	// Writing to a client that has gone away should just fail, not kill us.
+	signal(SIGPIPE, SIG_IGN);
 
 	/* Create a socket and start listening for new connections on the
 	 * specified port. */
 	int server_sock = createSocketAndListen(port);
 
-	/* Now let's start accepting connections. */
-	acceptConnections(server_sock);
-
-    close(server_sock);
-
-	return 0;
-}
-
-/**
- * Sends message over given socket, raising an exception if there was a problem
- * sending.
- *
- * @param socket_fd The socket to send data over.
- * @param data The data to send.
- * @param data_length Number of bytes of data to send.
- */
-void sendData(int socked_fd, const char *data, size_t data_length) {
-	// TODO: Wrap the following code in a loop so that it keeps sending until
-	// the data has been completely sent.
-	
-	int num_bytes_sent = send(socked_fd, data, data_length, 0);
-	if (num_bytes_sent == -1) {
-		std::error_code ec(errno, std::generic_category());
-		throw std::system_error(ec, "send failed");
+	/* Now let's start accepting connections, on a thread per core. */
+	unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+	if (engine == "uring" && !uringEngineAvailable()) {
+		perror("io_uring unavailable, using epoll");
+		engine = "epoll";
 	}
-}
-
-/**
- * Receives message over given socket, raising an exception if there was an
- * error in receiving.
- *
- * @param socket_fd The socket to send data over.
- * @param dest The buffer where we will store the received data.
- * @param buff_size Number of bytes in the buffer.
- * @return The number of bytes received and written to the destination buffer.
- */
-int receiveData(int socked_fd, char *dest, size_t buff_size) {
-	int num_bytes_received = recv(socked_fd, dest, buff_size, 0);
-	if (num_bytes_received == -1) {
-		std::error_code ec(errno, std::generic_category());
-		throw std::system_error(ec, "recv failed");
+	FileCache files(root);
+	if (!files.paths().start()) {
+		perror("Can't watch the directory, resolving paths without a table");
+	}
+	if (engine == "uring") {
+		runUringEngine(server_sock, files, num_threads);
+	}
+	else {
+		runEpollEngine(server_sock, files, num_threads);
 	}
 
-	return num_bytes_received;
-}
-
-/**
- * Receives a request from a connected HTTP client and sends back the
- * appropriate response.
- *
- * @note After this function returns, client_sock will have been closed (i.e.
- * may not be used again).
- *
- * @param client_sock The client's socket file descriptor.
- */
-void handleClient(const int client_sock) {
-	// Step 1: Receive the request message from the client
-	char received_data[2048];
-	int bytes_received = receiveData(client_sock, received_data, 2048);
+    close(server_sock);
 
-	// Turn the char array into a C++ string for easier processing.
-	string request_string(received_data, bytes_received);
-	
-	// TODO
-	// Step 2: Parse the request string to determine what response to generate.
-	// I recommend using regular expressions (specifically C++'s std::regex) to
-	// determine if a request is properly formatted.
-	
-	// TODO
-	// Step 3: Generate HTTP response message based on the request you received.
-	
-	// TODO
-	// Step 4: Send response to client using the sendData function.
-	// FIXME: The following line just sends back the request message, which is
-	// definitely not what you want to do.
-	sendData(client_sock, request_string.c_str(), request_string.length());
-	
-	// Close connection with client.
-	close(client_sock);
+	return 0;
 }
 
 /**
@@ -228,49 +190,3 @@ int createSocketAndListen(const int port_num) {
 
 	return sock;
 }
-
-/**
- * Sit around forever accepting new connections from client.
- *
- * @param server_sock The socket used by the server.
- */
-void acceptConnections(const int server_sock) {
-    while (true) {
-        // Declare a socket for the client connection.
-        int sock;
-
-        /* 
-		 * Another address structure.  This time, the system will automatically
-         * fill it in, when we accept a connection, to tell us where the
-         * connection came from.
-		 */
-        struct sockaddr_in remote_addr;
-        unsigned int socklen = sizeof(remote_addr); 
-
-        /* 
-		 * Accept the first waiting connection from the server socket and
-         * populate the address information.  The result (sock) is a socket
-         * descriptor for the conversation with the newly connected client.  If
-         * there are no pending connections in the back log, this function will
-         * block indefinitely while waiting for a client connection to be made.
-         */
-        sock = accept(server_sock, (struct sockaddr*) &remote_addr, &socklen);
-        if (sock < 0) {
-            perror("Error accepting connection");
-            exit(1);
-        }
-
-        /* 
-		 * At this point, you have a connected socket (named sock) that you can
-         * use to send() and recv(). The handleClient function should handle all
-		 * of the sending and receiving to/from the client.
-		 *
-		 * TODO: You shouldn't call handleClient directly here. Instead it
-		 * should be called from a separate thread. You'll just need to put sock
-		 * in a shared buffer that is synchronized using condition variables.
-		 * You'll implement this shared buffer in one of the labs and can use
-		 * it directly here.
-		 */
-		handleClient(sock);
-    }
-}
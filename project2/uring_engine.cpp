@@ -0,0 +1,858 @@
+/*
+ * File: uring_engine.cpp
+ *
+ * Implementation of the io_uring engine.
+ *
+ * liburing can't be counted on to be installed, so this talks to the kernel
+ * directly: through the io_uring_setup, io_uring_enter and io_uring_register
+ * system calls, and the submission and completion rings it shares with us
+ * through mmap.
+ *
+ * Every operation's user_data holds the ID of the connection it's for (in
+ * the high bits) and what kind of operation it is (in the low byte). A
+ * connection is only freed once every operation queued for it has completed,
+ * so a completion never refers to a connection that's gone.
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "engine.hpp"
+#include "http.hpp"
+
+// Sizes of each thread's submission and completion queues. Multishot
+// operations can post many completions each, so the completion queue gets
+// plenty of room.
+static const unsigned SQ_ENTRIES = 1024;
+static const unsigned CQ_ENTRIES = 8192;
+
+// Each thread's table of registered descriptors. Slot 0 is the listening
+// socket; the kernel puts accepted connections in the rest.
+static const unsigned NUM_FILES = 4096;
+static const unsigned LISTEN_SLOT = 0;
+
+// The pool of buffers the kernel picks from for each recv. NUM_BUFFERS must
+// be a power of two.
+static const unsigned NUM_BUFFERS = 1024;
+static const unsigned BUFFER_SIZE = 4096;
+static const uint16_t BUFFER_GROUP = 0;
+
+// Most of a file to move through a connection's pipe at once: the size of a
+// pipe's buffer.
+static const size_t SPLICE_CHUNK = 65536;
+
+enum UringOp : uint8_t {
+	OP_ACCEPT, OP_RECV, OP_SEND, OP_SPLICE_IN, OP_SPLICE_OUT, OP_CANCEL, OP_CLOSE
+};
+
+static uint64_t makeUserData(uint32_t conn_id, UringOp op) {
+	return ((uint64_t)conn_id << 8) | op;
+}
+
+/**
+ * An io_uring instance: its descriptor and the rings shared with the kernel.
+ */
+class Ring {
+public:
+	Ring() = default;
+	~Ring();
+
+	Ring(const Ring&) = delete;
+	Ring& operator=(const Ring&) = delete;
+
+	/**
+	 * Creates the ring.
+	 *
+	 * @return False (with errno set) if it couldn't be created.
+	 */
+	bool setup();
+
+	/**
+	 * @return A cleared submission queue entry to fill in, which is
+	 * 		submitted by the next call to submitAndWait.
+	 */
+	struct io_uring_sqe *getSqe();
+
+	/**
+	 * Makes sure the next few calls to getSqe won't need to submit what's
+	 * queued, e.g. so a chain of linked entries all goes in one submission.
+	 *
+	 * @param count How many entries are needed.
+	 */
+	void reserve(unsigned count);
+
+	/**
+	 * Submits the queued entries and waits for completions.
+	 *
+	 * @param wait_for How many completions to wait for (0 to not block).
+	 */
+	void submitAndWait(unsigned wait_for);
+
+	/**
+	 * Calls handler with (a copy of) each completion that's ready.
+	 */
+	template <typename Handler>
+	void forEachCompletion(Handler handler);
+
+	/**
+	 * Calls io_uring_register.
+	 *
+	 * @return As io_uring_register does.
+	 */
+	int registerResource(unsigned opcode, void *arg, unsigned nr_args) {
+		return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+	}
+
+private:
+	int ring_fd = -1;
+
+	void *sq_ptr = MAP_FAILED;
+	size_t sq_size = 0;
+	void *cq_ptr = MAP_FAILED;
+	size_t cq_size = 0;
+	struct io_uring_sqe *sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+	size_t sqes_size = 0;
+
+	unsigned *sq_head = nullptr;
+	unsigned *sq_tail = nullptr;
+	unsigned sq_mask = 0;
+	unsigned sq_entries = 0;
+	unsigned sqe_tail = 0;		// entries handed out by getSqe
+	unsigned sqe_flushed = 0;	// entries the kernel has been told about
+
+	unsigned *cq_head = nullptr;
+	unsigned *cq_tail = nullptr;
+	unsigned cq_mask = 0;
+	struct io_uring_cqe *cqes = nullptr;
+};
+
+bool Ring::setup() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.cq_entries = CQ_ENTRIES;
+
+	// Only this thread uses the ring, and it only wants to hear about
+	// completions when it asks for them, which saves the kernel from
+	// interrupting it.
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL
+		| IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER
+		| IORING_SETUP_DEFER_TASKRUN;
+	ring_fd = syscall(__NR_io_uring_setup, SQ_ENTRIES, &params);
+	if (ring_fd < 0 && errno == EINVAL) {
+		// an older kernel, without some of those
+		memset(&params, 0, sizeof(params));
+		params.cq_entries = CQ_ENTRIES;
+		params.flags = IORING_SETUP_CQSIZE;
+		ring_fd = syscall(__NR_io_uring_setup, SQ_ENTRIES, &params);
+	}
+	if (ring_fd < 0) {
+		return false;
+	}
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap) {
+		sq_size = cq_size = std::max(sq_size, cq_size);
+	}
+
+	sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED) {
+		return false;
+	}
+	if (single_mmap) {
+		cq_ptr = sq_ptr;
+	}
+	else {
+		cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED) {
+			return false;
+		}
+	}
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = static_cast<struct io_uring_sqe*>(mmap(nullptr, sqes_size,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+				IORING_OFF_SQES));
+	if (sqes == MAP_FAILED) {
+		return false;
+	}
+
+	char *sq = static_cast<char*>(sq_ptr);
+	sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	sq_entries = params.sq_entries;
+	sqe_tail = sqe_flushed = *sq_tail;
+
+	// Entries are always used in ring order, so the indirection array can
+	// be filled in once.
+	unsigned *sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	for (unsigned i = 0; i < sq_entries; i++) {
+		sq_array[i] = i;
+	}
+
+	char *cq = static_cast<char*>(cq_ptr);
+	cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+	return true;
+}
+
+Ring::~Ring() {
+	if (sqes != MAP_FAILED) {
+		munmap(sqes, sqes_size);
+	}
+	if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+		munmap(cq_ptr, cq_size);
+	}
+	if (sq_ptr != MAP_FAILED) {
+		munmap(sq_ptr, sq_size);
+	}
+	if (ring_fd >= 0) {
+		close(ring_fd);
+	}
+}
+
+void Ring::reserve(unsigned count) {
+	if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)
+			> sq_entries - count) {
+		// Not enough room, so hand what's queued to the kernel.
+		submitAndWait(0);
+	}
+}
+
+struct io_uring_sqe *Ring::getSqe() {
+	reserve(1);
+	struct io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe_tail++;
+	return sqe;
+}
+
+void Ring::submitAndWait(unsigned wait_for) {
+	__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+	unsigned to_submit = sqe_tail - sqe_flushed;
+	sqe_flushed = sqe_tail;
+
+	int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_for,
+			IORING_ENTER_GETEVENTS, nullptr, 0);
+	if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		perror("io_uring_enter");
+		exit(1);
+	}
+}
+
+template <typename Handler>
+void Ring::forEachCompletion(Handler handler) {
+	unsigned head = *cq_head;
+	while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe cqe = cqes[head & cq_mask];
+		head++;
+		// Give the entry back before handling it, since handling it may
+		// mean waiting on the kernel.
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		handler(cqe);
+	}
+}
+
+/**
+ * Bytes received into one of the ring's buffers that haven't fit in the
+ * connection's input yet.
+ */
+struct HeldBuffer {
+	uint16_t id;
+	uint32_t offset;
+	uint32_t length;
+};
+
+/**
+ * A client connection.
+ */
+struct UringConnection {
+	UringConnection(FileCache &files, BufferPool &pool) : http(files, pool) {}
+
+	HttpConnection http;
+	uint32_t id = 0;
+	unsigned slot = 0;				// registered descriptor of the socket
+
+	unsigned ops = 0;				// operations queued for the connection
+	unsigned write_ops = 0;			// ... of which are sending a response
+	bool recv_armed = false;
+	bool recv_stopping = false;		// a cancel of the recv has been queued
+	bool write_failed = false;
+	bool done_sending = false;		// the client has shut down its side
+	bool closing = false;
+
+	// A pipe to splice files to the socket through, and how many bytes of the
+	// current file part are sitting in it.
+	int pipe_fds[2] = {-1, -1};
+	size_t in_pipe = 0;
+
+	// Received bytes waiting for room in the input (oldest first), whose
+	// buffers go back to the ring once they've all been taken.
+	std::vector<HeldBuffer> held;
+};
+
+/**
+ * One thread's event loop: a ring, its buffers and its connections.
+ */
+class UringLoop {
+public:
+	UringLoop(int server_sock, FileCache &files);
+	~UringLoop();
+
+	/**
+	 * Sets up the ring and registers the descriptors and buffers with it.
+	 *
+	 * @return False (with errno set) if the kernel wouldn't have it.
+	 */
+	bool setup();
+
+	/**
+	 * Serves clients forever.
+	 */
+	void run();
+
+private:
+	void armAccept();
+	void armRecv(UringConnection *conn);
+	void stopRecv(UringConnection *conn);
+	void provideBuffer(uint16_t id);
+	void feedInput(UringConnection *conn);
+
+	void handleCompletion(const struct io_uring_cqe &cqe);
+	void handleAccept(const struct io_uring_cqe &cqe);
+	void handleRecv(UringConnection *conn, const struct io_uring_cqe &cqe);
+	void handleWrite(UringConnection *conn, UringOp op, int result);
+
+	void startWrite(UringConnection *conn);
+	void queueSend(UringConnection *conn, const ResponsePart &part);
+	void queueSplice(UringConnection *conn, const ResponsePart &part);
+	void closeConnection(UringConnection *conn);
+
+	int server_sock;
+	FileCache &files;
+	Ring ring;
+
+	// The buffers connections keep received bytes and responses in. (recv
+	// fills buffers from the ring below, which the kernel picks from.)
+	BufferPool pool;
+
+	// The ring of buffers to pick from. Its tail overlays the first entry's
+	// resv field (the kernel header's io_uring_buf_ring says as much, but
+	// its flexible array is laid out differently when compiled as C++).
+	struct io_uring_buf *buf_ring = nullptr;
+	size_t buf_ring_size = 0;
+	uint16_t buf_tail = 0;
+	char *buffers = nullptr;
+
+	std::vector<UringConnection*> conns;	// by ID
+	std::vector<uint32_t> free_ids;
+};
+
+UringLoop::UringLoop(int server_sock, FileCache &files)
+	: server_sock(server_sock), files(files) {}
+
+UringLoop::~UringLoop() {
+	for (UringConnection *conn : conns) {
+		delete conn;
+	}
+	if (buffers != nullptr) {
+		munmap(buffers, (size_t)NUM_BUFFERS * BUFFER_SIZE);
+	}
+	if (buf_ring != nullptr) {
+		munmap(buf_ring, buf_ring_size);
+	}
+}
+
+bool UringLoop::setup() {
+	if (!ring.setup()) {
+		return false;
+	}
+
+	// Register the listening socket, leaving the other slots empty for the
+	// kernel to fill with accepted connections.
+	std::vector<int> files(NUM_FILES, -1);
+	files[LISTEN_SLOT] = server_sock;
+	if (ring.registerResource(IORING_REGISTER_FILES, files.data(),
+				NUM_FILES) < 0) {
+		return false;
+	}
+	struct io_uring_file_index_range range;
+	memset(&range, 0, sizeof(range));
+	range.off = LISTEN_SLOT + 1;
+	range.len = NUM_FILES - range.off;
+	if (ring.registerResource(IORING_REGISTER_FILE_ALLOC_RANGE, &range, 0) < 0) {
+		return false;
+	}
+
+	// The buffer ring has to be page aligned, which mmap takes care of.
+	buf_ring_size = NUM_BUFFERS * sizeof(struct io_uring_buf);
+	void *ring_mem = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	void *buffer_mem = mmap(nullptr, (size_t)NUM_BUFFERS * BUFFER_SIZE,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring_mem == MAP_FAILED || buffer_mem == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	buf_ring = static_cast<struct io_uring_buf*>(ring_mem);
+	buffers = static_cast<char*>(buffer_mem);
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+	reg.ring_entries = NUM_BUFFERS;
+	reg.bgid = BUFFER_GROUP;
+	if (ring.registerResource(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		return false;
+	}
+	for (unsigned i = 0; i < NUM_BUFFERS; i++) {
+		provideBuffer(i);
+	}
+	return true;
+}
+
+/**
+ * Puts a buffer (back) in the pool the kernel picks recv buffers from.
+ */
+void UringLoop::provideBuffer(uint16_t id) {
+	struct io_uring_buf *buf = &buf_ring[buf_tail & (NUM_BUFFERS - 1)];
+	buf->addr = reinterpret_cast<uint64_t>(buffers + (size_t)id * BUFFER_SIZE);
+	buf->len = BUFFER_SIZE;
+	buf->bid = id;
+	buf_tail++;
+	__atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Queues a multishot accept, which completes once for each new connection
+ * and puts it straight into the registered descriptor table.
+ */
+void UringLoop::armAccept() {
+	struct io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = LISTEN_SLOT;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->file_index = IORING_FILE_INDEX_ALLOC;
+	sqe->user_data = makeUserData(0, OP_ACCEPT);
+}
+
+/**
+ * Queues a multishot recv, which completes each time data arrives, in a
+ * buffer the kernel takes from the pool.
+ */
+void UringLoop::armRecv(UringConnection *conn) {
+	struct io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->slot;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = BUFFER_GROUP;
+	sqe->user_data = makeUserData(conn->id, OP_RECV);
+	conn->recv_armed = true;
+	conn->ops++;
+}
+
+/**
+ * Cancels a connection's recv, so the kernel stops filling buffers for it.
+ * The recv's last completion says when it has stopped.
+ */
+void UringLoop::stopRecv(UringConnection *conn) {
+	struct io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = makeUserData(conn->id, OP_RECV);
+	sqe->user_data = makeUserData(conn->id, OP_CANCEL);
+	conn->recv_stopping = true;
+	conn->ops++;
+}
+
+void UringLoop::run() {
+	armAccept();
+	while (true) {
+		ring.submitAndWait(1);
+		ring.forEachCompletion([this](const struct io_uring_cqe &cqe) {
+			handleCompletion(cqe);
+		});
+	}
+}
+
+void UringLoop::handleCompletion(const struct io_uring_cqe &cqe) {
+	UringOp op = static_cast<UringOp>(cqe.user_data & 0xff);
+	if (op == OP_ACCEPT) {
+		handleAccept(cqe);
+		return;
+	}
+
+	uint32_t id = cqe.user_data >> 8;
+	UringConnection *conn = conns[id];
+	switch (op) {
+		case OP_RECV:
+			handleRecv(conn, cqe);
+			break;
+
+		case OP_SEND:
+		case OP_SPLICE_IN:
+		case OP_SPLICE_OUT:
+			handleWrite(conn, op, cqe.res);
+			break;
+
+		default:
+			// OP_CANCEL and OP_CLOSE: nothing to do but count them
+			conn->ops--;
+	}
+
+	if (conn->closing && conn->ops == 0) {
+		if (conn->pipe_fds[0] >= 0) {
+			close(conn->pipe_fds[0]);
+			close(conn->pipe_fds[1]);
+		}
+		delete conn;
+		conns[id] = nullptr;
+		free_ids.push_back(id);
+	}
+}
+
+void UringLoop::handleAccept(const struct io_uring_cqe &cqe) {
+	if (!(cqe.flags & IORING_CQE_F_MORE)) {
+		armAccept();
+	}
+	if (cqe.res < 0) {
+		if (cqe.res != -ECONNABORTED && cqe.res != -EINTR) {
+			fprintf(stderr, "accept: %s\n", strerror(-cqe.res));
+		}
+		return;
+	}
+
+	uint32_t id;
+	if (free_ids.empty()) {
+		id = conns.size();
+		conns.push_back(nullptr);
+	}
+	else {
+		id = free_ids.back();
+		free_ids.pop_back();
+	}
+
+	UringConnection *conn = new UringConnection(files, pool);
+	conn->id = id;
+	conn->slot = cqe.res;
+	conns[id] = conn;
+	armRecv(conn);
+}
+
+void UringLoop::handleRecv(UringConnection *conn,
+		const struct io_uring_cqe &cqe) {
+	if (!(cqe.flags & IORING_CQE_F_MORE)) {
+		conn->recv_armed = false;
+		conn->recv_stopping = false;
+		conn->ops--;
+	}
+
+	if (cqe.flags & IORING_CQE_F_BUFFER) {
+		uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe.res > 0 && !conn->closing) {
+			conn->held.push_back({buffer_id, 0, (uint32_t)cqe.res});
+		}
+		else {
+			provideBuffer(buffer_id);
+		}
+	}
+
+	if (conn->closing) {
+		return;
+	}
+	if (cqe.res == 0) {
+		conn->done_sending = true;
+	}
+	else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+		closeConnection(conn);
+		return;
+	}
+
+	// Sending the responses to what's in the input makes room for the rest.
+	if (conn->write_ops == 0) {
+		startWrite(conn);
+	}
+	else {
+		feedInput(conn);
+	}
+}
+
+/**
+ * Moves as many of the held received bytes as fit into the connection's
+ * input. While some don't fit, the recv is stopped, so a client that sends
+ * requests faster than it reads the responses can't have us hold more and
+ * more of its bytes. Once they all have, the recv is started again (if the
+ * kernel has stopped it, which it also does when it runs out of buffers).
+ */
+void UringLoop::feedInput(UringConnection *conn) {
+	while (!conn->held.empty()) {
+		HeldBuffer &held = conn->held.front();
+		size_t taken = conn->http.received(buffers
+				+ (size_t)held.id * BUFFER_SIZE + held.offset, held.length);
+		held.offset += taken;
+		held.length -= taken;
+		if (held.length > 0) {
+			if (conn->recv_armed && !conn->recv_stopping) {
+				stopRecv(conn);
+			}
+			return;
+		}
+		provideBuffer(held.id);
+		conn->held.erase(conn->held.begin());
+	}
+
+	if (!conn->recv_armed && !conn->done_sending) {
+		armRecv(conn);
+	}
+}
+
+/**
+ * Starts sending whatever is next: the rest of the current response, or the
+ * response to the next request that has arrived (taking in held received
+ * bytes as answering requests makes room for them). If there's nothing to
+ * send and the client has stopped sending, closes the connection.
+ */
+void UringLoop::startWrite(UringConnection *conn) {
+	HttpConnection &http = conn->http;
+	while (true) {
+		feedInput(conn);
+		if (!http.nextResponse()) {
+			break;
+		}
+
+		ResponsePart part = http.pendingPart();
+		if (part.length > 0) {
+			// room for a send and two splices, which have to be submitted
+			// together to stay linked
+			ring.reserve(3);
+			if (part.from_file) {
+				queueSplice(conn, part);
+			}
+			else {
+				queueSend(conn, part);
+			}
+			return;
+		}
+		if (!http.finishResponse()) {
+			closeConnection(conn);
+			return;
+		}
+	}
+
+	if (conn->done_sending) {
+		closeConnection(conn);
+	}
+}
+
+/**
+ * Queues a send of a memory part, linked to the splice of the file part that
+ * follows it, if one does.
+ */
+void UringLoop::queueSend(UringConnection *conn, const ResponsePart &part) {
+	ResponsePart next = conn->http.pendingPart(1);
+	bool file_follows = next.from_file && next.length > 0;
+	if (file_follows && conn->pipe_fds[0] < 0
+			&& pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+		perror("pipe2");
+		closeConnection(conn);
+		return;
+	}
+
+	// MSG_WAITALL makes a short send fail the link, so that the file can
+	// never be sent after only part of the headers.
+	struct io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = conn->slot;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = reinterpret_cast<uint64_t>(conn->http.partData(part));
+	sqe->len = part.length;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = makeUserData(conn->id, OP_SEND);
+	conn->ops++;
+	conn->write_ops++;
+
+	if (file_follows) {
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe->msg_flags |= MSG_MORE;
+		queueSplice(conn, next);
+	}
+}
+
+/**
+ * Queues the sending of (a chunk of) a file part: a splice from the file into
+ * the connection's pipe, linked to a splice from the pipe to the socket. If
+ * the pipe still holds bytes from last time, just sends those.
+ */
+void UringLoop::queueSplice(UringConnection *conn, const ResponsePart &part) {
+	if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_CLOEXEC) < 0) {
+		perror("pipe2");
+		closeConnection(conn);
+		return;
+	}
+
+	size_t length = conn->in_pipe;
+	if (length == 0) {
+		length = std::min(part.length, SPLICE_CHUNK);
+		struct io_uring_sqe *sqe = ring.getSqe();
+		sqe->opcode = IORING_OP_SPLICE;
+		sqe->fd = conn->pipe_fds[1];
+		sqe->off = (uint64_t)-1;
+		sqe->splice_fd_in = conn->http.file();
+		sqe->splice_off_in = part.offset;
+		sqe->len = length;
+		// A short splice fails the link, so the socket splice is only run if
+		// all of the chunk made it into the pipe.
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = makeUserData(conn->id, OP_SPLICE_IN);
+		conn->ops++;
+		conn->write_ops++;
+	}
+
+	struct io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->fd = conn->slot;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->off = (uint64_t)-1;
+	sqe->splice_fd_in = conn->pipe_fds[0];
+	sqe->splice_off_in = (uint64_t)-1;
+	sqe->len = length;
+	if (length < part.length) {
+		sqe->splice_flags = SPLICE_F_MORE;
+	}
+	sqe->user_data = makeUserData(conn->id, OP_SPLICE_OUT);
+	conn->ops++;
+	conn->write_ops++;
+}
+
+/**
+ * Handles the completion of one of the operations sending a response. Once
+ * they've all completed, moves on to whatever is to be sent next.
+ */
+void UringLoop::handleWrite(UringConnection *conn, UringOp op, int result) {
+	conn->ops--;
+	conn->write_ops--;
+
+	if (result > 0) {
+		switch (op) {
+			case OP_SEND:
+				conn->http.sent(result);
+				break;
+			case OP_SPLICE_IN:
+				conn->in_pipe += result;
+				break;
+			default:
+				conn->in_pipe -= result;
+				conn->http.sent(result);
+		}
+	}
+	else if (result != -ECANCELED) {
+		// A real error, or a file that got shorter since it was opened
+		// (which leaves nothing to splice in). Operations linked after a
+		// short one are cancelled, and just pick up where it left off.
+		conn->write_failed = true;
+	}
+
+	if (conn->write_ops > 0 || conn->closing) {
+		return;
+	}
+	if (conn->write_failed) {
+		closeConnection(conn);
+	}
+	else {
+		startWrite(conn);
+	}
+}
+
+/**
+ * Cancels everything queued on a connection's socket and closes it. The
+ * connection itself is freed once all its operations have completed.
+ */
+void UringLoop::closeConnection(UringConnection *conn) {
+	if (conn->closing) {
+		return;
+	}
+	conn->closing = true;
+	for (const HeldBuffer &held : conn->held) {
+		provideBuffer(held.id);
+	}
+	conn->held.clear();
+
+	struct io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = conn->slot;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED
+		| IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = makeUserData(conn->id, OP_CANCEL);
+	conn->ops++;
+
+	sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = conn->slot + 1;
+	sqe->user_data = makeUserData(conn->id, OP_CLOSE);
+	conn->ops++;
+}
+
+/**
+ * One thread's event loop.
+ */
+static void uringLoop(int server_sock, FileCache &files) {
+	UringLoop loop(server_sock, files);
+	if (!loop.setup()) {
+		perror("io_uring setup");
+		exit(1);
+	}
+	loop.run();
+}
+
+bool uringEngineAvailable() {
+	// See if a ring can be set up with everything we use (the features we
+	// need arrived with the file allocation range, in Linux 6.0).
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return false;
+	}
+	FileCache files("/");
+	UringLoop loop(sock, files);
+	bool available = loop.setup();
+	close(sock);
+	return available;
+}
+
+void runUringEngine(int server_sock, FileCache &files, unsigned num_threads) {
+	// Accepted sockets never get a descriptor of their own to call
+	// setsockopt on, but they inherit this from the listening socket.
+	int one = 1;
+	if (setsockopt(server_sock, IPPROTO_TCP, TCP_NODELAY, &one,
+				sizeof(one)) < 0) {
+		perror("setsockopt");
+		exit(1);
+	}
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < num_threads; i++) {
+		threads.emplace_back(uringLoop, server_sock, std::ref(files));
+	}
+	uringLoop(server_sock, files);
+}
@@ -1,10 +1,44 @@
 /*
  * This file contains some useful structs and functions for working with DNS
- * messages.
+ * messages. Use the builder in dns_build.h to write messages, and the parser
+ * in dns_parse.h to read received messages.
  */
+#ifndef DNS_H
+#define DNS_H
 
 #include <stdint.h>
 
+// Resource record types (RFC 1035, section 3.2.2, and later RFCs).
+#define DNS_TYPE_A      1
+#define DNS_TYPE_NS     2
+#define DNS_TYPE_CNAME  5
+#define DNS_TYPE_SOA    6
+#define DNS_TYPE_PTR    12
+#define DNS_TYPE_MX     15
+#define DNS_TYPE_TXT    16
+#define DNS_TYPE_AAAA   28
+#define DNS_TYPE_SRV    33
+#define DNS_TYPE_OPT    41
+
+#define DNS_CLASS_IN    1
+
+// Header flag bits.
+#define DNS_FLAG_QR     0x8000	// message is a response
+#define DNS_FLAG_AA     0x0400	// authoritative answer
+#define DNS_FLAG_TC     0x0200	// truncated
+#define DNS_FLAG_RD     0x0100	// recursion desired
+#define DNS_FLAG_RA     0x0080	// recursion available
+#define DNS_OPCODE_MASK 0x7800	// kind of query (0 for a standard query)
+#define DNS_RCODE_MASK  0x000f
+
+// Response codes.
+#define DNS_RCODE_NOERROR   0
+#define DNS_RCODE_FORMERR   1
+#define DNS_RCODE_SERVFAIL  2
+#define DNS_RCODE_NXDOMAIN  3
+#define DNS_RCODE_NOTIMP    4
+#define DNS_RCODE_REFUSED   5
+
 /**
  * DNS header structure.
  * Most of the message is variable size, which means we can't declare them in
@@ -39,72 +73,4 @@ struct DNSRecord {
 
 typedef struct DNSRecord DNSRecord;
 
-/**
- * Converts our normal C-style string (e.g. www.sandiego.edu) to the DNS-style
- * string (e.g. (3)www(8)sandiego(3)edu(0).
- *
- * @param str_name The string you want to convert.
- * @param dns_name The DNS-style equivalent to str_name
- * @returns Length of dns_name
- */
-int convertStringToDNS(char* str_name, uint8_t* dns_name) {
-	int part_len=0;
-	for (unsigned i=0; i < strlen(str_name); i++) {
-		if (str_name[i] != '.') {
-			dns_name[i+1]=str_name[i];
-			part_len++;
-		}
-		else {
-			dns_name[i-part_len]=part_len;
-			part_len=0;
-		}
-	}
-
-	dns_name[strlen(str_name)-part_len] = part_len;
-	dns_name[strlen(str_name)+1] = 0;
-	return strlen(str_name)+2;
-}
-
-/**
- * Converts a DNS-style string (e.g. (3)www(8)sandiego(3)edu(0) to the normal
- * C-style string (e.g. www.sandiego.edu).
- * This supports DNS-style name compression (see RFC 1035, Section 4.1.4).
- *
- * @info You need to pass in a pointer to the start of the DNS message with
- * the DNS-style string so we can determine if the name is compressed or not.
- *
- * @param message Pointer to beginning of DNS response message that contains
- * 					the DNS-style string you are trying to convert.
- * @param dns_name The DNS-style name string to convert.
- * @param str_name The normal version of dns_name 
- * @return The number of bytes of dns_name read.
- */
-int getStringFromDNS(uint8_t *message, uint8_t *dns_name, char *str_name) {
-	uint8_t part_remainder = 0;
-	int len = 0;
-	int return_len = 0;
-	uint8_t *orig_name = dns_name;
-	while (*dns_name) {
-		if (part_remainder == 0) {
-			// this condition checks for message compression, see RFC 1035 4.1.4
-			if ((*dns_name) >= 0xc0) { 
-				if (return_len==0)
-					return_len = (dns_name-orig_name)+2;
-				dns_name=message+(((*dns_name)&0x3f) << 8) + *(dns_name+1);
-				continue;
-			}
-			else {
-				part_remainder = *dns_name;
-				if (len > 0)
-					str_name[len++] = '.';
-			}
-		}
-		else {
-			str_name[len++] = *dns_name;
-			part_remainder--;
-		}
-		dns_name++;
-	}
-	str_name[len]=0;
-	return (return_len ? return_len : dns_name-orig_name+1);
-}
+#endif
@@ -0,0 +1,300 @@
+/*
+ * File: dns_build.c
+ *
+ * Implementation of the DNS message builder.
+ *
+ */
+#include <ctype.h>
+#include <string.h>
+
+#include "dns.h"
+#include "dns_build.h"
+
+// Compression pointers only have 14 bits for the offset.
+#define MAX_POINTER_OFFSET 0x3fff
+
+// A wire format name of DNS_MAX_NAME_WIRE bytes has at most this many labels.
+#define MAX_LABELS 128
+
+static void put_u16_at(uint8_t *p, uint16_t value) {
+	p[0] = value >> 8;
+	p[1] = value & 0xff;
+}
+
+/*
+ * Appends bytes to the message.
+ */
+static bool put(DNSBuilder *b, const void *data, int length) {
+	if (b->error || b->pos + length > b->size) {
+		b->error = true;
+		return false;
+	}
+	memcpy(b->buf + b->pos, data, length);
+	b->pos += length;
+	return true;
+}
+
+static bool put_u16(DNSBuilder *b, uint16_t value) {
+	uint8_t bytes[2] = {value >> 8, value & 0xff};
+	return put(b, bytes, 2);
+}
+
+static bool put_u32(DNSBuilder *b, uint32_t value) {
+	uint8_t bytes[4] = {value >> 24, (value >> 16) & 0xff, (value >> 8) & 0xff,
+			value & 0xff};
+	return put(b, bytes, 4);
+}
+
+/*
+ * Extends the hash of a name suffix by the label in front of it. Case is
+ * ignored, as names differing only in case are equal.
+ */
+static uint32_t hash_label(const uint8_t *label, uint32_t suffix_hash) {
+	uint32_t hash = (suffix_hash ^ label[0]) * 16777619u;
+	for (int i = 1; i <= label[0]; i++) {
+		hash = (hash ^ (uint8_t)tolower(label[i])) * 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Finds where a name suffix was written earlier in the message.
+ *
+ * @return Its offset, or -1 if it hasn't been written (or was forgotten).
+ */
+static int find_suffix(DNSBuilder *b, uint32_t hash, const uint8_t *suffix) {
+	int count = (b->num_suffixes < DNS_BUILD_MAX_SUFFIXES)
+			? b->num_suffixes : DNS_BUILD_MAX_SUFFIXES;
+	DNSName wanted = dns_wire_name(suffix, DNS_MAX_NAME_WIRE);
+	for (int i = 0; i < count; i++) {
+		if (b->suffixes[i].hash == hash) {
+			DNSName written = {b->buf, b->pos, b->suffixes[i].offset};
+			if (dns_name_equal(wanted, written)) {
+				return b->suffixes[i].offset;
+			}
+		}
+	}
+	return -1;
+}
+
+static void remember_suffix(DNSBuilder *b, uint32_t hash, int offset) {
+	if (offset > MAX_POINTER_OFFSET) {
+		return;
+	}
+	// Once the table is full, the oldest entries are overwritten.
+	DNSSuffix *entry = &b->suffixes[b->num_suffixes % DNS_BUILD_MAX_SUFFIXES];
+	entry->hash = hash;
+	entry->offset = offset;
+	b->num_suffixes++;
+}
+
+/*
+ * Appends a name given in uncompressed wire format. Its labels are written
+ * up to the longest suffix that's already in the message, which is replaced
+ * by a pointer to it.
+ */
+static bool write_name(DNSBuilder *b, const uint8_t *wire, bool compress) {
+	if (dns_name_skip(dns_wire_name(wire, DNS_MAX_NAME_WIRE)) < 0) {
+		b->error = true;
+		return false;
+	}
+
+	int label_offsets[MAX_LABELS];
+	int num_labels = 0;
+	int wire_len = 0;
+	while (wire[wire_len] != 0) {
+		label_offsets[num_labels++] = wire_len;
+		wire_len += wire[wire_len] + 1;
+	}
+
+	uint32_t hashes[MAX_LABELS];
+	uint32_t hash = 0;
+	for (int i = num_labels - 1; i >= 0; i--) {
+		hash = hash_label(wire + label_offsets[i], hash);
+		hashes[i] = hash;
+	}
+
+	int match = num_labels;		// first label of the suffix found
+	int match_offset = -1;
+	for (int i = 0; compress && i < num_labels; i++) {
+		match_offset = find_suffix(b, hashes[i], wire + label_offsets[i]);
+		if (match_offset >= 0) {
+			match = i;
+			break;
+		}
+	}
+
+	int start = b->pos;
+	int literal_len = (match < num_labels) ? label_offsets[match] : wire_len;
+	if (!put(b, wire, literal_len)) {
+		return false;
+	}
+	for (int i = 0; i < match; i++) {
+		remember_suffix(b, hashes[i], start + label_offsets[i]);
+	}
+
+	if (match_offset >= 0) {
+		return put_u16(b, 0xc000 | match_offset);
+	}
+	uint8_t root = 0;
+	return put(b, &root, 1);
+}
+
+/*
+ * Moves on to a section, checking that sections are written in order and
+ * that no record is left open.
+ */
+static bool enter_section(DNSBuilder *b, DNSSection section) {
+	if (section < b->section || b->rdata_start >= 0) {
+		b->error = true;
+		return false;
+	}
+	b->section = section;
+	return !b->error;
+}
+
+void dns_build_init(DNSBuilder *b, uint8_t *buf, int size, uint16_t id,
+		uint16_t flags) {
+	b->buf = buf;
+	b->size = size;
+	b->pos = 0;
+	b->error = false;
+	b->section = DNS_SECTION_QUESTION;
+	memset(b->counts, 0, sizeof(b->counts));
+	b->rdata_start = -1;
+	b->num_suffixes = 0;
+
+	put_u16(b, id);
+	put_u16(b, flags);
+	put(b, b->counts, sizeof(b->counts)); // filled in by dns_build_finish
+}
+
+bool dns_build_question(DNSBuilder *b, const char *name, uint16_t qtype,
+		uint16_t qclass) {
+	uint8_t wire[DNS_MAX_NAME_WIRE];
+	if (!enter_section(b, DNS_SECTION_QUESTION)
+			|| dns_string_to_wire(name, wire) < 0) {
+		b->error = true;
+		return false;
+	}
+	if (!write_name(b, wire, true) || !put_u16(b, qtype)
+			|| !put_u16(b, qclass)) {
+		return false;
+	}
+	b->counts[DNS_SECTION_QUESTION]++;
+	return true;
+}
+
+bool dns_build_rr_begin(DNSBuilder *b, DNSSection section, const char *name,
+		uint16_t type, uint16_t class, uint32_t ttl) {
+	uint8_t wire[DNS_MAX_NAME_WIRE];
+	if (section == DNS_SECTION_QUESTION || !enter_section(b, section)
+			|| dns_string_to_wire(name, wire) < 0) {
+		b->error = true;
+		return false;
+	}
+	if (!write_name(b, wire, true) || !put_u16(b, type) || !put_u16(b, class)
+			|| !put_u32(b, ttl) || !put_u16(b, 0)) {
+		return false;
+	}
+	b->rdata_start = b->pos;
+	return true;
+}
+
+bool dns_build_bytes(DNSBuilder *b, const void *data, int length) {
+	if (b->rdata_start < 0) {
+		b->error = true;
+		return false;
+	}
+	return put(b, data, length);
+}
+
+bool dns_build_wire_name(DNSBuilder *b, const uint8_t *wire, bool compress) {
+	if (b->rdata_start < 0) {
+		b->error = true;
+		return false;
+	}
+	return write_name(b, wire, compress);
+}
+
+bool dns_build_rr_end(DNSBuilder *b) {
+	int rdlength = b->pos - b->rdata_start;
+	if (b->error || b->rdata_start < 0 || rdlength > 0xffff) {
+		b->error = true;
+		return false;
+	}
+	put_u16_at(b->buf + b->rdata_start - 2, rdlength);
+	b->counts[b->section]++;
+	b->rdata_start = -1;
+	return true;
+}
+
+bool dns_build_opt(DNSBuilder *b, uint16_t udp_payload_size) {
+	// The OPT record borrows the class field for the payload size, and the
+	// TTL for the extended rcode, EDNS version (0) and flags.
+	return dns_build_rr_begin(b, DNS_SECTION_ADDITIONAL, "", DNS_TYPE_OPT,
+				udp_payload_size, 0)
+			&& dns_build_rr_end(b);
+}
+
+int dns_build_finish(DNSBuilder *b) {
+	if (b->error || b->rdata_start >= 0) {
+		return -1;
+	}
+	for (int i = 0; i < 4; i++) {
+		put_u16_at(b->buf + 4 + 2*i, b->counts[i]);
+	}
+	return b->pos;
+}
+
+int dns_string_to_wire(const char *str, uint8_t *out) {
+	int out_len = 0;
+	const char *p = str;
+
+	// "" and "." are both the root
+	if (p[0] == '.' && p[1] == '\0') {
+		p++;
+	}
+
+	while (*p != '\0') {
+		int len_pos = out_len++;
+		int label_len = 0;
+		while (*p != '\0' && *p != '.') {
+			int c = (unsigned char)*p++;
+			if (c == '\\') {
+				if (isdigit((unsigned char)p[0]) && isdigit((unsigned char)p[1])
+						&& isdigit((unsigned char)p[2])) {
+					c = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+					p += 3;
+					if (c > 255) {
+						return -1;
+					}
+				}
+				else if (*p != '\0') {
+					c = (unsigned char)*p++;
+				}
+				else {
+					return -1;
+				}
+			}
+
+			// leave room for the root label at the end
+			if (label_len == 63 || out_len + 1 >= DNS_MAX_NAME_WIRE) {
+				return -1;
+			}
+			out[out_len++] = c;
+			label_len++;
+		}
+
+		if (label_len == 0) {
+			return -1; // empty label, e.g. "www..edu"
+		}
+		out[len_pos] = label_len;
+		if (*p == '.') {
+			p++;
+		}
+	}
+
+	out[out_len++] = 0;
+	return out_len;
+}
@@ -0,0 +1,141 @@
+/*
+ * File: dns_build.h
+ *
+ * Header / API file for writing DNS messages.
+ *
+ * A DNSBuilder appends questions and resource records to a message in a
+ * caller-provided buffer, filling in the header counts at the end. Names are
+ * compressed (RFC 1035, section 4.1.4): the builder remembers where recent
+ * names and their suffixes were written, and replaces any repeated suffix with
+ * a pointer to the earlier copy. Nothing in the buffer is written twice, so
+ * building a query costs little more than copying its bytes.
+ */
+#ifndef DNS_BUILD_H
+#define DNS_BUILD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dns_parse.h"
+
+// How many earlier name suffixes the builder remembers for compression.
+#define DNS_BUILD_MAX_SUFFIXES 32
+
+typedef struct DNSSuffix {
+	uint32_t hash;		// hash of the lower-cased, uncompressed suffix
+	uint16_t offset;	// where it starts in the message
+} DNSSuffix;
+
+typedef struct DNSBuilder {
+	uint8_t *buf;
+	int size;
+	int pos;
+	bool error;			// set once anything didn't fit or was invalid
+
+	DNSSection section;	// section being written; they must come in order
+	uint16_t counts[4];
+	int rdata_start;	// start of the open record's data, or -1
+
+	int num_suffixes;
+	DNSSuffix suffixes[DNS_BUILD_MAX_SUFFIXES];
+} DNSBuilder;
+
+/**
+ * Starts a message by writing its header (with all counts zero for now).
+ *
+ * @param b The builder to set up.
+ * @param buf Where to write the message.
+ * @param size Size of buf in bytes.
+ * @param id The message's transaction ID.
+ * @param flags The header flags (e.g. DNS_FLAG_RD).
+ */
+void dns_build_init(DNSBuilder *b, uint8_t *buf, int size, uint16_t id,
+		uint16_t flags);
+
+/**
+ * Adds a question.
+ *
+ * @param b The builder.
+ * @param name The name asked about, as a string (e.g. www.sandiego.edu).
+ * @param qtype The type asked for.
+ * @param qclass The class asked for (normally DNS_CLASS_IN).
+ * @return False if the name is invalid or the message is full.
+ */
+bool dns_build_question(DNSBuilder *b, const char *name, uint16_t qtype,
+		uint16_t qclass);
+
+/**
+ * Starts a resource record. Its data is then added with dns_build_bytes and
+ * dns_build_wire_name, and the record finished with dns_build_rr_end.
+ *
+ * @param b The builder.
+ * @param section The section it goes in (not DNS_SECTION_QUESTION).
+ * @param name The owner name, as a string.
+ * @param type The record's type.
+ * @param class The record's class.
+ * @param ttl The record's TTL.
+ * @return False if the name is invalid, the message is full, or the section
+ * 		comes before one that has already been written.
+ */
+bool dns_build_rr_begin(DNSBuilder *b, DNSSection section, const char *name,
+		uint16_t type, uint16_t class, uint32_t ttl);
+
+/**
+ * Adds raw bytes to the open record's data.
+ *
+ * @return False if the message is full.
+ */
+bool dns_build_bytes(DNSBuilder *b, const void *data, int length);
+
+/**
+ * Adds a name, given in uncompressed wire format, to the open record's data,
+ * compressing it where allowed.
+ *
+ * @param b The builder.
+ * @param wire The name.
+ * @param compress Whether the name may be compressed. RFC 3597 only allows
+ * 		it for the names in NS, CNAME, PTR, MX and SOA records.
+ * @return False if the name is invalid or the message is full.
+ */
+bool dns_build_wire_name(DNSBuilder *b, const uint8_t *wire, bool compress);
+
+/**
+ * Finishes the open record, filling in its data length.
+ *
+ * @return False if anything went wrong while building it.
+ */
+bool dns_build_rr_end(DNSBuilder *b);
+
+/**
+ * Adds an EDNS0 OPT pseudo-record (RFC 6891) to the additional section,
+ * telling the other side how large a UDP response we can take.
+ *
+ * @param b The builder.
+ * @param udp_payload_size The largest UDP payload we can receive.
+ * @return False if the message is full.
+ */
+bool dns_build_opt(DNSBuilder *b, uint16_t udp_payload_size);
+
+/**
+ * Finishes the message by writing the section counts into its header.
+ *
+ * @param b The builder.
+ * @return The length of the message in bytes, or -1 if anything didn't fit
+ * 		or was invalid.
+ */
+int dns_build_finish(DNSBuilder *b);
+
+/**
+ * Converts a name from a normal C-style string (e.g. www.sandiego.edu, with
+ * an optional trailing dot, and \DDD or \X escapes as written by
+ * dns_name_to_string) to uncompressed wire format (e.g. (3)www(8)sandiego
+ * (3)edu(0)).
+ *
+ * @param str The name as a string.
+ * @param out Where to write it (at least DNS_MAX_NAME_WIRE bytes).
+ * @return The length of the wire format name, or -1 if the string isn't a
+ * 		valid name.
+ */
+int dns_string_to_wire(const char *str, uint8_t *out);
+
+#endif
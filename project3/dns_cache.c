@@ -0,0 +1,368 @@
+/*
+ * File: dns_cache.c
+ *
+ * Implementation of the resolver's sharded, TTL-aware answer cache.
+ *
+ */
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dns.h"
+#include "dns_cache.h"
+
+#define NUM_SHARDS 16
+
+// Negative NXDOMAIN entries apply to every type, so they are filed under a
+// type that no real record uses.
+#define NXDOMAIN_TYPE 0
+
+/*
+ * One cached (name, type) pair. Entries are chained together in their hash
+ * bucket, and also kept in a list from most to least recently used.
+ */
+typedef struct CacheEntry {
+	struct CacheEntry *hash_next;
+	struct CacheEntry *lru_prev;
+	struct CacheEntry *lru_next;
+	uint32_t hash;
+	uint16_t type;
+	DNSRRset *rrset;
+	char name[DNS_CACHE_MAX_NAME + 1];
+} CacheEntry;
+
+typedef struct CacheShard {
+	pthread_mutex_t lock;
+	CacheEntry **buckets;
+	uint32_t num_buckets;	// always a power of two
+	int num_entries;
+	int max_entries;
+	CacheEntry lru;			// sentinel: lru.lru_next is the most recently used
+} CacheShard;
+
+struct DNSCache {
+	CacheShard shards[NUM_SHARDS];
+};
+
+uint64_t dns_cache_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Copies name into key in the form it is stored in the cache: lower case,
+ * without a trailing dot.
+ *
+ * @return False if the name is too long to be cached.
+ */
+static bool canonical_name(const char *name, char *key) {
+	size_t len = strlen(name);
+	if (len > 0 && name[len-1] == '.') {
+		len--;
+	}
+	if (len > DNS_CACHE_MAX_NAME) {
+		return false;
+	}
+	for (size_t i = 0; i < len; i++) {
+		key[i] = tolower((unsigned char)name[i]);
+	}
+	key[len] = '\0';
+	return true;
+}
+
+/*
+ * FNV-1a hash of a (canonical name, type) pair.
+ */
+static uint32_t hash_key(const char *key, uint16_t type) {
+	uint32_t hash = 2166136261u;
+	for (const char *p = key; *p; p++) {
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	}
+	hash = (hash ^ (type & 0xff)) * 16777619u;
+	hash = (hash ^ (type >> 8)) * 16777619u;
+	return hash;
+}
+
+static CacheShard *shard_for(DNSCache *cache, uint32_t hash) {
+	// The low bits pick the bucket, so use the high bits for the shard.
+	return &cache->shards[hash >> 28];
+}
+
+DNSCache *dns_cache_create(int max_entries) {
+	DNSCache *cache = calloc(1, sizeof(DNSCache));
+	if (cache == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	int per_shard = max_entries / NUM_SHARDS;
+	if (per_shard < 1) {
+		per_shard = 1;
+	}
+
+	for (int i = 0; i < NUM_SHARDS; i++) {
+		CacheShard *shard = &cache->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->max_entries = per_shard;
+		shard->num_buckets = 16;
+		while ((int)shard->num_buckets < per_shard) {
+			shard->num_buckets *= 2;
+		}
+		shard->buckets = calloc(shard->num_buckets, sizeof(CacheEntry*));
+		if (shard->buckets == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		shard->lru.lru_next = shard->lru.lru_prev = &shard->lru;
+	}
+	return cache;
+}
+
+void dns_cache_free(DNSCache *cache) {
+	for (int i = 0; i < NUM_SHARDS; i++) {
+		CacheShard *shard = &cache->shards[i];
+		CacheEntry *entry = shard->lru.lru_next;
+		while (entry != &shard->lru) {
+			CacheEntry *next = entry->lru_next;
+			dns_rrset_release(entry->rrset);
+			free(entry);
+			entry = next;
+		}
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	free(cache);
+}
+
+void dns_rrset_release(DNSRRset *rrset) {
+	if (rrset != NULL && atomic_fetch_sub(&rrset->refs, 1) == 1) {
+		free(rrset);
+	}
+}
+
+uint32_t dns_rrset_ttl(const DNSRRset *rrset) {
+	uint64_t now = dns_cache_now();
+	return (rrset->expires > now) ? rrset->expires - now : 0;
+}
+
+/*
+ * Creates an RRset with a single reference, copying the records' data into
+ * the same allocation.
+ */
+static DNSRRset *rrset_create(uint16_t type, uint32_t ttl, DNSCacheRank rank,
+		const DNSCacheRecord *records, int num_records) {
+	size_t size = sizeof(DNSRRset) + num_records * sizeof(DNSCacheRecord);
+	for (int i = 0; i < num_records; i++) {
+		size += records[i].rdlength;
+	}
+
+	DNSRRset *rrset = malloc(size);
+	if (rrset == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	atomic_init(&rrset->refs, 1);
+	rrset->type = type;
+	rrset->rank = rank;
+	rrset->negative = false;
+	rrset->rcode = DNS_RCODE_NOERROR;
+	rrset->ttl = ttl;
+	rrset->expires = dns_cache_now() + ttl;
+	rrset->num_records = num_records;
+
+	uint8_t *data = (uint8_t*)&rrset->records[num_records];
+	for (int i = 0; i < num_records; i++) {
+		memcpy(data, records[i].rdata, records[i].rdlength);
+		rrset->records[i].rdlength = records[i].rdlength;
+		rrset->records[i].rdata = data;
+		data += records[i].rdlength;
+	}
+	return rrset;
+}
+
+static void lru_unlink(CacheEntry *entry) {
+	entry->lru_prev->lru_next = entry->lru_next;
+	entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void lru_push_front(CacheShard *shard, CacheEntry *entry) {
+	entry->lru_prev = &shard->lru;
+	entry->lru_next = shard->lru.lru_next;
+	shard->lru.lru_next->lru_prev = entry;
+	shard->lru.lru_next = entry;
+}
+
+/*
+ * Finds an entry in a shard. The shard must be locked.
+ */
+static CacheEntry *find_entry(CacheShard *shard, uint32_t hash,
+		const char *key, uint16_t type) {
+	CacheEntry *entry = shard->buckets[hash & (shard->num_buckets - 1)];
+	while (entry != NULL) {
+		if (entry->hash == hash && entry->type == type
+				&& strcmp(entry->name, key) == 0) {
+			return entry;
+		}
+		entry = entry->hash_next;
+	}
+	return NULL;
+}
+
+/*
+ * Removes an entry from a shard and frees it. The shard must be locked.
+ */
+static void remove_entry(CacheShard *shard, CacheEntry *entry) {
+	CacheEntry **link = &shard->buckets[entry->hash & (shard->num_buckets - 1)];
+	while (*link != entry) {
+		link = &(*link)->hash_next;
+	}
+	*link = entry->hash_next;
+	lru_unlink(entry);
+	dns_rrset_release(entry->rrset);
+	free(entry);
+	shard->num_entries--;
+}
+
+/*
+ * Looks up one exact (key, type) pair, dropping the entry if it has expired.
+ */
+static DNSRRset *lookup_key(DNSCache *cache, const char *key, uint16_t type) {
+	uint32_t hash = hash_key(key, type);
+	CacheShard *shard = shard_for(cache, hash);
+	DNSRRset *rrset = NULL;
+
+	pthread_mutex_lock(&shard->lock);
+	CacheEntry *entry = find_entry(shard, hash, key, type);
+	if (entry != NULL) {
+		if (entry->rrset->expires <= dns_cache_now()) {
+			remove_entry(shard, entry);
+		}
+		else {
+			lru_unlink(entry);
+			lru_push_front(shard, entry);
+			rrset = entry->rrset;
+			atomic_fetch_add(&rrset->refs, 1);
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return rrset;
+}
+
+DNSRRset *dns_cache_lookup(DNSCache *cache, const char *name, uint16_t type) {
+	char key[DNS_CACHE_MAX_NAME + 1];
+	if (!canonical_name(name, key)) {
+		return NULL;
+	}
+
+	DNSRRset *rrset = lookup_key(cache, key, type);
+	if (rrset == NULL) {
+		rrset = lookup_key(cache, key, NXDOMAIN_TYPE);
+	}
+	return rrset;
+}
+
+/*
+ * Stores an RRset under (name, type), taking over the caller's reference to
+ * it. If a more trustworthy RRset is already cached, the new one is dropped.
+ */
+static void store(DNSCache *cache, const char *name, uint16_t type,
+		DNSRRset *rrset) {
+	char key[DNS_CACHE_MAX_NAME + 1];
+	if (!canonical_name(name, key)) {
+		dns_rrset_release(rrset);
+		return;
+	}
+
+	uint32_t hash = hash_key(key, type);
+	CacheShard *shard = shard_for(cache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	CacheEntry *entry = find_entry(shard, hash, key, type);
+	if (entry != NULL) {
+		DNSRRset *old = entry->rrset;
+		if (old->rank > rrset->rank && old->expires > dns_cache_now()) {
+			pthread_mutex_unlock(&shard->lock);
+			dns_rrset_release(rrset);
+			return;
+		}
+		entry->rrset = rrset;
+		lru_unlink(entry);
+		lru_push_front(shard, entry);
+		pthread_mutex_unlock(&shard->lock);
+		dns_rrset_release(old);
+		return;
+	}
+
+	// Make room by evicting the least recently used entries.
+	while (shard->num_entries >= shard->max_entries) {
+		remove_entry(shard, shard->lru.lru_prev);
+	}
+
+	entry = malloc(sizeof(CacheEntry));
+	if (entry == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	entry->hash = hash;
+	entry->type = type;
+	entry->rrset = rrset;
+	strcpy(entry->name, key);
+
+	CacheEntry **bucket = &shard->buckets[hash & (shard->num_buckets - 1)];
+	entry->hash_next = *bucket;
+	*bucket = entry;
+	lru_push_front(shard, entry);
+	shard->num_entries++;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void dns_cache_insert(DNSCache *cache, const char *name, uint16_t type,
+		uint32_t ttl, DNSCacheRank rank,
+		const DNSCacheRecord *records, int num_records) {
+	if (ttl == 0 || num_records == 0) {
+		return;
+	}
+	if (ttl > DNS_CACHE_MAX_TTL) {
+		ttl = DNS_CACHE_MAX_TTL;
+	}
+	store(cache, name, type, rrset_create(type, ttl, rank, records, num_records));
+}
+
+void dns_cache_insert_negative(DNSCache *cache, const char *name,
+		uint16_t type, int rcode, uint32_t ttl) {
+	if (ttl == 0) {
+		return;
+	}
+	if (ttl > DNS_CACHE_MAX_NEGATIVE_TTL) {
+		ttl = DNS_CACHE_MAX_NEGATIVE_TTL;
+	}
+
+	// A name that doesn't exist has no records of any type.
+	if (rcode == DNS_RCODE_NXDOMAIN) {
+		type = NXDOMAIN_TYPE;
+	}
+
+	DNSRRset *rrset = rrset_create(type, ttl, DNS_RANK_ANSWER, NULL, 0);
+	rrset->negative = true;
+	rrset->rcode = rcode;
+	store(cache, name, type, rrset);
+}
+
+void dns_cache_foreach(DNSCache *cache, DNSCacheVisitor visit, void *arg) {
+	uint64_t now = dns_cache_now();
+	for (int i = 0; i < NUM_SHARDS; i++) {
+		CacheShard *shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		for (CacheEntry *entry = shard->lru.lru_prev; entry != &shard->lru;
+				entry = entry->lru_prev) {
+			if (entry->rrset->expires > now) {
+				visit(entry->name, entry->rrset, arg);
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
@@ -0,0 +1,177 @@
+/*
+ * File: dns_cache.h
+ *
+ * Header / API file for the resolver's answer cache.
+ *
+ * The cache maps a (name, type) pair to the RRset for it: all of the resource
+ * records of that type owned by that name. An RRset is only kept for as long
+ * as its TTL allows. Lookups that failed are cached too ("negative caching",
+ * RFC 2308), so asking again for a name that doesn't exist doesn't go back out
+ * to the network.
+ *
+ * Entries are spread over a number of independently locked shards so that
+ * many threads can use one cache without all waiting on a single lock.
+ */
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Longest domain name, in presentation format, that the cache will store.
+#define DNS_CACHE_MAX_NAME 255
+
+// No RRset is kept longer than this (in seconds), whatever its TTL says.
+#define DNS_CACHE_MAX_TTL (24 * 60 * 60)
+
+// Negative answers are kept for at most this long (RFC 2308, section 5).
+#define DNS_CACHE_MAX_NEGATIVE_TTL (3 * 60 * 60)
+
+/**
+ * How much an RRset can be trusted, based on which section of which kind of
+ * response it came from (RFC 2181, section 5.4.1). Cached data is only ever
+ * replaced by data that is at least as trustworthy.
+ */
+typedef enum DNSCacheRank {
+	DNS_RANK_ADDITIONAL = 1,	// glue and other additional section records
+	DNS_RANK_AUTHORITY  = 2,	// authority section of a referral or answer
+	DNS_RANK_ANSWER     = 3		// answer section
+} DNSCacheRank;
+
+/**
+ * The data of one resource record. Any domain names inside rdata are stored
+ * uncompressed, so the data can be read without the message it came from.
+ */
+typedef struct DNSCacheRecord {
+	uint16_t rdlength;
+	const uint8_t *rdata;
+} DNSCacheRecord;
+
+/**
+ * A cached RRset. These are never modified once created, and are reference
+ * counted so a lookup can hand one out without copying it.
+ */
+typedef struct DNSRRset {
+	atomic_int refs;
+	uint16_t type;
+	uint8_t rank;
+
+	// For negative entries there are no records; rcode is NXDOMAIN if the
+	// name doesn't exist at all or NOERROR if it has no records of this type.
+	bool negative;
+	int rcode;
+
+	uint32_t ttl;		// TTL when the RRset was cached
+	uint64_t expires;	// when it stops being valid (see dns_cache_now)
+
+	int num_records;
+	DNSCacheRecord records[];	// rdata follows the records in memory
+} DNSRRset;
+
+typedef struct DNSCache DNSCache;
+
+/**
+ * Creates an empty cache.
+ *
+ * @param max_entries The most RRsets the cache may hold. When full, the least
+ * 		recently used RRsets are evicted to make room.
+ * @return The new cache.
+ */
+DNSCache *dns_cache_create(int max_entries);
+
+/**
+ * Frees a cache. RRsets that are still referenced by someone else stay
+ * valid until they are released.
+ *
+ * @param cache The cache to free.
+ */
+void dns_cache_free(DNSCache *cache);
+
+/**
+ * Looks up the RRset for a name and type. If the name is cached as not
+ * existing at all, that negative entry is returned whatever type was asked
+ * for.
+ *
+ * @param cache The cache to search.
+ * @param name The owner name (case is ignored, as is a trailing dot).
+ * @param type The record type.
+ * @return The RRset, which the caller must release with dns_rrset_release, or
+ * 		NULL if nothing (unexpired) is cached.
+ */
+DNSRRset *dns_cache_lookup(DNSCache *cache, const char *name, uint16_t type);
+
+/**
+ * Caches an RRset, unless something more trustworthy is already cached for
+ * the same name and type.
+ *
+ * @param cache The cache to add to.
+ * @param name The owner name.
+ * @param type The record type.
+ * @param ttl How long (in seconds) the RRset may be used for. RRsets with a
+ * 		TTL of 0 aren't cached.
+ * @param rank Where the records came from.
+ * @param records The records' data, which is copied.
+ * @param num_records Number of records in the set.
+ */
+void dns_cache_insert(DNSCache *cache, const char *name, uint16_t type,
+		uint32_t ttl, DNSCacheRank rank,
+		const DNSCacheRecord *records, int num_records);
+
+/**
+ * Caches the fact that a name, or a type of record for a name, doesn't exist.
+ *
+ * @param cache The cache to add to.
+ * @param name The name that was looked up.
+ * @param type The type that was looked up. Ignored for NXDOMAIN, which covers
+ * 		every type.
+ * @param rcode NXDOMAIN or NOERROR (for a "no data" answer).
+ * @param ttl How long (in seconds) the answer may be used for, normally the
+ * 		smaller of the SOA record's TTL and its MINIMUM field.
+ */
+void dns_cache_insert_negative(DNSCache *cache, const char *name,
+		uint16_t type, int rcode, uint32_t ttl);
+
+/**
+ * Called by dns_cache_foreach for each cached RRset.
+ *
+ * @param name The owner name, in the cache's canonical form.
+ * @param rrset The RRset. Negative NXDOMAIN entries have type 0.
+ * @param arg The argument given to dns_cache_foreach.
+ */
+typedef void (*DNSCacheVisitor)(const char *name, const DNSRRset *rrset,
+		void *arg);
+
+/**
+ * Calls visit for every unexpired RRset in the cache, from the least to the
+ * most recently used within each shard (so inserting them again in that
+ * order keeps the same ones in line for eviction). Each shard is locked
+ * while its RRsets are visited, so visit mustn't use the cache itself, and
+ * should be quick.
+ *
+ * @param cache The cache.
+ * @param visit The function to call.
+ * @param arg Passed on to visit.
+ */
+void dns_cache_foreach(DNSCache *cache, DNSCacheVisitor visit, void *arg);
+
+/**
+ * Drops a reference to an RRset returned by dns_cache_lookup.
+ *
+ * @param rrset The RRset (may be NULL).
+ */
+void dns_rrset_release(DNSRRset *rrset);
+
+/**
+ * @param rrset A cached RRset.
+ * @return How many seconds are left before the RRset expires.
+ */
+uint32_t dns_rrset_ttl(const DNSRRset *rrset);
+
+/**
+ * @return The clock used for cache expiry times, in seconds. It is monotonic,
+ * 		so it isn't affected by changes to the system time.
+ */
+uint64_t dns_cache_now(void);
+
+#endif
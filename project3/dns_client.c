@@ -0,0 +1,585 @@
+/*
+ * File: dns_client.c
+ *
+ * Implementation of the asynchronous DNS client.
+ *
+ */
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dns.h"
+#include "dns_build.h"
+#include "dns_client.h"
+#include "dns_random.h"
+#include "dns_tcp.h"
+
+#define NUM_SOCKETS 4
+#define RECV_BATCH 64			// datagrams read per recvmmsg call
+#define MAX_UDP_PAYLOAD 4096
+#define SOCKET_BUFFER (1 << 20)
+#define MAX_QUERY_SIZE 512
+
+// Slots in the table that matches responses to queries: a power of two, and
+// at least twice the most queries in flight, so probe sequences stay short.
+#define MATCH_TABLE_SIZE (2 * DNS_CLIENT_MAX_IN_FLIGHT)
+
+// TCP responses are matched as if they came to this port.
+#define TCP_PORT_KEY 0
+
+/*
+ * A query in flight.
+ */
+typedef struct PendingQuery {
+	bool in_use;
+	uint64_t key;	// see match_key
+	int sock;		// index of the UDP socket it's sent from
+	int tries;
+	long sent_at;
+	bool use_tcp;	// the answer didn't fit in UDP
+	char name[DNS_CACHE_MAX_NAME + 1];
+	uint16_t qtype;
+	DNSClientCallback callback;
+	void *arg;
+
+	// Queries in flight are kept in the order they were (re)sent, which is
+	// also the order they will time out in. Free slots are kept in a list
+	// using next.
+	struct PendingQuery *prev;
+	struct PendingQuery *next;
+} PendingQuery;
+
+struct DNSClient {
+	struct in_addr server;
+	uint16_t port;
+	uint16_t edns_payload_size;
+	int socks[NUM_SOCKETS];
+	uint16_t ports[NUM_SOCKETS];	// each socket's (random) local port
+	int epoll_fd;
+
+	// Connection that queries with answers too big for UDP are pipelined
+	// on (not open until one is needed). It is the client's own, rather
+	// than one from the thread's pool, so it is opened without waiting and
+	// is always watched.
+	DNSTCPConn tcp;
+	bool tcp_writing;	// it is watched for writability too
+
+	PendingQuery pending[DNS_CLIENT_MAX_IN_FLIGHT];
+	PendingQuery *match[MATCH_TABLE_SIZE];	// open addressing, by key
+	PendingQuery *free_list;
+	PendingQuery *oldest;	// next to time out
+	PendingQuery *newest;
+	int in_flight;
+
+	uint8_t (*recv_bufs)[MAX_UDP_PAYLOAD];
+	DNSResponse resp;
+};
+
+static long now_msec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Hashes a question: its name, in wire format and with case ignored, and
+ * its type.
+ */
+static uint32_t question_hash(const uint8_t *wire, uint16_t qtype) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; wire[i] != 0; i += wire[i] + 1) {
+		hash = (hash ^ wire[i]) * 16777619u;
+		for (int j = 1; j <= wire[i]; j++) {
+			hash = (hash ^ (uint8_t)tolower(wire[i + j])) * 16777619u;
+		}
+	}
+	hash = (hash ^ (qtype & 0xff)) * 16777619u;
+	return (hash ^ (qtype >> 8)) * 16777619u;
+}
+
+/*
+ * The key a query is found by when its response comes in: the transaction
+ * ID, the port the response arrives at, and the question it repeats.
+ */
+static uint64_t match_key(uint16_t id, uint16_t port, uint32_t qhash) {
+	return ((uint64_t)qhash << 32) | ((uint32_t)port << 16) | id;
+}
+
+static uint32_t match_slot(uint64_t key) {
+	// The ID and question hash are already random, so just fold the key.
+	return (uint32_t)(key ^ (key >> 29)) & (MATCH_TABLE_SIZE - 1);
+}
+
+static PendingQuery *match_find(DNSClient *client, uint64_t key) {
+	for (uint32_t i = match_slot(key); client->match[i] != NULL;
+			i = (i + 1) & (MATCH_TABLE_SIZE - 1)) {
+		if (client->match[i]->key == key) {
+			return client->match[i];
+		}
+	}
+	return NULL;
+}
+
+static void match_insert(DNSClient *client, PendingQuery *pq) {
+	uint32_t i = match_slot(pq->key);
+	while (client->match[i] != NULL) {
+		i = (i + 1) & (MATCH_TABLE_SIZE - 1);
+	}
+	client->match[i] = pq;
+}
+
+/*
+ * Removes a query from the match table, moving later entries of its probe
+ * sequence back so that no tombstones are needed.
+ */
+static void match_remove(DNSClient *client, PendingQuery *pq) {
+	uint32_t hole = match_slot(pq->key);
+	while (client->match[hole] != pq) {
+		hole = (hole + 1) & (MATCH_TABLE_SIZE - 1);
+	}
+	client->match[hole] = NULL;
+
+	for (uint32_t i = (hole + 1) & (MATCH_TABLE_SIZE - 1);
+			client->match[i] != NULL; i = (i + 1) & (MATCH_TABLE_SIZE - 1)) {
+		// An entry can fill the hole if its home slot isn't between the
+		// hole and where it is now.
+		uint32_t home = match_slot(client->match[i]->key);
+		if (((i - home) & (MATCH_TABLE_SIZE - 1))
+				>= ((i - hole) & (MATCH_TABLE_SIZE - 1))) {
+			client->match[hole] = client->match[i];
+			client->match[i] = NULL;
+			hole = i;
+		}
+	}
+}
+
+/*
+ * Gives a query a random ID no other query to the same port with the same
+ * question has, and files it under its new key.
+ */
+static void assign_id(DNSClient *client, PendingQuery *pq, uint16_t port,
+		uint32_t qhash) {
+	do {
+		pq->key = match_key(dns_random_id(), port, qhash);
+	} while (match_find(client, pq->key) != NULL);
+	match_insert(client, pq);
+}
+
+static void timeout_list_remove(DNSClient *client, PendingQuery *pq) {
+	if (pq->prev != NULL) {
+		pq->prev->next = pq->next;
+	}
+	else {
+		client->oldest = pq->next;
+	}
+	if (pq->next != NULL) {
+		pq->next->prev = pq->prev;
+	}
+	else {
+		client->newest = pq->prev;
+	}
+}
+
+static void timeout_list_append(DNSClient *client, PendingQuery *pq) {
+	pq->next = NULL;
+	pq->prev = client->newest;
+	if (client->newest != NULL) {
+		client->newest->next = pq;
+	}
+	else {
+		client->oldest = pq;
+	}
+	client->newest = pq;
+}
+
+/*
+ * Adds a socket to the client's epoll set. Its tag is the index of a UDP
+ * socket, or NUM_SOCKETS for the TCP connection.
+ */
+static void watch(DNSClient *client, int fd, uint32_t tag) {
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.u32 = tag;
+	if (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Watches the TCP connection for writability as well as readability while
+ * it has queries queued (or is still being set up), and only for
+ * readability otherwise.
+ */
+static void watch_tcp_writes(DNSClient *client) {
+	bool writing = client->tcp.open
+			&& (client->tcp.connecting || client->tcp.out_len > 0);
+	if (!client->tcp.open || writing == client->tcp_writing) {
+		return;
+	}
+	struct epoll_event event;
+	event.events = writing ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+	event.data.u32 = NUM_SOCKETS;
+	if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, client->tcp.fd,
+				&event) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+	client->tcp_writing = writing;
+}
+
+DNSClient *dns_client_create(struct in_addr server, uint16_t port,
+		uint16_t edns_payload_size) {
+	DNSClient *client = calloc(1, sizeof(DNSClient));
+	if (client == NULL
+			|| (client->recv_bufs = malloc(RECV_BATCH * MAX_UDP_PAYLOAD)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	client->server = server;
+	client->port = port;
+	client->edns_payload_size = edns_payload_size;
+
+	client->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (client->epoll_fd < 0) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr = server;
+
+	for (int i = 0; i < NUM_SOCKETS; i++) {
+		// Connecting the socket means the OS drops datagrams from anyone but
+		// the server for us.
+		client->socks[i] = socket(AF_INET,
+				SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (client->socks[i] < 0) {
+			perror("socket");
+			exit(EXIT_FAILURE);
+		}
+		int port = dns_random_bind(client->socks[i]);
+		if (port < 0) {
+			perror("bind");
+			exit(EXIT_FAILURE);
+		}
+		client->ports[i] = port;
+		if (connect(client->socks[i], (struct sockaddr*)&addr,
+					sizeof(addr)) < 0) {
+			perror("connect");
+			exit(EXIT_FAILURE);
+		}
+
+		// Make room for a burst of responses to arrive between reads.
+		int buffer_size = SOCKET_BUFFER;
+		setsockopt(client->socks[i], SOL_SOCKET, SO_RCVBUF, &buffer_size,
+				sizeof(buffer_size));
+		watch(client, client->socks[i], i);
+	}
+
+	for (int i = DNS_CLIENT_MAX_IN_FLIGHT - 1; i >= 0; i--) {
+		client->pending[i].next = client->free_list;
+		client->free_list = &client->pending[i];
+	}
+	return client;
+}
+
+void dns_client_free(DNSClient *client) {
+	for (int i = 0; i < NUM_SOCKETS; i++) {
+		close(client->socks[i]);
+	}
+	dns_tcp_free(&client->tcp);
+	close(client->epoll_fd);
+	free(client->recv_bufs);
+	free(client);
+}
+
+int dns_client_fd(DNSClient *client) {
+	return client->epoll_fd;
+}
+
+int dns_client_in_flight(DNSClient *client) {
+	return client->in_flight;
+}
+
+int dns_client_timeout(DNSClient *client) {
+	if (client->oldest == NULL) {
+		return -1;
+	}
+	long wait = DNS_CLIENT_TIMEOUT_MS - (now_msec() - client->oldest->sent_at);
+	return (wait > 0) ? wait : 0;
+}
+
+/**
+ * Sends a query on the TCP connection to the server, starting to open the
+ * connection (and watching it) if need be. Any number of queries may be
+ * waiting for answers on it at once; those that can't go yet (because it's
+ * still being set up, or its buffer is full) are queued until it's writable.
+ *
+ * @return False if the query couldn't be sent or queued.
+ */
+static bool send_tcp(DNSClient *client, const uint8_t *query, int query_len) {
+	DNSTCPConn *conn = &client->tcp;
+	if (!conn->open) {
+		if (!dns_tcp_open_async(conn, client->server, client->port)) {
+			return false;
+		}
+		watch(client, conn->fd, NUM_SOCKETS);
+		client->tcp_writing = false;
+	}
+	bool queued = dns_tcp_queue(conn, query, query_len);
+	watch_tcp_writes(client);
+	return queued;
+}
+
+/**
+ * (Re)sends a pending query to the server and puts it at the back of the
+ * timeout list.
+ */
+static void send_pending(DNSClient *client, PendingQuery *pq) {
+	uint8_t query[MAX_QUERY_SIZE];
+	DNSBuilder builder;
+	dns_build_init(&builder, query, sizeof(query), pq->key & 0xffff,
+			DNS_FLAG_RD);
+	dns_build_question(&builder, pq->name, pq->qtype, DNS_CLASS_IN);
+	if (client->edns_payload_size > 0) {
+		dns_build_opt(&builder, client->edns_payload_size);
+	}
+	int query_len = dns_build_finish(&builder);
+
+	if (pq->use_tcp) {
+		send_tcp(client, query, query_len);
+	}
+	else {
+		if (send(client->socks[pq->sock], query, query_len, 0) < 0
+				&& errno != EAGAIN && errno != ECONNREFUSED) {
+			perror("send");
+		}
+	}
+	// If it didn't go (e.g. the socket buffer was full), it will simply time
+	// out and be sent again.
+
+	pq->tries++;
+	pq->sent_at = now_msec();
+	timeout_list_append(client, pq);
+}
+
+bool dns_client_query(DNSClient *client, const char *name, uint16_t qtype,
+		DNSClientCallback callback, void *arg) {
+	uint8_t wire[DNS_MAX_NAME_WIRE];
+	if (client->free_list == NULL || strlen(name) > DNS_CACHE_MAX_NAME
+			|| dns_string_to_wire(name, wire) < 0) {
+		return false;
+	}
+
+	PendingQuery *pq = client->free_list;
+	client->free_list = pq->next;
+	pq->in_use = true;
+	pq->sock = dns_random_below(NUM_SOCKETS);
+	assign_id(client, pq, client->ports[pq->sock],
+			question_hash(wire, qtype));
+	pq->tries = 0;
+	pq->use_tcp = false;
+	strcpy(pq->name, name);
+	pq->qtype = qtype;
+	pq->callback = callback;
+	pq->arg = arg;
+	client->in_flight++;
+	send_pending(client, pq);
+	return true;
+}
+
+/**
+ * Frees a query's slot and then runs its callback (so the callback can reuse
+ * the slot for a new query).
+ *
+ * @param resp The response, or NULL if the query timed out.
+ */
+static void finish(DNSClient *client, PendingQuery *pq,
+		const DNSResponse *resp) {
+	timeout_list_remove(client, pq);
+	match_remove(client, pq);
+	pq->in_use = false;
+	pq->next = client->free_list;
+	client->free_list = pq;
+	client->in_flight--;
+
+	// The name lives in the slot, which a new query started by the callback
+	// might take over.
+	char name[DNS_CACHE_MAX_NAME + 1];
+	strcpy(name, pq->name);
+
+	DNSClientResult result;
+	result.name = name;
+	result.qtype = pq->qtype;
+	result.response = resp;
+	result.num_answers = 0;
+	if (resp == NULL) {
+		result.status = DNS_CLIENT_TIMEOUT;
+	}
+	else if (resp->rcode == DNS_RCODE_NXDOMAIN) {
+		result.status = DNS_CLIENT_NXDOMAIN;
+	}
+	else if (resp->rcode != DNS_RCODE_NOERROR) {
+		result.status = DNS_CLIENT_SERVFAIL;
+	}
+	else {
+		result.num_answers = dns_response_answers(resp, name, pq->qtype,
+				result.answers, DNS_RESPONSE_MAX_RECORDS);
+		result.status = (result.num_answers > 0)
+				? DNS_CLIENT_OK : DNS_CLIENT_NODATA;
+	}
+
+	pq->callback(&result, pq->arg);
+}
+
+/**
+ * Matches a response to its pending query, and finishes the query.
+ *
+ * @param port The port it arrived at, or TCP_PORT_KEY.
+ */
+static void handle_response(DNSClient *client, const uint8_t *response,
+		int len, uint16_t port) {
+	DNSParser parser;
+	DNSName qname;
+	uint16_t qtype, qclass;
+	uint8_t wire[DNS_MAX_NAME_WIRE];
+	if (!dns_parse_header(&parser, response, len)
+			|| !(parser.flags & DNS_FLAG_QR)
+			|| parser.counts[DNS_SECTION_QUESTION] != 1
+			|| !dns_parse_question(&parser, &qname, &qtype, &qclass)) {
+		return;
+	}
+	dns_name_to_wire(qname, wire);
+
+	uint32_t qhash = question_hash(wire, qtype);
+	PendingQuery *pq = match_find(client, match_key(parser.id, port, qhash));
+	if (pq == NULL) {
+		return; // a late answer to a query we've already finished with
+	}
+
+	// The key only has a hash of the question, so check it's really about
+	// our name.
+	char answered[DNS_CACHE_MAX_NAME + 1];
+	if (qtype != pq->qtype
+			|| dns_name_to_string(qname, answered, sizeof(answered)) < 0
+			|| strcasecmp(answered, pq->name) != 0) {
+		return;
+	}
+
+	// A truncated answer is asked for again over TCP, where it will fit.
+	if ((parser.flags & DNS_FLAG_TC) && !pq->use_tcp) {
+		pq->use_tcp = true;
+		timeout_list_remove(client, pq);
+		match_remove(client, pq);
+		assign_id(client, pq, TCP_PORT_KEY, qhash);
+		pq->tries--;	// this doesn't count as a failed try
+		send_pending(client, pq);
+		return;
+	}
+
+	DNSResponse *resp = &client->resp;
+	if (!dns_response_parse(response, len, resp)) {
+		return;
+	}
+
+	if (resp->rcode != DNS_RCODE_NOERROR && resp->rcode != DNS_RCODE_NXDOMAIN
+			&& pq->tries < DNS_CLIENT_MAX_TRIES) {
+		timeout_list_remove(client, pq);
+		send_pending(client, pq);
+		return;
+	}
+	finish(client, pq, resp);
+}
+
+/**
+ * Reads every response waiting on a socket, a batch at a time.
+ */
+static void drain_socket(DNSClient *client, int index) {
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+
+	while (true) {
+		for (int i = 0; i < RECV_BATCH; i++) {
+			iovs[i].iov_base = client->recv_bufs[i];
+			iovs[i].iov_len = MAX_UDP_PAYLOAD;
+			memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int count = recvmmsg(client->socks[index], msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+		if (count < 0) {
+			if (errno != EAGAIN && errno != ECONNREFUSED && errno != EINTR) {
+				perror("recvmmsg");
+			}
+			return;
+		}
+		for (int i = 0; i < count; i++) {
+			handle_response(client, client->recv_bufs[i], msgs[i].msg_len,
+					client->ports[index]);
+		}
+		if (count < RECV_BATCH) {
+			return;
+		}
+	}
+}
+
+/**
+ * Sends what's queued on the TCP connection, if it's writable, and reads
+ * every complete response waiting on it.
+ */
+static void drain_tcp(DNSClient *client) {
+	dns_tcp_flush(&client->tcp);
+	watch_tcp_writes(client);
+
+	const uint8_t *response;
+	int len;
+	while ((len = dns_tcp_recv(&client->tcp, &response)) > 0) {
+		handle_response(client, response, len, TCP_PORT_KEY);
+	}
+	// If the connection was closed, the queries on it will time out and be
+	// sent again on a new one.
+}
+
+void dns_client_process(DNSClient *client) {
+	struct epoll_event events[NUM_SOCKETS + 1];
+	int ready = epoll_wait(client->epoll_fd, events, NUM_SOCKETS + 1, 0);
+	if (ready < 0 && errno != EINTR) {
+		perror("epoll_wait");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < ready; i++) {
+		if (events[i].data.u32 < NUM_SOCKETS) {
+			drain_socket(client, events[i].data.u32);
+		}
+		else if (client->tcp.open) {
+			drain_tcp(client);
+		}
+	}
+
+	// Time out (and resend, or give up on) the oldest queries.
+	long now = now_msec();
+	while (client->oldest != NULL
+			&& now - client->oldest->sent_at >= DNS_CLIENT_TIMEOUT_MS) {
+		PendingQuery *pq = client->oldest;
+		if (pq->tries < DNS_CLIENT_MAX_TRIES) {
+			timeout_list_remove(client, pq);
+			send_pending(client, pq);
+		}
+		else {
+			finish(client, pq, NULL);
+		}
+	}
+}
@@ -0,0 +1,142 @@
+/*
+ * File: dns_client.h
+ *
+ * Header / API file for an asynchronous DNS client.
+ *
+ * A client sends queries to one recursive server and calls back when each is
+ * answered (or given up on), so a program can have thousands of lookups in
+ * flight without a thread blocked on each. It never blocks: all of its
+ * sockets are watched through a single file descriptor, which the program
+ * adds to its own event loop (poll, epoll, ...). Whenever that descriptor is
+ * readable, or the time given by dns_client_timeout has passed, the program
+ * calls dns_client_process, which reads the responses and runs the callbacks.
+ *
+ * Queries go over UDP, spread over a few sockets bound to random ports, and
+ * each gets a random transaction ID (see dns_random.h). A response is matched
+ * to its query in one hash table lookup, keyed by its ID, the port it came
+ * to and its question, so late or forged responses are simply not found.
+ * Queries that get no answer are sent again a few times, and those whose
+ * answers are truncated are asked again over a pipelined TCP connection of
+ * the client's own (queued until it is set up, so connecting doesn't block
+ * either).
+ *
+ * A client, and the callbacks it runs, belong to the thread that created it.
+ * Any record type can be asked for; dns_record_to_string (in dns_response.h)
+ * turns the answers to the common ones (A, AAAA, MX, NS, CNAME, TXT, SRV)
+ * into text.
+ */
+#ifndef DNS_CLIENT_H
+#define DNS_CLIENT_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dns_response.h"
+
+// Most queries a client may have in flight at once.
+#define DNS_CLIENT_MAX_IN_FLIGHT 4096
+
+// How long to wait for each try of a query, and how many tries it gets.
+#define DNS_CLIENT_TIMEOUT_MS 1000
+#define DNS_CLIENT_MAX_TRIES 3
+
+typedef enum DNSClientStatus {
+	DNS_CLIENT_OK,			// there is at least one answer
+	DNS_CLIENT_NODATA,		// the name exists, but has no records of the type
+	DNS_CLIENT_NXDOMAIN,	// the name doesn't exist
+	DNS_CLIENT_SERVFAIL,	// the server couldn't (or wouldn't) answer
+	DNS_CLIENT_TIMEOUT		// no answer came
+} DNSClientStatus;
+
+/**
+ * The outcome of a query, valid only while its callback runs.
+ */
+typedef struct DNSClientResult {
+	DNSClientStatus status;
+	const char *name;		// as it was asked for
+	uint16_t qtype;
+
+	// The answers: the records of the type asked for, at the end of any
+	// CNAME chain.
+	int num_answers;
+	const DNSResourceRecord *answers[DNS_RESPONSE_MAX_RECORDS];
+
+	// The whole response (NULL on a timeout), e.g. for caching.
+	const DNSResponse *response;
+} DNSClientResult;
+
+/**
+ * Called with the result of a query. It may start new queries.
+ *
+ * @param result The result.
+ * @param arg The argument given with the query.
+ */
+typedef void (*DNSClientCallback)(const DNSClientResult *result, void *arg);
+
+typedef struct DNSClient DNSClient;
+
+/**
+ * Creates a client.
+ *
+ * @param server The address of the recursive server to ask.
+ * @param port The server's port (in host byte order), normally 53.
+ * @param edns_payload_size The UDP payload size to advertise with EDNS0, or
+ * 		0 to send plain queries (with answers limited to 512 bytes).
+ * @return The new client.
+ */
+DNSClient *dns_client_create(struct in_addr server, uint16_t port,
+		uint16_t edns_payload_size);
+
+/**
+ * Frees a client. Queries still in flight are dropped without their
+ * callbacks being run. Mustn't be called from a callback.
+ *
+ * @param client The client.
+ */
+void dns_client_free(DNSClient *client);
+
+/**
+ * @param client The client.
+ * @return The descriptor to watch for readability.
+ */
+int dns_client_fd(DNSClient *client);
+
+/**
+ * Starts looking up a record. The callback is always run later, from
+ * dns_client_process, never from in here.
+ *
+ * @param client The client.
+ * @param name The name to look up.
+ * @param qtype The type of record wanted (e.g. DNS_TYPE_AAAA).
+ * @param callback Called with the result.
+ * @param arg Passed on to the callback.
+ * @return False, without starting the query, if the name isn't valid or
+ * 		DNS_CLIENT_MAX_IN_FLIGHT queries are already in flight.
+ */
+bool dns_client_query(DNSClient *client, const char *name, uint16_t qtype,
+		DNSClientCallback callback, void *arg);
+
+/**
+ * Reads any responses that have arrived, resends or gives up on queries that
+ * have timed out, and runs the callbacks of those that are finished. Never
+ * blocks.
+ *
+ * @param client The client.
+ */
+void dns_client_process(DNSClient *client);
+
+/**
+ * @param client The client.
+ * @return How many milliseconds from now dns_client_process should be called
+ * 		even if nothing arrives, or -1 if no queries are in flight.
+ */
+int dns_client_timeout(DNSClient *client);
+
+/**
+ * @param client The client.
+ * @return The number of queries in flight.
+ */
+int dns_client_in_flight(DNSClient *client);
+
+#endif
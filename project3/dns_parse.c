@@ -0,0 +1,312 @@
+/*
+ * File: dns_parse.c
+ *
+ * Implementation of the bounds-checked DNS message parser.
+ *
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dns_parse.h"
+
+#define HEADER_SIZE 12
+
+/*
+ * State for walking the labels of a (possibly compressed) name.
+ */
+typedef struct LabelIter {
+	const uint8_t *msg;
+	int length;
+	int pos;		// where the next label's length byte is
+	int limit;		// a pointer must point before here
+	int end;		// where the name ends in its original place (-1 if unknown)
+	int hops;		// compression pointers followed
+	int wire_len;	// uncompressed length so far
+} LabelIter;
+
+static void iter_init(LabelIter *it, DNSName name) {
+	it->msg = name.msg;
+	it->length = name.length;
+	it->pos = name.offset;
+	it->limit = name.offset;
+	it->end = -1;
+	it->hops = 0;
+	it->wire_len = 0;
+}
+
+/*
+ * Moves to the next label of a name, following compression pointers.
+ *
+ * @param it The iterator.
+ * @param label Set to the first byte of the label.
+ * @return The length of the label (0 for the empty root label that ends every
+ * 		name), or -1 if the name is malformed.
+ */
+static int next_label(LabelIter *it, const uint8_t **label) {
+	while (true) {
+		if (it->pos < 0 || it->pos >= it->length) {
+			return -1;
+		}
+
+		uint8_t len = it->msg[it->pos];
+		if ((len & 0xc0) == 0xc0) {
+			// Compression pointer (RFC 1035, section 4.1.4). Requiring each
+			// one to point before the part of the name that led to it means
+			// every hop moves strictly backwards, so there can't be a loop.
+			if (it->pos + 1 >= it->length || ++it->hops > DNS_MAX_POINTER_HOPS) {
+				return -1;
+			}
+			int target = ((len & 0x3f) << 8) | it->msg[it->pos + 1];
+			if (it->end < 0) {
+				it->end = it->pos + 2;
+			}
+			if (target >= it->limit) {
+				return -1;
+			}
+			it->pos = target;
+			it->limit = target;
+			continue;
+		}
+		if (len & 0xc0) {
+			return -1; // extended label types aren't in use
+		}
+
+		it->wire_len += len + 1;
+		if (it->wire_len > DNS_MAX_NAME_WIRE || it->pos + 1 + len > it->length) {
+			return -1;
+		}
+		*label = it->msg + it->pos + 1;
+		it->pos += 1 + len;
+		if (len == 0 && it->end < 0) {
+			it->end = it->pos;
+		}
+		return len;
+	}
+}
+
+int dns_name_skip(DNSName name) {
+	LabelIter it;
+	iter_init(&it, name);
+
+	const uint8_t *label;
+	int len;
+	while ((len = next_label(&it, &label)) > 0) {
+	}
+	return (len == 0) ? it.end : -1;
+}
+
+bool dns_name_equal(DNSName a, DNSName b) {
+	LabelIter it_a, it_b;
+	iter_init(&it_a, a);
+	iter_init(&it_b, b);
+
+	while (true) {
+		const uint8_t *label_a, *label_b;
+		int len_a = next_label(&it_a, &label_a);
+		int len_b = next_label(&it_b, &label_b);
+		if (len_a < 0 || len_a != len_b) {
+			return false;
+		}
+		if (len_a == 0) {
+			return true;
+		}
+		for (int i = 0; i < len_a; i++) {
+			if (tolower(label_a[i]) != tolower(label_b[i])) {
+				return false;
+			}
+		}
+	}
+}
+
+int dns_name_to_wire(DNSName name, uint8_t *out) {
+	LabelIter it;
+	iter_init(&it, name);
+
+	int out_len = 0;
+	while (true) {
+		const uint8_t *label;
+		int len = next_label(&it, &label);
+		if (len < 0) {
+			return -1;
+		}
+		out[out_len] = len;
+		memcpy(out + out_len + 1, label, len);
+		out_len += len + 1;
+		if (len == 0) {
+			return out_len;
+		}
+	}
+}
+
+int dns_name_to_string(DNSName name, char *out, size_t size) {
+	LabelIter it;
+	iter_init(&it, name);
+
+	size_t out_len = 0;
+	while (true) {
+		const uint8_t *label;
+		int len = next_label(&it, &label);
+		if (len < 0) {
+			return -1;
+		}
+		if (len == 0) {
+			break;
+		}
+
+		if (out_len > 0) {
+			if (out_len + 1 >= size) {
+				return -1;
+			}
+			out[out_len++] = '.';
+		}
+		for (int i = 0; i < len; i++) {
+			uint8_t c = label[i];
+			if (c == '.' || c == '\\' || c <= ' ' || c > '~') {
+				if (out_len + 4 >= size) {
+					return -1;
+				}
+				snprintf(out + out_len, 5, "\\%03d", c);
+				out_len += 4;
+			}
+			else {
+				if (out_len + 1 >= size) {
+					return -1;
+				}
+				out[out_len++] = c;
+			}
+		}
+	}
+
+	if (size == 0) {
+		return -1;
+	}
+	out[out_len] = '\0';
+	return out_len;
+}
+
+DNSName dns_wire_name(const uint8_t *wire, int length) {
+	DNSName name = {wire, length, 0};
+	return name;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Moves on to the next section with entries in it, once the current one has
+ * been read.
+ */
+static void next_section(DNSParser *p) {
+	while (p->left == 0 && p->section < DNS_SECTION_ADDITIONAL) {
+		p->section++;
+		p->left = p->counts[p->section];
+	}
+}
+
+bool dns_parse_header(DNSParser *p, const uint8_t *msg, int length) {
+	memset(p, 0, sizeof(DNSParser));
+	p->msg = msg;
+	p->length = length;
+	if (length < HEADER_SIZE || length > DNS_MAX_MESSAGE_SIZE) {
+		p->error = true;
+		return false;
+	}
+
+	p->id = get_u16(msg);
+	p->flags = get_u16(msg + 2);
+	for (int i = 0; i < 4; i++) {
+		p->counts[i] = get_u16(msg + 4 + 2*i);
+	}
+	p->pos = HEADER_SIZE;
+	p->section = DNS_SECTION_QUESTION;
+	p->left = p->counts[DNS_SECTION_QUESTION];
+	next_section(p);
+	return true;
+}
+
+bool dns_parse_question(DNSParser *p, DNSName *name, uint16_t *qtype,
+		uint16_t *qclass) {
+	if (p->error || p->section != DNS_SECTION_QUESTION || p->left == 0) {
+		return false;
+	}
+
+	DNSName qname = {p->msg, p->length, p->pos};
+	int end = dns_name_skip(qname);
+	if (end < 0 || end + 4 > p->length) {
+		p->error = true;
+		return false;
+	}
+
+	*name = qname;
+	*qtype = get_u16(p->msg + end);
+	*qclass = get_u16(p->msg + end + 2);
+	p->pos = end + 4;
+	p->left--;
+	next_section(p);
+	return true;
+}
+
+bool dns_parse_record(DNSParser *p, DNSRecordView *rr) {
+	while (p->section == DNS_SECTION_QUESTION && p->left > 0) {
+		DNSName name;
+		uint16_t qtype, qclass;
+		if (!dns_parse_question(p, &name, &qtype, &qclass)) {
+			return false;
+		}
+	}
+	if (p->error || p->left == 0) {
+		return false;
+	}
+
+	DNSName name = {p->msg, p->length, p->pos};
+	int end = dns_name_skip(name);
+	if (end < 0 || end + 10 > p->length) {
+		p->error = true;
+		return false;
+	}
+
+	const uint8_t *fixed = p->msg + end;
+	rr->section = p->section;
+	rr->name = name;
+	rr->type = get_u16(fixed);
+	rr->class = get_u16(fixed + 2);
+	rr->ttl = get_u32(fixed + 4);
+	rr->rdlength = get_u16(fixed + 8);
+	rr->rdata_offset = end + 10;
+	rr->rdata = p->msg + rr->rdata_offset;
+	if (rr->rdata_offset + rr->rdlength > p->length) {
+		p->error = true;
+		return false;
+	}
+
+	// RFC 2181, section 8: a TTL with the top bit set is treated as zero.
+	if (rr->ttl & 0x80000000u) {
+		rr->ttl = 0;
+	}
+
+	p->pos = rr->rdata_offset + rr->rdlength;
+	p->left--;
+	next_section(p);
+	return true;
+}
+
+int dns_rdata_name(const DNSRecordView *rr, int offset, DNSName *name) {
+	if (offset < 0 || offset >= rr->rdlength) {
+		return -1;
+	}
+
+	name->msg = rr->name.msg;
+	name->length = rr->name.length;
+	name->offset = rr->rdata_offset + offset;
+	int end = dns_name_skip(*name);
+	if (end < 0 || end > rr->rdata_offset + rr->rdlength) {
+		return -1;
+	}
+	return end - rr->rdata_offset;
+}
@@ -0,0 +1,174 @@
+/*
+ * File: dns_parse.h
+ *
+ * Header / API file for reading DNS messages.
+ *
+ * A DNSParser walks a message from front to back like a cursor, handing out
+ * each question and resource record as a view into the message: nothing is
+ * copied until the caller asks for it. Every read is checked against the end
+ * of the message, and names are checked as they are followed: compression
+ * pointers must point backwards, there may only be DNS_MAX_POINTER_HOPS of
+ * them, and a name may not be longer than DNS_MAX_NAME_WIRE bytes. A
+ * malformed or hostile message therefore can't make the parser loop forever
+ * or read outside the buffer; it just fails to parse.
+ */
+#ifndef DNS_PARSE_H
+#define DNS_PARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest message we'll parse (the most a TCP length prefix allows).
+#define DNS_MAX_MESSAGE_SIZE 65535
+
+// Longest name in wire format, including its length bytes (RFC 1035).
+#define DNS_MAX_NAME_WIRE 255
+
+// Most compression pointers we'll follow in one name.
+#define DNS_MAX_POINTER_HOPS 32
+
+typedef enum DNSSection {
+	DNS_SECTION_QUESTION,
+	DNS_SECTION_ANSWER,
+	DNS_SECTION_AUTHORITY,
+	DNS_SECTION_ADDITIONAL
+} DNSSection;
+
+/**
+ * A name somewhere in a message (or in any buffer holding wire format names),
+ * possibly compressed.
+ */
+typedef struct DNSName {
+	const uint8_t *msg;
+	int length;		// size of msg
+	int offset;		// where the name starts in msg
+} DNSName;
+
+/**
+ * A resource record in a message. rdata points into the message, so any
+ * names in it may be compressed: use dns_rdata_name to read them.
+ */
+typedef struct DNSRecordView {
+	DNSSection section;
+	DNSName name;
+	uint16_t type;
+	uint16_t class;
+	uint32_t ttl;
+	uint16_t rdlength;
+	int rdata_offset;	// offset of the data in the message
+	const uint8_t *rdata;
+} DNSRecordView;
+
+/**
+ * A cursor over a message.
+ */
+typedef struct DNSParser {
+	const uint8_t *msg;
+	int length;
+	int pos;
+
+	uint16_t id;
+	uint16_t flags;
+	uint16_t counts[4];	// number of entries in each DNSSection
+
+	DNSSection section;	// section of the next entry
+	int left;			// entries left in that section
+	bool error;			// set once anything malformed is found
+} DNSParser;
+
+/**
+ * Starts parsing a message by reading its header.
+ *
+ * @param p The parser to set up.
+ * @param msg The message.
+ * @param length Size of the message in bytes.
+ * @return False if the message is too short or too long to be valid.
+ */
+bool dns_parse_header(DNSParser *p, const uint8_t *msg, int length);
+
+/**
+ * Reads the next question.
+ *
+ * @param p The parser.
+ * @param name Set to the question's name.
+ * @param qtype Set to the question's type.
+ * @param qclass Set to the question's class.
+ * @return False if there are no more questions, or (with p->error set) the
+ * 		question is malformed.
+ */
+bool dns_parse_question(DNSParser *p, DNSName *name, uint16_t *qtype,
+		uint16_t *qclass);
+
+/**
+ * Reads the next resource record from the answer, authority or additional
+ * sections, skipping any questions that haven't been read.
+ *
+ * @param p The parser.
+ * @param rr Set to the record.
+ * @return False if there are no more records, or (with p->error set) the
+ * 		record is malformed.
+ */
+bool dns_parse_record(DNSParser *p, DNSRecordView *rr);
+
+/**
+ * Finds a name inside a record's data.
+ *
+ * @param rr The record.
+ * @param offset Where the name starts, relative to the start of the data.
+ * @param name Set to the name.
+ * @return The offset just after the name (relative to the start of the data),
+ * 		or -1 if the name is malformed or runs past the end of the data.
+ */
+int dns_rdata_name(const DNSRecordView *rr, int offset, DNSName *name);
+
+/**
+ * Checks that a name is well formed and finds where it ends.
+ *
+ * @param name The name.
+ * @return The offset just after the name where it appears (i.e. after its
+ * 		first compression pointer, if it has one), or -1 if it is malformed.
+ */
+int dns_name_skip(DNSName name);
+
+/**
+ * Compares two names without decompressing them. Case is ignored, as DNS
+ * requires.
+ *
+ * @return True if both are valid and equal.
+ */
+bool dns_name_equal(DNSName a, DNSName b);
+
+/**
+ * Copies a name into a buffer in uncompressed wire format.
+ *
+ * @param name The name.
+ * @param out Where to write it (at least DNS_MAX_NAME_WIRE bytes).
+ * @return The number of bytes written, or -1 if the name is malformed.
+ */
+int dns_name_to_wire(DNSName name, uint8_t *out);
+
+/**
+ * Converts a name to a normal C-style string (e.g. www.sandiego.edu), with
+ * no trailing dot; the root becomes "". Characters that would be ambiguous
+ * in a string (dots inside labels, and unprintable bytes) are written as
+ * \DDD escapes, as in zone files.
+ *
+ * @param name The name.
+ * @param out Where to write the string.
+ * @param size Size of out in bytes.
+ * @return The length of the string, or -1 if the name is malformed or the
+ * 		string doesn't fit.
+ */
+int dns_name_to_string(DNSName name, char *out, size_t size);
+
+/**
+ * Makes a DNSName for a name stored on its own in uncompressed wire format
+ * (e.g. in cached record data).
+ *
+ * @param wire The name.
+ * @param length Size of the buffer it is in.
+ */
+DNSName dns_wire_name(const uint8_t *wire, int length);
+
+#endif
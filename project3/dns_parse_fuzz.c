@@ -0,0 +1,138 @@
+/*
+ * File: dns_parse_fuzz.c
+ *
+ * Fuzz harness for the DNS message parser (dns_parse.h) and the response
+ * reader built on it (dns_response.h).
+ *
+ * Every input is treated as a received message: each question and record is
+ * walked, every name in it is checked, compared, copied and converted to a
+ * string, and the names inside the data of the record types that have them
+ * are followed. Under ASan/UBSan, any read outside the message or any other
+ * undefined behaviour shows up as a crash; a loop shows up as a timeout.
+ *
+ * Built with -DDNS_FUZZ_LIBFUZZER, this is just the libFuzzer entry point.
+ * Otherwise it has a main that runs each file named on the command line (or
+ * standard input, if there are none) through it, which is what AFL wants
+ * and how a crashing input is replayed. See the Makefile's fuzz targets.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dns.h"
+#include "dns_parse.h"
+#include "dns_response.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/*
+ * Exercises everything that can be done with a name from a message.
+ */
+static void check_name(DNSName name, DNSName question) {
+	uint8_t wire[DNS_MAX_NAME_WIRE];
+	char str[4 * DNS_MAX_NAME_WIRE + 1];
+
+	int end = dns_name_skip(name);
+	int wire_len = dns_name_to_wire(name, wire);
+	int str_len = dns_name_to_string(name, str, sizeof(str));
+	dns_name_equal(name, question);
+
+	// A name is valid to all of them or to none.
+	if ((end < 0) != (wire_len < 0) || (end < 0) != (str_len < 0)) {
+		abort();
+	}
+
+	// Copying it out must give the same name back.
+	if (wire_len > 0 && !dns_name_equal(name, dns_wire_name(wire, wire_len))) {
+		abort();
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	if (size > DNS_MAX_MESSAGE_SIZE) {
+		return 0;
+	}
+
+	DNSParser parser;
+	if (!dns_parse_header(&parser, data, (int)size)) {
+		return 0;
+	}
+
+	DNSName question = dns_wire_name((const uint8_t*)"", 1);
+	DNSName name;
+	uint16_t qtype, qclass;
+	while (dns_parse_question(&parser, &name, &qtype, &qclass)) {
+		check_name(name, question);
+		question = name;
+	}
+
+	DNSRecordView rr;
+	while (dns_parse_record(&parser, &rr)) {
+		check_name(rr.name, question);
+
+		// The names inside the data of the types that have them.
+		int offset = -1;
+		switch (rr.type) {
+			case DNS_TYPE_NS:
+			case DNS_TYPE_CNAME:
+			case DNS_TYPE_PTR:
+			case DNS_TYPE_SOA:
+				offset = 0;
+				break;
+			case DNS_TYPE_MX:
+				offset = 2;
+				break;
+			case DNS_TYPE_SRV:
+				offset = 6;
+				break;
+		}
+		int next = offset < 0 ? -1 : dns_rdata_name(&rr, offset, &name);
+		if (next >= 0) {
+			check_name(name, question);
+			if (rr.type == DNS_TYPE_SOA && dns_rdata_name(&rr, next, &name) >= 0) {
+				check_name(name, question);
+			}
+		}
+	}
+
+	// The copying reader goes over the same message again. Its result is
+	// big, so it isn't put on the stack.
+	static DNSResponse resp;
+	if (dns_response_parse(data, (int)size, &resp)) {
+		for (int i = 0; i < resp.num_records; i++) {
+			free(dns_record_to_string(resp.records[i].type,
+						&resp.records[i].data));
+		}
+	}
+	return 0;
+}
+
+#ifndef DNS_FUZZ_LIBFUZZER
+
+/*
+ * Runs the contents of a file through the harness.
+ */
+static void run_file(FILE *file) {
+	static uint8_t buf[DNS_MAX_MESSAGE_SIZE + 1];
+	size_t size = fread(buf, 1, sizeof(buf), file);
+	LLVMFuzzerTestOneInput(buf, size);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		run_file(stdin);
+		return 0;
+	}
+	for (int i = 1; i < argc; i++) {
+		FILE *file = fopen(argv[i], "rb");
+		if (file == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		run_file(file);
+		fclose(file);
+	}
+	return 0;
+}
+
+#endif
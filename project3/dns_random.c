@@ -0,0 +1,115 @@
+/*
+ * File: dns_random.c
+ *
+ * Implementation of the per-thread random number generator.
+ *
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dns_random.h"
+
+#define BIND_ATTEMPTS 16
+
+static _Thread_local uint64_t state[4];
+static _Thread_local uint32_t outputs_left;	// until the next reseed
+
+static uint64_t rotl(uint64_t x, int k) {
+	return (x << k) | (x >> (64 - k));
+}
+
+/*
+ * splitmix64, used to spread a weak seed over the whole state.
+ */
+static uint64_t splitmix(uint64_t *x) {
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+static void reseed(void) {
+	if (getrandom(state, sizeof(state), GRND_NONBLOCK) != sizeof(state)) {
+		// No kernel randomness (yet): fall back on what we can find, mixed
+		// into whatever the state already held.
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		uint64_t seed = state[0] ^ ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec
+				^ ((uint64_t)getpid() << 16) ^ (uintptr_t)&ts;
+		for (int i = 0; i < 4; i++) {
+			state[i] = splitmix(&seed);
+		}
+	}
+	// xoshiro's state must not be all zero.
+	if ((state[0] | state[1] | state[2] | state[3]) == 0) {
+		state[0] = 1;
+	}
+	outputs_left = DNS_RANDOM_RESEED;
+}
+
+uint64_t dns_random(void) {
+	if (outputs_left == 0) {
+		reseed();
+	}
+	outputs_left--;
+
+	// xoshiro256** (Blackman and Vigna)
+	uint64_t result = rotl(state[1] * 5, 7) * 9;
+	uint64_t t = state[1] << 17;
+	state[2] ^= state[0];
+	state[3] ^= state[1];
+	state[1] ^= state[2];
+	state[0] ^= state[3];
+	state[2] ^= t;
+	state[3] = rotl(state[3], 45);
+	return result;
+}
+
+uint32_t dns_random_below(uint32_t n) {
+	// Lemire's method: scale a 32-bit number up to [0, n), redrawing the
+	// few values that would make some results more likely than others.
+	uint64_t m = (uint64_t)(uint32_t)dns_random() * n;
+	if ((uint32_t)m < n) {
+		uint32_t threshold = -n % n;
+		while ((uint32_t)m < threshold) {
+			m = (uint64_t)(uint32_t)dns_random() * n;
+		}
+	}
+	return m >> 32;
+}
+
+uint16_t dns_random_id(void) {
+	return dns_random() >> 48;
+}
+
+int dns_random_bind(int sock) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	for (int i = 0; i <= BIND_ATTEMPTS; i++) {
+		// The last try leaves it to the kernel.
+		uint16_t port = (i < BIND_ATTEMPTS) ? DNS_RANDOM_MIN_PORT
+				+ dns_random_below(65536 - DNS_RANDOM_MIN_PORT) : 0;
+		addr.sin_port = htons(port);
+		if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+			socklen_t len = sizeof(addr);
+			if (getsockname(sock, (struct sockaddr*)&addr, &len) < 0) {
+				return -1;
+			}
+			return ntohs(addr.sin_port);
+		}
+		if (errno != EADDRINUSE) {
+			return -1;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,53 @@
+/*
+ * File: dns_random.h
+ *
+ * Header / API file for the random numbers that make spoofing hard.
+ *
+ * Anyone who can send packets can try to slip a forged response in ahead of
+ * a server's real one, and it will be accepted if it has the right
+ * transaction ID and arrives at the right port. Choosing both at random for
+ * every query means a forger has to guess from about 2^32 combinations
+ * instead of knowing them (RFC 5452).
+ *
+ * The numbers come from xoshiro256**, which is fast enough to call for every
+ * query. Each thread has its own generator, seeded from the kernel's random
+ * source and reseeded from it every DNS_RANDOM_RESEED outputs, so watching
+ * IDs go by doesn't give away the ones to come for long.
+ */
+#ifndef DNS_RANDOM_H
+#define DNS_RANDOM_H
+
+#include <stdint.h>
+
+#define DNS_RANDOM_RESEED 65536
+
+// Source ports are picked from the ports above the privileged ones.
+#define DNS_RANDOM_MIN_PORT 1024
+
+/**
+ * @return 64 random bits.
+ */
+uint64_t dns_random(void);
+
+/**
+ * @param n The number of possible values (at least 1).
+ * @return A random number from 0 to n - 1, without bias.
+ */
+uint32_t dns_random_below(uint32_t n);
+
+/**
+ * @return A random transaction ID.
+ */
+uint16_t dns_random_id(void);
+
+/**
+ * Binds an IPv4 UDP socket to a random port, trying a few in case the first
+ * ones picked are in use. If they all are, the kernel picks the port.
+ *
+ * @param sock The socket.
+ * @return The port (in host byte order), or -1 if the socket couldn't be
+ * 		bound.
+ */
+int dns_random_bind(int sock);
+
+#endif
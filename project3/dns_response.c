@@ -0,0 +1,349 @@
+/*
+ * File: dns_response.c
+ *
+ * Implementation of DNS response parsing and record formatting.
+ *
+ */
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dns.h"
+#include "dns_response.h"
+
+static const struct {
+	uint16_t type;
+	const char *name;
+} type_names[] = {
+	{DNS_TYPE_A, "A"},
+	{DNS_TYPE_NS, "NS"},
+	{DNS_TYPE_CNAME, "CNAME"},
+	{DNS_TYPE_SOA, "SOA"},
+	{DNS_TYPE_PTR, "PTR"},
+	{DNS_TYPE_MX, "MX"},
+	{DNS_TYPE_TXT, "TXT"},
+	{DNS_TYPE_AAAA, "AAAA"},
+	{DNS_TYPE_SRV, "SRV"}
+};
+
+#define NUM_TYPE_NAMES (sizeof(type_names) / sizeof(type_names[0]))
+
+/**
+ * Copies a (possibly compressed) name in a record's data into the response's
+ * rdata area in uncompressed DNS format.
+ *
+ * @param rr The record.
+ * @param offset Where the name starts in the record's data.
+ * @param resp The response whose rdata area gets the name.
+ * @return The offset in the record's data just after the name, or -1 if the
+ * 		name is malformed or the rdata area is full.
+ */
+static int append_name(const DNSRecordView *rr, int offset,
+		DNSResponse *resp) {
+	if (resp->rdata_used + DNS_MAX_NAME_WIRE > DNS_RESPONSE_MAX_RDATA) {
+		return -1;
+	}
+
+	DNSName name;
+	int end = dns_rdata_name(rr, offset, &name);
+	if (end < 0) {
+		return -1;
+	}
+	resp->rdata_used += dns_name_to_wire(name, resp->rdata + resp->rdata_used);
+	return end;
+}
+
+/**
+ * Copies plain bytes from a record's data into the response's rdata area.
+ *
+ * @return The offset in the record's data just after the bytes, or -1 if they
+ * 		run past the end of the data or there isn't room for them.
+ */
+static int append_bytes(const DNSRecordView *rr, int offset, int length,
+		DNSResponse *resp) {
+	if (offset < 0 || offset + length > rr->rdlength
+			|| resp->rdata_used + length > DNS_RESPONSE_MAX_RDATA) {
+		return -1;
+	}
+	memcpy(resp->rdata + resp->rdata_used, rr->rdata + offset, length);
+	resp->rdata_used += length;
+	return offset + length;
+}
+
+/**
+ * Copies a record's data into the response's rdata area, uncompressing any
+ * names in it so that it can be understood on its own.
+ *
+ * @param view The record in the message.
+ * @param rr The parsed record, whose data field gets filled in.
+ * @param resp The response that rr belongs to.
+ * @return False if the data is malformed or doesn't fit.
+ */
+static bool copy_rdata(const DNSRecordView *view, DNSResourceRecord *rr,
+		DNSResponse *resp) {
+	int start = resp->rdata_used;
+	int end;
+
+	switch (rr->type) {
+		case DNS_TYPE_NS:
+		case DNS_TYPE_CNAME:
+		case DNS_TYPE_PTR:
+			end = append_name(view, 0, resp);
+			break;
+
+		case DNS_TYPE_MX:
+			end = append_name(view, append_bytes(view, 0, 2, resp), resp);
+			break;
+
+		case DNS_TYPE_SRV:
+			end = append_name(view, append_bytes(view, 0, 6, resp), resp);
+			break;
+
+		case DNS_TYPE_SOA:
+			// two names (primary server and admin mailbox), then five numbers
+			end = append_name(view, 0, resp);
+			end = append_name(view, end, resp);
+			end = append_bytes(view, end, 20, resp);
+			break;
+
+		default:
+			end = append_bytes(view, 0, view->rdlength, resp);
+	}
+
+	rr->data.rdata = resp->rdata + start;
+	rr->data.rdlength = resp->rdata_used - start;
+	return end == view->rdlength;
+}
+
+bool dns_response_parse(const uint8_t *message, int length,
+		DNSResponse *resp) {
+	DNSParser parser;
+	if (!dns_parse_header(&parser, message, length)) {
+		return false;
+	}
+
+	resp->id = parser.id;
+	resp->flags = parser.flags;
+	resp->rcode = resp->flags & DNS_RCODE_MASK;
+	resp->num_records = 0;
+	resp->rdata_used = 0;
+
+	// A response repeats the (single) question it answers.
+	DNSName qname;
+	uint16_t qclass;
+	if (parser.counts[DNS_SECTION_QUESTION] != 1
+			|| !dns_parse_question(&parser, &qname, &resp->qtype, &qclass)) {
+		return false;
+	}
+	dns_name_to_wire(qname, resp->qname);
+
+	DNSCacheRank section_ranks[] = {
+		[DNS_SECTION_ANSWER] = DNS_RANK_ANSWER,
+		[DNS_SECTION_AUTHORITY] = DNS_RANK_AUTHORITY,
+		[DNS_SECTION_ADDITIONAL] = DNS_RANK_ADDITIONAL
+	};
+
+	DNSRecordView view;
+	while (resp->num_records < DNS_RESPONSE_MAX_RECORDS
+			&& dns_parse_record(&parser, &view)) {
+		// EDNS0 pseudo-records aren't real data, and we only handle the
+		// Internet class.
+		if (view.type == DNS_TYPE_OPT || view.class != DNS_CLASS_IN) {
+			continue;
+		}
+
+		DNSResourceRecord *rr = &resp->records[resp->num_records];
+		rr->type = view.type;
+		rr->ttl = view.ttl;
+		rr->section = section_ranks[view.section];
+		if (dns_name_to_string(view.name, rr->name, sizeof(rr->name)) < 0
+				|| !copy_rdata(&view, rr, resp)) {
+			return false;
+		}
+		resp->num_records++;
+	}
+
+	// Past DNS_RESPONSE_MAX_RECORDS we keep what we have; the rest is extra.
+	return !parser.error;
+}
+
+void dns_response_follow_cnames(const DNSResponse *resp, char *name) {
+	for (int hops = 0; hops < DNS_MAX_CNAME_CHAIN; hops++) {
+		bool found = false;
+		for (int i = 0; i < resp->num_records && !found; i++) {
+			const DNSResourceRecord *rr = &resp->records[i];
+			if (rr->section == DNS_RANK_ANSWER && rr->type == DNS_TYPE_CNAME
+					&& strcasecmp(rr->name, name) == 0) {
+				found = dns_record_name_string(&rr->data, 0, name);
+			}
+		}
+		if (!found) {
+			return;
+		}
+	}
+}
+
+int dns_response_answers(const DNSResponse *resp, const char *name,
+		uint16_t qtype, const DNSResourceRecord **answers, int max) {
+	char target[DNS_CACHE_MAX_NAME + 1];
+	strncpy(target, name, DNS_CACHE_MAX_NAME);
+	target[DNS_CACHE_MAX_NAME] = '\0';
+	if (qtype != DNS_TYPE_CNAME) {
+		dns_response_follow_cnames(resp, target);
+	}
+
+	int count = 0;
+	for (int i = 0; i < resp->num_records && count < max; i++) {
+		const DNSResourceRecord *rr = &resp->records[i];
+		if (rr->section == DNS_RANK_ANSWER && rr->type == qtype
+				&& strcasecmp(rr->name, target) == 0) {
+			answers[count++] = rr;
+		}
+	}
+	return count;
+}
+
+bool dns_record_name_string(const DNSCacheRecord *data, int offset,
+		char *out) {
+	if (offset >= data->rdlength) {
+		return false;
+	}
+	DNSName name = dns_wire_name(data->rdata + offset,
+			data->rdlength - offset);
+	return dns_name_to_string(name, out, DNS_CACHE_MAX_NAME + 1) >= 0;
+}
+
+/*
+ * Formats the character-strings of a TXT record as quoted strings separated
+ * by spaces, escaping quotes, backslashes and unprintable bytes.
+ */
+static char *txt_to_string(const DNSCacheRecord *data) {
+	// At worst every byte becomes a four character \DDD escape, and every
+	// string (which takes at least one byte) adds two quotes and a space.
+	char *str = malloc(7 * data->rdlength + 1);
+	if (str == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	int len = 0;
+	int pos = 0;
+	while (pos < data->rdlength) {
+		int string_len = data->rdata[pos++];
+		if (pos + string_len > data->rdlength) {
+			free(str);
+			return NULL;
+		}
+		if (len > 0) {
+			str[len++] = ' ';
+		}
+		str[len++] = '"';
+		for (int i = 0; i < string_len; i++) {
+			uint8_t c = data->rdata[pos + i];
+			if (c == '"' || c == '\\') {
+				str[len++] = '\\';
+				str[len++] = c;
+			}
+			else if (c < 0x20 || c > 0x7e) {
+				len += sprintf(str + len, "\\%03d", c);
+			}
+			else {
+				str[len++] = c;
+			}
+		}
+		str[len++] = '"';
+		pos += string_len;
+	}
+	str[len] = '\0';
+	return str;
+}
+
+/*
+ * Formats record data in the generic "\# length hex" form (RFC 3597).
+ */
+static char *generic_to_string(const DNSCacheRecord *data) {
+	char *str = malloc(16 + 2 * data->rdlength);
+	if (str == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	int len = sprintf(str, "\\# %d%s", data->rdlength,
+			data->rdlength > 0 ? " " : "");
+	for (int i = 0; i < data->rdlength; i++) {
+		len += sprintf(str + len, "%02x", data->rdata[i]);
+	}
+	return str;
+}
+
+char *dns_record_to_string(uint16_t type, const DNSCacheRecord *data) {
+	char str[DNS_CACHE_MAX_NAME + 32];
+
+	switch (type) {
+		case DNS_TYPE_A:
+			if (data->rdlength != 4 || inet_ntop(AF_INET, data->rdata, str,
+						sizeof(str)) == NULL) {
+				return NULL;
+			}
+			break;
+
+		case DNS_TYPE_AAAA:
+			if (data->rdlength != 16 || inet_ntop(AF_INET6, data->rdata, str,
+						sizeof(str)) == NULL) {
+				return NULL;
+			}
+			break;
+
+		case DNS_TYPE_NS:
+		case DNS_TYPE_CNAME:
+		case DNS_TYPE_PTR:
+			if (!dns_record_name_string(data, 0, str)) {
+				return NULL;
+			}
+			break;
+
+		case DNS_TYPE_MX:
+			// skip the preference
+			if (!dns_record_name_string(data, 2, str)) {
+				return NULL;
+			}
+			break;
+
+		case DNS_TYPE_SRV: {
+			char target[DNS_CACHE_MAX_NAME + 1];
+			if (!dns_record_name_string(data, 6, target)) {
+				return NULL;
+			}
+			const uint8_t *p = data->rdata;
+			snprintf(str, sizeof(str), "%d %d %d %s", (p[0] << 8) | p[1],
+					(p[2] << 8) | p[3], (p[4] << 8) | p[5], target);
+			break;
+		}
+
+		case DNS_TYPE_TXT:
+			return txt_to_string(data);
+
+		default:
+			return generic_to_string(data);
+	}
+	return strdup(str);
+}
+
+uint16_t dns_type_from_name(const char *name) {
+	for (size_t i = 0; i < NUM_TYPE_NAMES; i++) {
+		if (strcasecmp(type_names[i].name, name) == 0) {
+			return type_names[i].type;
+		}
+	}
+	return 0;
+}
+
+const char *dns_type_name(uint16_t type) {
+	for (size_t i = 0; i < NUM_TYPE_NAMES; i++) {
+		if (type_names[i].type == type) {
+			return type_names[i].name;
+		}
+	}
+	return NULL;
+}
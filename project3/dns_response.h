@@ -0,0 +1,129 @@
+/*
+ * File: dns_response.h
+ *
+ * Header / API file for reading the records out of a DNS response.
+ *
+ * Where dns_parse.h walks a message in place, this copies the question and
+ * resource records of a response into a DNSResponse, uncompressing any names
+ * inside record data so that each record can be understood (or cached)
+ * without the message it came from. It also has helpers for following CNAME
+ * chains in a response and for turning record data into text.
+ */
+#ifndef DNS_RESPONSE_H
+#define DNS_RESPONSE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dns_cache.h"
+#include "dns_parse.h"
+
+// Most resource records kept from one response, and the space available to
+// hold their data once any names in it are uncompressed.
+#define DNS_RESPONSE_MAX_RECORDS 64
+#define DNS_RESPONSE_MAX_RDATA (DNS_MAX_MESSAGE_SIZE \
+		+ 2 * DNS_RESPONSE_MAX_RECORDS * DNS_MAX_NAME_WIRE)
+
+// Longest CNAME chain that will be followed.
+#define DNS_MAX_CNAME_CHAIN 8
+
+/**
+ * A resource record from a response, with its name converted to a normal
+ * C-style string and any names in its data uncompressed.
+ */
+typedef struct DNSResourceRecord {
+	char name[DNS_CACHE_MAX_NAME + 1];
+	uint16_t type;
+	uint32_t ttl;
+	DNSCacheRank section;	// which section of the response it was in
+	DNSCacheRecord data;
+} DNSResourceRecord;
+
+/**
+ * The parts of a DNS response we care about.
+ */
+typedef struct DNSResponse {
+	uint16_t id;
+	uint16_t flags;
+	int rcode;
+	uint8_t qname[DNS_MAX_NAME_WIRE];	// the question, uncompressed
+	uint16_t qtype;
+	int num_records;
+	DNSResourceRecord records[DNS_RESPONSE_MAX_RECORDS];
+	int rdata_used;
+	uint8_t rdata[DNS_RESPONSE_MAX_RDATA];
+} DNSResponse;
+
+/**
+ * Parses the question and resource records out of a DNS response. Records
+ * past DNS_RESPONSE_MAX_RECORDS are left out.
+ *
+ * @param message The response.
+ * @param length The size of the response in bytes.
+ * @param resp Where to store the parsed response.
+ * @return False if the response is malformed.
+ */
+bool dns_response_parse(const uint8_t *message, int length,
+		DNSResponse *resp);
+
+/**
+ * Finds the name a CNAME chain starting at name ends up at, using the CNAME
+ * records in the answer section of a response.
+ *
+ * @param resp The response.
+ * @param name The name to start from (DNS_CACHE_MAX_NAME + 1 bytes); replaced
+ * 		by the end of the chain.
+ */
+void dns_response_follow_cnames(const DNSResponse *resp, char *name);
+
+/**
+ * Finds the answers to a question in a response: the answer section records
+ * of the type asked for, at the end of any CNAME chain.
+ *
+ * @param resp The response.
+ * @param name The name that was asked about.
+ * @param qtype The type that was asked about.
+ * @param answers Set to the records found.
+ * @param max Room in answers.
+ * @return The number of records found.
+ */
+int dns_response_answers(const DNSResponse *resp, const char *name,
+		uint16_t qtype, const DNSResourceRecord **answers, int max);
+
+/**
+ * Converts a name stored uncompressed in a record's data to a string.
+ *
+ * @param data The record's data.
+ * @param offset Where the name starts in the data.
+ * @param out Where to write the name (DNS_CACHE_MAX_NAME + 1 bytes).
+ * @return False if the name is malformed.
+ */
+bool dns_record_name_string(const DNSCacheRecord *data, int offset,
+		char *out);
+
+/**
+ * Converts a record's data to text: an IP address for A and AAAA records,
+ * the host name for NS, CNAME, PTR and MX (without its preference) records,
+ * "priority weight port target" for SRV records, and the quoted strings of
+ * TXT records. Other types are shown in the generic form of RFC 3597.
+ *
+ * @param type The type of the record.
+ * @param data The record's data (with uncompressed names).
+ * @return The string, which the caller must free, or NULL if the data isn't
+ * 		valid for its type.
+ */
+char *dns_record_to_string(uint16_t type, const DNSCacheRecord *data);
+
+/**
+ * @param name A record type's mnemonic, e.g. "AAAA" (case is ignored).
+ * @return The type's number, or 0 if it isn't one we know.
+ */
+uint16_t dns_type_from_name(const char *name);
+
+/**
+ * @param type A record type.
+ * @return Its mnemonic, or NULL if it isn't one we know.
+ */
+const char *dns_type_name(uint16_t type);
+
+#endif
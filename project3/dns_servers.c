@@ -0,0 +1,137 @@
+/*
+ * File: dns_servers.c
+ *
+ * Implementation of the per-server smoothed RTT table.
+ *
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dns_random.h"
+#include "dns_servers.h"
+
+#define TABLE_SIZE 1024	// must be a power of two
+#define MAX_PROBES 8
+
+// Servers we know nothing about start with a random SRTT below this.
+#define UNKNOWN_SRTT_MS 32
+
+#define FAILURE_PENALTY_MS 500
+#define MAX_SRTT_MS 10000
+
+typedef struct ServerEntry {
+	bool used;
+	in_addr_t addr;
+	int srtt_ms;
+} ServerEntry;
+
+static ServerEntry table[TABLE_SIZE];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Finds (or makes) the entry for a server. The table must be locked.
+ */
+static ServerEntry *find_server(in_addr_t addr) {
+	uint32_t slot = (addr * 2654435761u) & (TABLE_SIZE - 1);
+	for (int i = 0; i < MAX_PROBES; i++) {
+		ServerEntry *entry = &table[(slot + i) & (TABLE_SIZE - 1)];
+		if (entry->used && entry->addr == addr) {
+			return entry;
+		}
+		if (!entry->used) {
+			entry->used = true;
+			entry->addr = addr;
+			entry->srtt_ms = 1 + dns_random_below(UNKNOWN_SRTT_MS);
+			return entry;
+		}
+	}
+
+	// The neighbourhood is full, so forget about whoever lives here.
+	ServerEntry *entry = &table[slot];
+	entry->addr = addr;
+	entry->srtt_ms = 1 + dns_random_below(UNKNOWN_SRTT_MS);
+	return entry;
+}
+
+void dns_server_rtt_sample(struct in_addr addr, int rtt_ms) {
+	pthread_mutex_lock(&table_lock);
+	ServerEntry *entry = find_server(addr.s_addr);
+	entry->srtt_ms = (7 * entry->srtt_ms + rtt_ms) / 8;
+	pthread_mutex_unlock(&table_lock);
+}
+
+void dns_server_failed(struct in_addr addr) {
+	pthread_mutex_lock(&table_lock);
+	ServerEntry *entry = find_server(addr.s_addr);
+	entry->srtt_ms *= 2;
+	if (entry->srtt_ms < FAILURE_PENALTY_MS) {
+		entry->srtt_ms = FAILURE_PENALTY_MS;
+	}
+	if (entry->srtt_ms > MAX_SRTT_MS) {
+		entry->srtt_ms = MAX_SRTT_MS;
+	}
+	pthread_mutex_unlock(&table_lock);
+}
+
+int dns_server_srtt(struct in_addr addr) {
+	pthread_mutex_lock(&table_lock);
+	int srtt = find_server(addr.s_addr)->srtt_ms;
+	pthread_mutex_unlock(&table_lock);
+	return srtt;
+}
+
+void dns_servers_rank(struct in_addr *addrs, int count) {
+	if (count <= 0) {
+		return;
+	}
+	int srtt[count];
+
+	pthread_mutex_lock(&table_lock);
+	for (int i = 0; i < count; i++) {
+		srtt[i] = find_server(addrs[i].s_addr)->srtt_ms;
+	}
+
+	// insertion sort: there are only ever a handful of servers for a zone
+	for (int i = 1; i < count; i++) {
+		struct in_addr addr = addrs[i];
+		int rtt = srtt[i];
+		int j = i - 1;
+		while (j >= 0 && srtt[j] > rtt) {
+			addrs[j+1] = addrs[j];
+			srtt[j+1] = srtt[j];
+			j--;
+		}
+		addrs[j+1] = addr;
+		srtt[j+1] = rtt;
+	}
+
+	for (int i = 1; i < count; i++) {
+		ServerEntry *entry = find_server(addrs[i].s_addr);
+		entry->srtt_ms = entry->srtt_ms * 98 / 100;
+	}
+	pthread_mutex_unlock(&table_lock);
+}
+
+void dns_servers_foreach(DNSServerVisitor visit, void *arg) {
+	pthread_mutex_lock(&table_lock);
+	for (int i = 0; i < TABLE_SIZE; i++) {
+		if (table[i].used) {
+			struct in_addr addr = {table[i].addr};
+			visit(addr, table[i].srtt_ms, arg);
+		}
+	}
+	pthread_mutex_unlock(&table_lock);
+}
+
+void dns_server_set_srtt(struct in_addr addr, int srtt_ms) {
+	if (srtt_ms < 1) {
+		srtt_ms = 1;
+	}
+	if (srtt_ms > MAX_SRTT_MS) {
+		srtt_ms = MAX_SRTT_MS;
+	}
+	pthread_mutex_lock(&table_lock);
+	find_server(addr.s_addr)->srtt_ms = srtt_ms;
+	pthread_mutex_unlock(&table_lock);
+}
@@ -0,0 +1,75 @@
+/*
+ * File: dns_servers.h
+ *
+ * Header / API file for tracking how quickly each name server answers.
+ *
+ * Every answer from a server gives a sample of its round trip time (RTT),
+ * which is folded into a smoothed estimate (SRTT) for that server. When a zone
+ * has several servers, the resolver asks the one with the lowest SRTT first,
+ * so lookups get faster as the resolver learns which servers are close.
+ */
+#ifndef DNS_SERVERS_H
+#define DNS_SERVERS_H
+
+#include <netinet/in.h>
+
+/**
+ * Records how long a server took to answer a query.
+ *
+ * @param addr The server's address.
+ * @param rtt_ms The round trip time, in milliseconds.
+ */
+void dns_server_rtt_sample(struct in_addr addr, int rtt_ms);
+
+/**
+ * Records that a server didn't answer (or gave an unusable answer), making it
+ * less likely to be picked again soon.
+ *
+ * @param addr The server's address.
+ */
+void dns_server_failed(struct in_addr addr);
+
+/**
+ * @param addr A server's address.
+ * @return The server's smoothed RTT in milliseconds. Servers we haven't heard
+ * 		from yet get a small random value, so each is tried early on.
+ */
+int dns_server_srtt(struct in_addr addr);
+
+/**
+ * Sorts servers from fastest to slowest. The estimates for all but the first
+ * (the one that will be asked) are aged slightly, so that a server which was
+ * slow once still gets retried now and then.
+ *
+ * @param addrs The servers' addresses.
+ * @param count Number of servers.
+ */
+void dns_servers_rank(struct in_addr *addrs, int count);
+
+/**
+ * Called by dns_servers_foreach for each server with an SRTT estimate.
+ *
+ * @param addr The server's address.
+ * @param srtt_ms Its smoothed RTT in milliseconds.
+ * @param arg The argument given to dns_servers_foreach.
+ */
+typedef void (*DNSServerVisitor)(struct in_addr addr, int srtt_ms, void *arg);
+
+/**
+ * Calls visit for every server in the table. The table is locked meanwhile,
+ * so visit mustn't call the other functions here.
+ *
+ * @param visit The function to call.
+ * @param arg Passed on to visit.
+ */
+void dns_servers_foreach(DNSServerVisitor visit, void *arg);
+
+/**
+ * Sets a server's SRTT outright, e.g. to one saved by an earlier run.
+ *
+ * @param addr The server's address.
+ * @param srtt_ms The smoothed RTT in milliseconds.
+ */
+void dns_server_set_srtt(struct in_addr addr, int srtt_ms);
+
+#endif
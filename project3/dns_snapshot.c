@@ -0,0 +1,266 @@
+/*
+ * File: dns_snapshot.c
+ *
+ * Implementation of cache snapshots.
+ *
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dns.h"
+#include "dns_servers.h"
+#include "dns_snapshot.h"
+
+// Every RRset starts on a multiple of this, so its fields can be read in
+// place from the mapped file.
+#define ALIGNMENT 8
+
+/*
+ * A snapshot being put together in memory before it is written out.
+ */
+typedef struct SnapshotBuf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+} SnapshotBuf;
+
+/*
+ * Makes room for length more bytes at the end of the buffer.
+ *
+ * @return Where they go.
+ */
+static uint8_t *reserve(SnapshotBuf *buf, size_t length) {
+	if (buf->len + length > buf->size) {
+		while (buf->len + length > buf->size) {
+			buf->size *= 2;
+		}
+		buf->data = realloc(buf->data, buf->size);
+		if (buf->data == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	uint8_t *p = buf->data + buf->len;
+	buf->len += length;
+	return p;
+}
+
+static void save_server(struct in_addr addr, int srtt_ms, void *arg) {
+	SnapshotBuf *buf = arg;
+	DNSSnapshotServer entry = {addr.s_addr, srtt_ms};
+	memcpy(reserve(buf, sizeof(entry)), &entry, sizeof(entry));
+	((DNSSnapshotHeader*)buf->data)->num_servers++;
+}
+
+static void save_rrset(const char *name, const DNSRRset *rrset, void *arg) {
+	SnapshotBuf *buf = arg;
+	size_t name_len = strlen(name);
+
+	size_t size = sizeof(DNSSnapshotRRset) + name_len;
+	for (int i = 0; i < rrset->num_records; i++) {
+		size += 2 + rrset->records[i].rdlength;
+	}
+	size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+	uint8_t *p = reserve(buf, size);
+	DNSSnapshotRRset entry = {
+		.size = size,
+		.ttl = dns_rrset_ttl(rrset),
+		.type = rrset->type,
+		.num_records = rrset->num_records,
+		.rank = rrset->rank,
+		.negative = rrset->negative,
+		.rcode = rrset->rcode,
+		.name_len = name_len
+	};
+	memcpy(p, &entry, sizeof(entry));
+	memcpy(p + sizeof(entry), name, name_len);
+
+	uint8_t *q = p + sizeof(entry) + name_len;
+	for (int i = 0; i < rrset->num_records; i++) {
+		uint16_t rdlength = rrset->records[i].rdlength;
+		memcpy(q, &rdlength, 2);
+		memcpy(q + 2, rrset->records[i].rdata, rdlength);
+		q += 2 + rdlength;
+	}
+	memset(q, 0, p + size - q);
+	((DNSSnapshotHeader*)buf->data)->num_rrsets++;
+}
+
+/*
+ * Writes all of a buffer to a file.
+ */
+static bool write_all(int fd, const uint8_t *data, size_t length) {
+	while (length > 0) {
+		ssize_t n = write(fd, data, length);
+		if (n < 0) {
+			return false;
+		}
+		data += n;
+		length -= n;
+	}
+	return true;
+}
+
+bool dns_snapshot_save(DNSCache *cache, const char *path) {
+	SnapshotBuf buf = {NULL, 0, 1 << 16};
+	buf.data = malloc(buf.size);
+	if (buf.data == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	DNSSnapshotHeader *header = (DNSSnapshotHeader*)reserve(&buf, sizeof(*header));
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, DNS_SNAPSHOT_MAGIC, sizeof(header->magic));
+	header->saved_at = time(NULL);
+
+	dns_servers_foreach(save_server, &buf);
+	dns_cache_foreach(cache, save_rrset, &buf);
+	((DNSSnapshotHeader*)buf.data)->size = buf.len;
+
+	// Write a new file and rename it over the old one, so a crash part way
+	// through never leaves a truncated snapshot behind.
+	char tmp_path[4096];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path)
+			>= (int)sizeof(tmp_path)) {
+		fprintf(stderr, "%s: path too long\n", path);
+		free(buf.data);
+		return false;
+	}
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(tmp_path);
+		free(buf.data);
+		return false;
+	}
+	bool ok = write_all(fd, buf.data, buf.len) && fsync(fd) == 0;
+	if (close(fd) < 0 || !ok || rename(tmp_path, path) < 0) {
+		perror(tmp_path);
+		unlink(tmp_path);
+		free(buf.data);
+		return false;
+	}
+	free(buf.data);
+	return true;
+}
+
+/*
+ * Puts one saved RRset back in the cache, unless it has expired.
+ *
+ * @param entry The RRset, which has been checked to fit in its size.
+ * @param elapsed Seconds since the snapshot was saved.
+ * @param records Room for the RRset's records.
+ * @return False if the RRset is malformed.
+ */
+static bool load_rrset(DNSCache *cache, const DNSSnapshotRRset *entry,
+		uint64_t elapsed, DNSCacheRecord *records) {
+	const uint8_t *p = (const uint8_t*)(entry + 1);
+	const uint8_t *end = (const uint8_t*)entry + entry->size;
+	if (p + entry->name_len > end) {
+		return false;
+	}
+	char name[DNS_CACHE_MAX_NAME + 1];
+	memcpy(name, p, entry->name_len);
+	name[entry->name_len] = '\0';
+	p += entry->name_len;
+
+	for (int i = 0; i < entry->num_records; i++) {
+		if (end - p < 2) {
+			return false;
+		}
+		uint16_t rdlength;
+		memcpy(&rdlength, p, 2);
+		if (end - p - 2 < rdlength) {
+			return false;
+		}
+		records[i].rdlength = rdlength;
+		records[i].rdata = p + 2;
+		p += 2 + rdlength;
+	}
+
+	if (entry->ttl <= elapsed) {
+		return true;
+	}
+	uint32_t ttl = entry->ttl - elapsed;
+	if (entry->negative) {
+		dns_cache_insert_negative(cache, name, entry->type, entry->rcode, ttl);
+	}
+	else {
+		dns_cache_insert(cache, name, entry->type, ttl, entry->rank, records,
+				entry->num_records);
+	}
+	return true;
+}
+
+int dns_snapshot_load(DNSCache *cache, const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(DNSSnapshotHeader)) {
+		close(fd);
+		return -1;
+	}
+	size_t size = st.st_size;
+	const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	const DNSSnapshotHeader *header = (const DNSSnapshotHeader*)data;
+	size_t servers_end = sizeof(*header)
+			+ (size_t)header->num_servers * sizeof(DNSSnapshotServer);
+	if (memcmp(header->magic, DNS_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+			|| header->size != size || servers_end > size) {
+		fprintf(stderr, "%s: not a valid snapshot\n", path);
+		munmap((void*)data, size);
+		return -1;
+	}
+
+	// The wall clock is the only one that carries on across restarts. If it
+	// has gone backwards, just assume no time has passed.
+	uint64_t now = time(NULL);
+	uint64_t elapsed = (now > header->saved_at) ? now - header->saved_at : 0;
+
+	const DNSSnapshotServer *servers = (const DNSSnapshotServer*)(header + 1);
+	for (uint32_t i = 0; i < header->num_servers; i++) {
+		struct in_addr addr = {servers[i].addr};
+		dns_server_set_srtt(addr, servers[i].srtt_ms);
+	}
+
+	DNSCacheRecord *records = malloc(UINT16_MAX * sizeof(DNSCacheRecord));
+	if (records == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	int loaded = 0;
+	size_t offset = servers_end;
+	for (uint32_t i = 0; i < header->num_rrsets; i++) {
+		const DNSSnapshotRRset *entry = (const DNSSnapshotRRset*)(data + offset);
+		if (size - offset < sizeof(*entry) || entry->size < sizeof(*entry)
+				|| entry->size % ALIGNMENT != 0 || entry->size > size - offset
+				|| !load_rrset(cache, entry, elapsed, records)) {
+			fprintf(stderr, "%s: snapshot is corrupt\n", path);
+			break;
+		}
+		if (entry->ttl > elapsed) {
+			loaded++;
+		}
+		offset += entry->size;
+	}
+
+	free(records);
+	munmap((void*)data, size);
+	return loaded;
+}
@@ -0,0 +1,80 @@
+/*
+ * File: dns_snapshot.h
+ *
+ * Header / API file for saving the resolver's state to disk.
+ *
+ * A resolver that starts with an empty cache has to walk down from the root
+ * servers for every name it is asked about. To avoid that after a restart, the
+ * cache (answers, negative answers and the NS delegations and glue that lead
+ * to each zone's servers) and the servers' RTT estimates can be saved to a
+ * snapshot file and loaded back in when the resolver starts again.
+ *
+ * The file is laid out so that it can be mapped into memory and read in
+ * place, without a separate parsing step:
+ *
+ *   DNSSnapshotHeader
+ *   DNSSnapshotServer[num_servers]
+ *   num_rrsets RRsets, each a DNSSnapshotRRset, the owner name, and then for
+ *   every record a two byte length and the record's data, padded to a
+ *   multiple of 8 bytes.
+ *
+ * Numbers are in host byte order: a snapshot is only meant to be read by the
+ * machine that wrote it.
+ */
+#ifndef DNS_SNAPSHOT_H
+#define DNS_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dns_cache.h"
+
+#define DNS_SNAPSHOT_MAGIC "DNSSNAP1"
+
+typedef struct DNSSnapshotHeader {
+	char magic[8];
+	uint64_t saved_at;		// wall clock time (seconds since the epoch)
+	uint64_t size;			// of the whole file, in bytes
+	uint32_t num_servers;
+	uint32_t num_rrsets;
+} DNSSnapshotHeader;
+
+typedef struct DNSSnapshotServer {
+	uint32_t addr;			// in network byte order, like in_addr_t
+	int32_t srtt_ms;
+} DNSSnapshotServer;
+
+typedef struct DNSSnapshotRRset {
+	uint32_t size;			// including the name, records and padding
+	uint32_t ttl;			// seconds left when the snapshot was saved
+	uint16_t type;
+	uint16_t num_records;
+	uint8_t rank;
+	uint8_t negative;
+	uint8_t rcode;
+	uint8_t name_len;		// the name isn't NUL terminated
+} DNSSnapshotRRset;
+
+/**
+ * Writes the unexpired contents of a cache, and the server RTT estimates, to
+ * a snapshot file. The file is replaced atomically, so a reader never sees a
+ * half written one.
+ *
+ * @param cache The cache to save.
+ * @param path The file to write.
+ * @return True if the snapshot was written.
+ */
+bool dns_snapshot_save(DNSCache *cache, const char *path);
+
+/**
+ * Loads a snapshot into a cache and the server RTT table. The time since the
+ * snapshot was saved is taken off every TTL, and whatever has expired in the
+ * meantime is skipped.
+ *
+ * @param cache The cache to load into.
+ * @param path The snapshot file.
+ * @return The number of RRsets loaded, or -1 if there was no usable snapshot.
+ */
+int dns_snapshot_load(DNSCache *cache, const char *path);
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ * File: dns_tcp.c
+ *
+ * Implementation of pooled, pipelined DNS over TCP.
+ *
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dns_parse.h"
+#include "dns_tcp.h"
+
+// Room for the largest message and its length prefix.
+#define IN_BUF_SIZE (2 + DNS_MAX_MESSAGE_SIZE)
+
+// Room for messages queued by dns_tcp_queue.
+#define OUT_BUF_SIZE (64 * 1024)
+
+// Each thread has its own pool, so connections (and the order of the bytes
+// on them) are never shared between threads.
+static _Thread_local DNSTCPConn pool[DNS_TCP_POOL_SIZE];
+
+static long now_msec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Waits for a socket to become readable or writable.
+ *
+ * @return True if it did before the deadline.
+ */
+static bool wait_for(int fd, short events, long deadline) {
+	while (true) {
+		long left = deadline - now_msec();
+		if (left < 0) {
+			return false;
+		}
+		struct pollfd pfd = {fd, events, 0};
+		int ready = poll(&pfd, 1, left);
+		if (ready > 0) {
+			return true;
+		}
+		if (ready < 0 && errno != EINTR) {
+			perror("poll");
+			return false;
+		}
+	}
+}
+
+/*
+ * Starts connecting a non-blocking socket to a server.
+ *
+ * @param in_progress Set to whether the connection is still being set up.
+ * @return The socket, or -1 if connecting failed.
+ */
+static int start_connect(struct in_addr addr, uint16_t port,
+		bool *in_progress) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr = addr;
+	*in_progress = false;
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+		if (errno != EINPROGRESS) {
+			close(fd);
+			return -1;
+		}
+		*in_progress = true;
+	}
+	return fd;
+}
+
+/*
+ * @return False if a connection that was being set up failed.
+ */
+static bool connect_succeeded(int fd) {
+	int error;
+	socklen_t error_len = sizeof(error);
+	return getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0
+			&& error == 0;
+}
+
+/*
+ * Fills in a connection that has just been opened on fd.
+ */
+static void init_conn(DNSTCPConn *conn, int fd, struct in_addr addr,
+		uint16_t port) {
+	if (conn->in_buf == NULL && (conn->in_buf = malloc(IN_BUF_SIZE)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	conn->open = true;
+	conn->fd = fd;
+	conn->addr = addr;
+	conn->port = port;
+	conn->last_used = now_msec();
+	conn->num_queries = 0;
+	conn->connecting = false;
+	conn->in_start = 0;
+	conn->in_len = 0;
+	conn->out_len = 0;
+}
+
+/*
+ * Opens a non-blocking connection, waiting at most until deadline for it to
+ * be set up.
+ */
+static bool open_conn(DNSTCPConn *conn, struct in_addr addr, uint16_t port,
+		long deadline) {
+	bool in_progress;
+	int fd = start_connect(addr, port, &in_progress);
+	if (fd < 0) {
+		return false;
+	}
+	if (in_progress && (!wait_for(fd, POLLOUT, deadline)
+				|| !connect_succeeded(fd))) {
+		close(fd);
+		return false;
+	}
+	init_conn(conn, fd, addr, port);
+	return true;
+}
+
+DNSTCPConn *dns_tcp_connect(struct in_addr addr, uint16_t port,
+		int timeout_ms) {
+	long now = now_msec();
+	DNSTCPConn *victim = &pool[0];
+
+	for (int i = 0; i < DNS_TCP_POOL_SIZE; i++) {
+		DNSTCPConn *conn = &pool[i];
+		if (conn->open && now - conn->last_used >= DNS_TCP_IDLE_MS) {
+			dns_tcp_close(conn);
+		}
+		if (conn->open && conn->addr.s_addr == addr.s_addr
+				&& conn->port == port) {
+			conn->last_used = now;
+			return conn;
+		}
+
+		// Otherwise use a free place, or close the least recently used
+		// connection to make one.
+		if (victim->open && (!conn->open || conn->last_used < victim->last_used)) {
+			victim = conn;
+		}
+	}
+
+	if (victim->open) {
+		dns_tcp_close(victim);
+	}
+	return open_conn(victim, addr, port, now + timeout_ms) ? victim : NULL;
+}
+
+bool dns_tcp_send(DNSTCPConn *conn, const uint8_t *msg, int length,
+		int timeout_ms) {
+	long deadline = now_msec() + timeout_ms;
+	uint8_t prefix[2] = {length >> 8, length & 0xff};
+	int sent = 0;
+
+	while (sent < 2 + length) {
+		// Send whatever hasn't gone yet of the prefix and the message.
+		struct iovec parts[2];
+		struct msghdr hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = parts;
+		if (sent < 2) {
+			parts[hdr.msg_iovlen++] = (struct iovec){prefix + sent, 2 - sent};
+		}
+		int msg_sent = (sent > 2) ? sent - 2 : 0;
+		parts[hdr.msg_iovlen++] = (struct iovec){(uint8_t*)msg + msg_sent,
+				length - msg_sent};
+
+		// MSG_NOSIGNAL: a connection the server has closed should fail, not
+		// kill us with SIGPIPE.
+		ssize_t n = sendmsg(conn->fd, &hdr, MSG_NOSIGNAL);
+		if (n >= 0) {
+			sent += n;
+		}
+		else if ((errno != EAGAIN && errno != EINTR)
+				|| !wait_for(conn->fd, POLLOUT, deadline)) {
+			dns_tcp_close(conn);
+			return false;
+		}
+	}
+
+	conn->num_queries++;
+	conn->last_used = now_msec();
+	return true;
+}
+
+bool dns_tcp_open_async(DNSTCPConn *conn, struct in_addr addr,
+		uint16_t port) {
+	bool in_progress;
+	int fd = start_connect(addr, port, &in_progress);
+	if (fd < 0) {
+		return false;
+	}
+	if (conn->out_buf == NULL
+			&& (conn->out_buf = malloc(OUT_BUF_SIZE)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	init_conn(conn, fd, addr, port);
+	conn->connecting = in_progress;
+	return true;
+}
+
+bool dns_tcp_queue(DNSTCPConn *conn, const uint8_t *msg, int length) {
+	if (!conn->open || conn->out_len + 2 + length > OUT_BUF_SIZE) {
+		return false;
+	}
+	uint8_t *p = conn->out_buf + conn->out_len;
+	p[0] = length >> 8;
+	p[1] = length & 0xff;
+	memcpy(p + 2, msg, length);
+	conn->out_len += 2 + length;
+	conn->num_queries++;
+	return dns_tcp_flush(conn);
+}
+
+bool dns_tcp_flush(DNSTCPConn *conn) {
+	if (!conn->open) {
+		return false;
+	}
+	if (conn->connecting) {
+		struct pollfd pfd = {conn->fd, POLLOUT, 0};
+		if (poll(&pfd, 1, 0) == 0) {
+			return true; // still being set up
+		}
+		if (!connect_succeeded(conn->fd)) {
+			dns_tcp_close(conn);
+			return false;
+		}
+		conn->connecting = false;
+	}
+
+	int sent = 0;
+	while (sent < conn->out_len) {
+		// MSG_NOSIGNAL: as in dns_tcp_send.
+		ssize_t n = send(conn->fd, conn->out_buf + sent, conn->out_len - sent,
+				MSG_NOSIGNAL);
+		if (n >= 0) {
+			sent += n;
+		}
+		else if (errno == EAGAIN) {
+			break;
+		}
+		else if (errno != EINTR) {
+			dns_tcp_close(conn);
+			return false;
+		}
+	}
+	memmove(conn->out_buf, conn->out_buf + sent, conn->out_len - sent);
+	conn->out_len -= sent;
+	conn->last_used = now_msec();
+	return true;
+}
+
+/*
+ * @return The length of the complete message at the front of the buffer, or
+ * 		-1 if it hasn't all arrived yet.
+ */
+static int buffered_message(DNSTCPConn *conn) {
+	if (conn->in_len < 2) {
+		return -1;
+	}
+	const uint8_t *p = conn->in_buf + conn->in_start;
+	int length = (p[0] << 8) | p[1];
+	return (conn->in_len >= 2 + length) ? length : -1;
+}
+
+int dns_tcp_recv(DNSTCPConn *conn, const uint8_t **msg) {
+	if (!conn->open) {
+		return -1;
+	}
+
+	int length = buffered_message(conn);
+	if (length < 0) {
+		// Make room by moving what's left of the buffer to the front: the
+		// largest message then always fits.
+		memmove(conn->in_buf, conn->in_buf + conn->in_start, conn->in_len);
+		conn->in_start = 0;
+
+		ssize_t n = recv(conn->fd, conn->in_buf + conn->in_len,
+				IN_BUF_SIZE - conn->in_len, 0);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+			dns_tcp_close(conn);
+			return -1;
+		}
+		if (n > 0) {
+			conn->in_len += n;
+		}
+		length = buffered_message(conn);
+	}
+	if (length < 0) {
+		return 0;
+	}
+
+	*msg = conn->in_buf + conn->in_start + 2;
+	conn->in_start += 2 + length;
+	conn->in_len -= 2 + length;
+	conn->last_used = now_msec();
+	return length;
+}
+
+void dns_tcp_close(DNSTCPConn *conn) {
+	if (conn->open) {
+		close(conn->fd);
+		conn->open = false;
+	}
+	conn->connecting = false;
+	conn->out_len = 0;
+}
+
+void dns_tcp_free(DNSTCPConn *conn) {
+	dns_tcp_close(conn);
+	free(conn->in_buf);
+	free(conn->out_buf);
+	conn->in_buf = NULL;
+	conn->out_buf = NULL;
+}
+
+int dns_tcp_query(struct in_addr addr, uint16_t port, const uint8_t *query,
+		int length, uint8_t *response, int size, int timeout_ms) {
+	long deadline = now_msec() + timeout_ms;
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		DNSTCPConn *conn = dns_tcp_connect(addr, port, timeout_ms);
+		if (conn == NULL) {
+			return -1;
+		}
+		bool reused = conn->num_queries > 0;
+		if (!dns_tcp_send(conn, query, length, deadline - now_msec())) {
+			if (reused) {
+				continue;
+			}
+			return -1;
+		}
+
+		while (true) {
+			const uint8_t *msg;
+			int msg_len = dns_tcp_recv(conn, &msg);
+			if (msg_len < 0) {
+				break; // closed: try a fresh connection if this one was old
+			}
+			if (msg_len == 0) {
+				if (!wait_for(conn->fd, POLLIN, deadline)) {
+					return -1;
+				}
+				continue;
+			}
+
+			// Answers to earlier queries that were given up on may still
+			// be on the way: skip them.
+			if (msg_len < 2 || msg[0] != query[0] || msg[1] != query[1]) {
+				continue;
+			}
+			if (msg_len > size) {
+				return -1;
+			}
+			memcpy(response, msg, msg_len);
+			return msg_len;
+		}
+		if (!reused) {
+			return -1;
+		}
+	}
+	return -1;
+}
+
+void dns_tcp_pool_free(void) {
+	for (int i = 0; i < DNS_TCP_POOL_SIZE; i++) {
+		dns_tcp_free(&pool[i]);
+	}
+}
@@ -0,0 +1,155 @@
+/*
+ * File: dns_tcp.h
+ *
+ * Header / API file for sending DNS messages over TCP.
+ *
+ * A server that can't fit its answer in a UDP datagram sets the TC flag, and
+ * the query has to be asked again over TCP. Connecting costs an extra round
+ * trip, so connections are pooled (RFC 7766): each thread keeps up to
+ * DNS_TCP_POOL_SIZE of them open, one per server, and reuses them for later
+ * queries. Queries can also be pipelined: several may be sent on a connection
+ * before any answers come back, and the answers, which may arrive in any
+ * order, are matched up by ID.
+ *
+ * A program with its own event loop can instead open a connection of its own
+ * with dns_tcp_open_async and send on it with dns_tcp_queue, neither of which
+ * ever waits.
+ */
+#ifndef DNS_TCP_H
+#define DNS_TCP_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Most connections each thread keeps open.
+#define DNS_TCP_POOL_SIZE 16
+
+// Connections unused for this long are assumed closed by the server.
+#define DNS_TCP_IDLE_MS 10000
+
+typedef struct DNSTCPConn {
+	bool open;
+	int fd;
+	struct in_addr addr;
+	uint16_t port;
+	long last_used;
+	int num_queries;	// sent since it was opened
+	bool connecting;	// opened with dns_tcp_open_async, and not set up yet
+
+	// Received bytes not handed out yet: the start of the next message(s),
+	// each with its two byte length prefix.
+	uint8_t *in_buf;
+	int in_start;
+	int in_len;
+
+	// Messages (with their length prefixes) given to dns_tcp_queue that
+	// haven't been sent yet.
+	uint8_t *out_buf;
+	int out_len;
+} DNSTCPConn;
+
+/**
+ * Gets an open connection to a server from this thread's pool, connecting if
+ * there isn't one already. The connection is non-blocking, so its fd can be
+ * watched with epoll for responses.
+ *
+ * @param addr The server's address.
+ * @param port The server's port (in host byte order).
+ * @param timeout_ms How long connecting may take.
+ * @return The connection, or NULL if it couldn't be made.
+ */
+DNSTCPConn *dns_tcp_connect(struct in_addr addr, uint16_t port,
+		int timeout_ms);
+
+/**
+ * Sends a message on a connection, with its length prefix.
+ *
+ * @param conn The connection.
+ * @param msg The message.
+ * @param length Size of the message in bytes.
+ * @param timeout_ms How long to wait if the connection's buffer is full.
+ * @return False (with the connection closed) if it couldn't be sent.
+ */
+bool dns_tcp_send(DNSTCPConn *conn, const uint8_t *msg, int length,
+		int timeout_ms);
+
+/**
+ * Starts opening a connection of the caller's own (not one from the pool),
+ * without waiting for it to be set up. Its fd becomes writable once it is
+ * (or once it has failed); messages queued before then are sent by
+ * dns_tcp_flush.
+ *
+ * @param conn The connection (zeroed, or closed, the first time).
+ * @param addr The server's address.
+ * @param port The server's port (in host byte order).
+ * @return False if the connection couldn't be started.
+ */
+bool dns_tcp_open_async(DNSTCPConn *conn, struct in_addr addr,
+		uint16_t port);
+
+/**
+ * Queues a message on a connection opened with dns_tcp_open_async, with its
+ * length prefix, and sends as much of the queue as can go without waiting.
+ *
+ * @param conn The connection.
+ * @param msg The message.
+ * @param length Size of the message in bytes.
+ * @return False if the queue is full or the connection failed (in which case
+ * 		it is closed).
+ */
+bool dns_tcp_queue(DNSTCPConn *conn, const uint8_t *msg, int length);
+
+/**
+ * Sends as much of a connection's queue as can go without waiting (nothing,
+ * if it is still being set up).
+ *
+ * @param conn The connection.
+ * @return False (with the connection closed) if it failed.
+ */
+bool dns_tcp_flush(DNSTCPConn *conn);
+
+/**
+ * Reads the next message from a connection, without waiting for one.
+ *
+ * @param conn The connection.
+ * @param msg Set to the message, which stays valid until the next call.
+ * @return The message's length, 0 if no complete message has arrived yet, or
+ * 		-1 (with the connection closed) if it was closed or failed.
+ */
+int dns_tcp_recv(DNSTCPConn *conn, const uint8_t **msg);
+
+/**
+ * Closes a connection, leaving its place in the pool free. Anything still
+ * queued on it is dropped.
+ */
+void dns_tcp_close(DNSTCPConn *conn);
+
+/**
+ * Closes a connection opened with dns_tcp_open_async and frees its buffers.
+ */
+void dns_tcp_free(DNSTCPConn *conn);
+
+/**
+ * Sends one query over a pooled connection and waits for its response. If a
+ * reused connection turns out to have been closed by the server, the query
+ * is sent again on a new one.
+ *
+ * @param addr The server's address.
+ * @param port The server's port (in host byte order).
+ * @param query The query.
+ * @param length Size of the query in bytes.
+ * @param response Where to store the response.
+ * @param size Size of response in bytes.
+ * @param timeout_ms How long the whole exchange may take.
+ * @return The length of the response, or -1 if none came in time.
+ */
+int dns_tcp_query(struct in_addr addr, uint16_t port, const uint8_t *query,
+		int length, uint8_t *response, int size, int timeout_ms);
+
+/**
+ * Closes all of this thread's connections and frees their buffers.
+ */
+void dns_tcp_pool_free(void);
+
+#endif
@@ -1,174 +1,2260 @@
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
 
 #include "dns.h"
+#include "dns_build.h"
+#include "dns_cache.h"
+#include "dns_client.h"
+#include "dns_parse.h"
+#include "dns_random.h"
+#include "dns_response.h"
+#include "dns_servers.h"
+#include "dns_snapshot.h"
+#include "dns_tcp.h"
 
 #define MAX_QUERY_SIZE 1024
-#define MAX_RESPONSE_SIZE 4096
+
+// Responses over UDP are limited by the EDNS0 payload size we advertise (at
+// most MAX_UDP_PAYLOAD), and over TCP only by the length prefix.
+#define MAX_UDP_PAYLOAD 4096
+#define DEFAULT_EDNS_PAYLOAD 1232	// avoids IP fragmentation (DNS flag day 2020)
+#define MAX_RESPONSE_SIZE DNS_MAX_MESSAGE_SIZE
+
+// Limits on how much work one lookup may do: how many referrals it follows
+// from the root down, and how deeply lookups of name server addresses
+// (needed when a referral has no glue) may nest.
+#define MAX_REFERRALS 16
+#define MAX_DEPTH 4
+
+// Most servers we'll consider for one zone.
+#define MAX_SERVERS 16
+
+// How long to wait for a server, based on its smoothed RTT.
+#define MIN_QUERY_TIMEOUT_MS 400
+#define MAX_QUERY_TIMEOUT_MS 2000
+
+// How long to wait for one server before also asking the next.
+#define STAGGER_MS 50
+
+#define CACHE_SIZE 4096
+
+// Buckets in the table of lookups in progress (see Flight).
+#define FLIGHT_BUCKETS 4096
+#define ROOT_HINTS_FILE "root-servers.txt"
+
+// Batch mode: new queries started between reads of responses.
+#define BATCH_SEND_BURST 256
+#define BATCH_CACHE_SIZE 65536
+
+// Server mode: at most one thread receiving UDP queries per CPU (each on a
+// socket of its own), threads looking up answers that aren't cached, and the
+// most lookups that may be in progress (or waiting to start) at once.
+#define SERVER_MAX_RECEIVERS 16
+#define SERVER_WORKERS 16
+#define SERVER_MAX_PENDING 65536
+#define SERVER_RECV_BATCH 64
+#define SERVER_CACHE_SIZE (1 << 20)
+#define SERVER_TCP_TIMEOUT_MS 10000
+#define SERVER_SOCKET_BUFFER (1 << 20)
+
+// A cached RRset that's asked for in the last tenth of its TTL is looked up
+// again in the background, unless its TTL is too short to bother.
+#define PREFETCH_FRACTION 10
+#define PREFETCH_MIN_TTL 10
+
+// Server mode saves a snapshot of the cache this often (in seconds).
+#define SNAPSHOT_INTERVAL 60
+
+/**
+ * The name servers for a zone that a query can be sent to.
+ */
+typedef struct ServerSet {
+	char zone[DNS_CACHE_MAX_NAME + 1];	// "" for the root
+	int num_addrs;
+	struct in_addr addrs[MAX_SERVERS];
+
+	// Servers whose addresses we don't know yet.
+	int num_unresolved;
+	char unresolved[MAX_SERVERS][DNS_CACHE_MAX_NAME + 1];
+} ServerSet;
+
+/**
+ * A lookup in progress. Whoever else asks the same question while it's in
+ * progress shares its result, rather than sending the same queries again
+ * ("singleflight"): threads in resolve_name wait for it to land, and server
+ * mode's clients (over UDP or TCP, forwarding or not) are queued on it to be
+ * answered when it does. A burst of requests for a name that isn't cached
+ * then costs one set of queries, not one each.
+ */
+typedef struct Flight {
+	char name[DNS_CACHE_MAX_NAME + 1];	// lower-cased, without trailing dot
+	uint16_t qtype;
+	bool refresh;			// ask even if the answer is cached
+	bool done;
+	char *answer;
+	struct Waiter *waiters;	// server mode clients to answer when it lands
+	int refs;				// the thread doing the lookup, and those waiting
+	pthread_cond_t landed;	// signalled once done
+	struct Flight *next;		// in its hash bucket
+	struct Flight *next_job;	// in server mode's queue of lookups to do
+} Flight;
+
+static DNSCache *cache;
+
+// File the cache is saved to and loaded from (NULL if it isn't kept).
+static const char *snapshot_file;
+
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+static Flight *flights[FLIGHT_BUCKETS];
+static int num_flights;
+
+// UDP payload size advertised in queries' OPT records (0 to send none).
+static uint16_t edns_payload_size = DEFAULT_EDNS_PAYLOAD;
+
+static int num_root_servers;
+static struct in_addr root_servers[MAX_SERVERS];
 
 // Note: uint8_t* is a pointer to 8 bits of data.
 
 /**
- * Constructs a DNS query for hostname's Type A record.
+ * Constructs a DNS query for one type of record for hostname.
+ *
+ * @param query Pointer to memory where query will stored (MAX_QUERY_SIZE
+ * 		bytes). Only the bytes of the query itself are written.
+ * @param hostname The host we are trying to resolve
+ * @param qtype The type of record wanted (e.g. DNS_TYPE_A).
+ * @param id The query's transaction ID.
+ * @param flags The header flags (0 for an iterative query).
+ * @return The number of bytes in the constructed query, or -1 if hostname
+ * 		isn't a valid name.
+ */
+int construct_query(uint8_t* query, const char* hostname, uint16_t qtype,
+		uint16_t id, uint16_t flags) {
+	DNSBuilder builder;
+	dns_build_init(&builder, query, MAX_QUERY_SIZE, id, flags);
+	dns_build_question(&builder, hostname, qtype, DNS_CLASS_IN);
+
+	// Without EDNS0, servers may only send 512 bytes over UDP, and anything
+	// bigger (e.g. a large MX or NS set) is truncated.
+	if (edns_payload_size > 0) {
+		dns_build_opt(&builder, edns_payload_size);
+	}
+	return dns_build_finish(&builder);
+}
+
+
+/**
+ * Checks that a response is to the question asked in a query.
+ *
+ * @param resp The parsed response.
+ * @param query The query, as sent.
+ * @return True if the question in the response matches the query's.
+ */
+static bool same_question(const DNSResponse *resp, const uint8_t *query) {
+	DNSName asked = dns_wire_name(query + sizeof(DNSHeader), DNS_MAX_NAME_WIRE);
+	DNSName answered = dns_wire_name(resp->qname, DNS_MAX_NAME_WIRE);
+	int qtype_offset = sizeof(DNSHeader) + dns_name_skip(asked);
+	uint16_t qtype = (query[qtype_offset] << 8) | query[qtype_offset + 1];
+	return resp->qtype == qtype && dns_name_equal(asked, answered);
+}
+
+/**
+ * Checks whether a name is in a zone, i.e. is the zone's name or ends with it.
+ *
+ * @param name The name to check.
+ * @param zone The zone ("" for the root).
+ * @return True if name is at or below zone.
+ */
+static bool in_zone(const char *name, const char *zone) {
+	size_t name_len = strlen(name);
+	size_t zone_len = strlen(zone);
+	if (zone_len == 0) {
+		return true;
+	}
+	if (name_len < zone_len
+			|| strcasecmp(name + name_len - zone_len, zone) != 0) {
+		return false;
+	}
+	return name_len == zone_len || name[name_len - zone_len - 1] == '.';
+}
+
+/**
+ * Adds everything useful in a response to the cache: every RRset in it
+ * (including NS records and glue for delegations), and, for a negative answer,
+ * the fact that the name or type doesn't exist.
+ *
+ * A server is only trusted for data in the zone it serves, so records for
+ * names outside that zone are ignored. Otherwise any server could fill the
+ * cache with false data for names it has no authority over.
+ *
+ * @param resp The parsed response.
+ * @param qname The name that was asked about.
+ * @param qtype The type that was asked about.
+ * @param zone The zone of the server that sent the response.
+ */
+static void cache_response(const DNSResponse *resp, const char *qname,
+		uint16_t qtype, const char *zone) {
+	bool done[DNS_RESPONSE_MAX_RECORDS] = {false};
+	DNSCacheRecord records[DNS_RESPONSE_MAX_RECORDS];
+	bool has_answer = false;
+	const DNSResourceRecord *soa = NULL;
+
+	for (int i = 0; i < resp->num_records; i++) {
+		const DNSResourceRecord *rr = &resp->records[i];
+		if (rr->section == DNS_RANK_ANSWER) {
+			has_answer = true;
+		}
+		if (rr->section == DNS_RANK_AUTHORITY && rr->type == DNS_TYPE_SOA
+				&& in_zone(rr->name, zone)) {
+			soa = rr;
+		}
+		if (done[i] || !in_zone(rr->name, zone)) {
+			continue;
+		}
+
+		// Gather the rest of this record's RRset. Its TTL is the lowest of
+		// its records' TTLs, and it is only as trustworthy as its least
+		// trustworthy record.
+		int num_records = 0;
+		uint32_t ttl = rr->ttl;
+		DNSCacheRank rank = rr->section;
+		for (int j = i; j < resp->num_records; j++) {
+			const DNSResourceRecord *other = &resp->records[j];
+			if (!done[j] && other->type == rr->type
+					&& strcasecmp(other->name, rr->name) == 0) {
+				records[num_records++] = other->data;
+				if (other->ttl < ttl) {
+					ttl = other->ttl;
+				}
+				if (other->section < rank) {
+					rank = other->section;
+				}
+				done[j] = true;
+			}
+		}
+		dns_cache_insert(cache, rr->name, rr->type, ttl, rank,
+				records, num_records);
+	}
+
+	// A negative answer names the zone's SOA record in the authority section.
+	// It may be cached for the lower of that record's TTL and its MINIMUM
+	// field (RFC 2308, section 5); without an SOA it mustn't be cached.
+	bool negative = resp->rcode == DNS_RCODE_NXDOMAIN
+			|| (resp->rcode == DNS_RCODE_NOERROR && !has_answer);
+	if (negative && soa != NULL && soa->data.rdlength >= 4) {
+		uint32_t minimum;
+		memcpy(&minimum, soa->data.rdata + soa->data.rdlength - 4, 4);
+		minimum = ntohl(minimum);
+		uint32_t ttl = (soa->ttl < minimum) ? soa->ttl : minimum;
+
+		// After a CNAME chain, it's the name at the end that doesn't exist.
+		char name[DNS_CACHE_MAX_NAME + 1];
+		strcpy(name, qname);
+		dns_response_follow_cnames(resp, name);
+		if (in_zone(name, zone)) {
+			dns_cache_insert_negative(cache, name, qtype, resp->rcode, ttl);
+		}
+	}
+}
+
+/**
+ * Tries to answer a query using only what's in the cache, following any
+ * cached CNAMEs.
+ *
+ * @param name The name to look up. If the cache holds CNAMEs for it, this is
+ * 		changed to the name at the end of the cached part of the chain.
+ * @param qtype The type of record wanted.
+ * @param answer Set to the answer (which the caller must free), or NULL if
+ * 		the cache says there is no answer.
+ * @return True if the cache had an answer, positive or negative.
+ */
+static bool answer_from_cache(char *name, uint16_t qtype, char **answer) {
+	for (int hops = 0; hops <= DNS_MAX_CNAME_CHAIN; hops++) {
+		DNSRRset *rrset = dns_cache_lookup(cache, name, qtype);
+		if (rrset != NULL) {
+			*answer = rrset->negative ? NULL
+					: dns_record_to_string(qtype, &rrset->records[0]);
+			dns_rrset_release(rrset);
+			return true;
+		}
+
+		rrset = dns_cache_lookup(cache, name, DNS_TYPE_CNAME);
+		if (rrset == NULL) {
+			return false;
+		}
+		if (rrset->negative) {
+			*answer = NULL;
+			dns_rrset_release(rrset);
+			return true;
+		}
+		bool ok = dns_record_name_string(&rrset->records[0], 0, name);
+		dns_rrset_release(rrset);
+		if (!ok) {
+			return false;
+		}
+	}
+	return false;
+}
+
+/**
+ * Finds the answer to a query in a response, following any CNAMEs in it.
+ *
+ * @return The answer (which the caller must free) or NULL if there isn't one.
+ */
+static char *answer_from_response(DNSResponse *resp, const char *hostname,
+		uint16_t qtype) {
+	const DNSResourceRecord *answer;
+	if (dns_response_answers(resp, hostname, qtype, &answer, 1) == 0) {
+		return NULL;
+	}
+	return dns_record_to_string(qtype, &answer->data);
+}
+
+/**
+ * @return The current time in milliseconds, from a clock that is never set
+ * 		backwards.
+ */
+static long now_msec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Reads the addresses of the root name servers, one per line.
+ *
+ * @param path The file to read them from.
+ */
+static void load_root_hints(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	char line[64];
+	while (num_root_servers < MAX_SERVERS && fgets(line, sizeof(line), f)) {
+		line[strcspn(line, " \t\r\n")] = '\0';
+		if (line[0] == '\0') {
+			continue;
+		}
+		if (inet_pton(AF_INET, line, &root_servers[num_root_servers]) == 1) {
+			num_root_servers++;
+		}
+		else {
+			fprintf(stderr, "%s: ignoring invalid address %s\n", path, line);
+		}
+	}
+	fclose(f);
+
+	if (num_root_servers == 0) {
+		fprintf(stderr, "%s: no root servers listed\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * @return How long to wait for a server before giving up on it, based on
+ * 		how quickly it has answered before.
+ */
+static int query_timeout(struct in_addr server) {
+	int timeout = 3 * dns_server_srtt(server);
+	if (timeout < MIN_QUERY_TIMEOUT_MS) {
+		timeout = MIN_QUERY_TIMEOUT_MS;
+	}
+	if (timeout > MAX_QUERY_TIMEOUT_MS) {
+		timeout = MAX_QUERY_TIMEOUT_MS;
+	}
+	return timeout;
+}
+
+/**
+ * Checks whether a response was truncated (has its TC flag set), meaning the
+ * full answer has to be fetched over TCP. Only the header is looked at, as
+ * the rest of a truncated response may be cut off anywhere.
+ *
+ * @param response The response.
+ * @param len The size of the response in bytes.
+ * @param id The ID of the query it should answer.
+ */
+static bool is_truncated(const uint8_t *response, int len, uint16_t id) {
+	DNSParser parser;
+	return dns_parse_header(&parser, response, len) && parser.id == id
+			&& (parser.flags & DNS_FLAG_QR) && (parser.flags & DNS_FLAG_TC);
+}
+
+/**
+ * Asks a zone's servers for a record, fastest first, and takes the first
+ * usable response.
+ *
+ * Rather than waiting for each server in turn to answer or time out, the
+ * query "races" them (like happy eyeballs does for connections): the next
+ * server is asked if no answer has come STAGGER_MS after asking the previous
+ * one, or straight away once every server asked so far has failed. A dead or
+ * slow server then costs a lookup a few tens of milliseconds, not a whole
+ * timeout.
+ *
+ * A server whose answer doesn't fit in UDP has still answered, so that ends
+ * the race (and its RTT is the time its UDP answer took). It is then asked
+ * again over TCP, on a connection kept open for any later queries to it; if
+ * that fails, the race is run again without it.
+ *
+ * @param servers The servers to ask.
+ * @param name The name to ask about.
+ * @param qtype The type of record wanted.
+ * @param flags The query's header flags (DNS_FLAG_RD to ask a recursive
+ * 		server to do the work, 0 for an iterative query).
+ * @param resp Where to store the parsed response.
+ * @return True if resp holds a usable response, false if no server gave one.
+ */
+static bool query_servers(ServerSet *servers, const char *name,
+		uint16_t qtype, uint16_t flags, DNSResponse *resp) {
+	uint8_t query[MAX_QUERY_SIZE];
+	uint16_t id = dns_random_id();
+	int query_len = construct_query(query, name, qtype, id, flags);
+	if (query_len < 0) {
+		return false;
+	}
+
+	// create a non-blocking UDP (i.e. Datagram) socket, which all of the
+	// servers will be queried from, on a port of its own that a forger
+	// would have to guess along with the ID
+	int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (sock < 0) {
+		perror("socket");
+		exit(EXIT_FAILURE);
+	}
+	if (dns_random_bind(sock) < 0) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+
+	int epoll_fd = epoll_create1(0);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = sock;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+
+	int num_servers = servers->num_addrs;
+	long sent_at[MAX_SERVERS];
+	long deadline[MAX_SERVERS];
+	bool waiting[MAX_SERVERS];	// asked, and hasn't answered or failed yet
+	int num_sent = 0;
+	int num_waiting = 0;
+	long next_send = now_msec();
+	bool found = false;
+	int truncated = -1;		// the server whose answer didn't fit
+
+	dns_servers_rank(servers->addrs, num_servers);
+
+	while (!found && truncated < 0
+			&& (num_sent < num_servers || num_waiting > 0)) {
+		long now = now_msec();
+
+		// Give up on servers that have had long enough.
+		for (int i = 0; i < num_sent; i++) {
+			if (waiting[i] && now >= deadline[i]) {
+				dns_server_failed(servers->addrs[i]);
+				waiting[i] = false;
+				num_waiting--;
+				next_send = now;
+			}
+		}
+
+		if (num_sent < num_servers && (now >= next_send || num_waiting == 0)) {
+			struct sockaddr_in addr;
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(53); // port 53 for DNS
+			addr.sin_addr = servers->addrs[num_sent];
+
+			waiting[num_sent] = false;
+			if (sendto(sock, query, query_len, 0, (struct sockaddr*)&addr,
+						sizeof(addr)) == query_len) {
+				sent_at[num_sent] = now;
+				deadline[num_sent] = now + query_timeout(addr.sin_addr);
+				waiting[num_sent] = true;
+				num_waiting++;
+			}
+			else {
+				dns_server_failed(addr.sin_addr);
+			}
+			num_sent++;
+			next_send = now + STAGGER_MS;
+			continue;
+		}
+
+		// Sleep until a response comes in, it's time to ask another server,
+		// or a server's time is up.
+		long wake = now + MAX_QUERY_TIMEOUT_MS;
+		if (num_sent < num_servers) {
+			wake = next_send;
+		}
+		for (int i = 0; i < num_sent; i++) {
+			if (waiting[i] && deadline[i] < wake) {
+				wake = deadline[i];
+			}
+		}
+		int ready = epoll_wait(epoll_fd, &event, 1, wake - now);
+		if (ready < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+		if (ready <= 0) {
+			continue;
+		}
+
+		uint8_t response[MAX_RESPONSE_SIZE];
+		struct sockaddr_in from;
+		socklen_t from_len = sizeof(from);
+		int len;
+		while (!found && truncated < 0
+				&& (len = recvfrom(sock, response, MAX_RESPONSE_SIZE, 0,
+						(struct sockaddr*)&from, &from_len)) >= 0) {
+			from_len = sizeof(from);
+
+			// Only listen to servers we asked, and still expect to hear from.
+			int server = -1;
+			for (int i = 0; i < num_sent; i++) {
+				if (waiting[i] && from.sin_port == htons(53)
+						&& from.sin_addr.s_addr == servers->addrs[i].s_addr) {
+					server = i;
+				}
+			}
+			if (server < 0) {
+				continue;
+			}
+			if (is_truncated(response, len, id)) {
+				waiting[server] = false;
+				num_waiting--;
+				dns_server_rtt_sample(servers->addrs[server],
+						now_msec() - sent_at[server]);
+				truncated = server;
+				continue;
+			}
+			if (!dns_response_parse(response, len, resp) || resp->id != id
+					|| !(resp->flags & DNS_FLAG_QR)
+					|| !same_question(resp, query)) {
+				continue; // not an answer to our query: keep waiting
+			}
+
+			waiting[server] = false;
+			num_waiting--;
+			dns_server_rtt_sample(servers->addrs[server],
+					now_msec() - sent_at[server]);
+
+			// SERVFAIL, REFUSED and the like mean this server can't help us,
+			// but another one for the same zone might.
+			if (resp->rcode != DNS_RCODE_NOERROR
+					&& resp->rcode != DNS_RCODE_NXDOMAIN) {
+				dns_server_failed(servers->addrs[server]);
+				next_send = now_msec();
+				continue;
+			}
+			found = true;
+		}
+	}
+
+	close(epoll_fd);
+	close(sock);
+	if (truncated < 0) {
+		return found;
+	}
+
+	struct in_addr addr = servers->addrs[truncated];
+	uint8_t response[MAX_RESPONSE_SIZE];
+	int len = dns_tcp_query(addr, 53, query, query_len, response,
+			MAX_RESPONSE_SIZE, query_timeout(addr));
+	if (len >= 0 && dns_response_parse(response, len, resp) && resp->id == id
+			&& (resp->flags & DNS_FLAG_QR) && same_question(resp, query)
+			&& (resp->rcode == DNS_RCODE_NOERROR
+				|| resp->rcode == DNS_RCODE_NXDOMAIN)) {
+		return true;
+	}
+
+	// No answer over TCP: race the rest of the servers instead.
+	dns_server_failed(addr);
+	ServerSet rest = *servers;
+	rest.num_addrs = 0;
+	for (int i = 0; i < num_servers; i++) {
+		if (i != truncated) {
+			rest.addrs[rest.num_addrs++] = servers->addrs[i];
+		}
+	}
+	return rest.num_addrs > 0
+			&& query_servers(&rest, name, qtype, flags, resp);
+}
+
+static char *resolve_name(const char *hostname, uint16_t qtype, int depth,
+		bool refresh);
+
+/**
+ * Adds a name server to a set, by address if the cache knows it (from glue
+ * or an earlier lookup) or else just by name.
+ *
+ * @param servers The set to add to.
+ * @param ns_name The name of the server.
+ */
+static void add_server(ServerSet *servers, const char *ns_name) {
+	DNSRRset *rrset = dns_cache_lookup(cache, ns_name, DNS_TYPE_A);
+	if (rrset != NULL && !rrset->negative) {
+		for (int i = 0; i < rrset->num_records; i++) {
+			if (servers->num_addrs < MAX_SERVERS
+					&& rrset->records[i].rdlength == 4) {
+				memcpy(&servers->addrs[servers->num_addrs++],
+						rrset->records[i].rdata, 4);
+			}
+		}
+	}
+	else if (rrset == NULL && servers->num_unresolved < MAX_SERVERS) {
+		strcpy(servers->unresolved[servers->num_unresolved++], ns_name);
+	}
+	dns_rrset_release(rrset);
+}
+
+/**
+ * Looks up the addresses of servers that we only know by name, stopping as
+ * soon as we have one to ask.
+ *
+ * @param servers The set of servers.
+ * @param depth How deeply nested the lookup needing these servers is.
+ */
+static void resolve_server_addresses(ServerSet *servers, int depth) {
+	for (int i = 0; i < servers->num_unresolved && servers->num_addrs == 0;
+			i++) {
+		// A server inside the zone it serves can only be reached with glue,
+		// and asking the zone for it would just lead back here.
+		if (in_zone(servers->unresolved[i], servers->zone)) {
+			continue;
+		}
+
+		char *addr = resolve_name(servers->unresolved[i], DNS_TYPE_A,
+				depth + 1, false);
+		if (addr != NULL
+				&& inet_pton(AF_INET, addr, &servers->addrs[0]) == 1) {
+			servers->num_addrs = 1;
+		}
+		free(addr);
+	}
+}
+
+/**
+ * Sets up a server set from a zone's NS records.
+ *
+ * @param servers The set to fill in.
+ * @param zone The zone's name.
+ * @param records The zone's NS records.
+ * @param num_records Number of NS records.
+ * @param depth How deeply nested the lookup needing these servers is.
+ */
+static void servers_from_ns(ServerSet *servers, const char *zone,
+		const DNSCacheRecord *records, int num_records, int depth) {
+	strcpy(servers->zone, zone);
+	servers->num_addrs = 0;
+	servers->num_unresolved = 0;
+
+	for (int i = 0; i < num_records; i++) {
+		char ns_name[DNS_CACHE_MAX_NAME + 1];
+		if (dns_record_name_string(&records[i], 0, ns_name)) {
+			add_server(servers, ns_name);
+		}
+	}
+	resolve_server_addresses(servers, depth);
+}
+
+/**
+ * Finds the servers to start a lookup with: those of the closest enclosing
+ * zone that we have cached NS records for, or the root servers.
+ *
+ * @param name The name being looked up.
+ * @param servers The set to fill in.
+ * @param depth How deeply nested the lookup is.
+ */
+static void find_servers(const char *name, ServerSet *servers, int depth) {
+	const char *zone = name;
+	while (*zone != '\0') {
+		DNSRRset *rrset = dns_cache_lookup(cache, zone, DNS_TYPE_NS);
+		if (rrset != NULL && rrset->type == DNS_TYPE_NS && !rrset->negative) {
+			servers_from_ns(servers, zone, rrset->records, rrset->num_records,
+					depth);
+			dns_rrset_release(rrset);
+			if (servers->num_addrs > 0) {
+				return;
+			}
+		}
+		else {
+			dns_rrset_release(rrset);
+		}
+
+		const char *dot = strchr(zone, '.');
+		zone = (dot != NULL) ? dot + 1 : "";
+	}
+
+	servers->zone[0] = '\0';
+	servers->num_addrs = num_root_servers;
+	memcpy(servers->addrs, root_servers, sizeof(root_servers));
+	servers->num_unresolved = 0;
+}
+
+/**
+ * Follows a referral: switches to the servers of the zone that a response
+ * delegated the name to.
+ *
+ * @param resp The response.
+ * @param name The name being looked up.
+ * @param servers The servers that sent the response; replaced by the servers
+ * 		of the delegated zone.
+ * @param depth How deeply nested the lookup is.
+ * @return False if the response isn't a usable referral, e.g. because it
+ * 		doesn't lead any closer to the name, as a lame server's referral may not.
+ */
+static bool follow_referral(DNSResponse *resp, const char *name,
+		ServerSet *servers, int depth) {
+	DNSCacheRecord records[DNS_RESPONSE_MAX_RECORDS];
+	int num_records = 0;
+	const char *zone = NULL;
+
+	for (int i = 0; i < resp->num_records; i++) {
+		DNSResourceRecord *rr = &resp->records[i];
+		if (rr->section != DNS_RANK_AUTHORITY || rr->type != DNS_TYPE_NS) {
+			continue;
+		}
+		if (zone == NULL) {
+			// The new zone must be below the current one, and contain name.
+			if (!in_zone(name, rr->name) || !in_zone(rr->name, servers->zone)
+					|| strcasecmp(rr->name, servers->zone) == 0) {
+				continue;
+			}
+			zone = rr->name;
+		}
+		if (strcasecmp(rr->name, zone) == 0) {
+			records[num_records++] = rr->data;
+		}
+	}
+
+	if (num_records == 0) {
+		return false;
+	}
+	servers_from_ns(servers, zone, records, num_records, depth);
+	return servers->num_addrs > 0;
+}
+
+/**
+ * Adds the answer section records of a response to those gathered from
+ * earlier responses, skipping any outside the zone of the server that sent
+ * it (see cache_response) and any there's no room for.
+ *
+ * @param to The records gathered so far.
+ * @param resp The response.
+ * @param zone The zone of the server that sent the response.
+ */
+static void add_answer_records(DNSResponse *to, const DNSResponse *resp,
+		const char *zone) {
+	for (int i = 0; i < resp->num_records; i++) {
+		const DNSResourceRecord *rr = &resp->records[i];
+		if (rr->section != DNS_RANK_ANSWER || !in_zone(rr->name, zone)
+				|| to->num_records == DNS_RESPONSE_MAX_RECORDS
+				|| to->rdata_used + rr->data.rdlength > DNS_RESPONSE_MAX_RDATA) {
+			continue;
+		}
+		DNSResourceRecord *copy = &to->records[to->num_records++];
+		*copy = *rr;
+		memcpy(to->rdata + to->rdata_used, rr->data.rdata, rr->data.rdlength);
+		copy->data.rdata = to->rdata + to->rdata_used;
+		to->rdata_used += rr->data.rdlength;
+	}
+}
+
+/**
+ * Looks a name up iteratively: starting from the closest zone whose servers
+ * we know (the root if nothing else), asks that zone's servers and follows
+ * their referrals down the tree until reaching servers that can answer.
+ *
+ * @param hostname The name to resolve.
+ * @param qtype The type of record wanted.
+ * @param depth How many lookups this one is nested inside. (Looking up the
+ * 		address of a name server that came without glue nests a lookup.)
+ * @param refresh Whether to ask again even if the answer is cached, to
+ * 		refresh it before it expires.
+ * @param final If not NULL, set to what server mode needs to answer a client
+ * 		with, whether or not it could be cached: the answer section records
+ * 		of the responses along the way (from each server's own zone), and the
+ * 		rcode of the response that ended the lookup. Its rcode is -1 if the
+ * 		lookup didn't end with a response (it failed, or the rest of the
+ * 		answer was cached).
+ * @return The answer, which the caller must free, or NULL if there isn't one.
+ */
+static char *lookup_name(const char *hostname, uint16_t qtype, int depth,
+		bool refresh, DNSResponse *final) {
+	if (final != NULL) {
+		final->rcode = -1;
+		final->num_records = 0;
+		final->rdata_used = 0;
+	}
+	if (depth > MAX_DEPTH) {
+		return NULL;
+	}
+
+	char name[DNS_CACHE_MAX_NAME + 1];
+	strncpy(name, hostname, DNS_CACHE_MAX_NAME);
+	name[DNS_CACHE_MAX_NAME] = '\0';
+	size_t name_len = strlen(name);
+	if (name_len > 0 && name[name_len-1] == '.') {
+		name[name_len-1] = '\0';
+	}
+
+	for (int hops = 0; hops <= DNS_MAX_CNAME_CHAIN; hops++) {
+		char *answer = NULL;
+		if ((hops > 0 || !refresh) && answer_from_cache(name, qtype, &answer)) {
+			return answer;
+		}
+
+		ServerSet servers;
+		find_servers(name, &servers, depth);
+
+		bool new_name = false;
+		for (int referrals = 0; referrals < MAX_REFERRALS && !new_name;
+				referrals++) {
+			DNSResponse resp;
+			if (!query_servers(&servers, name, qtype, 0, &resp)) {
+				return NULL;
+			}
+			cache_response(&resp, name, qtype, servers.zone);
+			if (final != NULL) {
+				add_answer_records(final, &resp, servers.zone);
+			}
+
+			answer = answer_from_response(&resp, name, qtype);
+			if (answer != NULL) {
+				if (final != NULL) {
+					final->rcode = resp.rcode;
+				}
+				return answer;
+			}
+
+			// A CNAME without the record it points to: look up its target,
+			// which may well be in another zone.
+			char target[DNS_CACHE_MAX_NAME + 1];
+			strcpy(target, name);
+			dns_response_follow_cnames(&resp, target);
+			if (strcasecmp(target, name) != 0) {
+				strcpy(name, target);
+				new_name = true;
+			}
+			else if (resp.rcode == DNS_RCODE_NXDOMAIN
+					|| (resp.flags & DNS_FLAG_AA)) {
+				if (final != NULL) {
+					final->rcode = resp.rcode;
+				}
+				return NULL;
+			}
+			else if (!follow_referral(&resp, name, &servers, depth)) {
+				return NULL;
+			}
+		}
+
+		if (!new_name) {
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Makes a flight's key from a question: the name lower-cased, without a
+ * trailing dot.
+ */
+static void flight_key(const char *hostname, char *key) {
+	int len = 0;
+	while (hostname[len] != '\0' && len < DNS_CACHE_MAX_NAME) {
+		key[len] = tolower((unsigned char)hostname[len]);
+		len++;
+	}
+	if (len > 0 && key[len - 1] == '.') {
+		len--;
+	}
+	key[len] = '\0';
+}
+
+static uint32_t flight_hash(const char *key, uint16_t qtype) {
+	uint32_t hash = 2166136261u ^ qtype;
+	for (const char *p = key; *p != '\0'; p++) {
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	}
+	return hash % FLIGHT_BUCKETS;
+}
+
+/*
+ * Finds the flight for a question (with flights_lock held).
+ *
+ * @return The flight, or NULL if the question isn't being looked up.
+ */
+static Flight *flight_find(const char *key, uint16_t qtype) {
+	Flight *flight = flights[flight_hash(key, qtype)];
+	while (flight != NULL
+			&& (flight->qtype != qtype || strcmp(flight->name, key) != 0)) {
+		flight = flight->next;
+	}
+	return flight;
+}
+
+/*
+ * Adds a flight for a question to the table (with flights_lock held). The
+ * caller holds its first reference, and lands it with flight_land once the
+ * lookup is done.
+ */
+static Flight *flight_add(const char *key, uint16_t qtype, bool refresh) {
+	Flight *flight = calloc(1, sizeof(Flight));
+	if (flight == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(flight->name, key);
+	flight->qtype = qtype;
+	flight->refresh = refresh;
+	flight->refs = 1;
+	pthread_cond_init(&flight->landed, NULL);
+
+	uint32_t bucket = flight_hash(key, qtype);
+	flight->next = flights[bucket];
+	flights[bucket] = flight;
+	num_flights++;
+	return flight;
+}
+
+/*
+ * Drops a reference to a flight (with flights_lock held), freeing it once
+ * nobody is left waiting on it.
+ */
+static void flight_release(Flight *flight) {
+	if (--flight->refs == 0) {
+		pthread_cond_destroy(&flight->landed);
+		free(flight->answer);
+		free(flight);
+	}
+}
+
+/*
+ * Waits for a flight to land (with flights_lock held), then drops the
+ * caller's reference to it.
+ *
+ * @return A copy of its answer, which the caller must free.
+ */
+static char *flight_wait(Flight *flight) {
+	while (!flight->done) {
+		pthread_cond_wait(&flight->landed, &flights_lock);
+	}
+	char *answer = (flight->answer != NULL) ? strdup(flight->answer) : NULL;
+	flight_release(flight);
+	return answer;
+}
+
+static void answer_waiters(struct Waiter *waiters, bool found,
+		const DNSResponse *resp);
+
+/*
+ * Ends a flight once its lookup is done: takes it out of the table, answers
+ * the server mode clients queued on it, wakes the threads waiting for it, and
+ * drops the caller's reference.
+ *
+ * @param flight The flight.
+ * @param answer What the lookup found (copied), or NULL.
+ * @param found Whether resp holds what to answer clients with (see
+ * 		server_lookup).
+ * @param resp What server_lookup set it to (or NULL if there isn't one).
+ */
+static void flight_land(Flight *flight, const char *answer, bool found,
+		const DNSResponse *resp) {
+	// Once it's out of the table, nobody else can join it.
+	pthread_mutex_lock(&flights_lock);
+	Flight **link = &flights[flight_hash(flight->name, flight->qtype)];
+	while (*link != flight) {
+		link = &(*link)->next;
+	}
+	*link = flight->next;
+	num_flights--;
+	struct Waiter *waiters = flight->waiters;
+	flight->waiters = NULL;
+	pthread_mutex_unlock(&flights_lock);
+
+	answer_waiters(waiters, found, resp);
+
+	pthread_mutex_lock(&flights_lock);
+	flight->answer = (answer != NULL) ? strdup(answer) : NULL;
+	flight->done = true;
+	pthread_cond_broadcast(&flight->landed);
+	flight_release(flight);
+	pthread_mutex_unlock(&flights_lock);
+}
+
+/**
+ * Resolves a name, as lookup_name does, but without sending the same queries
+ * twice at once: if the question is already being looked up (by another
+ * thread, or for a server mode client), this waits for that lookup's answer
+ * instead.
+ *
+ * Lookups nested inside others (of name server addresses) never wait, as two
+ * lookups each waiting on a lookup nested in the other would wait forever.
+ *
+ * @param hostname The name to resolve.
+ * @param qtype The type of record wanted.
+ * @param depth How many lookups this one is nested inside.
+ * @param refresh Whether to ask again even if the answer is cached.
+ * @return The answer, which the caller must free, or NULL if there isn't one.
+ */
+static char *resolve_name(const char *hostname, uint16_t qtype, int depth,
+		bool refresh) {
+	if (depth > 0) {
+		return lookup_name(hostname, qtype, depth, refresh, NULL);
+	}
+
+	char key[DNS_CACHE_MAX_NAME + 1];
+	flight_key(hostname, key);
+
+	// Answers that are cached don't need to go anywhere near the table.
+	char *answer = NULL;
+	char name[DNS_CACHE_MAX_NAME + 1];
+	strcpy(name, key);
+	if (!refresh && answer_from_cache(name, qtype, &answer)) {
+		return answer;
+	}
+
+	pthread_mutex_lock(&flights_lock);
+	Flight *flight = flight_find(key, qtype);
+	if (flight != NULL) {
+		// Someone else is on it: wait for them to land.
+		flight->refs++;
+		answer = flight_wait(flight);
+		pthread_mutex_unlock(&flights_lock);
+		return answer;
+	}
+	flight = flight_add(key, qtype, refresh);
+	pthread_mutex_unlock(&flights_lock);
+
+	answer = lookup_name(hostname, qtype, depth, refresh, NULL);
+	flight_land(flight, answer, true, NULL);
+	return answer;
+}
+
+/**
+ * Returns a string with the answer to a query for one type of record for
+ * hostname (see dns_record_to_string for what it looks like).
+ *
+ * The name is resolved iteratively, starting at the root servers. Answers,
+ * delegations and glue are cached for as long as their TTLs allow, so later
+ * lookups skip as much of the walk down from the root as they can.
+ *
+ * @param hostname The name of the host to resolve.
+ * @param qtype The type of record wanted (e.g. DNS_TYPE_AAAA).
+ * @return The answer, which the caller must free, or NULL if the request
+ * 		could not be resolved.
+ */
+static char *resolve_type(char *hostname, uint16_t qtype) {
+	printf("Requesting %s record for %s\n", dns_type_name(qtype), hostname);
+	return resolve_name(hostname, qtype, 0, false);
+}
+
+/**
+ * Returns a string with the IP address (for an A record) or name of mail
+ * server associated with the given hostname.
+ *
+ * @param hostname The name of the host to resolve.
+ * @param is_mx True (1) if requesting the MX record result, False (0) if
+ *    requesting the A record.
+ *
+ * @return A string representation of an IP address (e.g. "192.168.0.1") or
+ *   mail server (e.g. "mail.google.com"), which the caller must free. If the
+ *   request could not be resolved, NULL will be returned.
+ */
+char* resolve(char *hostname, bool is_mx) {
+	return resolve_type(hostname, is_mx ? DNS_TYPE_MX : DNS_TYPE_A);
+}
+
+/**
+ * State of a batch run.
+ */
+typedef struct Batch {
+	DNSClient *client;
+	uint16_t qtype;
+	unsigned long num_answered;
+	unsigned long num_failed;
+} Batch;
+
+/**
+ * Prints one result line: the name, a tab, then the answer or the reason
+ * there isn't one.
+ */
+static void print_result(Batch *batch, const char *name, const char *answer,
+		const char *failure) {
+	if (answer != NULL) {
+		printf("%s\t%s\n", name, answer);
+		batch->num_answered++;
+	}
+	else {
+		printf("%s\t%s\n", name, failure);
+		batch->num_failed++;
+	}
+}
+
+/**
+ * Caches and reports the result of one of the batch's queries.
+ */
+static void batch_result(const DNSClientResult *result, void *arg) {
+	Batch *batch = arg;
+
+	// The upstream server is recursive, so it is trusted for any zone.
+	if (result->response != NULL) {
+		cache_response(result->response, result->name,
+				result->qtype, "");
+	}
+
+	static const char *failures[] = {
+		[DNS_CLIENT_OK] = "NODATA",	// the answer was malformed
+		[DNS_CLIENT_NODATA] = "NODATA",
+		[DNS_CLIENT_NXDOMAIN] = "NXDOMAIN",
+		[DNS_CLIENT_SERVFAIL] = "SERVFAIL",
+		[DNS_CLIENT_TIMEOUT] = "TIMEOUT"
+	};
+	char *answer = NULL;
+	if (result->num_answers > 0) {
+		answer = dns_record_to_string(result->qtype, &result->answers[0]->data);
+	}
+	print_result(batch, result->name, answer, failures[result->status]);
+	free(answer);
+}
+
+/**
+ * Starts resolving a name from the input, unless the cache already knows the
+ * answer.
+ */
+static void start_query(Batch *batch, const char *line) {
+	char name[DNS_CACHE_MAX_NAME + 1];
+	strncpy(name, line, DNS_CACHE_MAX_NAME);
+	name[DNS_CACHE_MAX_NAME] = '\0';
+
+	uint8_t wire[DNS_MAX_NAME_WIRE];
+	if (dns_string_to_wire(name, wire) < 0) {
+		print_result(batch, name, NULL, "INVALID");
+		return;
+	}
+
+	char *answer = NULL;
+	char cached_name[DNS_CACHE_MAX_NAME + 1];
+	strcpy(cached_name, name);
+	if (answer_from_cache(cached_name, batch->qtype, &answer)) {
+		print_result(batch, name, answer, "NOANSWER");
+		free(answer);
+		return;
+	}
+
+	dns_client_query(batch->client, name, batch->qtype, batch_result, batch);
+}
+
+/**
+ * Resolves every name in a file (one per line) through a recursive upstream
+ * server, writing "name<TAB>answer" lines to stdout as the answers arrive.
  *
- * @param query Pointer to memory where query will stored.
- * @param hostname The host we are trying to resolve
- * @return The number of bytes in the constructed query.
+ * The queries are sent by an asynchronous client (see dns_client.h), which
+ * keeps up to DNS_CLIENT_MAX_IN_FLIGHT of them outstanding at once, retries
+ * those that get no answer, and asks again over TCP for answers that are
+ * truncated.
+ *
+ * @param in The file to read names from.
+ * @param upstream The address of the recursive server to ask.
+ * @param qtype The type of record to look up for each name.
+ */
+static void resolve_batch(FILE *in, struct in_addr upstream, uint16_t qtype) {
+	Batch batch = {0};
+	batch.client = dns_client_create(upstream, 53, edns_payload_size);
+	batch.qtype = qtype;
+
+	// Results are written in big chunks rather than line by line.
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+	char line[1024];
+	bool more_input = true;
+	while (more_input || dns_client_in_flight(batch.client) > 0) {
+		// Start new queries a burst at a time, reading responses in between,
+		// so that neither side's socket buffers overflow.
+		for (int i = 0; i < BATCH_SEND_BURST && more_input
+				&& dns_client_in_flight(batch.client)
+					< DNS_CLIENT_MAX_IN_FLIGHT; i++) {
+			if (fgets(line, sizeof(line), in) == NULL) {
+				more_input = false;
+				break;
+			}
+			line[strcspn(line, " \t\r\n")] = '\0';
+			if (line[0] != '\0' && line[0] != '#') {
+				start_query(&batch, line);
+			}
+		}
+
+		int wait = dns_client_timeout(batch.client);
+		if (more_input && dns_client_in_flight(batch.client)
+				< DNS_CLIENT_MAX_IN_FLIGHT) {
+			wait = 0;
+		}
+		struct pollfd pfd = {dns_client_fd(batch.client), POLLIN, 0};
+		if (poll(&pfd, 1, wait) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(EXIT_FAILURE);
+		}
+		dns_client_process(batch.client);
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "%lu answered, %lu failed\n", batch.num_answered,
+			batch.num_failed);
+	dns_client_free(batch.client);
+}
+
+/**
+ * A query from a client in server mode.
+ */
+typedef struct ClientQuery {
+	uint16_t id;
+	uint16_t flags;
+	bool has_question;
+	char name[DNS_CACHE_MAX_NAME + 1];
+	uint16_t qtype;
+	bool edns;		// the client sent an OPT record
+	int max_size;	// largest response the client can take
+} ClientQuery;
+
+/**
+ * A record in the answer to a client's query.
+ */
+typedef struct AnswerRecord {
+	const char *owner;
+	uint16_t type;
+	uint32_t ttl;
+	DNSCacheRecord data;
+} AnswerRecord;
+
+/**
+ * The answer to a client's query: the records of a CNAME chain, if any, and
+ * those of the type asked for at its end.
+ */
+typedef struct Answer {
+	int rcode;
+	int num_records;
+	AnswerRecord records[DNS_RESPONSE_MAX_RECORDS];
+	char owners[DNS_MAX_CNAME_CHAIN + 1][DNS_CACHE_MAX_NAME + 1];
+
+	// Cached RRsets the records point into, held until the answer is sent.
+	int num_rrsets;
+	DNSRRset *rrsets[DNS_MAX_CNAME_CHAIN + 1];
+
+	bool prefetch;	// some of it expires soon, so should be looked up again
+} Answer;
+
+/**
+ * A client waiting for a lookup (a Flight) to finish. Whoever finishes the
+ * lookup sends a UDP client its response, but writes a TCP client's into a
+ * buffer for the client's thread (which waits on the flight) to send.
  */
-int construct_query(uint8_t* query, char* hostname) {
-	memset(query, 0, MAX_QUERY_SIZE);
+typedef struct Waiter {
+	ClientQuery query;
+	int sock;
+	struct sockaddr_in addr;
+	uint8_t *out;		// TCP: where to write the response (NULL for UDP)
+	int out_len;		// TCP: the response's length, or -1 if there isn't one
+	struct Waiter *next;
+} Waiter;
 
-	// first part of the query is a fixed size header
-	DNSHeader *hdr = (DNSHeader*)query;
+/**
+ * State of server mode.
+ */
+typedef struct Server {
+	bool forward;				// send lookups to upstream, not iterate
+	struct in_addr upstream;
+
+	// The queue of flights for the lookup workers to do (protected by
+	// flights_lock).
+	pthread_cond_t job_ready;
+	Flight *first_job;
+	Flight *last_job;
+} Server;
+
+static Server server = {
+	.job_ready = PTHREAD_COND_INITIALIZER
+};
+
+/**
+ * Reads a client's query.
+ *
+ * @param msg The query.
+ * @param len The size of the query in bytes.
+ * @param tcp Whether it came over TCP (so the response may be of any size).
+ * @param q Set to the query.
+ * @return DNS_RCODE_NOERROR if it can be answered, another rcode if the
+ * 		response should be an error, or -1 if it should be ignored.
+ */
+static int parse_client_query(const uint8_t *msg, int len, bool tcp,
+		ClientQuery *q) {
+	DNSParser parser;
+	if (!dns_parse_header(&parser, msg, len) || (parser.flags & DNS_FLAG_QR)) {
+		return -1; // never answer responses, or a loop could start
+	}
 
-	// set ID to 5... you should randomize this!
-	hdr->id = htons(5);
+	q->id = parser.id;
+	q->flags = parser.flags;
+	q->has_question = false;
+	q->edns = false;
+	q->max_size = tcp ? DNS_MAX_MESSAGE_SIZE : 512;
+	if (parser.flags & DNS_OPCODE_MASK) {
+		return DNS_RCODE_NOTIMP;
+	}
 
-	// set header flags to request iterative query
-	hdr->flags = htons(0x0000);	
+	DNSName name;
+	uint16_t qclass;
+	if (parser.counts[DNS_SECTION_QUESTION] != 1
+			|| !dns_parse_question(&parser, &name, &q->qtype, &qclass)
+			|| dns_name_to_string(name, q->name, sizeof(q->name)) < 0) {
+		return DNS_RCODE_FORMERR;
+	}
+	q->has_question = true;
+	if (qclass != DNS_CLASS_IN) {
+		return DNS_RCODE_NOTIMP;
+	}
 
-	// 1 question, no answers or other records
-	hdr->q_count=htons(1);
-	hdr->a_count=htons(0);
-	hdr->auth_count=htons(0);
-	hdr->other_count=htons(0);
+	DNSRecordView rr;
+	while (dns_parse_record(&parser, &rr)) {
+		if (rr.type == DNS_TYPE_OPT && rr.section == DNS_SECTION_ADDITIONAL) {
+			// The OPT record's class is the client's UDP payload size.
+			q->edns = true;
+			if (!tcp && rr.class > 512) {
+				q->max_size = (rr.class < MAX_UDP_PAYLOAD)
+						? rr.class : MAX_UDP_PAYLOAD;
+			}
+		}
+	}
+	return parser.error ? DNS_RCODE_FORMERR : DNS_RCODE_NOERROR;
+}
 
-	// We are going to have to wade into pointer arithmetic here since our
-	// struct is a fixed size but our queries will be variably sized.
+static void answer_init(Answer *a, const char *qname) {
+	a->rcode = DNS_RCODE_NOERROR;
+	a->num_records = 0;
+	a->num_rrsets = 0;
+	a->prefetch = false;
+	strcpy(a->owners[0], qname);
+}
 
-	// add the name
-	int query_len = sizeof(DNSHeader); 
-	int name_len = convertStringToDNS(hostname,query+query_len);
-	query_len += name_len; 
-	
-	// set the query type to A (i.e. 1)
-	uint16_t *type = (uint16_t*)(query+query_len);
-	*type = htons(1);
-	query_len+=2;
+static void answer_add(Answer *a, const char *owner, uint16_t type,
+		uint32_t ttl, const DNSCacheRecord *data) {
+	if (a->num_records < DNS_RESPONSE_MAX_RECORDS) {
+		AnswerRecord *rr = &a->records[a->num_records++];
+		rr->owner = owner;
+		rr->type = type;
+		rr->ttl = ttl;
+		rr->data = *data;
+	}
+}
 
-	// finally the class: INET
-	uint16_t *class = (uint16_t*)(query+query_len);
-	*class = htons(1);
-	query_len += 2;
- 
-	return query_len;
+static void answer_release(Answer *a) {
+	for (int i = 0; i < a->num_rrsets; i++) {
+		dns_rrset_release(a->rrsets[i]);
+	}
+	a->num_rrsets = 0;
 }
 
 /**
- * Returns a string with the IP address (for an A record) or name of mail
- * server associated with the given hostname.
+ * Gathers the answer to a query from the cache, following cached CNAMEs. The
+ * TTLs given are what's left of the cached ones.
  *
- * @param hostname The name of the host to resolve.
- * @param is_mx True (1) if requesting the MX record result, False (0) if
- *    requesting the A record.
+ * @param qname The name asked about.
+ * @param qtype The type asked for.
+ * @param a Set to the answer; release it with answer_release when done, even
+ * 		if the cache didn't have it.
+ * @return True if the cache had the whole answer.
+ */
+static bool cached_answer(const char *qname, uint16_t qtype, Answer *a) {
+	answer_init(a, qname);
+
+	for (int hops = 0; hops <= DNS_MAX_CNAME_CHAIN; hops++) {
+		const char *owner = a->owners[hops];
+		DNSRRset *rrset = dns_cache_lookup(cache, owner, qtype);
+		bool at_end = rrset != NULL;
+		if (rrset == NULL && qtype != DNS_TYPE_CNAME) {
+			rrset = dns_cache_lookup(cache, owner, DNS_TYPE_CNAME);
+		}
+		if (rrset == NULL) {
+			return false;
+		}
+		a->rrsets[a->num_rrsets++] = rrset;
+
+		// Popular RRsets (ones asked for again near the end of their TTL)
+		// are refreshed before they expire, so clients never wait for them.
+		uint32_t ttl = dns_rrset_ttl(rrset);
+		if (rrset->ttl >= PREFETCH_MIN_TTL
+				&& ttl * PREFETCH_FRACTION <= rrset->ttl) {
+			a->prefetch = true;
+		}
+
+		if (rrset->negative) {
+			a->rcode = rrset->rcode;
+			return true;
+		}
+		for (int i = 0; i < rrset->num_records; i++) {
+			answer_add(a, owner, rrset->type, ttl, &rrset->records[i]);
+		}
+		if (at_end) {
+			return true;
+		}
+		if (hops == DNS_MAX_CNAME_CHAIN
+				|| !dns_record_name_string(&rrset->records[0], 0, a->owners[hops + 1])) {
+			return false;
+		}
+	}
+	return false;
+}
+
+/**
+ * Gathers the answer to a query from the response server_lookup got for it
+ * (the upstream server's, or the records lookup_name gathered).
+ */
+static void upstream_answer(const DNSResponse *resp, const char *qname,
+		uint16_t qtype, Answer *a) {
+	answer_init(a, qname);
+	a->rcode = resp->rcode;
+
+	for (int hops = 0; hops <= DNS_MAX_CNAME_CHAIN; hops++) {
+		const char *owner = a->owners[hops];
+		bool cname = false;
+		for (int i = 0; i < resp->num_records; i++) {
+			const DNSResourceRecord *rr = &resp->records[i];
+			if (rr->section != DNS_RANK_ANSWER
+					|| strcasecmp(rr->name, owner) != 0) {
+				continue;
+			}
+			if (rr->type == qtype) {
+				answer_add(a, owner, rr->type, rr->ttl, &rr->data);
+			}
+			else if (rr->type == DNS_TYPE_CNAME && !cname
+					&& hops < DNS_MAX_CNAME_CHAIN
+					&& dns_record_name_string(&rr->data, 0, a->owners[hops + 1])) {
+				answer_add(a, owner, rr->type, rr->ttl, &rr->data);
+				cname = true;
+			}
+		}
+		if (!cname) {
+			return;
+		}
+	}
+}
+
+/**
+ * Adds a record's data (with uncompressed names, as cached) to a message,
+ * compressing the names that may be compressed.
+ */
+static bool write_rdata(DNSBuilder *b, uint16_t type,
+		const DNSCacheRecord *data) {
+	const uint8_t *rdata = data->rdata;
+	int end;
+
+	switch (type) {
+		case DNS_TYPE_NS:
+		case DNS_TYPE_CNAME:
+		case DNS_TYPE_PTR:
+			return dns_build_wire_name(b, rdata, true);
+
+		case DNS_TYPE_MX:
+			return data->rdlength > 2 && dns_build_bytes(b, rdata, 2)
+					&& dns_build_wire_name(b, rdata + 2, true);
+
+		case DNS_TYPE_SRV:
+			return data->rdlength > 6 && dns_build_bytes(b, rdata, 6)
+					&& dns_build_wire_name(b, rdata + 6, false);
+
+		case DNS_TYPE_SOA:
+			end = dns_name_skip(dns_wire_name(rdata, data->rdlength));
+			return end > 0 && dns_build_wire_name(b, rdata, true)
+					&& dns_build_wire_name(b, rdata + end, true)
+					&& dns_build_bytes(b, data->rdata + data->rdlength - 20, 20);
+
+		default:
+			return dns_build_bytes(b, rdata, data->rdlength);
+	}
+}
+
+/**
+ * Writes the response to a client's query.
  *
- * @return A string representation of an IP address (e.g. "192.168.0.1") or
- *   mail server (e.g. "mail.google.com"). If the request could not be
- *   resolved, NULL will be returned.
+ * @param q The query.
+ * @param rcode The response code.
+ * @param a The answer (NULL for none).
+ * @param out Where to write the response (at least q->max_size bytes).
+ * @return The length of the response, or -1 if it couldn't be written.
  */
-char* resolve(char *hostname, bool is_mx) {
+static int write_response(const ClientQuery *q, int rcode, const Answer *a,
+		uint8_t *out) {
+	uint16_t flags = DNS_FLAG_QR | DNS_FLAG_RA | (q->flags & DNS_FLAG_RD)
+			| rcode;
+	DNSBuilder b;
+	dns_build_init(&b, out, q->max_size, q->id, flags);
+	if (q->has_question) {
+		dns_build_question(&b, q->name, q->qtype, DNS_CLASS_IN);
+	}
+	for (int i = 0; a != NULL && i < a->num_records; i++) {
+		const AnswerRecord *rr = &a->records[i];
+		dns_build_rr_begin(&b, DNS_SECTION_ANSWER, rr->owner, rr->type,
+				DNS_CLASS_IN, rr->ttl);
+		write_rdata(&b, rr->type, &rr->data);
+		dns_build_rr_end(&b);
+	}
+	if (q->edns) {
+		dns_build_opt(&b, DEFAULT_EDNS_PAYLOAD);
+	}
+
+	int len = dns_build_finish(&b);
+	if (len < 0 && a != NULL && a->num_records > 0) {
+		// Too big for the client: it will have to ask again over TCP.
+		dns_build_init(&b, out, q->max_size, q->id, flags | DNS_FLAG_TC);
+		dns_build_question(&b, q->name, q->qtype, DNS_CLASS_IN);
+		if (q->edns) {
+			dns_build_opt(&b, DEFAULT_EDNS_PAYLOAD);
+		}
+		len = dns_build_finish(&b);
+	}
+	return len;
+}
+
+/**
+ * Looks up the answer to a question that isn't (or soon won't be) cached,
+ * caching what is found.
+ *
+ * @param name The name asked about.
+ * @param qtype The type asked for.
+ * @param refresh Whether to ask even if the answer is cached.
+ * @param resp Set to what to answer clients with: in forwarding mode the
+ * 		upstream server's response, and otherwise the records gathered by
+ * 		lookup_name.
+ * @param answer Set to the answer as resolve_name gives it (which the caller
+ * 		must free), or NULL if there isn't one.
+ * @return False if resp wasn't set, because the lookup failed or (when not
+ * 		forwarding) found the answer in the cache.
+ */
+static bool server_lookup(const char *name, uint16_t qtype, bool refresh,
+		DNSResponse *resp, char **answer) {
+	*answer = NULL;
+	if (server.forward) {
+		ServerSet servers;
+		servers.zone[0] = '\0';
+		servers.num_addrs = 1;
+		servers.addrs[0] = server.upstream;
+		servers.num_unresolved = 0;
+		if (!query_servers(&servers, name, qtype, DNS_FLAG_RD, resp)) {
+			return false;
+		}
+		// The upstream server is recursive, so it is trusted for any zone.
+		cache_response(resp, name, qtype, "");
+		*answer = answer_from_response(resp, name, qtype);
+		return true;
+	}
 
-	if (is_mx == false) {
-		printf("Requesting A record for %s\n", hostname);
+	// Not resolve_name: this is already the question's flight.
+	*answer = lookup_name(name, qtype, 0, refresh, resp);
+	return resp->rcode >= 0;
+}
+
+/**
+ * Writes the response to a client's query once the lookup for it is done.
+ *
+ * @param q The query.
+ * @param found What server_lookup returned.
+ * @param resp What server_lookup set it to (or NULL, to answer from the
+ * 		cache).
+ * @param out Where to write the response (at least q->max_size bytes).
+ * @return The length of the response, or -1 if it couldn't be written.
+ */
+static int answer_after_lookup(const ClientQuery *q, bool found,
+		const DNSResponse *resp, uint8_t *out) {
+	Answer a;
+	int len;
+	if (found && resp != NULL) {
+		// Answered straight from the lookup, which is complete even when
+		// it couldn't be cached (e.g. a TTL of 0, or a negative answer
+		// without an SOA) or has expired since.
+		upstream_answer(resp, q->name, q->qtype, &a);
+		len = write_response(q, a.rcode, &a, out);
+	}
+	else if (cached_answer(q->name, q->qtype, &a)) {
+		len = write_response(q, a.rcode, &a, out);
 	}
 	else {
-		printf("Requesting MX record for %s\n", hostname);
+		len = write_response(q, DNS_RCODE_SERVFAIL, NULL, out);
+	}
+	answer_release(&a);
+	return len;
+}
+
+/*
+ * Answers the clients that were waiting for a flight to land (see
+ * flight_land).
+ */
+static void answer_waiters(Waiter *waiter, bool found,
+		const DNSResponse *resp) {
+	uint8_t out[MAX_UDP_PAYLOAD];
+	while (waiter != NULL) {
+		// A TCP client's waiter belongs to its thread, which may go on as
+		// soon as the flight has landed.
+		Waiter *next = waiter->next;
+		if (waiter->out != NULL) {
+			waiter->out_len = answer_after_lookup(&waiter->query, found, resp,
+					waiter->out);
+		}
+		else {
+			int len = answer_after_lookup(&waiter->query, found, resp, out);
+			if (len > 0) {
+				sendto(waiter->sock, out, len, 0,
+						(struct sockaddr*)&waiter->addr, sizeof(waiter->addr));
+			}
+			free(waiter);
+		}
+		waiter = next;
+	}
+}
+
+/**
+ * Queues a client on the flight for its question, starting one (for the
+ * lookup workers to do) if the question isn't being looked up already.
+ *
+ * @param q The query to look up the answer to.
+ * @param waiter The client, or NULL to only refresh the cache. A UDP
+ * 		client's waiter must be malloced, and is freed once it's answered. A
+ * 		TCP client's thread gets a reference to the flight, to wait on it
+ * 		with flight_wait.
+ * @return The flight, or NULL if there are too many in progress (in which
+ * 		case the client wasn't queued). Once a UDP client is queued, the
+ * 		flight may land at any moment, so it shouldn't be touched.
+ */
+static Flight *start_lookup(const ClientQuery *q, Waiter *waiter) {
+	char key[DNS_CACHE_MAX_NAME + 1];
+	flight_key(q->name, key);
+
+	pthread_mutex_lock(&flights_lock);
+	Flight *flight = flight_find(key, q->qtype);
+	if (flight == NULL && num_flights < SERVER_MAX_PENDING) {
+		flight = flight_add(key, q->qtype, waiter == NULL);
+		if (server.last_job != NULL) {
+			server.last_job->next_job = flight;
+		}
+		else {
+			server.first_job = flight;
+		}
+		server.last_job = flight;
+		pthread_cond_signal(&server.job_ready);
+	}
+
+	if (flight != NULL && waiter != NULL) {
+		waiter->next = flight->waiters;
+		flight->waiters = waiter;
+		if (waiter->out != NULL) {
+			flight->refs++;
+		}
 	}
+	pthread_mutex_unlock(&flights_lock);
+	return flight;
+}
+
+/**
+ * Takes flights off the queue and does their lookups, landing each when
+ * it's done.
+ */
+static void *lookup_worker(void *arg) {
+	(void)arg;
+	DNSResponse *resp = malloc(sizeof(DNSResponse));
+	if (resp == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	while (true) {
+		pthread_mutex_lock(&flights_lock);
+		while (server.first_job == NULL) {
+			pthread_cond_wait(&server.job_ready, &flights_lock);
+		}
+		Flight *flight = server.first_job;
+		server.first_job = flight->next_job;
+		if (server.first_job == NULL) {
+			server.last_job = NULL;
+		}
+		pthread_mutex_unlock(&flights_lock);
+
+		char *answer;
+		bool found = server_lookup(flight->name, flight->qtype,
+				flight->refresh, resp, &answer);
+		flight_land(flight, answer, found, resp);
+		free(answer);
+	}
+	return NULL;
+}
+
+/**
+ * Answers queries arriving on a UDP socket, a batch at a time. Answers found
+ * in the cache are sent straight back; other queries are handed to the
+ * lookup workers.
+ */
+static void *udp_receiver(void *arg) {
+	int sock = (intptr_t)arg;
+	uint8_t (*in)[MAX_UDP_PAYLOAD] = malloc(SERVER_RECV_BATCH * MAX_UDP_PAYLOAD);
+	uint8_t (*out)[MAX_UDP_PAYLOAD] = malloc(SERVER_RECV_BATCH * MAX_UDP_PAYLOAD);
+	if (in == NULL || out == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	struct sockaddr_in from[SERVER_RECV_BATCH];
+	struct mmsghdr in_msgs[SERVER_RECV_BATCH];
+	struct mmsghdr out_msgs[SERVER_RECV_BATCH];
+	struct iovec in_iovs[SERVER_RECV_BATCH];
+	struct iovec out_iovs[SERVER_RECV_BATCH];
+
+	while (true) {
+		for (int i = 0; i < SERVER_RECV_BATCH; i++) {
+			in_iovs[i].iov_base = in[i];
+			in_iovs[i].iov_len = MAX_UDP_PAYLOAD;
+			memset(&in_msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+			in_msgs[i].msg_hdr.msg_iov = &in_iovs[i];
+			in_msgs[i].msg_hdr.msg_iovlen = 1;
+			in_msgs[i].msg_hdr.msg_name = &from[i];
+			in_msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+		}
+
+		// Wait for one query, then take whatever else has arrived too.
+		int count = recvmmsg(sock, in_msgs, SERVER_RECV_BATCH, MSG_WAITFORONE,
+				NULL);
+		if (count < 0) {
+			if (errno != EINTR) {
+				perror("recvmmsg");
+			}
+			continue;
+		}
+
+		int num_out = 0;
+		for (int i = 0; i < count; i++) {
+			ClientQuery q;
+			int rcode = parse_client_query(in[i], in_msgs[i].msg_len, false, &q);
+			if (rcode < 0) {
+				continue;
+			}
+
+			int len = -1;
+			if (rcode != DNS_RCODE_NOERROR) {
+				len = write_response(&q, rcode, NULL, out[num_out]);
+			}
+			else {
+				Answer a;
+				if (cached_answer(q.name, q.qtype, &a)) {
+					len = write_response(&q, a.rcode, &a, out[num_out]);
+					if (a.prefetch) {
+						start_lookup(&q, NULL);
+					}
+				}
+				else {
+					Waiter *waiter = malloc(sizeof(Waiter));
+					if (waiter == NULL) {
+						perror("malloc");
+						exit(EXIT_FAILURE);
+					}
+					waiter->query = q;
+					waiter->sock = sock;
+					waiter->addr = from[i];
+					waiter->out = NULL;
+
+					// Too many lookups in progress: drop the query, and let
+					// the client ask again.
+					if (start_lookup(&q, waiter) == NULL) {
+						free(waiter);
+					}
+				}
+				answer_release(&a);
+			}
+
+			if (len > 0) {
+				out_iovs[num_out].iov_base = out[num_out];
+				out_iovs[num_out].iov_len = len;
+				memset(&out_msgs[num_out].msg_hdr, 0, sizeof(struct msghdr));
+				out_msgs[num_out].msg_hdr.msg_iov = &out_iovs[num_out];
+				out_msgs[num_out].msg_hdr.msg_iovlen = 1;
+				out_msgs[num_out].msg_hdr.msg_name = &from[i];
+				out_msgs[num_out].msg_hdr.msg_namelen = sizeof(from[i]);
+				num_out++;
+			}
+		}
+
+		if (num_out > 0 && sendmmsg(sock, out_msgs, num_out, 0) < 0) {
+			perror("sendmmsg");
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Reads or writes exactly len bytes on a TCP connection.
+ *
+ * @return False if the connection was closed, failed, or timed out.
+ */
+static bool tcp_transfer(int fd, uint8_t *buf, int len, bool write) {
+	int done = 0;
+	while (done < len) {
+		ssize_t n = write ? send(fd, buf + done, len - done, MSG_NOSIGNAL)
+				: recv(fd, buf + done, len - done, 0);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		done += n;
+	}
+	return true;
+}
+
+/**
+ * Answers the queries on a TCP connection, one after another, until the
+ * client closes it or leaves it idle for SERVER_TCP_TIMEOUT_MS.
+ */
+static void *tcp_client(void *arg) {
+	int fd = (intptr_t)arg;
+	struct timeval timeout = {SERVER_TCP_TIMEOUT_MS / 1000, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	uint8_t *in = malloc(DNS_MAX_MESSAGE_SIZE);
+	uint8_t *out = malloc(2 + DNS_MAX_MESSAGE_SIZE);
+	if (in == NULL || out == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	uint8_t prefix[2];
+	while (tcp_transfer(fd, prefix, 2, false)) {
+		int query_len = (prefix[0] << 8) | prefix[1];
+		if (!tcp_transfer(fd, in, query_len, false)) {
+			break;
+		}
+
+		ClientQuery q;
+		int rcode = parse_client_query(in, query_len, true, &q);
+		if (rcode < 0) {
+			continue;
+		}
+
+		int len;
+		Answer a;
+		if (rcode != DNS_RCODE_NOERROR) {
+			len = write_response(&q, rcode, NULL, out + 2);
+		}
+		else if (cached_answer(q.name, q.qtype, &a)) {
+			len = write_response(&q, a.rcode, &a, out + 2);
+			answer_release(&a);
+		}
+		else {
+			// Wait in line with everyone else asking the same question; the
+			// response is written into out when the lookup lands.
+			answer_release(&a);
+			Waiter waiter;
+			waiter.query = q;
+			waiter.out = out + 2;
+			waiter.out_len = -1;
+			Flight *flight = start_lookup(&q, &waiter);
+			if (flight != NULL) {
+				pthread_mutex_lock(&flights_lock);
+				free(flight_wait(flight));
+				pthread_mutex_unlock(&flights_lock);
+				len = waiter.out_len;
+			}
+			else {
+				len = write_response(&q, DNS_RCODE_SERVFAIL, NULL, out + 2);
+			}
+		}
+
+		if (len > 0) {
+			out[0] = len >> 8;
+			out[1] = len & 0xff;
+			if (!tcp_transfer(fd, out, 2 + len, true)) {
+				break;
+			}
+		}
+	}
+
+	close(fd);
+	free(in);
+	free(out);
+	dns_tcp_pool_free();
+	return NULL;
+}
+
+/**
+ * Accepts TCP connections, giving each its own thread.
+ */
+static void *tcp_acceptor(void *arg) {
+	int listen_fd = (intptr_t)arg;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				perror("accept");
+			}
+			continue;
+		}
+		pthread_t thread;
+		if (pthread_create(&thread, &attr, tcp_client, (void*)(intptr_t)fd)
+				!= 0) {
+			close(fd);
+		}
+	}
+	return NULL;
+}
 
-	// create a UDP (i.e. Datagram) socket
-	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+/**
+ * Opens a socket bound to a port on the loopback address.
+ *
+ * @param type SOCK_DGRAM or SOCK_STREAM.
+ * @param port The port to bind to.
+ * @return The socket.
+ */
+static int server_socket(int type, uint16_t port) {
+	int sock = socket(AF_INET, type, 0);
 	if (sock < 0) {
 		perror("socket");
-		exit(0);
+		exit(EXIT_FAILURE);
 	}
-	// Create a time value structure and set it to five seconds.
-	struct timeval tv;
-	memset(&tv, 0, sizeof(struct timeval));
-	tv.tv_sec = 5;
 
-	/* Tell the OS to use that time value as a time out for operations on
-	 * our socket. */
-	int res = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv,
-			sizeof(struct timeval));
-
-	if (res < 0) {
+	// SO_REUSEPORT lets each receiving thread have a socket of its own on
+	// the same port, with the kernel spreading the queries between them.
+	int on = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0
+			|| setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
 		perror("setsockopt");
-		exit(0);
+		exit(EXIT_FAILURE);
 	}
 
-	// The following is the IP address of USD's local DNS server. It is a
-	// placeholder only (i.e. you shouldn't have this hardcoded into your final
-	// program).
-	in_addr_t nameserver_addr = inet_addr("172.16.7.15");
-	
-	struct sockaddr_in addr; 	// internet socket address data structure
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
-	addr.sin_port = htons(53); // port 53 for DNS
-	addr.sin_addr.s_addr = nameserver_addr; // destination address (any local for now)
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+	return sock;
+}
 
-	// uint8_t is a standard, unsigned 8-bit value.
-	// You should use that type for all buffers used for sending to and
-	// receiving from the DNS server.
-	uint8_t query[MAX_QUERY_SIZE]; 
-	int query_len=construct_query(query, hostname);
+/**
+ * Saves a snapshot of the cache every SNAPSHOT_INTERVAL seconds, and once
+ * more when the server is told to stop (with SIGINT or SIGTERM, which the
+ * other threads have blocked), so a restarted server starts warm.
+ */
+static void *snapshot_saver(void *arg) {
+	(void)arg;
+	sigset_t stop_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	struct timespec interval = {SNAPSHOT_INTERVAL, 0};
 
-	int send_count = sendto(sock, query, query_len, 0,
-							(struct sockaddr*)&addr, sizeof(addr));
+	while (true) {
+		int sig = sigtimedwait(&stop_signals, NULL, &interval);
+		if (sig < 0 && errno == EINTR) {
+			continue;
+		}
+		dns_snapshot_save(cache, snapshot_file);
+		if (sig > 0) {
+			exit(EXIT_SUCCESS);
+		}
+	}
+	return NULL;
+}
 
-	if (send_count<0) { 
-		perror("Send failed");
-		exit(1);
+/**
+ * Runs as a local caching DNS server on 127.0.0.1, answering queries over
+ * UDP and TCP. Answers come from the cache when possible (with their TTLs
+ * counting down); otherwise they are looked up, either iteratively or by
+ * forwarding the query to a recursive server. Never returns.
+ *
+ * @param port The port to listen on.
+ * @param upstream The recursive server to forward queries to, or NULL to
+ * 		resolve them iteratively.
+ */
+static void run_server(uint16_t port, const struct in_addr *upstream) {
+	if (upstream != NULL) {
+		server.forward = true;
+		server.upstream = *upstream;
 	}
 
-	socklen_t len = sizeof(struct sockaddr_in);
+	pthread_t thread;
+	if (snapshot_file != NULL) {
+		// Leave stopping to the snapshot thread: every thread started from
+		// here on inherits this mask.
+		sigset_t stop_signals;
+		sigemptyset(&stop_signals);
+		sigaddset(&stop_signals, SIGINT);
+		sigaddset(&stop_signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+		if (pthread_create(&thread, NULL, snapshot_saver, NULL) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	uint8_t response[MAX_RESPONSE_SIZE];
+	for (int i = 0; i < SERVER_WORKERS; i++) {
+		if (pthread_create(&thread, NULL, lookup_worker, NULL) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	/* Blocking calls will now return error (-1) after the timeout period with
-	 * errno set to EAGAIN. */
-	res = recvfrom(sock, response, MAX_RESPONSE_SIZE, 0, 
-					(struct sockaddr *)&addr, &len);
+	int listen_fd = server_socket(SOCK_STREAM, port);
+	if (listen(listen_fd, SOMAXCONN) < 0) {
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_create(&thread, NULL, tcp_acceptor,
+				(void*)(intptr_t)listen_fd) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
 
-	if (res < 1) {
-		if (errno == EAGAIN) {
-			printf("Timed out!\n");
-		} else {
-			perror("recv");
+	long num_receivers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_receivers < 1) {
+		num_receivers = 1;
+	}
+	if (num_receivers > SERVER_MAX_RECEIVERS) {
+		num_receivers = SERVER_MAX_RECEIVERS;
+	}
+	for (long i = 0; i < num_receivers; i++) {
+		int sock = server_socket(SOCK_DGRAM, port);
+		int buffer_size = SERVER_SOCKET_BUFFER;
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size,
+				sizeof(buffer_size));
+		if (pthread_create(&thread, NULL, udp_receiver,
+					(void*)(intptr_t)sock) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
 		}
 	}
 
-	// TODO: The server's response will be located in the response array for you
-	// to further process and extract the needed information.
-	// Remember that DNS is a binary protocol: if you try printing out response
-	// as a string, it won't work correctly.
+	fprintf(stderr, "Listening on 127.0.0.1:%d (%ld UDP threads), %s\n",
+			port, num_receivers, upstream != NULL ? "forwarding"
+			: "resolving iteratively");
+	pthread_join(thread, NULL);
+}
 
-	return NULL;
+/**
+ * Finds the first name server listed in /etc/resolv.conf, to use as the
+ * upstream server in batch mode when none is given.
+ *
+ * @param addr Set to the server's address.
+ * @return True if one was found.
+ */
+static bool system_nameserver(struct in_addr *addr) {
+	FILE *f = fopen("/etc/resolv.conf", "r");
+	if (f == NULL) {
+		return false;
+	}
+
+	char line[256];
+	char server[64];
+	bool found = false;
+	while (!found && fgets(line, sizeof(line), f) != NULL) {
+		found = sscanf(line, " nameserver %63s", server) == 1
+				&& inet_pton(AF_INET, server, addr) == 1;
+	}
+	fclose(f);
+	return found;
+}
+
+/**
+ * Fills the cache from the snapshot file, if one was given and exists.
+ */
+static void load_snapshot(void) {
+	if (snapshot_file == NULL) {
+		return;
+	}
+	int loaded = dns_snapshot_load(cache, snapshot_file);
+	if (loaded >= 0) {
+		fprintf(stderr, "Loaded %d cached RRsets from %s\n", loaded,
+				snapshot_file);
+	}
 }
 
+/**
+ * Prints how to use the program.
+ *
+ * @param prog_name The name the program was run as.
+ */
+static void usage(char *prog_name) {
+	printf("Usage: %s [-m | -t type] [-e size] [-c file] hostname ...\n",
+			prog_name);
+	printf("       %s [-m | -t type] [-e size] [-c file] -b file [-s server]\n",
+			prog_name);
+	printf("       %s [-e size] [-c file] -d port [-s server]\n", prog_name);
+	printf("  -m         look up mail servers (MX records) instead of addresses\n");
+	printf("  -t type    look up records of this type: A, AAAA, MX, NS, CNAME,\n");
+	printf("             TXT, SRV, PTR or SOA\n");
+	printf("  -b file    batch mode: resolve every name in file (- for stdin)\n");
+	printf("  -d port    server mode: answer queries on 127.0.0.1:port, caching\n");
+	printf("             the answers\n");
+	printf("  -s server  recursive server to use in batch mode (default: the\n");
+	printf("             first nameserver in /etc/resolv.conf), or to forward\n");
+	printf("             queries to in server mode (default: resolve them\n");
+	printf("             iteratively)\n");
+	printf("  -e size    EDNS0 UDP payload size to advertise, from 512 to %d\n",
+			MAX_UDP_PAYLOAD);
+	printf("             (default: %d; 0 to not use EDNS0)\n",
+			DEFAULT_EDNS_PAYLOAD);
+	printf("  -c file    load the cache from file at startup, and save it\n");
+	printf("             there on exit (and every %d seconds in server mode)\n",
+			SNAPSHOT_INTERVAL);
+}
 
 int main(int argc, char **argv) {
-	if (argc < 2) {
-		// TODO: provide a more helpful message on how to use the program
-		printf("Invalid program usage for %s!\n", argv[0]);
+	uint16_t qtype = DNS_TYPE_A;
+	char *batch_file = NULL;
+	char *server = NULL;
+	int port = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "mt:b:s:e:d:c:")) != -1) {
+		switch (opt) {
+			case 'm':
+				qtype = DNS_TYPE_MX;
+				break;
+			case 't':
+				qtype = dns_type_from_name(optarg);
+				if (qtype == 0) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'b':
+				batch_file = optarg;
+				break;
+			case 's':
+				server = optarg;
+				break;
+			case 'c':
+				snapshot_file = optarg;
+				break;
+			case 'd':
+				port = atoi(optarg);
+				if (port <= 0 || port > 65535) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'e': {
+				char *end;
+				long size = strtol(optarg, &end, 10);
+				if (*end != '\0' || (size != 0
+							&& (size < 512 || size > MAX_UDP_PAYLOAD))) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				edns_payload_size = size;
+				break;
+			}
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
 	}
 
-	char *answer = resolve("www.sandiego.edu", false);
+	if (port != 0 ? (batch_file != NULL || optind < argc)
+			: (batch_file == NULL) == (optind >= argc)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
 
-	if (answer != NULL) {
-		printf("Answer: %s\n", answer);
+	if (port != 0) {
+		struct in_addr upstream;
+		if (server != NULL && inet_pton(AF_INET, server, &upstream) != 1) {
+			fprintf(stderr, "No valid recursive server to use\n");
+			exit(EXIT_FAILURE);
+		}
+		if (server == NULL) {
+			load_root_hints(ROOT_HINTS_FILE);
+		}
+		cache = dns_cache_create(SERVER_CACHE_SIZE);
+		load_snapshot();
+		run_server(port, server != NULL ? &upstream : NULL);
 	}
-	else {
-		printf("Could not resolve request.\n");
+
+	if (batch_file != NULL) {
+		struct in_addr upstream;
+		if (server != NULL ? inet_pton(AF_INET, server, &upstream) != 1
+				: !system_nameserver(&upstream)) {
+			fprintf(stderr, "No valid recursive server to use\n");
+			exit(EXIT_FAILURE);
+		}
+
+		FILE *in = stdin;
+		if (strcmp(batch_file, "-") != 0 && (in = fopen(batch_file, "r")) == NULL) {
+			perror(batch_file);
+			exit(EXIT_FAILURE);
+		}
+
+		cache = dns_cache_create(BATCH_CACHE_SIZE);
+		load_snapshot();
+		resolve_batch(in, upstream, qtype);
+		fclose(in);
+		if (snapshot_file != NULL) {
+			dns_snapshot_save(cache, snapshot_file);
+		}
+		dns_tcp_pool_free();
+		dns_cache_free(cache);
+		return 0;
+	}
+
+	load_root_hints(ROOT_HINTS_FILE);
+	cache = dns_cache_create(CACHE_SIZE);
+	load_snapshot();
+
+	for (int i = optind; i < argc; i++) {
+		char *answer = resolve_type(argv[i], qtype);
+
+		if (answer != NULL) {
+			printf("Answer: %s\n", answer);
+			free(answer);
+		}
+		else {
+			printf("Could not resolve request.\n");
+		}
 	}
 
+	if (snapshot_file != NULL) {
+		dns_snapshot_save(cache, snapshot_file);
+	}
+	dns_tcp_pool_free();
+	dns_cache_free(cache);
 	return 0;
 }
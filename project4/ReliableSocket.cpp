@@ -10,7 +10,8 @@
 // C++ library includes
 #include <iostream>
 #include <string.h>
-#include <chrono>
+#include <stdlib.h>
+#include <algorithm>
 
 // OS specific includes
 #include <unistd.h>
@@ -18,6 +19,8 @@
 #include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -31,11 +34,88 @@ using std::cout;
  * in the ReliableSocket header file.
  */
 
+// Bounds on the retransmission timeout, in milliseconds.
+static const int MIN_RTO_MS = 10;
+static const int MAX_RTO_MS = 500;
+
+// Number of times a segment is sent before we give up on the connection.
+static const int MAX_TRANSMISSIONS = 10;
+
+// Longest we wait for the remote host to close its side once ours is closed.
+static const int FIN_WAIT_TIMEOUT_MS = MAX_TRANSMISSIONS * MAX_RTO_MS;
+
+/*
+ * Returns true if timestamp a was taken before timestamp b. Timestamps are
+ * 32-bit millisecond counters, so this comparison handles wraparound.
+ */
+static bool ts_before(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) < 0;
+}
+
+/*
+ * Returns true if sequence number a comes before sequence number b, handling
+ * wraparound of the 32-bit sequence space.
+ */
+static bool seq_before(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) < 0;
+}
+
+/*
+ * Decodes the header of a received segment, dropping segments that are
+ * malformed, fail their checksum (or lack one when it's required), or carry
+ * more data than MAX_DATA_SIZE.
+ *
+ * @return Size of the segment's header, or -1 if the segment should be
+ * 		ignored.
+ */
+static int decode_segment(char *segment, int length, RDTHeader *hdr,
+							bool require_checksum) {
+	int hdr_len = rdt_decode_header((uint8_t*)segment, length, hdr);
+	if (hdr_len < 0) {
+		cerr << "INFO: Dropping malformed segment\n";
+		return -1;
+	}
+	// A peer with a header shorter than RDT_MAX_HEADER_SIZE could fit more
+	// data than that in a segment, which wouldn't fit a receive_data buffer.
+	if (length - hdr_len > ReliableSocket::MAX_DATA_SIZE) {
+		cerr << "INFO: Dropping oversized segment\n";
+		return -1;
+	}
+	if (!rdt_checksum_ok((uint8_t*)segment, length, require_checksum)) {
+		cerr << "INFO: Dropping corrupt segment\n";
+		return -1;
+	}
+	return hdr_len;
+}
+
 ReliableSocket::ReliableSocket() {
 	this->sequence_number = 0;
 	this->expected_sequence_number = 0;
 	this->estimated_rtt = 100;
 	this->dev_rtt = 10;
+	this->checksum_enabled = true;
+	this->ts_recent = 0;
+	const char *fast_open_env = getenv("RDT_FAST_OPEN");
+	this->fast_open = fast_open_env != NULL && strcmp(fast_open_env, "1") == 0;
+	this->initiator = false;
+
+	this->oldest_unacked = 0;
+	this->send_window_bytes = 0;
+	this->peer_window = MAX_DATA_SIZE;
+	this->retransmit_deadline = 0;
+	this->backoff_timeout = 0;
+	this->duplicate_acks = 0;
+
+	this->read_sequence_number = 0;
+	this->receive_buffer_size = DEFAULT_RECEIVE_BUFFER_SIZE;
+	this->receive_buffered_bytes = 0;
+	this->last_advertised_window = 0;
+	this->peer_closed = false;
+	this->app_closed = false;
+
+	this->fin_sent = false;
+	this->fin_sequence_number = 0;
+	this->linger_deadline = 0;
 
 	this->sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (this->sock_fd < 0) {
@@ -70,20 +150,30 @@ void ReliableSocket::accept_connection(int port_num) {
 	struct sockaddr_in fromaddr;
 	unsigned int addrlen = sizeof(fromaddr);
 	// Will always eventually receive an initial CONN message
-	int attempts = 0;
-	RDTHeader* hdr;
-	while (attempts < 5){
+	RDTHeader hdr;
+	char *conn_data;
+	int conn_data_size;
+	while (true){
 		int recv_count = recvfrom(this->sock_fd, segment, MAX_SEG_SIZE, 0, 
 									(struct sockaddr*)&fromaddr, &addrlen);		
 		if (recv_count < 0) {
 			perror("accept recvfrom");
 			exit(EXIT_FAILURE);
 		}
-		hdr = (RDTHeader*)segment;
-		if (hdr->type != RDT_CONN) {
-			attempts++;
+		int hdr_len = decode_segment(segment, recv_count, &hdr,
+										this->checksum_enabled);
+		if (hdr_len < 0) {
+			continue;
+		}
+		if (hdr.type == RDT_CONN) {
+			this->record_timestamp(&hdr);
+			if (hdr.has_window) {
+				this->peer_window = hdr.window;
+			}
+			conn_data = segment + hdr_len;
+			conn_data_size = recv_count - hdr_len;
+			break;
 		}
-		break;
 	}
 
 	/*
@@ -107,43 +197,84 @@ void ReliableSocket::accept_connection(int port_num) {
 	// Note that this function is called by the connection receiver/listener.
 
 
+	// Data segments that follow the handshake start at sequence number 1,
+	// in both directions.
+	this->expected_sequence_number = 1;
+	this->read_sequence_number = 1;
+	this->sequence_number = 1;
+	this->oldest_unacked = 1;
+
+	// Fast open: data riding on the RDT_CONN is segment 1. Buffer it, reply
+	// with an RDT_CONN that also ACKs it, and consider ourselves connected
+	// straight away. If our reply is lost the sender repeats its RDT_CONN,
+	// which handle_incoming answers again without buffering the data twice.
+	if (conn_data_size > 0) {
+		this->receive_buffer[1].assign(conn_data, conn_data + conn_data_size);
+		this->receive_buffered_bytes += conn_data_size;
+		this->expected_sequence_number = 2;
+		this->state = ESTABLISHED;
+		this->send_conn_reply();
+		cerr << "INFO: Connection ESTABLISHED (fast open)\n";
+		return;
+	}
+
 	// Send an Ack indicating that we are good to go.
 	// Let the sender know which socket we have allocated to them
 
-	hdr->ack_number = htonl(0);
-	hdr->sequence_number = htonl(0);
-	hdr->type = RDT_CONN;
-	attempts = 0;
+	int attempts = 0;
 	while(this->state != ESTABLISHED){
 		if (attempts > 10){
 			cerr << "Maximum attempts reached";
 			exit(EXIT_FAILURE);
 		}
 		attempts += 1;
-		if (send(this->sock_fd, segment, sizeof(RDTHeader), 0) < 0) {
-			perror("ERROR: Did not properly send ACK");
-		}
+		this->send_conn_reply();
 		
 		char received_segment[MAX_SEG_SIZE];
-		memset(received_segment, 0, MAX_SEG_SIZE);
+		RDTHeader rec_hdr;
+		char *data;
 
-		this->set_timeout_length(this->estimated_rtt*1.5);
-		if (recv(this->sock_fd, received_segment, MAX_SEG_SIZE, 0) != EWOULDBLOCK){
-			attempts = 0;
-			RDTHeader* rec_hdr = (RDTHeader*)received_segment;
-			if(rec_hdr->type == RDT_ACK){
-				this->state = ESTABLISHED;
-				this->expected_sequence_number += 1;
-				
-				// Make it so no other recv calls for the receiver timeout
-				this->set_timeout_length(0);
-				cerr << "INFO: Connection ESTABLISHED\n";
-				break;
+		this->set_timeout_length(this->retransmit_timeout());
+		int recv_data_size = this->recv_segment(received_segment, &rec_hdr,
+												&data, 0);
+		if (recv_data_size < 0){
+			continue;
+		}
+		attempts = 0;
+
+		// A repeated RDT_CONN just means our reply was lost, so loop around
+		// and send it again. An ACK completes the handshake, and so does
+		// data: the sender only sends data once it has our reply, so the
+		// ACK must have been lost.
+		if(rec_hdr.type == RDT_ACK || rec_hdr.type == RDT_DATA){
+			this->sample_rtt(&rec_hdr);
+			this->state = ESTABLISHED;
+			
+			// Make it so no other recv calls for the receiver timeout
+			this->set_timeout_length(0);
+			cerr << "INFO: Connection ESTABLISHED\n";
+
+			if (rec_hdr.type == RDT_DATA) {
+				this->handle_incoming(&rec_hdr, data, recv_data_size);
+			}
+			else {
+				this->record_timestamp(&rec_hdr);
+				if (rec_hdr.has_window) {
+					this->peer_window = rec_hdr.window;
+				}
 			}
 		}
 	}
 }
 
+void ReliableSocket::send_conn_reply() {
+	RDTHeader hdr;
+	rdt_init_header(&hdr, RDT_CONN, 0, this->expected_sequence_number);
+	if (this->send_segment(&hdr, NULL, 0) < 0) {
+		perror("ERROR: Did not properly send ACK");
+	}
+}
+
 void ReliableSocket::connect_to_remote(char *hostname, int port_num) {
 	if (this->state != INIT) {
 		cerr << "Cannot call connect_to_remote on used socket\n";
@@ -166,14 +297,27 @@ void ReliableSocket::connect_to_remote(char *hostname, int port_num) {
 		perror("connect");
 	}
 
-	// Send an RDT_CONN message to remote host to initiate an RDT connection.
-	char segment[sizeof(RDTHeader)];
-	memset(segment, 0, sizeof(RDTHeader));	
-	RDTHeader* hdr = (RDTHeader*)segment;
+	// Data segments that follow the handshake start at sequence number 1,
+	// in both directions.
+	this->sequence_number = 1;
+	this->oldest_unacked = 1;
+	this->expected_sequence_number = 1;
+	this->read_sequence_number = 1;
+	this->initiator = true;
 
-	hdr->ack_number = htonl(0);
-	hdr->sequence_number = htonl(0);
-	hdr->type = RDT_CONN;
+	// With fast open the handshake waits for the first send_data call, so
+	// its data can ride along on the RDT_CONN.
+	if (this->fast_open) {
+		this->state = CONN_PENDING;
+		return;
+	}
+	this->handshake();
+}
+
+void ReliableSocket::handshake() {
+	// Send an RDT_CONN message to remote host to initiate an RDT connection.
+	RDTHeader hdr;
+	rdt_init_header(&hdr, RDT_CONN, 0, 0);
 	
 	// Handshaking protocol for the connection setup.
 	// Note that this function is called by the connection initiator.
@@ -187,24 +331,26 @@ void ReliableSocket::connect_to_remote(char *hostname, int port_num) {
 			exit(EXIT_FAILURE);
 		}
 		attempts += 1;
-		if (send(this->sock_fd, segment, sizeof(RDTHeader), 0) < 0) {
+		if (this->send_segment(&hdr, NULL, 0) < 0) {
 			perror("conn1 send");
 		}
 
 		// Start timer, wait for ACK
 		// Also checks that the response from the receiver is the correct ACK 
-		this->set_timeout_length(this->estimated_rtt*1.5);
+		this->set_timeout_length(this->retransmit_timeout());
 		char received_segment[MAX_SEG_SIZE];
-		memset(received_segment, 0, MAX_SEG_SIZE);
-		if(recv(this->sock_fd, received_segment, MAX_SEG_SIZE, 0) != EWOULDBLOCK){
-			RDTHeader* rec_hdr = (RDTHeader*)received_segment;
-			memset(received_segment, 0, MAX_SEG_SIZE);
-			if(rec_hdr->type == RDT_CONN){
+		RDTHeader rec_hdr;
+		if(this->recv_segment(received_segment, &rec_hdr, NULL, 0) >= 0){
+			if(rec_hdr.type == RDT_CONN){
+				this->sample_rtt(&rec_hdr);
+				this->record_timestamp(&rec_hdr);
+				if (rec_hdr.has_window) {
+					this->peer_window = rec_hdr.window;
+				}
 				this->state = ESTABLISHED;
-				this->sequence_number += 1;
 				cerr << "INFO: Connection ESTABLISHED\n";
-				hdr->type = RDT_ACK;
-				if (send(this->sock_fd, segment, sizeof(RDTHeader), 0) < 0) {
+				hdr.type = RDT_ACK;
+				if (this->send_segment(&hdr, NULL, 0) < 0) {
 					perror("End of handshake fail");
 				}
 				break;
@@ -219,6 +365,128 @@ uint32_t ReliableSocket::get_estimated_rtt() {
 	return this->estimated_rtt;
 }
 
+void ReliableSocket::set_checksum_enabled(bool enabled) {
+	this->checksum_enabled = enabled;
+}
+
+void ReliableSocket::set_fast_open(bool enabled) {
+	this->fast_open = enabled;
+}
+
+void ReliableSocket::set_receive_buffer_size(uint32_t bytes) {
+	this->receive_buffer_size = std::max(bytes, (uint32_t)MAX_DATA_SIZE);
+}
+
+uint32_t ReliableSocket::retransmit_timeout() {
+	int rto = this->estimated_rtt + 4*this->dev_rtt;
+	return std::max(MIN_RTO_MS, std::min(rto, MAX_RTO_MS));
+}
+
+void ReliableSocket::sample_rtt(const RDTHeader *hdr) {
+	if (!hdr->has_timestamp || hdr->ts_echo == 0) {
+		return;
+	}
+
+	int sample = (int)((uint32_t)current_msec() - hdr->ts_echo);
+	if (sample < 0) {
+		return;
+	}
+
+	// Jacobson/Karels: smooth both the RTT and its deviation.
+	int deviation = std::abs(sample - this->estimated_rtt);
+	this->estimated_rtt = (int)(.875 * this->estimated_rtt + .125 * sample);
+	this->dev_rtt = (int)(.75 * this->dev_rtt + .25 * deviation);
+}
+
+bool ReliableSocket::timestamp_is_stale(const RDTHeader *hdr) {
+	return hdr->has_timestamp && this->ts_recent != 0
+		&& ts_before(hdr->ts_value, this->ts_recent);
+}
+
+bool ReliableSocket::record_timestamp(const RDTHeader *hdr) {
+	if (!hdr->has_timestamp) {
+		return true;
+	}
+	if (this->timestamp_is_stale(hdr)) {
+		return false;
+	}
+	this->ts_recent = hdr->ts_value;
+	return true;
+}
+
+int ReliableSocket::send_segment(RDTHeader *hdr, const void *data, int length) {
+	uint8_t header[RDT_MAX_HEADER_SIZE];
+
+	if (this->checksum_enabled) {
+		hdr->flags |= RDT_FLAG_CHECKSUM;
+	}
+	else {
+		hdr->flags &= ~RDT_FLAG_CHECKSUM;
+	}
+
+	// Stamp every segment so the peer can echo it back in its replies.
+	hdr->has_timestamp = true;
+	hdr->ts_value = (uint32_t)current_msec();
+	hdr->ts_echo = this->ts_recent;
+
+	// Every segment also tells the peer how much more we can buffer.
+	hdr->has_window = true;
+	hdr->window = this->advertised_window();
+	this->last_advertised_window = hdr->window;
+
+	int hdr_len = rdt_encode_header(hdr, header);
+	rdt_set_checksum(header, hdr_len, data, length);
+
+	// Gather the header and data straight into the datagram, rather than
+	// copying the data in behind the header first.
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = hdr_len;
+	iov[1].iov_base = (void*)data;
+	iov[1].iov_len = length;
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = length > 0 ? 2 : 1;
+	return sendmsg(this->sock_fd, &msg, 0);
+}
+
+int ReliableSocket::recv_segment(char segment[MAX_SEG_SIZE], RDTHeader *hdr,
+									char **payload, int flags) {
+	while (true) {
+		int recv_count = recv(this->sock_fd, segment, MAX_SEG_SIZE, flags);
+		if (recv_count < 0) {
+			return recv_count;
+		}
+
+		int hdr_len = decode_segment(segment, recv_count, hdr,
+										this->checksum_enabled);
+		if (hdr_len >= 0) {
+			if (payload != NULL) {
+				*payload = segment + hdr_len;
+			}
+			return recv_count - hdr_len;
+		}
+	}
+}
+
+int ReliableSocket::wait_for_segment(char segment[MAX_SEG_SIZE], RDTHeader *hdr,
+										char **payload, int timeout_ms) {
+	fd_set read_fds;
+	FD_ZERO(&read_fds);
+	FD_SET(this->sock_fd, &read_fds);
+
+	struct timeval timeout;
+	msec_to_timeval(std::max(timeout_ms, 0), &timeout);
+	int ready = select(this->sock_fd + 1, &read_fds, NULL, NULL,
+						timeout_ms < 0 ? NULL : &timeout);
+	if (ready <= 0) {
+		return -1;
+	}
+	return this->recv_segment(segment, hdr, payload, MSG_DONTWAIT);
+}
+
 // We did not modify this function in any way.
 void ReliableSocket::set_timeout_length(uint32_t timeout_length_ms) {
 	cerr << "INFO: Setting timeout to " << timeout_length_ms << " ms\n";
@@ -233,203 +501,648 @@ void ReliableSocket::set_timeout_length(uint32_t timeout_length_ms) {
 }
 
 void ReliableSocket::send_data(const void *data, int length) {
-	if (this->state != ESTABLISHED) {
+	if (!this->can_send()) {
 		cerr << "INFO: Cannot send: Connection not established.\n";
 		return;
 	}
 
- 	// Create the segment, which contains a header followed by the data.
-	char segment[MAX_SEG_SIZE];
-	memset(segment, 0, MAX_SEG_SIZE);
+	// The window keeps its own copy of the data, so the caller may reuse
+	// its buffer as soon as we return.
+	const char *next = (const char*)data;
+	while (length > 0) {
+		int seg_length = std::min(length, (int)MAX_DATA_SIZE);
+		this->queue_segment(next, seg_length, true);
+		next += seg_length;
+		length -= seg_length;
+	}
+}
 
-	// Fill in the header
-	RDTHeader *hdr = (RDTHeader*)segment;
-	
-	hdr->sequence_number = htonl(this->sequence_number);
-	hdr->ack_number = htonl(0);
-	hdr->type = RDT_DATA;
-	// Copy the user-supplied data to the spot right past the 
-	// 	header (i.e. hdr+1).
-	memcpy(hdr+1, data, length);
-	this->set_timeout_length(std::min((int)(this->estimated_rtt * 1.5), 500));
-	int attempts = 0;
-	bool no_repeat_send = false;
-	while(true){
-		if (attempts > 10){
-			cerr << "Maximum data send attempt exceeded exiting\n";
-			exit(EXIT_FAILURE);
+bool ReliableSocket::send_stream(const void *buffer, size_t length) {
+	if (!this->can_send()) {
+		cerr << "INFO: Cannot send: Connection not established.\n";
+		return false;
+	}
+
+	// Segments point straight into the caller's buffer, which is why we
+	// can't return until they have all been ACKed.
+	const char *next = (const char*)buffer;
+	while (length > 0 && this->is_open()) {
+		int seg_length = std::min(length, (size_t)MAX_DATA_SIZE);
+		this->queue_segment(next, seg_length, false);
+		next += seg_length;
+		length -= seg_length;
+	}
+	this->flush_send_window();
+
+	// A reset empties the window without any of it having been ACKed.
+	return this->is_open() && this->send_window.empty();
+}
+
+ssize_t ReliableSocket::send_file(int fd, off_t offset, size_t count) {
+	if (!this->can_send()) {
+		cerr << "INFO: Cannot send: Connection not established.\n";
+		return -1;
+	}
+
+	struct stat file_info;
+	if (fstat(fd, &file_info) < 0) {
+		perror("send_file fstat");
+		return -1;
+	}
+	if (offset >= file_info.st_size) {
+		return 0;
+	}
+	if (count == 0 || offset + (off_t)count > file_info.st_size) {
+		count = file_info.st_size - offset;
+	}
+
+	// Map the file so its pages are sent directly. mmap needs a page
+	// aligned offset, so map from the start of the page holding offset.
+	off_t page_offset = offset % sysconf(_SC_PAGESIZE);
+	size_t map_length = count + page_offset;
+	void *mapping = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd,
+							offset - page_offset);
+	if (mapping == MAP_FAILED) {
+		perror("send_file mmap");
+		return -1;
+	}
+	madvise(mapping, map_length, MADV_SEQUENTIAL);
+
+	bool sent = this->send_stream((char*)mapping + page_offset, count);
+
+	munmap(mapping, map_length);
+	return sent ? (ssize_t)count : -1;
+}
+
+bool ReliableSocket::can_send() {
+	// After the remote host closes its side we can still send (half-close).
+	return this->state == ESTABLISHED || this->state == CONN_PENDING
+		|| this->state == CONN_SENT || this->state == CLOSE_WAIT;
+}
+
+bool ReliableSocket::is_open() {
+	return this->state != INIT && this->state != CLOSED;
+}
+
+void ReliableSocket::queue_segment(const char *data, int length, bool copy) {
+	// Wait for room in both our window and the receiver's. If the receiver
+	// has no room at all, the timer makes handle_timeout probe it until it
+	// advertises a window again.
+	while (this->is_open() && !this->window_has_room(length)) {
+		if (this->retransmit_deadline == 0) {
+			this->backoff_timeout = this->retransmit_timeout();
+			this->retransmit_deadline = current_msec() + this->backoff_timeout;
 		}
-		attempts += 1;
-		if (no_repeat_send){
-			no_repeat_send = false;
+		this->service_send_window(true);
+	}
+	if (!this->is_open()) {
+		return;
+	}
+
+	// The data has to stay available until it has been ACKed, in case it
+	// needs to be retransmitted.
+	this->send_window.push_back(SentSegment());
+	SentSegment &seg = this->send_window.back();
+	seg.sequence_number = this->sequence_number;
+	if (copy) {
+		seg.copy.assign(data, data + length);
+		data = seg.copy.data();
+	}
+	seg.data = data;
+	seg.length = length;
+	seg.transmissions = 0;
+	seg.sacked = false;
+	this->send_window_bytes += length;
+	this->sequence_number += 1;
+
+	// Fast open: the first segment is sent on the RDT_CONN itself.
+	if (this->state == CONN_PENDING) {
+		this->state = CONN_SENT;
+	}
+	this->transmit(this->send_window.back());
+	if (this->retransmit_deadline == 0) {
+		this->backoff_timeout = this->retransmit_timeout();
+		this->retransmit_deadline = current_msec() + this->backoff_timeout;
+	}
+
+	// Take care of any ACKs that have already arrived, without waiting.
+	while (this->service_send_window(false));
+}
+
+void ReliableSocket::transmit(SentSegment &seg) {
+	if (seg.transmissions >= MAX_TRANSMISSIONS) {
+		cerr << "Maximum data send attempt exceeded exiting\n";
+		exit(EXIT_FAILURE);
+	}
+	seg.transmissions += 1;
+
+	// Until a fast open handshake completes, the first segment goes out as
+	// the RDT_CONN (whose sequence number is always 0) that opens it.
+	RDTHeader hdr;
+	if (this->state == CONN_SENT) {
+		rdt_init_header(&hdr, RDT_CONN, 0, 0);
+	}
+	else {
+		rdt_init_header(&hdr, RDT_DATA, seg.sequence_number,
+						this->expected_sequence_number);
+	}
+	if (this->send_segment(&hdr, seg.data, seg.length) < 0) {
+		perror("send_data send");
+		exit(EXIT_FAILURE);
+	}
+}
+
+bool ReliableSocket::window_has_room(int length) {
+	// Only the segment on the RDT_CONN may be in flight until the receiver
+	// has answered it.
+	if (this->state == CONN_PENDING || this->state == CONN_SENT) {
+		return this->send_window.empty();
+	}
+	return this->send_window.size() < (size_t)MAX_SEND_WINDOW
+		&& this->send_window_bytes + length <= this->peer_window;
+}
+
+void ReliableSocket::handle_ack(const RDTHeader *hdr) {
+	this->sample_rtt(hdr);
+	this->record_timestamp(hdr);
+
+	uint32_t old_window = this->peer_window;
+	if (hdr->has_window) {
+		this->peer_window = hdr->window;
+	}
+
+	for (int i = 0; i < hdr->num_sack_blocks; i++) {
+		const RDTSackBlock &block = hdr->sack_blocks[i];
+		for (SentSegment &seg : this->send_window) {
+			if (!seq_before(seg.sequence_number, block.start)
+					&& seq_before(seg.sequence_number, block.end)) {
+				seg.sacked = true;
+			}
 		}
-		else if (send(this->sock_fd, segment, sizeof(RDTHeader)+length, 0) < 0) {
-			perror("send_data send");
-			exit(EXIT_FAILURE);
+	}
+
+	if (seq_before(this->oldest_unacked, hdr->ack_number)
+			&& !seq_before(this->sequence_number, hdr->ack_number)) {
+		// Cumulative ACK of new data: slide the window forward.
+		while (!this->send_window.empty()
+				&& seq_before(this->send_window.front().sequence_number,
+								hdr->ack_number)) {
+			this->send_window_bytes -= this->send_window.front().length;
+			this->send_window.pop_front();
 		}
-		auto start_time = std::chrono::system_clock::now();
-		char received_segment[MAX_SEG_SIZE];
-		memset(received_segment, 0, MAX_SEG_SIZE);
-		if (recv(this->sock_fd, received_segment, MAX_SEG_SIZE, 0) > 0){
-			no_repeat_send = true;
-			RDTHeader* rec_hdr = (RDTHeader*)received_segment;
-			if((rec_hdr->type == RDT_ACK) && (this->sequence_number == rec_hdr->ack_number)){
-				auto end_time = std::chrono::system_clock::now();
-				std::chrono::duration<double> sample_rtt = end_time - start_time;
-				this->estimated_rtt = std::min((int)(.875 * this->estimated_rtt + .125 * sample_rtt.count()), 500);
-				cerr << "INFO: Data Packet " << rec_hdr->ack_number << " Sent and Received\n";
-				this->sequence_number += 1;
-				return;
+		cerr << "INFO: Data acknowledged up to " << hdr->ack_number << "\n";
+		this->oldest_unacked = hdr->ack_number;
+		this->duplicate_acks = 0;
+		this->backoff_timeout = this->retransmit_timeout();
+		this->retransmit_deadline = this->send_window.empty() ? 0
+			: current_msec() + this->backoff_timeout;
+
+		if (this->fin_sent
+				&& !seq_before(this->oldest_unacked, this->fin_sequence_number + 1)) {
+			this->fin_acked();
+		}
+	}
+	else if (hdr->ack_number == this->oldest_unacked
+			&& !this->send_window.empty()
+			&& (hdr->num_sack_blocks > 0 || this->peer_window <= old_window)) {
+		// Three duplicate ACKs means the oldest segment was probably lost,
+		// so don't wait for the timer to resend it. The receiver buffers what
+		// arrives past a gap, so its window shrinks with each duplicate; only
+		// an ACK that opens the window (after the application read) without
+		// SACKing anything is a window update rather than a duplicate.
+		this->duplicate_acks += 1;
+		if (this->duplicate_acks == 3) {
+			cerr << "INFO: Fast retransmit of " << this->oldest_unacked << "\n";
+			this->transmit(this->send_window.front());
+		}
+	}
+
+	// An open window ends any zero window probing.
+	if (this->send_window.empty() && this->peer_window > 0) {
+		this->retransmit_deadline = 0;
+	}
+}
+
+void ReliableSocket::handle_timeout() {
+	this->backoff_timeout = std::min(this->backoff_timeout * 2,
+										(uint32_t)MAX_RTO_MS);
+	this->retransmit_deadline = current_msec() + this->backoff_timeout;
+	this->duplicate_acks = 0;
+
+	for (SentSegment &seg : this->send_window) {
+		if (!seg.sacked) {
+			cerr << "INFO: Timeout, resending " << seg.sequence_number << "\n";
+			this->transmit(seg);
+			return;
+		}
+	}
+
+	if (this->send_window.empty()) {
+		// Zero window probe: an empty segment with an already ACKed
+		// sequence number, which the receiver answers with its window.
+		RDTHeader hdr;
+		rdt_init_header(&hdr, RDT_DATA, this->oldest_unacked - 1,
+						this->expected_sequence_number);
+		if (this->send_segment(&hdr, NULL, 0) < 0) {
+			perror("window probe send");
+		}
+	}
+	else {
+		// Everything was SACKed, so just nudge the receiver with the oldest.
+		this->transmit(this->send_window.front());
+	}
+}
+
+bool ReliableSocket::service_send_window(bool block) {
+	int timeout_ms = 0;
+	if (block) {
+		timeout_ms = -1;
+		if (this->retransmit_deadline != 0) {
+			timeout_ms = std::max(this->retransmit_deadline - current_msec(), 0);
+		}
+	}
+
+	char received_segment[MAX_SEG_SIZE];
+	RDTHeader rec_hdr;
+	char *data;
+	int recv_data_size = this->wait_for_segment(received_segment, &rec_hdr,
+												&data, timeout_ms);
+	if (recv_data_size >= 0) {
+		this->handle_incoming(&rec_hdr, data, recv_data_size);
+		return true;
+	}
+
+	if (this->retransmit_deadline != 0
+			&& current_msec() - this->retransmit_deadline >= 0) {
+		this->handle_timeout();
+		return true;
+	}
+	return false;
+}
+
+void ReliableSocket::flush_send_window() {
+	while (this->is_open() && !this->send_window.empty()) {
+		this->service_send_window(true);
+	}
+}
+
+uint32_t ReliableSocket::advertised_window() {
+	if (this->receive_buffered_bytes >= this->receive_buffer_size) {
+		return 0;
+	}
+	return this->receive_buffer_size - this->receive_buffered_bytes;
+}
+
+void ReliableSocket::send_ack() {
+	RDTHeader hdr;
+	rdt_init_header(&hdr, RDT_ACK, 0, this->expected_sequence_number);
+
+	// Describe runs of segments we hold beyond the cumulative ACK.
+	for (auto it = this->receive_buffer.begin();
+			it != this->receive_buffer.end()
+				&& hdr.num_sack_blocks < RDT_MAX_SACK_BLOCKS; ++it) {
+		if (!seq_before(this->expected_sequence_number, it->first)) {
+			continue;
+		}
+		if (hdr.num_sack_blocks > 0
+				&& hdr.sack_blocks[hdr.num_sack_blocks - 1].end == it->first) {
+			hdr.sack_blocks[hdr.num_sack_blocks - 1].end += 1;
+		}
+		else {
+			RDTSackBlock &block = hdr.sack_blocks[hdr.num_sack_blocks++];
+			block.start = it->first;
+			block.end = it->first + 1;
+		}
+	}
+
+	if (this->send_segment(&hdr, NULL, 0) < 0) {
+		perror("Error sending ack in response to data received");
+	}
+}
+
+void ReliableSocket::handle_incoming(const RDTHeader *hdr, const char *data,
+										int length) {
+	if (hdr->type == RDT_ACK) {
+		this->handle_ack(hdr);
+		return;
+	}
+	if (hdr->type == RDT_RESET) {
+		// The remote host's RDT_RESET carries the next sequence number it
+		// would have sent, which is at most a send window past what we've
+		// received. Anything else is stale, or forged by someone guessing.
+		uint32_t offset = hdr->sequence_number - this->expected_sequence_number;
+		if (offset > (uint32_t)MAX_SEND_WINDOW) {
+			cerr << "INFO: Ignoring reset outside the receive window\n";
+			return;
+		}
+		cerr << "INFO: Connection reset by remote host\n";
+		this->state = CLOSED;
+		this->peer_closed = true;
+		this->send_window.clear();
+		this->send_window_bytes = 0;
+		this->retransmit_deadline = 0;
+		return;
+	}
+	if (hdr->type == RDT_CLOSE) {
+		this->handle_fin(hdr);
+		return;
+	}
+	if (hdr->type == RDT_CONN && !this->initiator) {
+		// The sender didn't get our reply to its RDT_CONN. Any data on it
+		// was buffered the first time, so just answer again.
+		this->send_conn_reply();
+		return;
+	}
+	if (hdr->type == RDT_CONN) {
+		// The receiver's reply to a fast open RDT_CONN; its ack_number
+		// covers the data that rode along. If the third message of the
+		// handshake is lost we may receive an additional RDT_CONN message,
+		// so (re)send the ACK either way.
+		if (this->state == CONN_SENT) {
+			this->state = ESTABLISHED;
+			cerr << "INFO: Connection ESTABLISHED (fast open)\n";
+			this->handle_ack(hdr);
+		}
+		RDTHeader send_hdr;
+		rdt_init_header(&send_hdr, RDT_ACK, 0, 0);
+		if (this->send_segment(&send_hdr, NULL, 0) < 0) {
+			perror("Error sending ack in response to CONN\n");
+		}
+		return;
+	}
+
+	// PAWS: a data segment stamped earlier than one we've already seen
+	// is an old duplicate (possibly from before the sequence numbers
+	// wrapped), so re-ACK what we have and otherwise ignore it.
+	if (this->timestamp_is_stale(hdr)) {
+		this->send_ack();
+		return;
+	}
+
+	// Only echo the timestamp of a segment at or before the one our last
+	// ACK asked for (RFC 7323, section 4.3). A segment past a gap would
+	// otherwise have its later timestamp echoed when the gap is filled,
+	// making the sender's RTT samples too short.
+	uint32_t seq = hdr->sequence_number;
+	if (!seq_before(this->expected_sequence_number, seq)) {
+		this->record_timestamp(hdr);
+	}
+	bool is_new = length > 0
+		&& !seq_before(seq, this->expected_sequence_number)
+		&& this->receive_buffer.count(seq) == 0;
+
+	// Only keep what fits in the receive buffer: a sender respecting our
+	// window never sends more than that.
+	if (is_new && (uint32_t)length <= this->advertised_window()) {
+		cerr << "INFO: Received segment. "
+			<< "seq_num = "<< seq
+			<< ", type = " << hdr->type << "\n";
+
+		this->receive_buffer[seq].assign(data, data + length);
+		this->receive_buffered_bytes += length;
+		while (this->receive_buffer.count(this->expected_sequence_number)) {
+			this->expected_sequence_number += 1;
+		}
+		if (this->app_closed) {
+			this->discard_unread();
+		}
+	}
+
+	this->send_ack();
+}
+
+void ReliableSocket::discard_unread() {
+	// Segments past a gap are kept, so the gap can still be filled and the
+	// remote host's FIN reached.
+	for (auto it = this->receive_buffer.begin();
+			it != this->receive_buffer.end();) {
+		if (seq_before(it->first, this->expected_sequence_number)) {
+			this->receive_buffered_bytes -= it->second.size();
+			it = this->receive_buffer.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	this->read_sequence_number = this->expected_sequence_number;
+}
+
+void ReliableSocket::handle_fin(const RDTHeader *hdr) {
+	// Only accept the FIN once everything sent before it has arrived;
+	// otherwise the ACK below tells the remote host what is missing.
+	if (!this->peer_closed
+			&& hdr->sequence_number == this->expected_sequence_number) {
+		this->record_timestamp(hdr);
+		this->expected_sequence_number += 1;
+		this->peer_closed = true;
+
+		if (this->state == ESTABLISHED) {
+			this->state = CLOSE_WAIT;
+		}
+		else if (this->state == FIN_WAIT_1) {
+			this->state = CLOSING;
+		}
+		else if (this->state == FIN_WAIT_2) {
+			this->enter_time_wait();
+		}
+	}
+
+	// ACK the FIN, or repeat our ACK if it was lost and the FIN resent.
+	this->send_ack();
+}
+
+void ReliableSocket::send_fin() {
+	RDTHeader hdr;
+	rdt_init_header(&hdr, RDT_CLOSE, this->fin_sequence_number,
+					this->expected_sequence_number);
+	if (this->send_segment(&hdr, NULL, 0) < 0) {
+		perror("close send");
+	}
+}
+
+void ReliableSocket::fin_acked() {
+	if (this->state == FIN_WAIT_1) {
+		this->state = FIN_WAIT_2;
+	}
+	else if (this->state == CLOSING) {
+		this->enter_time_wait();
+	}
+	else if (this->state == LAST_ACK) {
+		// We closed second, so there is nothing left to wait for.
+		this->state = CLOSED;
+	}
+}
+
+void ReliableSocket::enter_time_wait() {
+	// Linger long enough to re-ACK the remote host's FIN if our ACK of it
+	// is lost and the FIN is retransmitted.
+	this->state = TIME_WAIT;
+	this->linger_deadline = current_msec() + 2 * this->retransmit_timeout();
+}
+
+void ReliableSocket::shutdown_send() {
+	// A fast open connection that never sent anything still needs its
+	// handshake, so the remote host sees the connection open and close.
+	if (this->state == CONN_PENDING) {
+		this->handshake();
+	}
+	if (!this->can_send()) {
+		return;
+	}
+
+	// Make sure everything we've sent has arrived, then send our FIN. It
+	// takes up a sequence number, just like a data segment.
+	this->flush_send_window();
+	if (!this->is_open()) {
+		return;
+	}
+	this->fin_sent = true;
+	this->fin_sequence_number = this->sequence_number;
+	this->sequence_number += 1;
+	this->state = (this->state == CLOSE_WAIT) ? LAST_ACK : FIN_WAIT_1;
+
+	uint32_t timeout = this->retransmit_timeout();
+	int transmissions = 0;
+	while (this->state == FIN_WAIT_1 || this->state == CLOSING
+			|| this->state == LAST_ACK) {
+		if (transmissions >= MAX_TRANSMISSIONS) {
+			cerr << "INFO: Remote host never acknowledged close\n";
+			this->state = CLOSED;
+			break;
+		}
+		transmissions += 1;
+		this->send_fin();
+
+		int deadline = current_msec() + timeout;
+		while (this->state == FIN_WAIT_1 || this->state == CLOSING
+				|| this->state == LAST_ACK) {
+			int remaining = deadline - current_msec();
+			if (remaining <= 0) {
+				break;
 			}
-			
-			// IF the third message of the handshake is lost we may
-			// receive an additional RDT_CONN message and that is handled
-			// here and then the ack and the sending data is resent
-			else if(rec_hdr->type == RDT_CONN){
-				char send_segment[sizeof(RDTHeader)];
-				memset(send_segment, 0, sizeof(RDTHeader));	
-				RDTHeader* send_hdr = (RDTHeader*)send_segment;
-				send_hdr->ack_number = htonl(0);
-				send_hdr->sequence_number = htonl(0);
-				send_hdr->type = RDT_ACK;
-				if (send(this->sock_fd, send_segment, sizeof(RDTHeader), 0) < 0) {
-					perror("Error sending ack in response to CONN\n");
-				}
+			char received_segment[MAX_SEG_SIZE];
+			RDTHeader hdr;
+			char *data;
+			int recv_data_size = this->wait_for_segment(received_segment,
+														&hdr, &data, remaining);
+			if (recv_data_size >= 0) {
+				this->handle_incoming(&hdr, data, recv_data_size);
 			}
 		}
-		else{
-			this->estimated_rtt = (int)(1.2*this->estimated_rtt);
-			this->set_timeout_length(std::min((int)(this->estimated_rtt * 1.5), 500));
+		timeout = std::min(timeout * 2, (uint32_t)MAX_RTO_MS);
+	}
+}
+
+void ReliableSocket::abort_connection() {
+	// A fast open connection that hasn't sent its RDT_CONN yet doesn't exist
+	// as far as the remote host knows.
+	if (this->is_open() && this->state != CONN_PENDING) {
+		RDTHeader hdr;
+		rdt_init_header(&hdr, RDT_RESET, this->sequence_number,
+						this->expected_sequence_number);
+		if (this->send_segment(&hdr, NULL, 0) < 0) {
+			perror("abort send");
 		}
 	}
-	// Made code that waits for an acknowledgment of the data you just sent, and keeps
-	// resending until that ack comes.
-	// Utilizes the set_timeout_length function to make sure you timeout after
-	// a certain amount of waiting (so you can try sending again).
+	this->state = CLOSED;
+	this->send_window.clear();
+	this->send_window_bytes = 0;
+	this->receive_buffer.clear();
+	this->receive_buffered_bytes = 0;
+
+	if (this->sock_fd >= 0 && close(this->sock_fd) < 0) {
+		perror("abort_connection close");
+	}
+	this->sock_fd = -1;
 }
 
 int ReliableSocket::receive_data(char buffer[MAX_DATA_SIZE]) {
-	if (this->state != ESTABLISHED) {
+	if (this->state == INIT || this->state == CONN_PENDING) {
 		cerr << "INFO: Cannot receive: Connection not established.\n";
 		return 0;
 	}
 
-	// Sent back an acknowledment that we
-	// received some data, but first we made sure that what we
-	// received was the type we wanted (RDT_DATA) and had the right sequence
-	// number.
-
-	//If the data received is good
 	while (true){
+		// ACK everything that has already arrived before handing data to
+		// the application, so the sender isn't kept waiting on us.
 		char received_segment[MAX_SEG_SIZE];
-		memset(received_segment, 0, MAX_SEG_SIZE);
-		int recv_count = recv(this->sock_fd, received_segment, MAX_SEG_SIZE, 0);
-		if (recv_count < 0) {
-			perror("receive_data recv");
-			exit(EXIT_FAILURE);
+		RDTHeader hdr;
+		char *data;
+		int recv_data_size;
+		while ((recv_data_size = this->wait_for_segment(received_segment,
+									&hdr, &data, 0)) >= 0) {
+			this->handle_incoming(&hdr, data, recv_data_size);
 		}
-		RDTHeader* hdr = (RDTHeader*)received_segment;
-		// If the package we received is the next set of data
-		if(hdr->type == RDT_DATA && this->expected_sequence_number == ntohl(hdr->sequence_number)){
-			char send_segment[sizeof(RDTHeader)];
-			memset(send_segment, 0, sizeof(RDTHeader));
-			RDTHeader* send_hdr = (RDTHeader*)send_segment;
-			send_hdr->ack_number = htonl(hdr->sequence_number);
-			send_hdr->type = RDT_ACK;
-			if (send(this->sock_fd, send_segment, sizeof(RDTHeader), 0) < 0) {
-				perror("Error sending ack in response to data received");
-			}
 
-			cerr << "INFO: Received segment. " 
-			<< "seq_num = "<< ntohl(hdr->sequence_number)
-			<< ", type = " << hdr->type << "\n";
+		auto next = this->receive_buffer.find(this->read_sequence_number);
+		if (next != this->receive_buffer.end()) {
+			int length = next->second.size();
+			memcpy(buffer, next->second.data(), length);
+			this->receive_buffer.erase(next);
+			this->receive_buffered_bytes -= length;
+			this->read_sequence_number += 1;
 
-			void *data = (void*)(received_segment + sizeof(RDTHeader));
-			this->expected_sequence_number += 1;
-			int recv_data_size = recv_count - sizeof(RDTHeader);
-			memcpy(buffer, data, recv_data_size);
-			return recv_data_size;
-		}
-		else if(hdr->type == RDT_DATA && (this->expected_sequence_number > ntohl(hdr->sequence_number)) && (ntohl(hdr->sequence_number) > 0)){
-			char send_segment[sizeof(RDTHeader)];
-			memset(send_segment, 0, sizeof(RDTHeader));
-			RDTHeader* send_hdr = (RDTHeader*)send_segment;
-			send_hdr->ack_number = ntohl(hdr->sequence_number);
-			send_hdr->type = RDT_ACK;
-			if (send(this->sock_fd, send_segment, sizeof(RDTHeader), 0) < 0) {
-				perror("Error sending ack for repeat received segment");
+			// If we had closed (or nearly closed) our window, let the
+			// sender know there is room again.
+			if (this->last_advertised_window < (uint32_t)MAX_DATA_SIZE
+					&& this->advertised_window() >= (uint32_t)MAX_DATA_SIZE) {
+				this->send_ack();
 			}
+			return length;
 		}
-		else if(hdr->type == RDT_CLOSE){
+
+		if (this->peer_closed || !this->is_open()) {
 			return 0;
 		}
+
+		recv_data_size = this->wait_for_segment(received_segment, &hdr, &data, -1);
+		if (recv_data_size >= 0) {
+			this->handle_incoming(&hdr, data, recv_data_size);
+		}
 	}
 }
 
 void ReliableSocket::close_connection() {
-	// Construct a RDT_CLOSE message to indicate to the remote host that we
-	// want to end this connection.
-	char segment[sizeof(RDTHeader)];
-	memset(segment, 0, sizeof(RDTHeader));	
-	RDTHeader* hdr = (RDTHeader*)segment;
-
-	hdr->sequence_number = htonl(0);
-	hdr->ack_number = htonl(0);
-	hdr->type = RDT_CLOSE;
-
-	// Reliably closies the connection to make sure both sides know that the
-	// connection has been closed.
-	//standardize timeout length for sender and receiver
-	this->set_timeout_length(50);
-	int timeouts = 0;
-	while(true){
-		if (timeouts > 2){
+	if (this->sock_fd < 0) {
+		return;
+	}
+
+	// Nobody will read anything from here on, so stop holding on to data
+	// that arrives (it's still ACKed), lest the window fill up and the
+	// remote host stall before it gets to close its side.
+	this->app_closed = true;
+	this->discard_unread();
+
+	// Send our FIN (if we haven't already) and wait for it to be ACKed.
+	this->shutdown_send();
+
+	// If we closed first, wait for the remote host to close its side, then
+	// linger in TIME_WAIT in case our ACK of its FIN is lost.
+	int give_up = current_msec() + FIN_WAIT_TIMEOUT_MS;
+	while (this->state == FIN_WAIT_2 || this->state == TIME_WAIT) {
+		int deadline = (this->state == TIME_WAIT) ? this->linger_deadline
+													: give_up;
+		int remaining = deadline - current_msec();
+		if (remaining <= 0) {
+			if (this->state == FIN_WAIT_2) {
+				cerr << "INFO: Remote host never closed its side\n";
+			}
 			break;
 		}
-		timeouts+=1;
-		if (send(this->sock_fd, segment, sizeof(RDTHeader), 0) < 0) {
-			perror("close send");
-		}
+
 		char received_segment[MAX_SEG_SIZE];
-		memset(received_segment, 0, MAX_SEG_SIZE);
-		int recv_count = recv(this->sock_fd, received_segment, MAX_SEG_SIZE, 0);
-		//Catch timeout
-		if (recv_count == -1){
-			this->estimated_rtt = (int)(2*this->estimated_rtt);
-			this->set_timeout_length(this->estimated_rtt*1.5);
-		}
-		else if (recv_count < 0) {
-			perror("receive_data recv");
-			exit(EXIT_FAILURE);
-		}
-		else{
-			RDTHeader* rec_hdr = (RDTHeader*)received_segment;
-			if(rec_hdr->type == RDT_CLOSE){
-				hdr->type = RDT_ACK;
-				if (send(this->sock_fd, segment, sizeof(RDTHeader), 0) < 0){
-					perror("error sending ack in response to close");
-					exit(EXIT_FAILURE);
-				}
-				this->state = CLOSED;
-				break;
-			}
-			else if(rec_hdr->type == RDT_ACK){
-				this->state = CLOSED;
-				break;
-			}
-			else if(rec_hdr->type == RDT_DATA){
-				char send_segment[sizeof(RDTHeader)];
-				memset(send_segment, 0, sizeof(RDTHeader));
-				RDTHeader* send_hdr = (RDTHeader*)send_segment;
-				send_hdr->ack_number = ntohl(rec_hdr->sequence_number);
-				send_hdr->type = RDT_ACK;
-				if (send(this->sock_fd, send_segment, sizeof(RDTHeader), 0) < 0) {
-					perror("Error sending ack for repeat received segment");
-				}
-			}
+		RDTHeader hdr;
+		char *data;
+		int recv_data_size = this->wait_for_segment(received_segment, &hdr,
+													&data, remaining);
+		if (recv_data_size >= 0) {
+			this->handle_incoming(&hdr, data, recv_data_size);
 		}
 	}
+
+	this->state = CLOSED;
 	if (close(this->sock_fd) < 0) {
 		perror("close_connection close");
 	}
+	this->sock_fd = -1;
 }
@@ -6,29 +6,30 @@
  *
  */
 
-// TODO: You'll likely need to add some new types, as you start doing things
-// like updating accept_connection and close_connection.
-enum RDTMessageType : uint8_t {RDT_CONN, RDT_CLOSE, RDT_ACK, RDT_DATA};
+#include <deque>
+#include <map>
+#include <vector>
 
-/**
- * Format for the header of a segment send by our reliable socket.
- */
-struct RDTHeader {
-	uint32_t sequence_number;
-	uint32_t ack_number;
-	RDTMessageType type;
-};
+#include <sys/types.h>
+
+#include "rdt_wire.h"
 
 // TODO: Again, you'll likely need to add new statuses (is that a word?) as
 // you start implementing the reliable protocol.
 
 // Maybe use an INPROGRESS status?
-enum connection_status { INIT, ESTABLISHED, CLOSED };
+// CONN_PENDING and CONN_SENT are only used with fast open, before and after
+// the RDT_CONN carrying the first data segment is sent. The states between
+// ESTABLISHED and CLOSED follow TCP's close: FIN_WAIT_1, FIN_WAIT_2, CLOSING
+// and TIME_WAIT for the side that closes first, CLOSE_WAIT and LAST_ACK for
+// the side that closes second.
+enum connection_status { INIT, CONN_PENDING, CONN_SENT, ESTABLISHED,
+	FIN_WAIT_1, FIN_WAIT_2, CLOSING, TIME_WAIT, CLOSE_WAIT, LAST_ACK, CLOSED };
 
 /**
  * Class that represents a socket using a reliable data transport protocol.
- * This socket uses a stop-and-wait protocol so your data is sent at a nice,
- * leisurely pace.
+ * This socket uses a sliding window with selective acknowledgments, limited
+ * by the window the receiver advertises so a slow reader is never overrun.
  */
 class ReliableSocket {
 public:
@@ -39,7 +40,15 @@ public:
 	
 	// These are constants for all reliable connections
 	static const int MAX_SEG_SIZE  = 1400;
-	static const int MAX_DATA_SIZE = MAX_SEG_SIZE - sizeof(RDTHeader);
+	static const int MAX_DATA_SIZE = MAX_SEG_SIZE - RDT_MAX_HEADER_SIZE;
+
+	// Most segments the sender will have in flight, whatever the receiver's
+	// advertised window.
+	static const int MAX_SEND_WINDOW = 32;
+
+	// Default size (in bytes) of the buffer that holds received data until
+	// the application reads it.
+	static const int DEFAULT_RECEIVE_BUFFER_SIZE = 64 * 1024;
 
 	/**
 	 * Basic Constructor, setting estimated RTT to 100 and deviation RTT to 10.
@@ -49,6 +58,9 @@ public:
 	/**
 	 * Connects to the specified remote hostname on the given port.
 	 *
+	 * @note With fast open enabled this returns right away, and the
+	 * handshake happens along with the first send_data call.
+	 *
 	 * @param hostname Name of the remote host to connect to.
 	 * @param port_num Port number of remote host.
 	 */
@@ -64,11 +76,44 @@ public:
 	/**
 	 * Send data to connected remote host.
 	 *
+	 * @note This returns once the data is in flight; it only waits when the
+	 * send window or the receiver's advertised window is full. Data longer
+	 * than MAX_DATA_SIZE is split over several segments.
+	 *
 	 * @param buffer The buffer with data to be sent.
 	 * @param length The amount of data in the buffer to send.
 	 */
 	void send_data(const void *buffer, int length);
 
+	/**
+	 * Sends any amount of data to the connected remote host, splitting it
+	 * into segments as needed. Segments are sent straight from buffer
+	 * rather than being copied, so this waits until all of the data has
+	 * been acknowledged before returning.
+	 *
+	 * @param buffer The buffer with data to be sent.
+	 * @param length The amount of data in the buffer to send.
+	 * @return True if all of it was ACKed, false if the connection wasn't
+	 * 		open or was reset or closed first (in which case it's unknown
+	 * 		how much of it arrived).
+	 */
+	bool send_stream(const void *buffer, size_t length);
+
+	/**
+	 * Sends part of a file to the connected remote host, like sendfile(2).
+	 * The file is memory mapped and sent with send_stream, so its contents
+	 * are never copied into an intermediate buffer.
+	 *
+	 * @param fd Descriptor of the (regular) file to send.
+	 * @param offset Offset in the file of the first byte to send.
+	 * @param count Number of bytes to send, or 0 to send up to the end of
+	 * 		the file.
+	 * @return The number of bytes sent (and ACKed), or -1 on error,
+	 * 		including the connection being reset or closed before they
+	 * 		were all ACKed.
+	 */
+	ssize_t send_file(int fd, off_t offset, size_t count);
+
 	/**
 	 * Receives data from remote host using a reliable connection.
 	 *
@@ -79,9 +124,28 @@ public:
 
 	/**
 	 * Closes an connection.
+	 *
+	 * @note Once both sides' RDT_CLOSE messages have been ACKed, the side
+	 * that closed second returns immediately and the side that closed first
+	 * lingers for two retransmission timeouts (TIME_WAIT).
 	 */
 	void close_connection();
 
+	/**
+	 * Closes just our side of the connection (a half-close): waits for all
+	 * sent data to be ACKed, then sends an RDT_CLOSE and waits for it to be
+	 * ACKed. Data from the remote host can still be received until it
+	 * closes its side too.
+	 */
+	void shutdown_send();
+
+	/**
+	 * Immediately tears down the connection, discarding any unsent or
+	 * unread data. The remote host is sent an RDT_RESET so it doesn't wait
+	 * around for us.
+	 */
+	void abort_connection();
+
 	/**
 	 * Returns the estimated RTT.
 	 * 
@@ -89,6 +153,40 @@ public:
 	 */
 	uint32_t get_estimated_rtt();
 
+	/**
+	 * Turns CRC32C checksums on or off (they are on by default). While on,
+	 * every segment we send carries one, and incoming segments without one
+	 * are dropped as corrupt. While off, incoming segments are still
+	 * verified whenever the sender included a checksum.
+	 *
+	 * @param enabled Whether to checksum the segments we send, and require
+	 * 		checksums on those we receive.
+	 */
+	void set_checksum_enabled(bool enabled);
+
+	/**
+	 * Sets the size of the buffer holding received data that the
+	 * application hasn't read yet. The window advertised to the sender never
+	 * exceeds the free space in this buffer.
+	 *
+	 * @param bytes Size of the buffer in bytes (at least MAX_DATA_SIZE).
+	 */
+	void set_receive_buffer_size(uint32_t bytes);
+
+	/**
+	 * Turns fast open on or off. With fast open, the first data segment
+	 * rides on the initial RDT_CONN, saving a round trip before data starts
+	 * flowing. Must be called before connect_to_remote. accept_connection
+	 * handles both kinds of connection either way.
+	 *
+	 * @note It is off by default, unless the RDT_FAST_OPEN environment
+	 * variable is set to 1 (so programs can try it without changing them,
+	 * e.g. RDT_FAST_OPEN=1 ./sender host port).
+	 *
+	 * @param enabled Whether to use fast open when connecting.
+	 */
+	void set_fast_open(bool enabled);
+
 private:
 	// Private member variables are initialized in the constructor
 	int sock_fd;
@@ -99,6 +197,46 @@ private:
 	connection_status state;
 
 	// In the (unlikely?) event you need a new field, add it here.
+	bool checksum_enabled;
+	uint32_t ts_recent; // most recent timestamp received from the peer
+	bool fast_open;
+	bool initiator; // whether we sent the first RDT_CONN
+
+	/**
+	 * A data segment we've sent but that hasn't been cumulatively ACKed.
+	 */
+	struct SentSegment {
+		uint32_t sequence_number;
+		const char *data;       // either copy.data() or the caller's memory
+		int length;
+		std::vector<char> copy;
+		int transmissions;
+		bool sacked; // receiver reported it holds this segment
+	};
+
+	// Sender side of the sliding window
+	uint32_t oldest_unacked;
+	std::deque<SentSegment> send_window;
+	uint32_t send_window_bytes;
+	uint32_t peer_window;       // latest window advertised by the receiver
+	int retransmit_deadline;    // msec time of the next timeout, 0 if unset
+	uint32_t backoff_timeout;   // current timeout, doubled on each expiry
+	int duplicate_acks;
+
+	// Receiver side: data received but not yet read by the application,
+	// keyed by sequence number.
+	uint32_t read_sequence_number;
+	std::map<uint32_t, std::vector<char>> receive_buffer;
+	uint32_t receive_buffer_size;
+	uint32_t receive_buffered_bytes;
+	uint32_t last_advertised_window;
+	bool peer_closed;
+	bool app_closed; // close_connection called, so nothing more is read
+
+	// Closing
+	bool fin_sent;
+	uint32_t fin_sequence_number; // sequence number of our FIN
+	int linger_deadline;          // msec time at which TIME_WAIT ends
 
 	/**
 	 * Sets the timeout length of this connection.
@@ -109,6 +247,17 @@ private:
 	 * @param timeout_length_ms Length of timeout period in milliseconds.
 	 */
 	void set_timeout_length(uint32_t timeout_length_ms);
+
+	/**
+	 * Performs the connection initiator's side of the three way handshake.
+	 */
+	void handshake();
+
+	/**
+	 * Sends the connection listener's RDT_CONN reply, which also ACKs any
+	 * data that rode on the initiator's RDT_CONN.
+	 */
+	void send_conn_reply();
 	
 	/*
 	 * Add new member functions (i.e. methods) after this point.
@@ -116,4 +265,215 @@ private:
 	 * implementation should be in the .cpp file.
 	 */
 
+	/**
+	 * Encodes a header followed by the given data into a segment, fills in
+	 * its checksum, then sends it to the remote host.
+	 *
+	 * @param hdr The header of the segment. Its flags are updated to reflect
+	 * 		whether a checksum is included.
+	 * @param data The data to send after the header (may be NULL if length
+	 * 		is 0).
+	 * @param length The amount of data, at most MAX_DATA_SIZE bytes.
+	 * @return The result of the underlying send call.
+	 */
+	int send_segment(RDTHeader *hdr, const void *data, int length);
+
+	/**
+	 * Receives the next intact segment from the remote host. Segments that
+	 * are malformed, of an unknown version or message type, fail their
+	 * checksum (or lack one while checksums are enabled), or carry more
+	 * than MAX_DATA_SIZE bytes of data are dropped (and so never ACKed), so
+	 * the sender will eventually retransmit them.
+	 *
+	 * @param segment Buffer (of MAX_SEG_SIZE bytes) to receive into.
+	 * @param hdr The decoded header of the segment will be stored here.
+	 * @param payload If not NULL, set to point to the segment's data within
+	 * 		segment.
+	 * @param flags Flags for the underlying recv call (e.g. MSG_DONTWAIT to
+	 * 		return right away if no segment has arrived), or 0 to wait up
+	 * 		to the socket's timeout.
+	 * @return Size of the segment's data, or -1 on timeout or error.
+	 */
+	int recv_segment(char segment[MAX_SEG_SIZE], RDTHeader *hdr,
+						char **payload, int flags);
+
+	/**
+	 * Waits up to the given time for a segment to arrive, then receives it
+	 * as recv_segment does.
+	 *
+	 * @param segment Buffer (of MAX_SEG_SIZE bytes) to receive into.
+	 * @param hdr The decoded header of the segment will be stored here.
+	 * @param payload If not NULL, set to point to the segment's data.
+	 * @param timeout_ms How long to wait in milliseconds, or -1 to wait as
+	 * 		long as it takes.
+	 * @return Size of the segment's data, or -1 if none arrived in time.
+	 */
+	int wait_for_segment(char segment[MAX_SEG_SIZE], RDTHeader *hdr,
+							char **payload, int timeout_ms);
+
+	/**
+	 * Calculates the retransmission timeout from the estimated RTT and its
+	 * deviation.
+	 *
+	 * @return The timeout length in milliseconds.
+	 */
+	uint32_t retransmit_timeout();
+
+	/**
+	 * Updates the estimated RTT (and deviation) using the timestamp the peer
+	 * echoed back in a received segment. Does nothing if the segment has no
+	 * echoed timestamp.
+	 *
+	 * @param hdr Header of the received segment.
+	 */
+	void sample_rtt(const RDTHeader *hdr);
+
+	/**
+	 * Remembers the peer's timestamp from a received segment so that it can
+	 * be echoed back in the next segment we send.
+	 *
+	 * @param hdr Header of the received segment.
+	 * @return False if the segment's timestamp is older than one we've
+	 * 		already seen (i.e. it is a stale duplicate, see PAWS in RFC 7323),
+	 * 		true otherwise.
+	 */
+	bool record_timestamp(const RDTHeader *hdr);
+
+	/**
+	 * Checks a received segment's timestamp without remembering it.
+	 *
+	 * @param hdr Header of the received segment.
+	 * @return True if the segment's timestamp is older than one we've
+	 * 		already seen (see record_timestamp).
+	 */
+	bool timestamp_is_stale(const RDTHeader *hdr);
+
+	/**
+	 * Checks that data can be sent on this connection. A fast open
+	 * connection can send before its handshake: the first segment queued
+	 * goes out on the RDT_CONN that starts it.
+	 *
+	 * @return True if the connection is (being) established.
+	 */
+	bool can_send();
+
+	/**
+	 * Checks whether the connection is still open, i.e. it has been set up
+	 * and hasn't been closed or reset.
+	 *
+	 * @return True if the connection is open.
+	 */
+	bool is_open();
+
+	/**
+	 * Adds a segment to the send window, once there is room for it, and
+	 * sends it.
+	 *
+	 * @param data The segment's data (at most MAX_DATA_SIZE bytes).
+	 * @param length Amount of data in the segment.
+	 * @param copy Whether the window needs its own copy of the data. If not,
+	 * 		data must stay valid until the segment has been ACKed.
+	 */
+	void queue_segment(const char *data, int length, bool copy);
+
+	/**
+	 * Sends (or resends) a data segment from the send window.
+	 *
+	 * @param seg The segment to send.
+	 */
+	void transmit(SentSegment &seg);
+
+	/**
+	 * Checks if another segment of the given size fits in both our send
+	 * window and the receiver's advertised window.
+	 *
+	 * @param length Amount of data in the segment.
+	 * @return True if the segment can be sent now.
+	 */
+	bool window_has_room(int length);
+
+	/**
+	 * Handles an ACK from the receiver: slides the send window forward,
+	 * records SACKed segments and the advertised window, and fast
+	 * retransmits after three duplicate ACKs.
+	 *
+	 * @param hdr Header of the ACK.
+	 */
+	void handle_ack(const RDTHeader *hdr);
+
+	/**
+	 * Handles the expiry of the retransmission timer, by resending the
+	 * oldest segment not known to have arrived, or by probing a zero window
+	 * if there is nothing in flight.
+	 */
+	void handle_timeout();
+
+	/**
+	 * Handles the next event on the sending side of the connection: an
+	 * incoming segment or a timer expiring.
+	 *
+	 * @param block Whether to wait for an event or just check for segments
+	 * 		that have already arrived.
+	 * @return True if something was handled.
+	 */
+	bool service_send_window(bool block);
+
+	/**
+	 * Waits until everything we've sent has been acknowledged.
+	 */
+	void flush_send_window();
+
+	/**
+	 * Calculates the window to advertise: the free space in the receive
+	 * buffer.
+	 *
+	 * @return The window size in bytes.
+	 */
+	uint32_t advertised_window();
+
+	/**
+	 * Sends a cumulative ACK for the data received so far, including SACK
+	 * blocks describing any segments received out of order.
+	 */
+	void send_ack();
+
+	/**
+	 * Drops the data that has arrived in order but not been read, once the
+	 * application has closed the connection and will never read it.
+	 */
+	void discard_unread();
+
+	/**
+	 * Handles an incoming segment on the receiving side of the connection,
+	 * buffering its data (if there is room) and ACKing it.
+	 *
+	 * @param hdr Header of the segment.
+	 * @param data The segment's data.
+	 * @param length Amount of data in the segment.
+	 */
+	void handle_incoming(const RDTHeader *hdr, const char *data, int length);
+
+	/**
+	 * Handles an RDT_CLOSE (FIN) from the remote host, accepting it once all
+	 * the data sent before it has arrived, and ACKs it.
+	 *
+	 * @param hdr Header of the RDT_CLOSE segment.
+	 */
+	void handle_fin(const RDTHeader *hdr);
+
+	/**
+	 * Sends (or resends) our RDT_CLOSE (FIN).
+	 */
+	void send_fin();
+
+	/**
+	 * Moves to the next close state once our FIN has been ACKed.
+	 */
+	void fin_acked();
+
+	/**
+	 * Enters TIME_WAIT, starting its linger timer.
+	 */
+	void enter_time_wait();
+
 };
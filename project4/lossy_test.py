@@ -0,0 +1,128 @@
+#!/usr/bin/python3
+
+"""
+Transfers a file through a UDP proxy on this machine that drops a share of
+the datagrams going either way, and checks that it arrives intact and that
+the sender recovered from (some of) the losses with fast retransmits rather
+than only with timeouts.
+
+Unlike transfer_test.py this needs no Mininet, just the sender and receiver
+built in this directory.
+"""
+
+import os
+import random
+import socket
+import subprocess
+import threading
+from sys import argv, exit
+from time import sleep, time
+
+# The file is 1000lines.txt repeated this many times (about 3 MB).
+COPIES = 125
+
+
+class LossyProxy:
+    """
+    Forwards datagrams between the sender (whoever sends to it first) and the
+    receiver, dropping each with the given probability.
+    """
+    def __init__(self, receiver_port, loss_rate):
+        self.receiver = ('127.0.0.1', receiver_port)
+        self.loss_rate = loss_rate
+        self.sender = None
+        self.dropped = 0
+        self.front = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.front.bind(('127.0.0.1', 0))
+        self.back = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.back.bind(('127.0.0.1', 0))
+        self.port = self.front.getsockname()[1]
+        for loop in (self.to_receiver, self.to_sender):
+            threading.Thread(target=loop, daemon=True).start()
+
+    def forward(self, sock, data, address):
+        if random.random() < self.loss_rate:
+            self.dropped += 1
+        else:
+            sock.sendto(data, address)
+
+    def to_receiver(self):
+        while True:
+            data, self.sender = self.front.recvfrom(65536)
+            self.forward(self.back, data, self.receiver)
+
+    def to_sender(self):
+        while True:
+            data, _ = self.back.recvfrom(65536)
+            if self.sender is not None:
+                self.forward(self.front, data, self.sender)
+
+
+def run_test(loss):
+    """
+    Runs the sender and receiver through the proxy.
+
+    Parameters:
+    loss (int): The percentage of datagrams to drop each way.
+    """
+    os.makedirs('test', exist_ok=True)
+    with open('1000lines.txt', 'rb') as f:
+        original = f.read() * COPIES
+    with open('test/lossy-data.txt', 'wb') as f:
+        f.write(original)
+
+    # Pick a free port for the receiver.
+    probe = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    probe.bind(('127.0.0.1', 0))
+    receiver_port = probe.getsockname()[1]
+    probe.close()
+
+    proxy = LossyProxy(receiver_port, loss / 100)
+    with open('test/lossy-received.txt', 'wb') as out, \
+            open('test/lossy-receiver.err.txt', 'wb') as err:
+        receiver = subprocess.Popen(['timeout', '30s', './receiver',
+                                     str(receiver_port)], stdout=out,
+                                    stderr=err)
+    sleep(0.5)
+
+    print("Sending %d bytes with %d%% loss each way..." % (len(original), loss))
+    start = time()
+    with open('test/lossy-data.txt', 'rb') as data, \
+            open('test/lossy-sender.err.txt', 'wb') as err:
+        status = subprocess.call(['timeout', '30s', './sender', '127.0.0.1',
+                                  str(proxy.port)], stdin=data, stderr=err)
+    elapsed = time() - start
+    receiver.wait()
+
+    with open('test/lossy-sender.err.txt') as f:
+        log = f.read()
+    fast = log.count('INFO: Fast retransmit')
+    timeouts = log.count('INFO: Timeout, resending')
+    print("\tTook %.2f s; %d datagrams dropped" % (elapsed, proxy.dropped))
+    print("\t%d fast retransmits, %d timeout resends" % (fast, timeouts))
+
+    with open('test/lossy-received.txt', 'rb') as f:
+        received = f.read()
+
+    failed = False
+    if status == 124:
+        print("\tFAILED: Sender timed out after 30 seconds.")
+        failed = True
+    if received != original:
+        print("\tFAILED: The received file differs from the original!")
+        failed = True
+    if loss > 0 and fast == 0:
+        print("\tFAILED: No fast retransmits, so every loss waited for a "
+              "timeout!")
+        failed = True
+    if not failed:
+        print("\n\tSUCCESS: The file arrived intact.")
+    return not failed
+
+
+if __name__ == '__main__':
+    if len(argv) > 2:
+        exit("Usage: %s [loss_rate]" % argv[0])
+
+    loss = int(argv[1]) if len(argv) == 2 else 2
+    exit(0 if run_test(loss) else 1)
@@ -0,0 +1,117 @@
+/*
+ * File: rdt_checksum.cpp
+ *
+ * Reliable data transport (RDT) segment checksum implementation.
+ *
+ */
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define RDT_HAVE_SSE42_PATH 1
+#endif
+
+#include "rdt_checksum.h"
+
+// Reversed representation of the CRC32C (Castagnoli) polynomial.
+static const uint32_t CRC32C_POLY = 0x82F63B78;
+
+/*
+ * The lookup tables used by the portable implementation, which works through
+ * 8 bytes at a time ("slicing-by-8"). entries[0] is the usual byte at a time
+ * table; entries[k][i] is the CRC of byte i followed by k zero bytes, so the
+ * contributions of 8 bytes can be looked up independently and combined.
+ */
+struct CRC32CTable {
+	uint32_t entries[8][256];
+
+	CRC32CTable() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; bit++) {
+				crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+			}
+			entries[0][i] = crc;
+		}
+		for (int k = 1; k < 8; k++) {
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t crc = entries[k - 1][i];
+				entries[k][i] = (crc >> 8) ^ entries[0][crc & 0xff];
+			}
+		}
+	}
+};
+
+static const CRC32CTable &crc32c_table() {
+	// A function's static is initialized exactly once, even if several
+	// threads get here at the same time.
+	static const CRC32CTable table;
+	return table;
+}
+
+/*
+ * Reads 4 bytes as a little endian number, whatever the CPU's byte order.
+ */
+static inline uint32_t load_le32(const uint8_t *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+		| (uint32_t)p[3] << 24;
+}
+
+static uint32_t crc32c_portable(const uint8_t *p, size_t length, uint32_t crc) {
+	const uint32_t (*t)[256] = crc32c_table().entries;
+	while (length >= 8) {
+		uint32_t one = crc ^ load_le32(p);
+		uint32_t two = load_le32(p + 4);
+		crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff]
+			^ t[5][(one >> 16) & 0xff] ^ t[4][one >> 24]
+			^ t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff]
+			^ t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+		p += 8;
+		length -= 8;
+	}
+	while (length--) {
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#ifdef RDT_HAVE_SSE42_PATH
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const uint8_t *p, size_t length, uint32_t crc) {
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	while (length >= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word)); // segments aren't necessarily aligned
+		crc64 = _mm_crc32_u64(crc64, word);
+		p += sizeof(word);
+		length -= sizeof(word);
+	}
+	crc = (uint32_t)crc64;
+#endif
+	while (length >= sizeof(uint32_t)) {
+		uint32_t word;
+		memcpy(&word, p, sizeof(word));
+		crc = _mm_crc32_u32(crc, word);
+		p += sizeof(word);
+		length -= sizeof(word);
+	}
+	while (length--) {
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+uint32_t crc32c(const void *data, size_t length, uint32_t crc) {
+	const uint8_t *p = (const uint8_t*)data;
+	crc = ~crc;
+
+#ifdef RDT_HAVE_SSE42_PATH
+	static const bool have_sse42 = __builtin_cpu_supports("sse4.2");
+	if (have_sse42) {
+		return ~crc32c_sse42(p, length, crc);
+	}
+#endif
+	return ~crc32c_portable(p, length, crc);
+}
@@ -0,0 +1,24 @@
+/*
+ * File: rdt_checksum.h
+ *
+ * Header / API file for the segment checksum component of the RDT library.
+ *
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Computes the CRC32C (Castagnoli) checksum of the given bytes.
+ *
+ * @note Uses the SSE4.2 crc32 instruction when the CPU supports it, falling
+ * back to a table driven (slicing-by-8) implementation otherwise. Both
+ * produce the same result.
+ *
+ * @param data Pointer to the bytes to checksum.
+ * @param length Number of bytes to checksum.
+ * @param crc CRC of any preceding bytes, allowing a checksum to be computed
+ * 		over several non-contiguous pieces (e.g. a header then its payload).
+ * 		Use 0 when starting a new checksum.
+ * @return The CRC32C of the bytes, continued from crc.
+ */
+uint32_t crc32c(const void *data, size_t length, uint32_t crc = 0);
@@ -0,0 +1,159 @@
+/*
+ * File: rdt_wire.cpp
+ *
+ * Reliable data transport (RDT) wire format implementation.
+ *
+ */
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "rdt_wire.h"
+#include "rdt_checksum.h"
+
+static void put_u32(uint8_t *p, uint32_t value) {
+	value = htonl(value);
+	memcpy(p, &value, sizeof(value));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return ntohl(value);
+}
+
+void rdt_init_header(RDTHeader *hdr, RDTMessageType type,
+						uint32_t sequence_number, uint32_t ack_number) {
+	memset(hdr, 0, sizeof(RDTHeader));
+	hdr->type = type;
+	hdr->sequence_number = sequence_number;
+	hdr->ack_number = ack_number;
+}
+
+int rdt_encode_header(const RDTHeader *hdr, uint8_t *buf) {
+	buf[0] = RDT_VERSION;
+	buf[1] = hdr->type;
+	buf[2] = hdr->flags;
+	put_u32(buf + 4, hdr->sequence_number);
+	put_u32(buf + 8, hdr->ack_number);
+	put_u32(buf + RDT_CHECKSUM_OFFSET, hdr->checksum);
+
+	int len = RDT_BASE_HEADER_SIZE;
+	if (hdr->has_timestamp) {
+		buf[len] = RDT_OPT_TIMESTAMP;
+		buf[len+1] = 10;
+		put_u32(buf + len + 2, hdr->ts_value);
+		put_u32(buf + len + 6, hdr->ts_echo);
+		len += 10;
+	}
+	if (hdr->has_window) {
+		buf[len] = RDT_OPT_WINDOW;
+		buf[len+1] = 6;
+		put_u32(buf + len + 2, hdr->window);
+		len += 6;
+	}
+	if (hdr->num_sack_blocks > 0) {
+		int num_blocks = hdr->num_sack_blocks;
+		if (num_blocks > RDT_MAX_SACK_BLOCKS) {
+			num_blocks = RDT_MAX_SACK_BLOCKS;
+		}
+		buf[len] = RDT_OPT_SACK;
+		buf[len+1] = 2 + 8*num_blocks;
+		for (int i = 0; i < num_blocks; i++) {
+			put_u32(buf + len + 2 + 8*i, hdr->sack_blocks[i].start);
+			put_u32(buf + len + 6 + 8*i, hdr->sack_blocks[i].end);
+		}
+		len += 2 + 8*num_blocks;
+	}
+
+	// Pad the options out to a whole number of 32-bit words.
+	while (len % 4 != 0) {
+		buf[len++] = RDT_OPT_END;
+	}
+	buf[3] = len / 4;
+	return len;
+}
+
+int rdt_decode_header(const uint8_t *buf, int length, RDTHeader *hdr) {
+	if (length < RDT_BASE_HEADER_SIZE || buf[0] != RDT_VERSION) {
+		return -1;
+	}
+
+	// Unlike options, a message type we don't know can't be skipped: we
+	// can't tell what the sender meant by it.
+	if (buf[1] > RDT_RESET) {
+		return -1;
+	}
+
+	int hdr_len = buf[3] * 4;
+	if (hdr_len < RDT_BASE_HEADER_SIZE || hdr_len > length) {
+		return -1;
+	}
+
+	rdt_init_header(hdr, (RDTMessageType)buf[1], get_u32(buf + 4),
+					get_u32(buf + 8));
+	hdr->flags = buf[2];
+	hdr->checksum = get_u32(buf + RDT_CHECKSUM_OFFSET);
+
+	int pos = RDT_BASE_HEADER_SIZE;
+	while (pos < hdr_len && buf[pos] != RDT_OPT_END) {
+		if (pos + 2 > hdr_len) {
+			return -1;
+		}
+		uint8_t kind = buf[pos];
+		int opt_len = buf[pos+1];
+		if (opt_len < 2 || pos + opt_len > hdr_len) {
+			return -1;
+		}
+
+		const uint8_t *value = buf + pos + 2;
+		if (kind == RDT_OPT_TIMESTAMP && opt_len == 10) {
+			hdr->has_timestamp = true;
+			hdr->ts_value = get_u32(value);
+			hdr->ts_echo = get_u32(value + 4);
+		}
+		else if (kind == RDT_OPT_WINDOW && opt_len == 6) {
+			hdr->has_window = true;
+			hdr->window = get_u32(value);
+		}
+		else if (kind == RDT_OPT_SACK && (opt_len - 2) % 8 == 0) {
+			int num_blocks = (opt_len - 2) / 8;
+			if (num_blocks > RDT_MAX_SACK_BLOCKS) {
+				num_blocks = RDT_MAX_SACK_BLOCKS;
+			}
+			for (int i = 0; i < num_blocks; i++) {
+				hdr->sack_blocks[i].start = get_u32(value + 8*i);
+				hdr->sack_blocks[i].end = get_u32(value + 4 + 8*i);
+			}
+			hdr->num_sack_blocks = num_blocks;
+		}
+		// Anything else is an option we don't understand: skip it.
+
+		pos += opt_len;
+	}
+
+	return hdr_len;
+}
+
+void rdt_set_checksum(uint8_t *header, int header_length,
+						const void *payload, int payload_length) {
+	put_u32(header + RDT_CHECKSUM_OFFSET, 0);
+	if (header[2] & RDT_FLAG_CHECKSUM) {
+		uint32_t crc = crc32c(header, header_length);
+		crc = crc32c(payload, payload_length, crc);
+		put_u32(header + RDT_CHECKSUM_OFFSET, crc);
+	}
+}
+
+bool rdt_checksum_ok(const uint8_t *segment, int length, bool required) {
+	if (length < RDT_BASE_HEADER_SIZE || !(segment[2] & RDT_FLAG_CHECKSUM)) {
+		return !required;
+	}
+
+	// The checksum was computed with the checksum field zeroed out.
+	static const uint8_t zeroes[4] = {0, 0, 0, 0};
+	uint32_t crc = crc32c(segment, RDT_CHECKSUM_OFFSET);
+	crc = crc32c(zeroes, sizeof(zeroes), crc);
+	crc = crc32c(segment + RDT_CHECKSUM_OFFSET + 4,
+					length - RDT_CHECKSUM_OFFSET - 4, crc);
+	return crc == get_u32(segment + RDT_CHECKSUM_OFFSET);
+}
@@ -0,0 +1,155 @@
+/*
+ * File: rdt_wire.h
+ *
+ * Header / API file for the RDT wire format: how an RDTHeader is laid out in
+ * the bytes of a segment.
+ *
+ * Every segment starts with a 16 byte base header, with all multi-byte fields
+ * in network byte order:
+ *
+ *    0       1       2       3
+ *   +-------+-------+-------+-------+
+ *   |version| type  | flags |hdr len|  (hdr len counts 32-bit words)
+ *   +-------+-------+-------+-------+
+ *   |        sequence number        |
+ *   +-------------------------------+
+ *   |          ack number           |
+ *   +-------------------------------+
+ *   |           checksum            |
+ *   +-------------------------------+
+ *   |   options (TLVs), padded to   |
+ *   |   a multiple of 4 bytes ...   |
+ *   +-------------------------------+
+ *
+ * Each option is a one byte kind, a one byte length (covering the kind and
+ * length bytes too), and then the option's value. Receivers skip options
+ * with a kind they don't know, so new options can be added without breaking
+ * older peers.
+ */
+#include <stdint.h>
+
+enum RDTMessageType : uint8_t {RDT_CONN, RDT_CLOSE, RDT_ACK, RDT_DATA, RDT_RESET};
+
+/**
+ * Bits used in the flags field of an RDTHeader.
+ */
+enum RDTHeaderFlags : uint8_t {
+	// The checksum field holds a CRC32C of the header and payload.
+	RDT_FLAG_CHECKSUM = 0x01
+};
+
+/**
+ * Kinds of the optional TLV extensions that may follow the base header.
+ */
+enum RDTOptionKind : uint8_t {
+	RDT_OPT_END       = 0, // padding; ends the option list
+	RDT_OPT_SACK      = 1, // blocks of sequence numbers received out of order
+	RDT_OPT_TIMESTAMP = 2, // sender's clock value and the echoed peer value
+	RDT_OPT_WINDOW    = 3  // receiver's advertised window, in bytes
+};
+
+// Version of the wire format written by this library.
+static const uint8_t RDT_VERSION = 1;
+
+// Size of the fixed part of the header, and the most any header (including
+// options) is allowed to take up in a segment.
+static const int RDT_BASE_HEADER_SIZE = 16;
+static const int RDT_MAX_HEADER_SIZE  = 64;
+
+// Byte offset of the checksum field within the base header.
+static const int RDT_CHECKSUM_OFFSET = 12;
+
+static const int RDT_MAX_SACK_BLOCKS = 3;
+
+/**
+ * A run of sequence numbers, [start, end), that a receiver holds.
+ */
+struct RDTSackBlock {
+	uint32_t start;
+	uint32_t end;
+};
+
+/**
+ * Decoded (host byte order) form of the header of a segment sent by our
+ * reliable socket. Use rdt_encode_header and rdt_decode_header to convert to
+ * and from the wire format; never send this struct directly.
+ */
+struct RDTHeader {
+	uint32_t sequence_number;
+	uint32_t ack_number;
+	uint32_t checksum;
+	RDTMessageType type;
+	uint8_t flags;
+
+	// Optional extensions, only put on the wire when their has_ field is set.
+	bool has_timestamp;
+	uint32_t ts_value;
+	uint32_t ts_echo;
+
+	bool has_window;
+	uint32_t window;
+
+	int num_sack_blocks;
+	RDTSackBlock sack_blocks[RDT_MAX_SACK_BLOCKS];
+};
+
+/**
+ * Resets a header so it has the given type and numbers, no flags and no
+ * options.
+ *
+ * @param hdr The header to initialize.
+ * @param type The type of message.
+ * @param sequence_number The sequence number of the segment.
+ * @param ack_number The acknowledgment number of the segment.
+ */
+void rdt_init_header(RDTHeader *hdr, RDTMessageType type,
+						uint32_t sequence_number, uint32_t ack_number);
+
+/**
+ * Writes a header, including any options, in wire format. The checksum is
+ * written as given; see rdt_set_checksum.
+ *
+ * @param hdr The header to encode.
+ * @param buf Where to write the header (at least RDT_MAX_HEADER_SIZE bytes).
+ * @return The number of bytes written (always a multiple of 4).
+ */
+int rdt_encode_header(const RDTHeader *hdr, uint8_t *buf);
+
+/**
+ * Reads a wire format header from the start of a segment.
+ *
+ * @param buf The received segment.
+ * @param length Number of bytes in the segment.
+ * @param hdr The decoded header will be stored here.
+ * @return The size of the header in bytes (i.e. the offset of the payload),
+ * 		or -1 if the segment is truncated, malformed, or of an unknown version
+ * 		or message type.
+ */
+int rdt_decode_header(const uint8_t *buf, int length, RDTHeader *hdr);
+
+/**
+ * Fills in the checksum field of an encoded header when its
+ * RDT_FLAG_CHECKSUM flag is set, otherwise zeroes it. The header and payload
+ * don't need to be contiguous, so the payload can be sent straight from the
+ * caller's memory.
+ *
+ * @param header The encoded header.
+ * @param header_length Size of the header in bytes.
+ * @param payload The data that will follow the header.
+ * @param payload_length Size of the payload in bytes.
+ */
+void rdt_set_checksum(uint8_t *header, int header_length,
+						const void *payload, int payload_length);
+
+/**
+ * Checks the checksum of an encoded segment.
+ *
+ * @param segment The encoded segment.
+ * @param length Size of the segment in bytes.
+ * @param required Whether the segment must carry a checksum. If so, one
+ * 		without is treated as corrupt: otherwise flipping the one bit of
+ * 		RDT_FLAG_CHECKSUM would switch checking off.
+ * @return False if the segment's checksum doesn't match its contents, or it
+ * 		has none and one is required; true otherwise.
+ */
+bool rdt_checksum_ok(const uint8_t *segment, int length, bool required);